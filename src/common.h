@@ -43,6 +43,28 @@ struct BufferParams {
 
 
 
+/**
+ * Approximate statistics parameters.
+ * If given, statistics are estimated from a stratified random sample
+ * of the pixels in each feature, instead of from all of them.
+ * Only avg, sum and nulls are estimates for the whole feature;
+ * min, max, stdev, median and mode are those of the sample values.
+ */
+struct ApproxParams {
+	/** were given? */
+	bool given;
+	
+	/** target relative error for the mean, e.g., 0.01 */
+	double rel_error;
+	
+	/** confidence level for the reported intervals, e.g., 0.95 */
+	double confidence;
+	
+	ApproxParams() : given(false), rel_error(0.01), confidence(0.95) {}
+};
+
+
+
 /**
  * Parses a string for a size.
  * @param sizeStr the input string which may contain a suffix ("px") 
@@ -212,6 +234,9 @@ struct GlobalOptions {
 	/** value used as nodata */
 	double nodata;  
 	
+	/** approximate statistics parameters */
+	ApproxParams approxParams;
+	
 	/** buffer parameters */
 	BufferParams bufferParams;
 	
@@ -224,6 +249,13 @@ struct GlobalOptions {
 	/** separation in pixels between minirasters in strip */
 	int mini_raster_separation;
 	
+	/** create minirasters as VRT files referencing the source raster;
+	  * with --in, the feature mask is given as a VRT mask band */
+	bool mini_raster_vrt;
+	
+	/** number of threads for the operations that can run in parallel */
+	int num_threads;
+	
     
 	/** separator for CSV files */
 	string delimiter;
@@ -236,5 +268,31 @@ struct GlobalOptions {
 extern GlobalOptions globalOptions;
 
 
+/**
+  * Options of one extraction job.
+  * Traversers (see Traverser::setContext), the observers they notify, and
+  * the commands that take a context read their options from it instead of
+  * globalOptions, so several jobs can run concurrently in one process,
+  * each with its own context. Per-job state derived from the options
+  * (eg., parsed box dimensions) is also kept in the context.
+  */
+struct ExtractionContext {
+	/** options of this job */
+	GlobalOptions options;
+	
+	/**
+	  * Whether traversals in this context start by calling ResetReading
+	  * on the layer. Per-job counterpart of Traverser::_resetReading, for
+	  * jobs that run a traversal per feature while reading the layer.
+	  */
+	bool resetReading;
+	
+	/** creates a context with a copy of the current globalOptions */
+	ExtractionContext() : options(globalOptions), resetReading(true) {}
+	
+	ExtractionContext(const GlobalOptions& options) : options(options), resetReading(true) {}
+};
+
+
 #endif
 
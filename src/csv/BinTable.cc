@@ -0,0 +1,335 @@
+//
+//	BinTable - columnar binary table format
+//	See BinTable.h for public doc.
+//
+
+#include "BinTable.h"
+
+#include "cpl_conv.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+typedef unsigned int uint32;
+
+static const char magic[4] = { 'S', 'S', 'B', 'T' };
+static const uint32 byteOrderMark = 0x01020304;
+
+
+// stores value in the given type at ptr
+static void storeValue(GDALDataType type, double value, void* ptr) {
+	switch ( type ) {
+		case GDT_Byte:    *(unsigned char*)  ptr = (unsigned char)  value; break;
+		case GDT_UInt16:  *(unsigned short*) ptr = (unsigned short) value; break;
+		case GDT_Int16:   *(short*)          ptr = (short)          value; break;
+		case GDT_UInt32:  *(unsigned int*)   ptr = (unsigned int)   value; break;
+		case GDT_Int32:   *(int*)            ptr = (int)            value; break;
+		case GDT_Float32: *(float*)          ptr = (float)          value; break;
+		case GDT_Float64: *(double*)         ptr = (double)         value; break;
+		default:
+			cerr<< "BinTable: unexpected type: " <<GDALGetDataTypeName(type)<< endl;
+			exit(1);
+	}
+}
+
+// reads the value at ptr as a double
+static double loadValue(GDALDataType type, const void* ptr) {
+	switch ( type ) {
+		case GDT_Byte:    return *(const unsigned char*)  ptr;
+		case GDT_UInt16:  return *(const unsigned short*) ptr;
+		case GDT_Int16:   return *(const short*)          ptr;
+		case GDT_UInt32:  return *(const unsigned int*)   ptr;
+		case GDT_Int32:   return *(const int*)            ptr;
+		case GDT_Float32: return *(const float*)          ptr;
+		case GDT_Float64: return *(const double*)         ptr;
+		default:
+			cerr<< "BinTable: unexpected type: " <<GDALGetDataTypeName(type)<< endl;
+			exit(1);
+	}
+}
+
+static bool writeUInt(FILE* file, uint32 value) {
+	return 1 == fwrite(&value, sizeof(value), 1, file);
+}
+
+static bool readUInt(FILE* file, uint32* value) {
+	return 1 == fread(value, sizeof(*value), 1, file);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// BinTableWriter
+
+BinTableWriter::BinTableWriter(FILE* file, bool compress, unsigned chunkRows)
+: file(file), compress(compress), chunkRows(chunkRows) {
+	closed = false;
+	numRows = 0;
+	col = 0;
+}
+
+BinTableWriter::~BinTableWriter() {
+	close();
+}
+
+void BinTableWriter::addColumn(const BinColumn& column) {
+	columns.push_back(column);
+	typeSizes.push_back(column.type == GDT_Unknown ? 0 : GDALGetDataTypeSize(column.type) >> 3);
+	data.push_back(string());
+	offsets.push_back(vector<unsigned>());
+}
+
+bool BinTableWriter::writeHeader() {
+	bool ok = 1 == fwrite(magic, sizeof(magic), 1, file)
+	       && writeUInt(file, byteOrderMark)
+	       && writeUInt(file, BINTABLE_VERSION)
+	       && writeUInt(file, compress ? BINTABLE_ZLIB : 0)
+	       && writeUInt(file, columns.size());
+	for ( unsigned i = 0; ok && i < columns.size(); i++ ) {
+		const BinColumn& column = columns[i];
+		ok = writeUInt(file, column.type)
+		  && writeUInt(file, column.precision)
+		  && writeUInt(file, column.name.size())
+		  && column.name.size() == fwrite(column.name.data(), 1, column.name.size(), file);
+	}
+	return ok;
+}
+
+BinTableWriter& BinTableWriter::addString(const char* value) {
+	string& str = data[col];
+	str += value;
+	offsets[col].push_back(str.size());
+	col++;
+	return *this;
+}
+
+BinTableWriter& BinTableWriter::addInt(long value) {
+	return addDouble((double) value);
+}
+
+BinTableWriter& BinTableWriter::addDouble(double value) {
+	char buff[sizeof(double)];
+	storeValue(columns[col].type, value, buff);
+	data[col].append(buff, typeSizes[col]);
+	col++;
+	return *this;
+}
+
+BinTableWriter& BinTableWriter::addNative(const void* value) {
+	data[col].append((const char*) value, typeSizes[col]);
+	col++;
+	return *this;
+}
+
+bool BinTableWriter::endRow() {
+	if ( col != columns.size() ) {
+		cerr<< "BinTableWriter: " <<col<< " values given for " <<columns.size()<< " columns" << endl;
+		exit(1);
+	}
+	col = 0;
+	if ( ++numRows >= chunkRows ) {
+		return writeChunk();
+	}
+	return true;
+}
+
+bool BinTableWriter::close() {
+	if ( closed ) {
+		return true;
+	}
+	closed = true;
+	bool ok = true;
+	if ( numRows > 0 ) {
+		ok = writeChunk();
+	}
+	// end mark
+	return writeUInt(file, 0) && ok;
+}
+
+bool BinTableWriter::writeChunk() {
+	if ( !writeUInt(file, numRows) ) {
+		return false;
+	}
+	for ( unsigned i = 0; i < columns.size(); i++ ) {
+		bool ok;
+		if ( columns[i].type == GDT_Unknown ) {
+			// end offsets followed by the bytes
+			string block((const char*) &offsets[i][0], numRows * sizeof(uint32));
+			block += data[i];
+			ok = writeBlock(block.data(), block.size());
+		}
+		else {
+			ok = writeBlock(data[i].data(), data[i].size());
+		}
+		if ( !ok ) {
+			return false;
+		}
+		data[i].clear();
+		offsets[i].clear();
+	}
+	numRows = 0;
+	return true;
+}
+
+bool BinTableWriter::writeBlock(const void* ptr, unsigned size) {
+	if ( compress && size > 0 ) {
+		size_t stored_size = 0;
+		void* stored = CPLZLibDeflate(ptr, size, -1, NULL, 0, &stored_size);
+		if ( !stored ) {
+			cerr<< "BinTableWriter: compression failed" << endl;
+			return false;
+		}
+		bool ok = writeUInt(file, size)
+		       && writeUInt(file, stored_size)
+		       && stored_size == fwrite(stored, 1, stored_size, file);
+		VSIFree(stored);
+		return ok;
+	}
+	return writeUInt(file, size)
+	    && writeUInt(file, size)
+	    && size == fwrite(ptr, 1, size, file);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// BinTableReader
+
+BinTableReader::BinTableReader(FILE* file) : file(file) {
+	flags = 0;
+	numRows = 0;
+	storedBytes = rawBytes = 0;
+}
+
+BinTableReader::~BinTableReader() {
+}
+
+bool BinTableReader::readHeader() {
+	char m[sizeof(magic)];
+	uint32 bom, version, num_columns;
+	if ( 1 != fread(m, sizeof(m), 1, file) || 0 != memcmp(m, magic, sizeof(magic)) ) {
+		cerr<< "BinTableReader: not a binary table" << endl;
+		return false;
+	}
+	if ( !readUInt(file, &bom) || bom != byteOrderMark ) {
+		cerr<< "BinTableReader: table written with a different byte order" << endl;
+		return false;
+	}
+	if ( !readUInt(file, &version) || version != BINTABLE_VERSION ) {
+		cerr<< "BinTableReader: unsupported version" << endl;
+		return false;
+	}
+	if ( !readUInt(file, &flags) || !readUInt(file, &num_columns) ) {
+		return false;
+	}
+	for ( unsigned i = 0; i < num_columns; i++ ) {
+		uint32 type, precision, len;
+		if ( !readUInt(file, &type) || !readUInt(file, &precision) || !readUInt(file, &len) ) {
+			return false;
+		}
+		string name(len, ' ');
+		if ( len > 0 && len != fread(&name[0], 1, len, file) ) {
+			return false;
+		}
+		if ( type >= GDT_CInt16 ) {
+			cerr<< "BinTableReader: unexpected column type " <<type<< endl;
+			return false;
+		}
+		columns.push_back(BinColumn(name, (GDALDataType) type, precision));
+		typeSizes.push_back(type == GDT_Unknown ? 0 : GDALGetDataTypeSize((GDALDataType) type) >> 3);
+	}
+	data.resize(num_columns);
+	stored.resize(num_columns);
+	return true;
+}
+
+int BinTableReader::readChunk() {
+	uint32 rows;
+	if ( !readUInt(file, &rows) ) {
+		cerr<< "BinTableReader: missing end of table" << endl;
+		return -1;
+	}
+	numRows = rows;
+	for ( unsigned i = 0; numRows > 0 && i < columns.size(); i++ ) {
+		if ( !readBlock(i) ) {
+			return -1;
+		}
+	}
+	return numRows;
+}
+
+bool BinTableReader::readBlock(unsigned col) {
+	uint32 raw_size, stored_size;
+	if ( !readUInt(file, &raw_size) || !readUInt(file, &stored_size) ) {
+		return false;
+	}
+	string& block = data[col];
+	block.resize(raw_size);
+	if ( !isCompressed() || raw_size == 0 ) {
+		if ( raw_size != stored_size
+		||   (raw_size > 0 && raw_size != fread(&block[0], 1, raw_size, file)) ) {
+			return false;
+		}
+	}
+	else {
+		string& buff = stored[col];
+		buff.resize(stored_size);
+		if ( stored_size > 0 && stored_size != fread(&buff[0], 1, stored_size, file) ) {
+			return false;
+		}
+		size_t size = 0;
+		if ( !CPLZLibInflate(buff.data(), stored_size, &block[0], raw_size, &size) || size != raw_size ) {
+			cerr<< "BinTableReader: corrupted column chunk" << endl;
+			return false;
+		}
+	}
+
+	// check expected size
+	const unsigned min_size = columns[col].type == GDT_Unknown
+		? numRows * sizeof(uint32)
+		: numRows * typeSizes[col];
+	if ( raw_size < min_size ) {
+		cerr<< "BinTableReader: truncated column chunk" << endl;
+		return false;
+	}
+	storedBytes += stored_size;
+	rawBytes += raw_size;
+	return true;
+}
+
+const void* BinTableReader::getNative(unsigned col, unsigned row) {
+	return data[col].data() + row * typeSizes[col];
+}
+
+string BinTableReader::getString(unsigned col, unsigned row) {
+	const string& block = data[col];
+	const uint32* ends = (const uint32*) block.data();
+	const unsigned base = numRows * sizeof(uint32);
+	const unsigned start = row == 0 ? 0 : ends[row - 1];
+	const unsigned end = ends[row];
+	if ( start > end || base + end > block.size() ) {
+		cerr<< "BinTableReader: invalid string offsets" << endl;
+		exit(1);
+	}
+	return block.substr(base + start, end - start);
+}
+
+double BinTableReader::getDouble(unsigned col, unsigned row) {
+	return loadValue(columns[col].type, getNative(col, row));
+}
+
+void BinTableReader::addField(CsvOutput& csvOut, unsigned col, unsigned row) {
+	const void* ptr = getNative(col, row);
+	switch ( columns[col].type ) {
+		case GDT_Unknown: csvOut.addString(getString(col, row)); break;
+		case GDT_Byte:    csvOut.addUInt(*(const unsigned char*)  ptr); break;
+		case GDT_UInt16:  csvOut.addUInt(*(const unsigned short*) ptr); break;
+		case GDT_Int16:   csvOut.addInt(*(const short*)           ptr); break;
+		case GDT_UInt32:  csvOut.addUInt(*(const unsigned int*)   ptr); break;
+		case GDT_Int32:   csvOut.addInt(*(const int*)             ptr); break;
+		case GDT_Float32: csvOut.addDouble(*(const float*)  ptr, columns[col].precision); break;
+		case GDT_Float64: csvOut.addDouble(*(const double*) ptr, columns[col].precision); break;
+		default:
+			cerr<< "BinTable: unexpected type: " <<GDALGetDataTypeName(columns[col].type)<< endl;
+			exit(1);
+	}
+}
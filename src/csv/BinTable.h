@@ -0,0 +1,182 @@
+//
+// BinTable - columnar binary table format
+//
+
+#ifndef BinTable_h
+#define BinTable_h
+
+#include "Csv.h"
+
+#include "gdal.h"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+using namespace std;
+
+
+/**
+  * A column in a binary table.
+  * The type is a GDAL data type (native values), or GDT_Unknown for
+  * string values. precision is the number of decimals used when
+  * floating point values are converted to text.
+  */
+struct BinColumn {
+	string name;
+	GDALDataType type;
+	int precision;
+
+	BinColumn(string name, GDALDataType type, int precision = 6)
+	: name(name), type(type), precision(precision) {}
+};
+
+
+/**
+  * Binary table file layout (all integers are 32-bit unsigned, in the
+  * byte order of the machine that wrote the file):
+  *
+  *    header:  "SSBT", byte-order mark (0x01020304), version, flags,
+  *             number of columns, and for each column:
+  *             type, precision, name length, name bytes.
+  *    chunks:  number of rows (0 marks the end of the table), and for
+  *             each column: raw size, stored size, stored bytes.
+  *
+  * Within a chunk, numeric columns are stored as arrays of native values.
+  * String columns are stored as an array of end offsets (one per row)
+  * followed by the concatenated bytes. If the BINTABLE_ZLIB flag is set,
+  * the bytes of each column chunk are compressed with zlib; stored size
+  * is then the compressed size.
+  */
+#define BINTABLE_VERSION  1
+#define BINTABLE_ZLIB     1
+
+
+/**
+  * Writes a binary table.
+  * Usage is similar to CsvOutput: add the columns, call writeHeader(),
+  * then for each row call startRow(), add the values in column order,
+  * and endRow(). Call close() at the end.
+  */
+class BinTableWriter {
+public:
+	/**
+	  * Creates a writer on the given file.
+	  * @param compress true to compress the column chunks
+	  * @param chunkRows number of rows per chunk
+	  */
+	BinTableWriter(FILE* file, bool compress, unsigned chunkRows = 64*1024);
+
+	/** calls close() */
+	~BinTableWriter();
+
+	/** adds a column to the schema */
+	void addColumn(const BinColumn& column);
+
+	/** gets the columns */
+	const vector<BinColumn>& getColumns() { return columns; }
+
+	/** writes the header. Returns false on I/O error. */
+	bool writeHeader();
+
+	/** starts a new row */
+	void startRow() { col = 0; }
+
+	/** adds a value to a string column */
+	BinTableWriter& addString(const char* value);
+
+	/** adds a value to a numeric column, converting it to the column type */
+	BinTableWriter& addInt(long value);
+	BinTableWriter& addDouble(double value);
+
+	/** adds a value already in the column type */
+	BinTableWriter& addNative(const void* value);
+
+	/** ends the current row. Returns false on I/O error. */
+	bool endRow();
+
+	/**
+	  * writes the pending rows and the end mark. Returns false on I/O error.
+	  * The file is not closed.
+	  */
+	bool close();
+
+private:
+	FILE* file;
+	bool compress;
+	unsigned chunkRows;
+	bool closed;
+
+	vector<BinColumn> columns;
+	vector<int> typeSizes;
+
+	// per column: values (or string bytes), and string end offsets
+	vector<string> data;
+	vector< vector<unsigned> > offsets;
+
+	unsigned numRows;
+	unsigned col;
+
+	bool writeChunk();
+	bool writeBlock(const void* ptr, unsigned size);
+};
+
+
+/**
+  * Reads a binary table chunk by chunk.
+  */
+class BinTableReader {
+public:
+	BinTableReader(FILE* file);
+	~BinTableReader();
+
+	/** reads the header. Returns false if the file is not a binary table. */
+	bool readHeader();
+
+	/** gets the columns */
+	const vector<BinColumn>& getColumns() { return columns; }
+
+	/** true if column chunks are compressed */
+	bool isCompressed() { return (flags & BINTABLE_ZLIB) != 0; }
+
+	/**
+	  * reads the next chunk.
+	  * @return number of rows in the chunk; 0 at end of table; -1 on error.
+	  */
+	int readChunk();
+
+	/** pointer to the native value at the given column and row of current chunk */
+	const void* getNative(unsigned col, unsigned row);
+
+	/** value at the given string column and row of current chunk */
+	string getString(unsigned col, unsigned row);
+
+	/** value at the given numeric column and row of current chunk */
+	double getDouble(unsigned col, unsigned row);
+
+	/** adds the value at the given column and row to the CSV line */
+	void addField(CsvOutput& csvOut, unsigned col, unsigned row);
+
+	/** stored and raw sizes of the column chunks read so far */
+	double getStoredBytes() { return storedBytes; }
+	double getRawBytes() { return rawBytes; }
+
+private:
+	FILE* file;
+	unsigned flags;
+	vector<BinColumn> columns;
+	vector<int> typeSizes;
+	unsigned numRows;
+
+	// per column data of current chunk
+	vector<string> data;
+	vector<string> stored;
+
+	double storedBytes;
+	double rawBytes;
+
+	bool readBlock(unsigned col);
+};
+
+
+#endif
@@ -3,104 +3,239 @@
 /* by Brian W. Kernighan and Rob Pike */
 // updated by carueda 2004-09-16
 // $Id: Csv.cc,v 1.1 2005-02-19 21:03:46 crueda Exp $
+//
+// CsvReader: parsing as in the original Csv class, but on a memory-mapped
+// file and without copying lines or fields.
 
 #include "Csv.h"
 
-// endofline: check for and consume \r, \n, \r\n, or EOF
-bool Csv::endofline(char c)
-{
-	bool eol;
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-	eol = (c=='\r' || c=='\n');
-	if (c == '\r') {
-		fin.get(c);
-		if (!fin.eof() && c != '\n')
-			fin.putback(c);	// read too far
-	}
-	return eol;
+
+const CsvField CsvReader::emptyField = { "", 0 };
+
+
+CsvReader::CsvReader(string sep) {
+	init(sep);
+	data = "";
+	size = 0;
 }
 
-// getline: get one line, grow as needed
-bool Csv::getline(string& str)
-{	
-	char c;
+CsvReader::CsvReader(const char* data, size_t size, string sep) {
+	init(sep);
+	this->data = data;
+	this->size = size;
+}
 
-	for (line = ""; fin.get(c) && !endofline(c); ) {
-		line += c;
+void CsvReader::init(string sep) {
+	pos = 0;
+	nfield = 0;
+	mapped = 0;
+	mappedSize = 0;
+	memset(isSep, 0, sizeof(isSep));
+	for ( unsigned i = 0; i < sep.size(); i++ ) {
+		isSep[(unsigned char) sep[i]] = true;
 	}
-	split();
-	str = line;
-	return !fin.eof();
 }
 
-// split: split line into fields
-unsigned Csv::split()
-{
-	string fld;
-	string::size_type i, j;
+CsvReader::~CsvReader() {
+	close();
+}
+
+bool CsvReader::open(const char* filename) {
+	close();
+	int fd = ::open(filename, O_RDONLY);
+	if ( fd < 0 ) {
+		return false;
+	}
+	struct stat st;
+	if ( 0 != fstat(fd, &st) ) {
+		::close(fd);
+		return false;
+	}
+	if ( st.st_size > 0 ) {
+		mapped = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if ( mapped == MAP_FAILED ) {
+			mapped = 0;
+		}
+	}
+	if ( mapped ) {
+		mappedSize = st.st_size;
+#ifdef MADV_SEQUENTIAL
+		madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+#endif
+		data = (const char*) mapped;
+		size = mappedSize;
+	}
+	else {
+		// not mappable (eg., a pipe): read the contents
+		char buff[64*1024];
+		ssize_t n;
+		while ( (n = read(fd, buff, sizeof(buff))) > 0 ) {
+			contents.append(buff, n);
+		}
+		data = contents.data();
+		size = contents.size();
+	}
+	::close(fd);
+	return true;
+}
 
+void CsvReader::close() {
+	if ( mapped ) {
+		munmap(mapped, mappedSize);
+		mapped = 0;
+		mappedSize = 0;
+	}
+	contents.clear();
+	data = "";
+	size = 0;
+	pos = 0;
 	nfield = 0;
-	if (line.length() == 0)
-		return 0;
-	i = 0;
+}
 
-	const string::size_type line_len = line.length();
+// nextLine: find the end of the line and split it into fields
+bool CsvReader::nextLine() {
+	nfield = 0;
+	copies.clear();
+	if ( pos >= size ) {
+		return false;
+	}
+	
+	// end of line: \n, \r\n, or \r
+	size_t start = pos;
+	size_t end = start;
+	while ( end < size && data[end] != '\n' && data[end] != '\r' ) {
+		end++;
+	}
+	pos = end;
+	if ( pos < size && data[pos] == '\r' ) {
+		pos++;
+	}
+	if ( pos < size && data[pos] == '\n' ) {
+		pos++;
+	}
+	
+	// split
+	if ( end > start ) {
+		size_t i = start;
+		size_t j;
+		do {
+			if ( i < end && data[i] == '"' )
+				j = advquoted(++i, end);	// skip quote
+			else
+				j = advplain(i, end);
+			i = j + 1;
+		} while ( j < end );
+	}
 	
-	do {
-		if (i < line_len && line[i] == '"')
-			j = advquoted(line, fld, ++i);	// skip quote
-		else
-			j = advplain(line, fld, i);
-		if (nfield >= field.size())
-			field.push_back(fld);
-		else
-			field[nfield] = fld;
-		nfield++;
-		i = j + 1;
-	} while (j < line_len);
-
-	return nfield;
+	// point fields to their copies, if any:
+	for ( unsigned n = 0; n < nfield; n++ ) {
+		if ( copyOffsets[n] >= 0 ) {
+			fields[n].ptr = copies.data() + copyOffsets[n];
+		}
+	}
+	return true;
+}
+
+void CsvReader::addField(const char* ptr, size_t len, long copyOffset) {
+	if ( nfield >= fields.size() ) {
+		fields.resize(nfield + 1);
+		copyOffsets.resize(nfield + 1);
+	}
+	fields[nfield].ptr = ptr;
+	fields[nfield].len = len;
+	copyOffsets[nfield] = copyOffset;
+	nfield++;
 }
 
 // advquoted: quoted field; return index of next separator
-string::size_type Csv::advquoted(const string& s, string& fld, int i)
-{
-	string::size_type j;
-
-	fld = "";
-	for (j = i; j < s.length(); j++) {
-		if (s[j] == '"' && s[++j] != '"') {
-			string::size_type k = s.find_first_of(fieldsep, j);
-			if (k == string::npos )	// no separator found
-				k = s.length();
-			for (k -= j; k-- > 0; )
-				fld += s[j++];
+size_t CsvReader::advquoted(size_t i, size_t end) {
+	size_t j;
+	
+	// common case: no escaped quotes and separator right after the closing quote
+	for ( j = i; j < end && data[j] != '"'; j++ ) 
+		;
+	if ( j >= end || j + 1 >= end || isSep[(unsigned char) data[j + 1]] ) {
+		addField(data + i, j - i, -1);
+		return j < end ? j + 1 : end;
+	}
+	
+	// otherwise, build a copy:
+	const long offset = copies.size();
+	copies.append(data + i, j - i);
+	for ( ; j < end; j++ ) {
+		if ( data[j] == '"' && (++j >= end || data[j] != '"') ) {
+			// closing quote: take anything up to the separator
+			size_t k = j;
+			while ( k < end && !isSep[(unsigned char) data[k]] )
+				k++;
+			copies.append(data + j, k - j);
+			j = k;
 			break;
 		}
-		fld += s[j];
+		copies += data[j];
 	}
+	addField(0, copies.size() - offset, offset);
 	return j;
 }
 
 // advplain: unquoted field; return index of next separator
-string::size_type Csv::advplain(const string& s, string& fld, int i)
-{
-	string::size_type j;
-
-	j = s.find_first_of(fieldsep, i); // look for separator
-	if (j == string::npos )               // none found
-		j = s.length();
-	fld = string(s, i, j-i);
+size_t CsvReader::advplain(size_t i, size_t end) {
+	size_t j = i;
+	while ( j < end && !isSep[(unsigned char) data[j]] )
+		j++;
+	addField(data + i, j - i, -1);
 	return j;
 }
 
+double CsvReader::getDouble(unsigned n) const {
+	const CsvField& field = getField(n);
+	char buff[128];
+	size_t len = field.len < sizeof(buff) ? field.len : sizeof(buff) - 1;
+	memcpy(buff, field.ptr, len);
+	buff[len] = 0;
+	return atof(buff);
+}
 
-// getfield: return n-th field
-string Csv::getfield(string::size_type n)
-{
-	if (n < 0 || n >= nfield)
-		return "";
-	else
-		return field[n];
+long CsvReader::getLong(unsigned n) const {
+	const CsvField& field = getField(n);
+	char buff[128];
+	size_t len = field.len < sizeof(buff) ? field.len : sizeof(buff) - 1;
+	memcpy(buff, field.ptr, len);
+	buff[len] = 0;
+	return atol(buff);
 }
 
+void CsvReader::getChunks(unsigned numChunks, vector<size_t>& bounds) const {
+	bounds.clear();
+	bounds.push_back(pos);
+	if ( numChunks < 1 ) {
+		numChunks = 1;
+	}
+	const size_t chunkSize = (size - pos) / numChunks;
+	for ( unsigned k = 1; k < numChunks; k++ ) {
+		size_t b = pos + k * chunkSize;
+		if ( b <= bounds.back() ) {
+			continue;
+		}
+		// move to the start of the next line:
+		while ( b < size && data[b - 1] != '\n' && data[b - 1] != '\r' ) {
+			b++;
+		}
+		if ( b < size && data[b - 1] == '\r' && data[b] == '\n' ) {
+			b++;
+		}
+		if ( b >= size ) {
+			break;
+		}
+		if ( b > bounds.back() ) {
+			bounds.push_back(b);
+		}
+	}
+	bounds.push_back(size);
+}
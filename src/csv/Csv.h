@@ -11,36 +11,148 @@
 #include <string>
 #include <vector>
 #include <cstdio>
+#include <cstring>
+
+#include "OutputFile.h"
 
 using namespace std;
 
-class Csv {	// read and parse comma-separated values
-	// sample input: "LU",86.25,"11/4/1998","2:19PM",+4.0625
+/**
+ * A field in a line read by CsvReader. It points to the input data 
+ * (or to a copy if unquoting required it) and is not null-terminated.
+ * It is valid until the next line is read.
+ */
+struct CsvField {
+	const char* ptr;
+	size_t len;
+	
+	string str() const { return string(ptr, len); }
+	
+	bool operator==(const char* s) const {
+		return len == strlen(s) && 0 == memcmp(ptr, s, len);
+	}
+	bool operator!=(const char* s) const {
+		return !(*this == s);
+	}
+};
 
-  public:
-	Csv(istream& fin = cin, string sep = ",") : 
-		fin(fin), fieldsep(sep) {}
 
-	bool getline(string&);
-	string getfield(string::size_type n);
-	unsigned getnfield() const { return nfield; }
+/**
+ * Reads and parses comma-separated values from a memory-mapped file
+ * without copying the lines or fields.
+ * Fields are split at any of the separator characters; a field starting
+ * with a quote extends up to the closing quote ("" being an escaped
+ * quote). Lines end with \n, \r\n, or \r.
+ * The data can be divided in chunks on line boundaries (getChunks) to
+ * be parsed in parallel by readers created on each chunk.
+ */
+class CsvReader {
+  public:
+	/**
+	 * Creates a reader. Call open() to associate a file.
+	 */
+	CsvReader(string sep = ",");
+	
+	/**
+	 * Creates a reader on a block of data, eg., a chunk of the
+	 * data of another reader. The data is not copied.
+	 */
+	CsvReader(const char* data, size_t size, string sep = ",");
+	
+	~CsvReader();
+	
+	/**
+	 * Maps the given file into memory.
+	 * @return false if the file cannot be read.
+	 */
+	bool open(const char* filename);
+	
+	/** Releases the file, if any. */
+	void close();
+	
+	/**
+	 * Parses the next line.
+	 * @return false if there are no more lines.
+	 */
+	bool nextLine();
+	
+	/** Goes back to the beginning of the data. */
+	void rewind() { pos = 0; nfield = 0; }
+	
+	/** Number of fields in the current line. */
+	unsigned getNumFields() const { return nfield; }
+	
+	/** n-th field of the current line; an empty field if n is out of range. */
+	const CsvField& getField(unsigned n) const {
+		return n < nfield ? fields[n] : emptyField;
+	}
+	
+	/** n-th field as a string */
+	string getString(unsigned n) const { return getField(n).str(); }
+	
+	/** n-th field as a double (as with atof) */
+	double getDouble(unsigned n) const;
+	
+	/** n-th field as a long (as with atol) */
+	long getLong(unsigned n) const;
+	
+	/** The data being read. */
+	const char* getData() const { return data; }
+	size_t getSize() const { return size; }
+	
+	/** Offset of the next line to be read. */
+	size_t getPosition() const { return pos; }
+	
+	/**
+	 * Divides the data from the current position to the end in chunks
+	 * starting at line boundaries.
+	 * @param numChunks desired number of chunks
+	 * @param bounds where the offsets are stored: chunk i is
+	 *        [bounds[i], bounds[i+1]). There may be fewer chunks than
+	 *        requested if the data is small.
+	 */
+	void getChunks(unsigned numChunks, vector<size_t>& bounds) const;
 
   private:
-	istream& fin;			// input file pointer
-	string line;			// input line
-	vector<string> field;	// field strings
-	unsigned nfield;				// number of fields
-	string fieldsep;		// separator characters
-
-	unsigned split();
-	bool endofline(char);
-	string::size_type advplain(const string& line, string& fld, int);
-	string::size_type advquoted(const string& line, string& fld, int);
+	const char* data;
+	size_t size;
+	size_t pos;
+	
+	// mapped file, or contents read if it couldn't be mapped
+	void* mapped;
+	size_t mappedSize;
+	string contents;
+	
+	// separator characters
+	bool isSep[256];
+	
+	// fields of the current line
+	vector<CsvField> fields;
+	unsigned nfield;
+	
+	// copies of the fields that needed unquoting, and the offset of
+	// each field in it (-1 if the field points to the data)
+	string copies;
+	vector<long> copyOffsets;
+	
+	static const CsvField emptyField;
+	
+	void init(string sep);
+	void addField(const char* ptr, size_t len, long copyOffset);
+	size_t advquoted(size_t i, size_t end);
+	size_t advplain(size_t i, size_t end);
+	
+	// not copyable
+	CsvReader(const CsvReader&);
+	CsvReader& operator=(const CsvReader&);
 };
 
 
 /**
  * Helper class to write out CSV values.
+ * Output is accumulated in a memory buffer and written to the file in
+ * big chunks. Make sure you call flush() before closing the file or
+ * writing to it by other means.
  * @author Carlos Rueda
  */
 class CsvOutput {
@@ -50,10 +162,33 @@ class CsvOutput {
 	 * Creates an instance with (stdout, ",", "\"") as default parameters.
 	 */
 	CsvOutput(string sep = ",", string quote = "\"") :   
-		file(stdout), separator(sep), quote(quote), numFields(0) {}
+		file(stdout), out(0), separator(sep), quote(quote), numFields(0) {}
+	
+	/**
+	 * Flushes any pending output.
+	 */
+	~CsvOutput() {
+		flush();
+	}
 		
+	/**
+	 * Sets the output file. Pending output, if any, is first flushed
+	 * to the previous file.
+	 */
 	void setFile(FILE* f) {
+		flush();
 		file = f;
+		out = 0;
+	}
+
+	/**
+	 * Sets an OutputFile as the output. Pending output, if any, is 
+	 * first flushed to the previous file.
+	 */
+	void setFile(OutputFile* of) {
+		flush();
+		file = 0;
+		out = of;
 	}
 
 	void setSeparator(string sep) {
@@ -73,9 +208,15 @@ class CsvOutput {
 	
 	/**
 	 * Adds a field to the current line.
+	 * The field is quoted if it contains the separator.
 	 * @return this
 	 */
-	CsvOutput& addString(string field);
+	CsvOutput& addString(const string& field);
+	CsvOutput& addString(const char* field);
+	CsvOutput& addString(const char* field, size_t len);
+	CsvOutput& addString(const CsvField& field) {
+		return addString(field.ptr, field.len);
+	}
 	
 	/**
 	 * Adds a formated field to the current line.
@@ -83,16 +224,70 @@ class CsvOutput {
 	 */
 	CsvOutput& addField(const char* fmt, ...);
 	
+	/**
+	 * Adds an integer field ("%ld") to the current line.
+	 * @return this
+	 */
+	CsvOutput& addInt(long value);
+	
+	/**
+	 * Adds an unsigned integer field ("%lu") to the current line.
+	 * @return this
+	 */
+	CsvOutput& addUInt(unsigned long value);
+	
+	/**
+	 * Adds a floating point field to the current line. 
+	 * Output is the same as with "%.<precision>f".
+	 * @return this
+	 */
+	CsvOutput& addDouble(double value, int precision = 6);
+	
+	/**
+	 * Adds a sequence of fields previously rendered with takeLine().
+	 * @param fields the rendered fields
+	 * @param count number of fields in the sequence
+	 * @return this
+	 */
+	CsvOutput& addRendered(const string& fields, int count);
+	
+	/**
+	 * Moves the fields of the current line (without line feed) to the
+	 * given string and starts a new line. Intended to pre-render fields
+	 * with an instance not associated with any file.
+	 * @return number of fields in the rendered line
+	 */
+	int takeLine(string& fields);
+	
 	/** 
 	 * Writes a line feed.
 	 */
 	void endLine(void);
 	
+	/**
+	 * Writes the pending output to the file.
+	 */
+	void flush(void);
+	
   private:
 	FILE* file;
+	OutputFile* out;
 	string separator;
 	string quote;
 	int numFields;
+	
+	// pending output
+	string buffer;
+	
+	// adds the separator if needed
+	inline void separate() {
+		if  ( numFields++ > 0 ) {
+			buffer += separator;
+		}
+	}
+	
+	// adds a field already formatted and not requiring quotes
+	void addRaw(const char* value, size_t len);
 };
 
 #endif
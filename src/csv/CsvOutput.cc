@@ -6,27 +6,51 @@
 
 #include "Csv.h"
 #include <stdarg.h>
+#include <cstring>
+#include <cmath>
+
+// pending output is written out when it reaches this size
+#define CSV_BUFFER_SIZE   (1024*1024)
 
 
 CsvOutput& CsvOutput::startLine() {
 	numFields = 0;
+	if ( (file || out) && buffer.capacity() < CSV_BUFFER_SIZE + 64*1024 ) {
+		buffer.reserve(CSV_BUFFER_SIZE + 64*1024);
+	}
 	return *this;
 }
 
-CsvOutput& CsvOutput::addString(string value) {
-	if  ( numFields++ > 0 ) {
-		fprintf(file, "%s", separator.c_str());
+CsvOutput& CsvOutput::addString(const char* value) {
+	return addString(value, strlen(value));
+}
+
+CsvOutput& CsvOutput::addString(const char* value, size_t len) {
+	separate();
+	
+	bool needs_quote;
+	if ( separator.size() == 1 ) {
+		needs_quote = memchr(value, separator[0], len) != NULL;
+	}
+	else {
+		needs_quote = string(value, len).find(separator) != string::npos;
 	}
 		
-	if ( value.find(separator) != string::npos ) {
-		fprintf(file, "%s%s%s", quote.c_str(), value.c_str(), quote.c_str());
+	if ( needs_quote ) {
+		buffer += quote;
+		buffer.append(value, len);
+		buffer += quote;
 	}
 	else {
-		fprintf(file, "%s", value.c_str());
+		buffer.append(value, len);
 	}
 	return *this;
 }
 
+CsvOutput& CsvOutput::addString(const string& value) {
+	return addString(value.data(), value.size());
+}
+
 CsvOutput& CsvOutput::addField(const char* fmt, ...) {
 	va_list args;
 	
@@ -39,11 +63,125 @@ CsvOutput& CsvOutput::addField(const char* fmt, ...) {
 	return addString(buff);
 }
 
+void CsvOutput::addRaw(const char* value, size_t len) {
+	separate();
+	buffer.append(value, len);
+}
+
+// writes the digits of value backwards ending at end; returns the start
+static inline char* format_digits(unsigned long value, char* end) {
+	do {
+		*--end = (char) ('0' + value % 10);
+		value /= 10;
+	} while ( value );
+	return end;
+}
+
+CsvOutput& CsvOutput::addInt(long value) {
+	char buff[32];
+	char* end = buff + sizeof(buff);
+	char* start;
+	if ( value < 0 ) {
+		start = format_digits(0UL - (unsigned long) value, end);
+		*--start = '-';
+	}
+	else {
+		start = format_digits((unsigned long) value, end);
+	}
+	addRaw(start, end - start);
+	return *this;
+}
+
+CsvOutput& CsvOutput::addUInt(unsigned long value) {
+	char buff[32];
+	char* end = buff + sizeof(buff);
+	char* start = format_digits(value, end);
+	addRaw(start, end - start);
+	return *this;
+}
+
+CsvOutput& CsvOutput::addDouble(double value, int precision) {
+	static const double pow10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+	
+	//
+	// Fast path: value*10^precision is computed in double precision and
+	// rounded. This gives exactly the same digits as printf as long as
+	// the scaled value is small enough (so its rounding error is tiny)
+	// and is not too close to a rounding tie. Otherwise, use snprintf.
+	//
+	if ( precision >= 0 && precision <= 9 ) {
+		const double mag = fabs(value);
+		const double scaled = mag * pow10[precision];
+		if ( scaled < 1099511627776.0 ) {   // 2^40
+			const double rounded = floor(scaled + 0.5);
+			const double diff = fabs(scaled - floor(scaled) - 0.5);
+			if ( diff > 1e-3 ) {
+				unsigned long digits = (unsigned long) rounded;
+				char buff[64];
+				char* end = buff + sizeof(buff);
+				char* start = end;
+				if ( precision > 0 ) {
+					for ( int k = 0; k < precision; k++ ) {
+						*--start = (char) ('0' + digits % 10);
+						digits /= 10;
+					}
+					*--start = '.';
+				}
+				start = format_digits(digits, start);
+				// as printf, keep the sign of negative values even if rounded to 0
+				if ( value < 0 || (value == 0 && signbit(value)) ) {
+					*--start = '-';
+				}
+				addRaw(start, end - start);
+				return *this;
+			}
+		}
+	}
+	
+	char buff[512];
+	int len = snprintf(buff, sizeof(buff), "%.*f", precision, value);
+	if ( len < 0 || len >= (int) sizeof(buff) ) {
+		return addField("%.*f", precision, value);
+	}
+	addRaw(buff, len);
+	return *this;
+}
+
+CsvOutput& CsvOutput::addRendered(const string& fields, int count) {
+	if ( count > 0 ) {
+		separate();
+		buffer += fields;
+		numFields += count - 1;
+	}
+	return *this;
+}
+
+int CsvOutput::takeLine(string& fields) {
+	int count = numFields;
+	fields.assign(buffer);
+	buffer.clear();
+	numFields = 0;
+	return count;
+}
+
 void CsvOutput::endLine() {
 	if  ( numFields > 0 ) {	
-		fprintf(file, "\n");
+		buffer += '\n';
+		if ( buffer.size() >= CSV_BUFFER_SIZE ) {
+			flush();
+		}
 	}
 	numFields = 0;
 }
 
-
+void CsvOutput::flush() {
+	if ( buffer.size() > 0 ) {
+		if ( out ) {
+			out->write(buffer);
+		}
+		else if ( file ) {
+			fwrite(buffer.data(), 1, buffer.size(), file);
+		}
+	}
+	buffer.clear();
+}
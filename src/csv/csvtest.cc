@@ -6,21 +6,55 @@
 //
 // g++ -Wall Csv.cc csvtest.cc -o csvtest
 //
+// With -chunks <n>, the file is divided with CsvReader::getChunks and
+// each chunk is parsed by its own reader; the output must be the same.
 //
 
 #include "Csv.h"
 
-// Csvtest main: test Csv class
-int main(void)
-{
-	string line;
-	Csv csv;
+#include <cstdlib>
 
-	while ( csv.getline(line) ) {
-		cout << "line = `" << line <<"'\n";
-		for (string::size_type i = 0; i < csv.getnfield(); i++)
+// prints the lines read by the reader, numbered from line + 1
+static int dump(CsvReader& reader, int line) {
+	while ( reader.nextLine() ) {
+		cout << "line " << ++line << "\n";
+		for (unsigned i = 0; i < reader.getNumFields(); i++)
 			cout << "field[" << i << "] = `"
-				 << csv.getfield(i) << "'\n";
+				 << reader.getString(i) << "'\n";
+	}
+	return line;
+}
+
+// Csvtest main: test CsvReader class
+int main(int argc, char** argv)
+{
+	unsigned numChunks = 0;
+	if ( argc == 4 && 0 == strcmp(argv[1], "-chunks") ) {
+		numChunks = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if ( argc != 2 ) {
+		cerr<< "usage: csvtest [-chunks <n>] <file.csv>" << endl;
+		return 1;
+	}
+	CsvReader reader;
+	if ( !reader.open(argv[1]) ) {
+		cerr<< "cannot open " <<argv[1]<< endl;
+		return 1;
+	}
+
+	if ( numChunks == 0 ) {
+		dump(reader, 0);
+		return 0;
+	}
+
+	vector<size_t> bounds;
+	reader.getChunks(numChunks, bounds);
+	int line = 0;
+	for ( unsigned k = 0; k + 1 < bounds.size(); k++ ) {
+		CsvReader chunk(reader.getData() + bounds[k], bounds[k + 1] - bounds[k]);
+		line = dump(chunk, line);
 	}
 	return 0;
 }
@@ -0,0 +1,64 @@
+/*
+	NoData - nodata handling for a raster band
+	See NoData.h for public doc.
+*/
+#include "NoData.h"
+
+
+BandNoData::BandNoData(GDALRasterBand* band, double nodata) {
+	value = nodata;
+	if ( !value ) {
+		// Note: if the band has no nodata value, GDAL returns a 
+		// default value that should not appear in the data.
+		value = band->GetNoDataValue();
+	}
+	
+	// a mask band other than the one derived from the nodata value?
+	maskBand = 0;
+	int flags = band->GetMaskFlags();
+	if ( !(flags & GMF_ALL_VALID) && !(flags & GMF_NODATA) ) {
+		maskBand = band->GetMaskBand();
+	}
+}
+
+//
+// Note: the loops below are kept free of branches so the compiler can
+// vectorize the comparisons.
+//
+
+void BandNoData::markValid(const vector<double>& values, vector<unsigned char>& valid) {
+	const unsigned n = values.size();
+	valid.resize(n);
+	if ( n == 0 )
+		return;
+	const double* v = &values[0];
+	unsigned char* ok = &valid[0];
+	const double nodata = value;
+	for ( unsigned i = 0; i < n; i++ ) {
+		ok[i] = v[i] != nodata;
+	}
+}
+
+void BandNoData::markValid(const vector<int>& values, vector<unsigned char>& valid) {
+	const unsigned n = values.size();
+	valid.resize(n);
+	if ( n == 0 )
+		return;
+	const int* v = &values[0];
+	unsigned char* ok = &valid[0];
+	const int nodata = int(value);
+	for ( unsigned i = 0; i < n; i++ ) {
+		ok[i] = v[i] != nodata;
+	}
+}
+
+void BandNoData::applyMask(const vector<unsigned char>& mask, vector<unsigned char>& valid) {
+	const unsigned n = valid.size();
+	if ( n == 0 )
+		return;
+	const unsigned char* m = &mask[0];
+	unsigned char* ok = &valid[0];
+	for ( unsigned i = 0; i < n; i++ ) {
+		ok[i] &= m[i] != 0;
+	}
+}
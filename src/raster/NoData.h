@@ -0,0 +1,62 @@
+/*
+	NoData - nodata handling for a raster band
+*/
+#ifndef NoData_h
+#define NoData_h
+
+#include "gdal.h"           
+#include "gdal_priv.h"
+
+#include <vector>
+
+using namespace std;
+
+
+/**
+  * Determines which values of a raster band are valid.
+  * A value is invalid if it equals the nodata value of the band or,
+  * if the band has a mask or alpha band (see GDALRasterBand::GetMaskFlags),
+  * the corresponding mask value is 0.
+  *
+  * Validity is given as a mask (1 = valid, 0 = nodata) parallel to the
+  * values, so accumulators can skip invalid entries without compacting
+  * or modifying the value lists.
+  */
+class BandNoData {
+public:
+	/**
+	  * @param band the band
+	  * @param nodata nodata value to be used for the band. If 0.0, the
+	  *        nodata value reported by the band is used.
+	  */
+	BandNoData(GDALRasterBand* band, double nodata);
+	
+	/** the nodata value in effect */
+	double getValue() { return value; }
+	
+	/** the mask band to be checked, or null if the band has no mask/alpha */
+	GDALRasterBand* getMaskBand() { return maskBand; }
+	
+	/** true iff value is not the nodata value */
+	bool isValid(double v) { return v != value; }
+	
+	/**
+	  * Sets valid[i] = 1 if values[i] is not the nodata value; 0 otherwise.
+	  * valid is resized to values.size().
+	  */
+	void markValid(const vector<double>& values, vector<unsigned char>& valid);
+	void markValid(const vector<int>& values, vector<unsigned char>& valid);
+	
+	/**
+	  * Clears valid[i] where mask[i] is 0.
+	  * @param mask values from getMaskBand() at the same locations.
+	  */
+	static void applyMask(const vector<unsigned char>& mask, vector<unsigned char>& valid);
+
+private:
+	double value;
+	GDALRasterBand* maskBand;
+};
+
+
+#endif
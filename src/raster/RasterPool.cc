@@ -0,0 +1,111 @@
+/*
+	RasterPool - pool of open rasters with LRU eviction
+	See RasterPool.h for public doc.
+*/
+
+#include "RasterPool.h"
+
+
+RasterPool& RasterPool::getPool() {
+	static RasterPool pool;
+	return pool;
+}
+
+RasterPool::RasterPool(unsigned maxOpen) : maxOpen(maxOpen) {
+	numOpens = 0;
+	mutex = CPLCreateMutex();
+	CPLReleaseMutex(mutex);    // created acquired
+}
+
+RasterPool::~RasterPool() {
+	for ( list<Entry>::iterator it = entries.begin(); it != entries.end(); it++ ) {
+		delete it->raster;
+	}
+	CPLDestroyMutex(mutex);
+}
+
+Raster* RasterPool::get(const string& filename) {
+	CPLAcquireMutex(mutex, 1000.0);
+	map<string, list<Entry>::iterator>::iterator found = byName.find(filename);
+	if ( found != byName.end() ) {
+		// move to front:
+		entries.splice(entries.begin(), entries, found->second);
+		Entry& entry = entries.front();
+		entry.refs++;
+		CPLReleaseMutex(mutex);
+		return entry.raster;
+	}
+	CPLReleaseMutex(mutex);
+	
+	// open without holding the lock:
+	Raster* raster = Raster::open(filename.c_str());
+	if ( !raster ) {
+		return 0;
+	}
+	
+	CPLAcquireMutex(mutex, 1000.0);
+	numOpens++;
+	Entry entry;
+	entry.filename = filename;
+	entry.raster = raster;
+	entry.refs = 1;
+	entries.push_front(entry);
+	// (another thread may have opened the same file meanwhile; this
+	// entry then takes over the name and the other one is evicted
+	// when released)
+	byName[filename] = entries.begin();
+	evict();
+	CPLReleaseMutex(mutex);
+	return raster;
+}
+
+void RasterPool::release(Raster* raster) {
+	CPLAcquireMutex(mutex, 1000.0);
+	for ( list<Entry>::iterator it = entries.begin(); it != entries.end(); it++ ) {
+		if ( it->raster == raster ) {
+			it->refs--;
+			break;
+		}
+	}
+	evict();
+	CPLReleaseMutex(mutex);
+}
+
+void RasterPool::setMaxOpen(unsigned maxOpen) {
+	CPLAcquireMutex(mutex, 1000.0);
+	this->maxOpen = maxOpen;
+	evict();
+	CPLReleaseMutex(mutex);
+}
+
+void RasterPool::clear() {
+	setMaxOpen(0);
+	CPLAcquireMutex(mutex, 1000.0);
+	maxOpen = RASTER_POOL_SIZE;
+	CPLReleaseMutex(mutex);
+}
+
+// closes unused rasters, least recently used first, while more than
+// maxOpen are open. Also closes unused duplicates (see get).
+// Called with the lock held.
+void RasterPool::evict() {
+	unsigned numOpen = entries.size();
+	list<Entry>::iterator it = entries.end();
+	while ( it != entries.begin() ) {
+		--it;
+		if ( it->refs > 0 ) {
+			continue;
+		}
+		map<string, list<Entry>::iterator>::iterator named = byName.find(it->filename);
+		const bool duplicate = named->second != it;
+		if ( !duplicate && numOpen <= maxOpen ) {
+			continue;
+		}
+		if ( !duplicate ) {
+			byName.erase(named);
+		}
+		delete it->raster;
+		it = entries.erase(it);
+		numOpen--;
+	}
+}
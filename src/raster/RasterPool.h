@@ -0,0 +1,84 @@
+/*
+	RasterPool - pool of open rasters with LRU eviction
+*/
+#ifndef RasterPool_h
+#define RasterPool_h
+
+#include "Raster.h"
+#include "cpl_multiproc.h"
+
+#include <string>
+#include <list>
+#include <map>
+
+using namespace std;
+
+// default maximum number of rasters kept open by the pool
+#define RASTER_POOL_SIZE 64
+
+
+/**
+  * Keeps rasters open by file name so consecutive requests for the same
+  * file do not reopen it. When more than maxOpen rasters are open, the
+  * least recently used ones that are not in use are closed.
+  * A raster obtained with get() must be given back with release().
+  * The pool can be used from several threads, but a raster should be
+  * used by one thread at a time.
+  */
+class RasterPool {
+public:
+	/** The process-wide pool. */
+	static RasterPool& getPool();
+	
+	/**
+	  * Creates a pool.
+	  * @param maxOpen maximum number of rasters not in use to keep open.
+	  */
+	RasterPool(unsigned maxOpen = RASTER_POOL_SIZE);
+	
+	/** closes all rasters */
+	~RasterPool();
+	
+	/**
+	  * Gets the raster for the given file, opening it if necessary.
+	  * @return the raster; NULL if it cannot be opened.
+	  */
+	Raster* get(const string& filename);
+	
+	/**
+	  * Gives back a raster obtained with get().
+	  */
+	void release(Raster* raster);
+	
+	/** Sets the maximum number of rasters to keep open. */
+	void setMaxOpen(unsigned maxOpen);
+	
+	/** Closes all the rasters not in use. */
+	void clear();
+	
+	/** Number of times a raster had to be opened. */
+	long getNumOpens() { return numOpens; }
+
+private:
+	struct Entry {
+		string filename;
+		Raster* raster;
+		int refs;
+	};
+	
+	// most recently used first
+	list<Entry> entries;
+	map<string, list<Entry>::iterator> byName;
+	
+	unsigned maxOpen;
+	long numOpens;
+	CPLMutex* mutex;
+	
+	void evict();
+	
+	// not copyable
+	RasterPool(const RasterPool&);
+	RasterPool& operator=(const RasterPool&);
+};
+
+#endif
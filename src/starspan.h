@@ -19,6 +19,7 @@
 #include "Stats.h"       
 
 #include <cstdio>
+#include <map>
 
 /////////////////////////////////////////////////////////////////////////////
 // services:
@@ -64,6 +65,31 @@ double** starspan_getFeatureStatsByField(
 
 
 
+/**
+  * Gets statistics for a list of features in a raster with a single
+  * traversal.
+  * results[FID][s][b] = statistic s on band b for the feature FID.
+  * Only features with intersecting pixels get an entry. Each entry
+  * must be released with starspan_releaseFeatureStats.
+  * @param FIDs  the features
+  * @param vect
+  * @param rast
+  * @param select_stats List of desired statistics (avg, mode, stdev, min, max)
+  * @param results  Output
+  * @return number of entries in results
+  */
+int starspan_getFeaturesStats(
+	const vector<long>& FIDs, Vector* vect, Raster* rast,
+	vector<const char*> select_stats,
+	map<long, double**>& results
+); 
+
+/**
+  * Releases stats obtained with starspan_getFeaturesStats.
+  */
+void starspan_releaseFeatureStats(double** stats);
+
+
 /////////////////////////////////////////////////////////////////////////////
 // main operations:
 
@@ -129,6 +155,39 @@ int starspan_stats(
 	int layernum
 );
 
+/** Stats calculation by attribute value on multiple rasters.
+  * The pixels of all features with the same value of the given field,
+  * from all the rasters, are accumulated into a single stats state, so
+  * results like median and stdev are computed over the whole group.
+  * Generates a CSV file with the following columns:
+  *     <group_field>, numFeatures, numPixels, S1_Band1, S1_Band2 ..., S2_Band1, S2_Band2 ...
+  * where:
+  *     <group_field> value of the field
+  *     numFeatures   Number of distinct features (FIDs) in the group, even
+  *                   if found in several rasters
+  *     numPixels     Number of pixels in the group
+  *     <s>_Band<b>   statistic s for band b 
+  *
+  * All rasters should have the same number of bands.
+  *
+  * @param vect Vector datasource
+  * @param raster_filenames rasters
+  * @param select_stats List of desired statistics
+  * @param group_field field to group by
+  * @param csv_filename output file name
+  * @param layernum layer number within the vector datasource
+  *
+  * @return 0 iff OK 
+  */
+int starspan_group_stats(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*> select_stats,
+	const char* group_field,
+	const char* csv_filename,
+	int layernum
+);
+
 /**
   * Gets an observer that computes statistics for each FID.
   *
@@ -148,21 +207,54 @@ Observer* starspan_getStatsObserver(
 
 
 /**
-  * Gets an observer that computes counts per class from an
-  * integral raster band. Only the first band from the raster
-  * dataset will be processed as long as its type is integral.
+  * Gets an observer that computes counts per class from integral
+  * raster bands. Counts are accumulated as pixels are visited; 8- and
+  * 16-bit bands use dense count arrays allocated once for the whole
+  * traversal.
   * The format of the output file is as follows:
   * <pre>
-  *		FID,class,count
+  *		FID,class,count                        (a single band)
+  *		FID,band,class,count                   (several bands)
+  *		FID,class_Band<i>,class_Band<j>,count  (cross-tabulation)
   * </pre>
   *
   * @param tr Data traverser
   * @param filename output file name
+  * @param bands 1-based indices of the bands to be processed.
+  *        If empty, all bands of integral type are processed.
+  * @param crosstab If true, bands must contain exactly two indices,
+  *        and counts are given for each combination of classes 
+  *        in the two bands (e.g., a change matrix).
   *
   * @return observer to be added to traverser. 
   */
 Observer* starspan_getCountByClassObserver(
 	Traverser& tr,
+	const char* filename,
+	vector<unsigned>& bands,
+	bool crosstab
+);
+
+/**
+  * Gets an observer that computes, for each feature, the mean vector and
+  * the band covariance matrix of the intersecting pixels. Values are
+  * accumulated while pixels are visited, so no pixel lists are kept.
+  * Pixels having the nodata value in any band are skipped.
+  * The format of the output file is as follows:
+  * <pre>
+  *		FID,{vect-attrs},numPixels,avg_Band1,...,cov_Band1_Band1,cov_Band1_Band2,...
+  * </pre>
+  * Only the upper triangle of the (symmetric) matrix is written.
+  *
+  * @param tr Data traverser
+  * @param select_fields desired fields from the vector. If null, all fields are included.
+  * @param filename output file name
+  *
+  * @return observer to be added to traverser. 
+  */
+Observer* starspan_getCovarianceObserver(
+	Traverser& tr,
+	vector<const char*>* select_fields,
 	const char* filename
 );
 
@@ -170,6 +262,8 @@ Observer* starspan_getCountByClassObserver(
 
 
 /** Extraction from rasters specified in vector field.
+  * Features of any geometry type are processed with the traverser,
+  * grouped by raster so each raster is opened once (see RasterPool).
   * Generates a CSV file with the following columns:
   *     FID, {vect-attrs}, [col,row,] [x,y,] {rast-bands}
   * where:
@@ -226,6 +320,42 @@ int starspan_csv(
 );
 
 
+/** Extraction from multiple rasters into a columnar binary table.
+  * The columns are the same as in starspan_csv, but values are stored
+  * in native form: FID, col, row as Int32, x, y as Float64, band values 
+  * in the raster data type, and attributes and RID as strings.
+  * See BinTable.h for the file layout.
+  * All rasters should have the same number and types of bands.
+  *
+  * @param vect Vector datasource
+  * @param raster_filenames rasters
+  * @param select_fields desired fields from vector
+  * @param bin_filename output file name
+  * @param layernum layer number within the vector datasource
+  * @param compress true to compress the column chunks with zlib
+  *
+  * @return 0 iff OK 
+  */
+int starspan_bintable(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*>* select_fields,
+	const char* bin_filename,
+	int layernum,
+	bool compress
+);
+
+/** Converts a binary table generated by starspan_bintable to CSV.
+  * @return 0 iff OK 
+  */
+int starspan_bin2csv(const char* bin_filename, const char* csv_filename);
+
+/** Prints the schema and size information of a binary table.
+  * @return 0 iff OK 
+  */
+int starspan_bininfo(const char* bin_filename);
+
+
 
 /**
  * FR 200337 Duplicate pixel handling.
@@ -260,8 +390,12 @@ Observer* starspan_gen_envisl(
 
 
 /**
-  * Updates a CSV
-  * DOC ME!
+  * Updates a CSV: creates a copy of the input file with the band values
+  * of the given rasters at the locations indicated by the x,y (or col,row)
+  * fields of each record.
+  * The records are processed in chunks; within a chunk, the pixels are
+  * read block by block (by globalOptions.num_threads workers) and the
+  * records are written in their original order.
   */
 int starspan_update_csv(
 	const char* in_csv_filename,
@@ -304,6 +438,8 @@ Observer* starspan_jtstest(
 
 /**
   * Creates mini-rasters.
+  * If globalOptions.num_threads > 1, the minirasters are created in 
+  * parallel, in batches of MINIRASTER_BATCH_SIZE.
   *
   * @param prefix
   * @param pszOutputSRS 
@@ -348,7 +484,14 @@ void starspan_print_envelope(FILE* file, const char* msg, OGREnvelope& env);
 
 
 /** 
-  * Creates a raster by subsetting a given raster
+  * Creates a raster by subsetting a given raster.
+  * If a mask is given, the pixels not flagged in it are set to mask_value
+  * in the output.
+  * If virtual_output is true, the created raster is a VRT file referencing
+  * the window of the input dataset, so no pixel data is copied; in this case
+  * the mask is given as the mask band of the VRT, with a byte file named
+  * like pszDest with extension ".mask.img" as its source, and mask_value
+  * is not used.
   */
 GDALDatasetH starspan_subset_raster(
 	GDALDatasetH hDataset,        // input dataset
@@ -364,7 +507,14 @@ GDALDatasetH starspan_subset_raster(
 	int          xsize_incr,      // used to create the raster 
 	int          ysize_incr,      // used to create the raster
 
-	double		 *nodata          // used if not null
+	double		 *nodata,         // used if not null
+
+	const char*  mask = NULL,     // if not null, xsize*ysize flags, row by row;
+	                              // pixels with a zero flag are set to mask_value,
+	                              // or masked out in a virtual output
+	double       mask_value = 0,
+
+	bool         virtual_output = false
 );
 
 
@@ -375,7 +525,7 @@ inline double starspan_extract_double_value(GDALDataType bandType, void* ptr) {
 	double value;
 	switch(bandType) {
 		case GDT_Byte:
-			value = (double) *( (char*) ptr );
+			value = (double) *( (unsigned char*) ptr );
 			break;
 		case GDT_UInt16:
 			value = (double) *( (unsigned short*) ptr );
@@ -408,7 +558,7 @@ inline double starspan_extract_double_value(GDALDataType bandType, void* ptr) {
 inline void starspan_extract_string_value(GDALDataType bandType, char* ptr, char* value) {
 	switch(bandType) {
 		case GDT_Byte:
-			sprintf(value, "%d", (int) *( (char*) ptr ));
+			sprintf(value, "%d", (int) *( (unsigned char*) ptr ));
 			break;
 		case GDT_UInt16:
 			sprintf(value, "%u", *( (unsigned short*) ptr ));
@@ -420,7 +570,7 @@ inline void starspan_extract_string_value(GDALDataType bandType, char* ptr, char
 			sprintf(value, "%u", *( (unsigned int*) ptr ));
 			break;
 		case GDT_Int32:
-			sprintf(value, "%u", *( (int*) ptr ));
+			sprintf(value, "%d", *( (int*) ptr ));
 			break;
 		case GDT_Float32:
 			sprintf(value, "%f", *( (float*) ptr ));
@@ -442,7 +592,7 @@ inline int starspan_extract_int_value(GDALDataType bandType, void* ptr) {
 	int value;
 	switch(bandType) {
 		case GDT_Byte:
-			value = (int) *( (char*) ptr );
+			value = (int) *( (unsigned char*) ptr );
 			break;
 		case GDT_UInt16:
 			value = (int) *( (unsigned short*) ptr );
@@ -489,6 +639,12 @@ inline void starspan_simplify_filename(string& filename) {
 struct ExtractionItem {
     OGRFeature* feature;
     const char* rasterFilename;
+    
+    /** data given to starspan_dup_pixel for the extraction function */
+    void* data;
+    
+    /** context of the run */
+    ExtractionContext* context;
 };
 
 
@@ -504,6 +660,8 @@ struct ExtractionItem {
  * @param layernum
  * @param dupPixelModes Modes for duplicate pixel handling
  * @param extractionFunction Function to call for each extraction item.
+ * @param extractionData Passed to extractionFunction in ExtractionItem::data.
+ * @param context Options for this run; a copy of globalOptions if NULL.
  *
  * @return 0 iff successful.
  */
@@ -514,9 +672,49 @@ int starspan_dup_pixel(
 	vector<const char*>* select_fields,
 	int layernum,
 	vector<DupPixelMode>& dupPixelModes,
-	void (*extractionFunction)(ExtractionItem* item)
+	void (*extractionFunction)(ExtractionItem* item),
+	void* extractionData = 0,
+	const ExtractionContext* context = 0
+);
+
+
+/**
+ * Extraction session: pixels of individual features are extracted from
+ * given rasters as with starspan_csv, keeping the output file, the 
+ * traverser and the rasters (see RasterPool) open between extractions.
+ */
+struct CSVSession;
+
+/**
+ * Opens an extraction session.
+ * @param csv_filename output file; new rows are appended if it exists.
+ * @param context Options for the session; a copy of globalOptions if NULL.
+ * @return the session; NULL if the output file cannot be opened.
+ */
+CSVSession* starspan_csv_open_session(
+	Vector* vect,
+	vector<const char*>* select_fields,
+	const char* csv_filename,
+	int layernum,
+	const ExtractionContext* context = 0
 );
 
+/**
+ * Extracts the pixels of a feature from a raster.
+ * @return 0 iff OK
+ */
+int starspan_csv_session_extract(
+	CSVSession* session,
+	long FID,
+	const char* raster_filename
+);
+
+/**
+ * Writes any pending output and releases the session.
+ * @return 0 iff OK
+ */
+int starspan_csv_close_session(CSVSession* session);
+
 
 int starspan_csv2(
 	Vector* _vect,
@@ -561,16 +759,32 @@ int starspan_grass(int argc, char ** argv);
 //////////////////////////////////////////////////////////////////////
 
 
+/**
+  * What to burn in a band of the rasterization output:
+  * a constant value, the FID, or the value of a numeric field.
+  */
+struct RasterizeBurn {
+    enum Kind { VALUE, FID, FIELD };
+    Kind kind;
+    double value;
+    const char* field;
+    
+    RasterizeBurn(Kind kind, double value = 0, const char* field = 0) :
+        kind(kind), value(value), field(field) {}
+};
+
 struct RasterizeParams {
-    const char* outRaster_filename; 
+    string outRaster_filename; 
     int rastValue;
     bool fillNoData;
     const char* rastFormat;
     const char* projection;
     double* geoTransform;
     
+    // one band per element; if empty, a single band with rastValue
+    vector<RasterizeBurn> burns;
+    
     RasterizeParams() : 
-        outRaster_filename(0), 
         rastValue(1), 
         fillNoData(true),
         rastFormat("ENVI"),
@@ -584,9 +798,16 @@ struct RasterizeParams {
     }
     
     ~RasterizeParams() {
-        delete geoTransform;
+        delete[] geoTransform;
     }
 };
+
+/**
+  * Creates the rasterization observer.
+  * Burned values are kept in an in-memory tile cache and written
+  * to the output raster tile by tile.
+  * @param rasterizeParams parameters
+  */
 Observer* starspan_getRasterizeObserver(RasterizeParams* rasterizeParams);
 
 
@@ -626,23 +847,40 @@ int starspan_validate_input_elements(
 ///////////////////////////////////////////////////
 // mini raster basic information; A list of these elements
 // is gathered by the main miniraster generator and then used by
-// the strip generator to properly locate the minirasters within the strip.
+// the strip generator to properly locate the minirasters within the strip
+// and to transfer their data directly from the source raster.
 //
 struct MRBasicInfo {
 	// corresponding FID from which the miniraster was extracted
 	long FID;
     
-    string mini_filename;
+    // raster from which the miniraster is extracted
+    string raster_filename;
+    
+    // location of the miniraster in the source raster
+    int col0;
+    int row0;
 	
 	// dimensions of this miniraster
 	int width;
 	int height;
     
+    // parity adjustments: extra columns and rows at the right and bottom
+    int xsize_incr;
+    int ysize_incr;
+    
+    // if not empty, width*height flags, row by row; pixels with
+    // a zero flag are nullified in the strip
+    string mask;
+    
     // row to locate this miniraster in strip:
     int mrs_row;
 	
-	MRBasicInfo(long FID, string& mini_filename, int width, int height, int mrs_row) : 
-		FID(FID), mini_filename(mini_filename), width(width), height(height), mrs_row(mrs_row)
+	MRBasicInfo(long FID, const string& raster_filename, int col0, int row0, 
+	            int width, int height, int xsize_incr, int ysize_incr, int mrs_row) : 
+		FID(FID), raster_filename(raster_filename), col0(col0), row0(row0), 
+		width(width), height(height), xsize_incr(xsize_incr), ysize_incr(ysize_incr), 
+		mrs_row(mrs_row)
 	{}
     
     /** Returns the next row just below this miniraster */
@@ -654,11 +892,12 @@ struct MRBasicInfo {
 
 /**
   * Creates output strips according to the minirasters registered in mrbi_list.
+  * The data is read directly from the source rasters and written to the
+  * outputs in blocks of complete rows.
   */
 void starspan_create_strip(
     GDALDataType strip_band_type,
     int strip_bands,
-    string prefix,
     vector<MRBasicInfo>* mrbi_list,
     string strip_filename,
     string fid_filename,
@@ -666,6 +905,36 @@ void starspan_create_strip(
 );
 
 
+/**
+  * Number of minirasters registered before they are created when the
+  * creation is deferred to run in parallel.
+  */
+#define MINIRASTER_BATCH_SIZE 256
+
+/**
+  * Creates the minirasters registered in mrbi_list, named after the given
+  * prefix and the FID. They are created by globalOptions.num_threads 
+  * workers, each one with its own handles on the source rasters.
+  */
+void starspan_create_minirasters(
+	string prefix,
+	const char* pszOutputSRS,
+    vector<MRBasicInfo>* mrbi_list
+);
+
+/**
+ * Called by starspan_miniraster2()
+ * Creates a MiniRasterObserver that only registers the minirasters in
+ * the given list, whose ownership remains the caller's. 
+ * The caller will presumably call starspan_create_minirasters().
+ */
+Observer* starspan_getMiniRasterObserver2(
+	const char* prefix,
+	const char* pszOutputSRS,
+    vector<MRBasicInfo>* mrbi_list
+);
+
+
 /**
  * Called by starspan_minirasterstrip2()
  * Creates a MiniRasterStripObserver with NO ownership over the
@@ -676,7 +945,6 @@ void starspan_create_strip(
  */
 Observer* starspan_getMiniRasterStripObserver2(
 	string basefilename,
-    string prefix,
     Vector* outVector,
     OGRLayer* outLayer,
     vector<MRBasicInfo>* mrbi_list
@@ -16,8 +16,11 @@
 
 #include "starspan.h"           
 #include "traverser.h"           
+#include "OutputFile.h"
+#include "RasterPool.h"
 
 #include <cstdlib>
+#include <cctype>
 #include <ctime>
 
 
@@ -30,6 +33,9 @@
 #define DEFAULT_CLASS_SUMMARY_SUFFIX        NULL
        //"_classsummary.csv"
 
+#define DEFAULT_COV_SUFFIX                  NULL
+       //"_cov.csv"
+
 #define DEFAULT_MINIRASTER_SUFFIX           "_mr"
                                             
 #define DEFAULT_MRST_IMG_SUFFIX             "_mrst.img"
@@ -76,14 +82,19 @@ static void usage(const char* msg) {
 		"\n"
 		"      --vector <filename>                         --raster <filenames> ... \n"
 		"      --layer <layername>                         --mask <filenames> ...   \n"
+		"      --raster-field <field> <directory>\n"
 		"\n"
 		"      --out-prefix <string>                       --out-type <type>\n"
-		"      --table-suffix <string>\n"
+		"      --table-suffix <string>                     --compress\n"
 		"      --summary-suffix <string>                   --stats <stat> <stat> ...\n"
-        "      --class-summary-suffix <string> \n"
+		"      --group-by <field>                          --approx <rel-error> [<confidence>]\n"
+        "      --class-summary-suffix <string>             --cov-suffix <string>\n"
+        "      --class-bands {all | <band> ...}            --class-crosstab <band> <band>\n"
 		"      --mr-img-suffix <string>                    --mini_raster_parity <parity> \n"
+		"      --mr-vrt                                    --threads <num>\n"
 		"      --mrst-img-suffix <string>                  --mrst-shp-suffix <string>\n"
 		"      --mrst-fid-suffix <string>                  --mrst-glt-suffix <string>\n"
+		"      --rasterize-suffix <string>                 --rasterize-burn {<value> | fid | <field>} ...\n"
 		"\n"
 		"      --duplicate <mode> <mode> ...               --validate_inputs\n"
 		"      --in                                        --separation <num-pixels> \n"
@@ -97,6 +108,9 @@ static void usage(const char* msg) {
 		"      --progress [<value>]                        --show-fields \n"
 		"      --report                                    --verbose \n"
 		"      --elapsed_time                              --version\n"
+		"      --bininfo <filename>                        --bin2csv <filename> <csv-filename>\n"
+		"      --update-csv <csv-filename> <csv-output>\n"
+		"      --calbase <link> <speclib-filename> <calbase-filename>\n"
 		);
 	}
 	
@@ -151,6 +165,8 @@ int main(int argc, char ** argv) {
 	globalOptions.boxParams.given = false;
 	globalOptions.mini_raster_parity = "";
 	globalOptions.mini_raster_separation = 0;
+	globalOptions.mini_raster_vrt = false;
+	globalOptions.num_threads = 1;
 	globalOptions.delimiter = ",";
     
 
@@ -172,6 +188,11 @@ int main(int argc, char ** argv) {
 	bool report_elapsed_time = false;
 	bool do_report = false;
 	bool show_fields = false;
+	bool compress = false;
+	const char* bininfo_filename = NULL;
+	const char* bin2csv_filenames[2] = { NULL, NULL };
+	const char* update_csv_filenames[2] = { NULL, NULL };
+	const char* calbase_args[3] = { NULL, NULL, NULL };
     
     
     const char*  outprefix = NULL;
@@ -185,8 +206,13 @@ int main(int argc, char ** argv) {
     
 	const char*  summary_suffix = DEFAULT_SUMMARY_SUFFIX;
 	vector<const char*> select_stats;
+	const char*  group_by = NULL;
     
     const char*  class_summary_suffix = DEFAULT_CLASS_SUMMARY_SUFFIX;
+    vector<unsigned> class_bands(1, 1);   // by default, only first band
+    bool class_crosstab = false;
+    
+    const char*  cov_suffix = DEFAULT_COV_SUFFIX;
     
     // ####.img will be appended to this
     const char*  miniraster_suffix = DEFAULT_MINIRASTER_SUFFIX;
@@ -205,6 +231,10 @@ int main(int argc, char ** argv) {
 	int vector_layernum = 0;
 	vector<const char*> raster_filenames;
 	
+	// rasters given by a vector field
+	const char* raster_field_name = 0;
+	const char* raster_directory = 0;
+	
     
 	vector<const char*> mask_filenames;
     vector<const char*> *masks = 0;
@@ -249,6 +279,15 @@ int main(int argc, char ** argv) {
 				--i;
 		}
         
+		else if ( 0==strcmp("--raster-field", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--raster-field: which field?");
+			raster_field_name = argv[i];
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--raster-field: which directory?");
+			raster_directory = argv[i];
+		}
+        
 		else if ( 0==strcmp("--mask", argv[i]) ) {
 			while ( ++i < argc && argv[i][0] != '-' ) {
 				const char* mask_filename = argv[i];
@@ -369,12 +408,66 @@ int main(int argc, char ** argv) {
 			if ( i < argc && argv[i][0] == '-' ) 
 				--i;
 		}
+		else if ( 0==strcmp("--approx", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--approx: relative error?");
+			globalOptions.approxParams.rel_error = atof(argv[i]);
+			if ( globalOptions.approxParams.rel_error <= 0 )
+				usage("--approx: relative error must be positive");
+			if ( i+1 < argc && argv[i+1][0] != '-' ) {
+				globalOptions.approxParams.confidence = atof(argv[++i]);
+				if ( globalOptions.approxParams.confidence <= 0 
+				||   globalOptions.approxParams.confidence >= 1 )
+					usage("--approx: confidence must be in (0,1)");
+			}
+			globalOptions.approxParams.given = true;
+		}
+		else if ( 0==strcmp("--group-by", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--group-by: ?");
+			group_by = argv[i];
+		}
 
 		else if ( 0==strcmp("--class-summary-suffix", argv[i]) ) {
 			if ( ++i == argc || argv[i][0] == '-' )
 				usage("--class-summary-suffix: ?");
 			class_summary_suffix = argv[i];
 		}
+		else if ( 0==strcmp("--class-bands", argv[i]) ) {
+			class_bands.clear();
+			class_crosstab = false;
+			if ( i+1 < argc && 0==strcmp("all", argv[i+1]) ) {
+				// empty list means all bands
+				++i;
+			}
+			else {
+				while ( ++i < argc && argv[i][0] != '-' ) {
+					int band = atoi(argv[i]);
+					if ( band <= 0 )
+						usage("--class-bands: invalid band index");
+					class_bands.push_back(band);
+				}
+				if ( class_bands.size() == 0 )
+					usage("--class-bands: ?");
+				if ( i < argc && argv[i][0] == '-' ) 
+					--i;
+			}
+		}
+		else if ( 0==strcmp("--class-crosstab", argv[i]) ) {
+			class_bands.clear();
+			class_crosstab = true;
+			for ( int k = 0; k < 2; k++ ) {
+				if ( ++i == argc || argv[i][0] == '-' || atoi(argv[i]) <= 0 )
+					usage("--class-crosstab: two band indices expected");
+				class_bands.push_back(atoi(argv[i]));
+			}
+		}
+
+		else if ( 0==strcmp("--cov-suffix", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--cov-suffix: ?");
+			cov_suffix = argv[i];
+		}
 
         
         // minirasters
@@ -383,6 +476,9 @@ int main(int argc, char ** argv) {
 				usage("--mr-img-suffix: ?");
             miniraster_suffix = argv[i];
 		}
+		else if ( 0==strcmp("--mr-vrt", argv[i]) ) {
+			globalOptions.mini_raster_vrt = true;
+		}
 		
         
         // miniraster strip
@@ -413,7 +509,27 @@ int main(int argc, char ** argv) {
 				usage("--rasterize: suffix?");
             }
             rasterize_suffix = argv[i];
-            // TODO: accept other parameters
+		}
+		else if ( 0==strcmp("--rasterize-burn", argv[i]) ) {
+			rasterizeParams.burns.clear();
+			// (negative numbers are accepted as values)
+			while ( ++i < argc && (argv[i][0] != '-' || isdigit(argv[i][1])) ) {
+				char* endptr;
+				double value = strtod(argv[i], &endptr);
+				if ( *endptr == 0 ) {
+					rasterizeParams.burns.push_back(RasterizeBurn(RasterizeBurn::VALUE, value));
+				}
+				else if ( 0==strcmp("fid", argv[i]) ) {
+					rasterizeParams.burns.push_back(RasterizeBurn(RasterizeBurn::FID));
+				}
+				else {
+					rasterizeParams.burns.push_back(RasterizeBurn(RasterizeBurn::FIELD, 0, argv[i]));
+				}
+			}
+			if ( rasterizeParams.burns.size() == 0 )
+				usage("--rasterize-burn: {<value> | fid | <field>} ...?");
+			if ( i < argc && argv[i][0] == '-' ) 
+				--i;
 		}
         
 		
@@ -431,6 +547,46 @@ int main(int argc, char ** argv) {
 		else if ( 0==strcmp("--report", argv[i]) ) {
 			do_report = true;
 		}
+		else if ( 0==strcmp("--compress", argv[i]) ) {
+			compress = true;
+		}
+		
+		else if ( 0==strcmp("--bininfo", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--bininfo: which binary table?");
+			bininfo_filename = argv[i];
+		}
+		
+		else if ( 0==strcmp("--bin2csv", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--bin2csv: which binary table?");
+			bin2csv_filenames[0] = argv[i];
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--bin2csv: which CSV output file?");
+			bin2csv_filenames[1] = argv[i];
+		}
+		
+		else if ( 0==strcmp("--update-csv", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--update-csv: which CSV file?");
+			update_csv_filenames[0] = argv[i];
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--update-csv: which CSV output file?");
+			update_csv_filenames[1] = argv[i];
+		}
+		
+		else if ( 0==strcmp("--calbase", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--calbase: which link field?");
+			calbase_args[0] = argv[i];
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--calbase: which speclib file?");
+			calbase_args[1] = argv[i];
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--calbase: which calbase output file?");
+			calbase_args[2] = argv[i];
+		}
+		
 		else if ( 0==strcmp("--show-fields", argv[i]) ) {
 			show_fields = true;
 		}
@@ -583,6 +739,14 @@ int main(int argc, char ** argv) {
 			globalOptions.progress = true;
 		}
 		
+		else if ( 0==strcmp("--threads", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--threads: number of threads?");
+			globalOptions.num_threads = atoi(argv[i]);
+			if ( globalOptions.num_threads < 1 )
+				usage("--threads: invalid number of threads");
+		}
+		
 		else if ( 0==strcmp("--verbose", argv[i]) ) {
 			globalOptions.verbose = true;
 			report_elapsed_time = true;
@@ -744,6 +908,39 @@ int main(int argc, char ** argv) {
         goto end;
 	}
     
+    if ( bininfo_filename ) {
+        res = starspan_bininfo(bininfo_filename);
+        goto end;
+    }
+    
+    if ( bin2csv_filenames[0] ) {
+        res = starspan_bin2csv(bin2csv_filenames[0], bin2csv_filenames[1]);
+        goto end;
+    }
+    
+    if ( update_csv_filenames[0] ) {
+        if ( raster_filenames.size() == 0 ) {
+            usage("--update-csv: Please give the rasters to extract the band values from\n");
+        }
+        res = starspan_update_csv(update_csv_filenames[0], raster_filenames, update_csv_filenames[1]);
+        goto end;
+    }
+    
+    if ( calbase_args[0] ) {
+        if ( !vect || raster_filenames.size() == 0 ) {
+            usage("--calbase: Please give the vector and rasters\n");
+        }
+        // the speclib links are resolved on the vector layer, not on an SQL result:
+        if ( globalOptions.vSelParams.sql.length() > 0 ) {
+            usage("--calbase: --sql is not supported\n");
+        }
+        if ( select_stats.size() == 0 ) {
+            select_stats.push_back(DEFAULT_STAT);
+        }
+        res = starspan_tuct_2(vect, raster_filenames, calbase_args[1], calbase_args[0], select_stats, calbase_args[2]);
+        goto end;
+    }
+    
     if ( show_fields ) {
         if ( !vect ) {
             usage("--show-fields: provide the vector datasource\n");
@@ -802,6 +999,7 @@ int main(int argc, char ** argv) {
     }
     
     if ( outtype != "table" 
+    &&   outtype != "binary" 
     &&   outtype != "mini_raster_strip" 
     &&   outtype != "mini_rasters"
     &&   outtype != "rasterization"      ) {
@@ -827,13 +1025,26 @@ int main(int argc, char ** argv) {
 			usage("--out-type table expects a vector input (use --vector)");
 		}
 
-        if ( raster_filenames.size() == 0 && globalOptions.dupPixelModes.size() == 0 ) {
+        if ( raster_filenames.size() == 0 && globalOptions.dupPixelModes.size() == 0 && !raster_field_name ) {
             usage("--out-type table expects at least a raster input (use --raster)");
         }
 
         if ( table_suffix ) {
             csv_name = string(outprefix) + table_suffix;
-            if ( globalOptions.dupPixelModes.size() > 0 ) {
+            if ( compress && !OutputFile::isCompressedName(csv_name.c_str()) ) {
+                csv_name += ".gz";
+            }
+            if ( raster_field_name ) {
+                res = starspan_csv_raster_field(
+                    vect,
+                    raster_field_name,
+                    raster_directory,
+                    select_fields,
+                    csv_name.c_str(),
+                    vector_layernum
+                );
+            }
+            else if ( globalOptions.dupPixelModes.size() > 0 ) {
                 res = starspan_csv2(
                     vect,
                     raster_filenames,
@@ -861,32 +1072,92 @@ int main(int argc, char ** argv) {
         
         if ( summary_suffix ) {
             string stats_name = string(outprefix) + summary_suffix;
+            if ( compress && !OutputFile::isCompressedName(stats_name.c_str()) ) {
+                stats_name += ".gz";
+            }
             
             if ( select_stats.size() == 0 ) {
                 select_stats.push_back(DEFAULT_STAT);
             }
             
-            res = starspan_stats(
-                vect,  
-                raster_filenames,     
-                select_stats,
-                select_fields, 
-                stats_name.c_str(),
-                vector_layernum
-            );
+            if ( group_by ) {
+                res = starspan_group_stats(
+                    vect,  
+                    raster_filenames,     
+                    select_stats,
+                    group_by, 
+                    stats_name.c_str(),
+                    vector_layernum
+                );
+            }
+            else {
+                res = starspan_stats(
+                    vect,  
+                    raster_filenames,     
+                    select_stats,
+                    select_fields, 
+                    stats_name.c_str(),
+                    vector_layernum
+                );
+            }
         }
         
         if ( class_summary_suffix ) {
             add_rasters_to_traverser(raster_filenames, traversr);
             
             string count_by_class_name = string(outprefix) + class_summary_suffix;
-            Observer* obs = starspan_getCountByClassObserver(traversr, count_by_class_name.c_str());
+            if ( compress && !OutputFile::isCompressedName(count_by_class_name.c_str()) ) {
+                count_by_class_name += ".gz";
+            }
+            Observer* obs = starspan_getCountByClassObserver(
+                traversr, count_by_class_name.c_str(), class_bands, class_crosstab
+            );
+            if ( obs ) {
+                traversr.addObserver(obs);
+            }
+        }
+        
+        if ( cov_suffix ) {
+            add_rasters_to_traverser(raster_filenames, traversr);
+            
+            string cov_name = string(outprefix) + cov_suffix;
+            if ( compress && !OutputFile::isCompressedName(cov_name.c_str()) ) {
+                cov_name += ".gz";
+            }
+            Observer* obs = starspan_getCovarianceObserver(traversr, select_fields, cov_name.c_str());
             if ( obs ) {
                 traversr.addObserver(obs);
             }
         }
     }
     
+    //
+    // Output: binary table
+    //
+    else if ( outtype == "binary" ) {
+        if ( !vect ) {
+            usage("--out-type binary expects a vector input (use --vector)");
+        }
+        if ( raster_filenames.size() == 0 ) {
+            usage("--out-type binary expects at least a raster input (use --raster)");
+        }
+        if ( globalOptions.dupPixelModes.size() > 0 ) {
+            usage("--out-type binary: --duplicate not supported");
+        }
+        if ( !table_suffix ) {
+            usage("--out-type binary expects --table-suffix");
+        }
+        string bin_name = string(outprefix) + table_suffix;
+        res = starspan_bintable(
+            vect,  
+            raster_filenames,
+            select_fields, 
+            bin_name.c_str(),
+            vector_layernum,
+            compress
+        );
+    }
+    
     else if ( outtype == "mini_raster_strip" ) {
         string mrst_img_filename = string(outprefix) + mrst_img_suffix;
         string mrst_shp_filename = string(outprefix) + mrst_shp_suffix;
@@ -949,7 +1220,10 @@ int main(int argc, char ** argv) {
     else if ( outtype == "rasterization" ) {
         add_rasters_to_traverser(raster_filenames, traversr);
         
-        rasterizeParams.outRaster_filename = (string(outprefix) + rasterize_suffix).c_str();
+        if ( !rasterize_suffix ) {
+            usage("--out-type rasterization expects --rasterize-suffix");
+        }
+        rasterizeParams.outRaster_filename = string(outprefix) + rasterize_suffix;
         rasterizeParams.fillNoData = true;
         
         GDALDataset* ds = traversr.getRaster(0)->getDataset();
@@ -991,6 +1265,7 @@ end:
 		delete vect;
 	}
 	
+	RasterPool::getPool().clear();
 	Vector::end();
 	Raster::end();
 	
@@ -998,6 +1273,7 @@ end:
 	Unload::Release();	
 	
 	if ( report_elapsed_time ) {
+		OutputFile::reportTotals(cout);
 		cout<< "Elapsed time: ";
 		// report elapsed time:
 		time_t secs = time(NULL) - time_start;
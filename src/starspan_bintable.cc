@@ -0,0 +1,341 @@
+//
+// STARSpan project
+// starspan_bintable - generate a columnar binary table from multiple rasters
+//
+
+#include "starspan.h"
+#include "traverser.h"
+#include "BinTable.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+
+/**
+  * Writes the pixel records of the features to a binary table.
+  * The schema is determined by the first raster; subsequent rasters
+  * must have the same number and types of bands.
+  */
+class BinTableObserver : public Observer {
+public:
+	GlobalInfo* global_info;
+	Vector* vect;
+	OGRLayer* poLayer;
+	vector<const char*>* select_fields;
+	const char* raster_filename;
+	string RID_value;  //  will be used only if globalOptions.RID != "none".
+	BinTableWriter& writer;
+	bool OK;
+	bool ioError;
+
+	// band types in the schema
+	vector<GDALDataType> bandTypes;
+	vector<int> bandOffsets;
+
+	// indices of the attribute fields in the layer definition
+	vector<int> fieldIndices;
+
+	// attribute values of the current feature
+	long FID;
+	vector<string> attrs;
+
+	BinTableObserver(Vector* vect, vector<const char*>* select_fields, BinTableWriter& writer, int layernum)
+	: vect(vect), select_fields(select_fields), writer(writer)
+	{
+		global_info = 0;
+		OK = ioError = false;
+		FID = -1;
+		poLayer = vect->getLayer(layernum);
+		if ( !poLayer ) {
+			fprintf(stderr, "Couldn't fetch layer %d\n", layernum);
+			exit(1);
+		}
+	}
+
+	/**
+	  * Defines the schema and writes the header if this is the first
+	  * raster; otherwise checks the bands are compatible with the schema.
+	  */
+	void init(GlobalInfo& info) {
+		global_info = &info;
+		OK = false;
+
+		const unsigned num_bands = global_info->bands.size();
+		if ( writer.getColumns().size() > 0 ) {
+			bool compatible = num_bands == bandTypes.size();
+			for ( unsigned i = 0; compatible && i < num_bands; i++ ) {
+				compatible = bandTypes[i] == global_info->bands[i]->GetRasterDataType();
+			}
+			if ( !compatible ) {
+				fprintf(stderr, "starspan_bintable: %s: bands differ from first raster; raster skipped\n", raster_filename);
+				return;
+			}
+		}
+		else {
+			// the fields are those of the layer being traversed, which
+			// under --sql is the result set and not poLayer:
+			OGRLayer* layer = global_info->layer ? global_info->layer : poLayer;
+			OGRFeatureDefn* poDefn = layer->GetLayerDefn();
+
+			// (Float64 holds any FID up to 2^53 exactly, while Int32
+			// would truncate 64-bit FIDs)
+			writer.addColumn(BinColumn("FID", GDT_Float64, 0));
+			if ( select_fields ) {
+				for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+					const int i = poDefn->GetFieldIndex(*fname);
+					if ( i < 0 ) {
+						fprintf(stderr, "\n\tField `%s' not found\n", *fname);
+						exit(1);
+					}
+					fieldIndices.push_back(i);
+					writer.addColumn(BinColumn(*fname, GDT_Unknown));
+				}
+			}
+			else {
+				for ( int i = 0; i < poDefn->GetFieldCount(); i++ ) {
+					fieldIndices.push_back(i);
+					writer.addColumn(BinColumn(poDefn->GetFieldDefn(i)->GetNameRef(), GDT_Unknown));
+				}
+			}
+			if ( globalOptions.RID != "none" ) {
+				writer.addColumn(BinColumn(RID_colName, GDT_Unknown));
+			}
+			if ( !globalOptions.noColRow ) {
+				writer.addColumn(BinColumn("col", GDT_Int32));
+				writer.addColumn(BinColumn("row", GDT_Int32));
+			}
+			if ( !globalOptions.noXY ) {
+				writer.addColumn(BinColumn("x", GDT_Float64, 3));
+				writer.addColumn(BinColumn("y", GDT_Float64, 3));
+			}
+			int offset = 0;
+			for ( unsigned i = 0; i < num_bands; i++ ) {
+				GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
+				if ( bandType == GDT_Unknown || bandType >= GDT_CInt16 ) {
+					fprintf(stderr, "starspan_bintable: unsupported band type: %s\n", GDALGetDataTypeName(bandType));
+					exit(1);
+				}
+				char name[32];
+				sprintf(name, "Band%d", i+1);
+				writer.addColumn(BinColumn(name, bandType));
+				bandTypes.push_back(bandType);
+				bandOffsets.push_back(offset);
+				offset += GDALGetDataTypeSize(bandType) >> 3;
+			}
+
+			if ( !writer.writeHeader() ) {
+				ioError = true;
+				return;
+			}
+		}
+
+		if ( globalOptions.RID != "none" ) {
+			RID_value = raster_filename;
+			if ( globalOptions.RID == "file" ) {
+				starspan_simplify_filename(RID_value);
+			}
+		}
+		OK = true;
+	}
+
+	/**
+	  * gets the attribute values of the feature.
+	  */
+	void intersectionFound(IntersectionInfo& intersInfo) {
+		if ( !OK )
+			return;
+		OGRFeature* feature = intersInfo.feature;
+		FID = feature->GetFID();
+		attrs.resize(fieldIndices.size());
+		for ( unsigned k = 0; k < fieldIndices.size(); k++ ) {
+			attrs[k] = feature->GetFieldAsString(fieldIndices[k]);
+		}
+	}
+
+	/**
+	  * Adds a record to the table.
+	  */
+	void addPixel(TraversalEvent& ev) {
+		if ( !OK )
+			return;
+
+		writer.startRow();
+		writer.addInt(FID);
+		for ( unsigned k = 0; k < attrs.size(); k++ ) {
+			writer.addString(attrs[k].c_str());
+		}
+		if ( globalOptions.RID != "none" ) {
+			writer.addString(RID_value.c_str());
+		}
+		if ( !globalOptions.noColRow ) {
+			writer.addInt(1 + ev.pixel.col).addInt(1 + ev.pixel.row);
+		}
+		if ( !globalOptions.noXY ) {
+			writer.addDouble(ev.pixel.x).addDouble(ev.pixel.y);
+		}
+		char* ptr = (char*) ev.bandValues;
+		for ( unsigned i = 0; i < bandTypes.size(); i++ ) {
+			writer.addNative(ptr + bandOffsets[i]);
+		}
+		if ( !writer.endRow() ) {
+			fprintf(stderr, "starspan_bintable: write error\n");
+			ioError = true;
+			OK = false;
+		}
+	}
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Each raster is processed independently; all records go to the same table
+//
+int starspan_bintable(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*>* select_fields,
+	const char* bin_filename,
+	int layernum,
+	bool compress
+) {
+	FILE* file = fopen(bin_filename, "wb");
+	if ( !file) {
+		fprintf(stderr, "Cannot create %s\n", bin_filename);
+		return 1;
+	}
+
+	BinTableWriter writer(file, compress);
+	BinTableObserver obs(vect, select_fields, writer, layernum);
+
+	Traverser tr;
+	tr.addObserver(&obs);
+
+	tr.setVector(vect);
+	tr.setLayerNum(layernum);
+
+	if ( globalOptions.progress ) {
+		tr.setProgress(globalOptions.progress_perc, cout);
+		cout << "Number of features: ";
+		long psize = vect->getLayer(layernum)->GetFeatureCount();
+		if ( psize >= 0 )
+			cout << psize;
+		else
+			cout << "(not known in advance)";
+		cout<< endl;
+	}
+
+	for ( unsigned i = 0; i < raster_filenames.size() && !obs.ioError; i++ ) {
+		fprintf(stdout, "starspan_bintable: %3u: Extracting from %s\n", i+1, raster_filenames[i]);
+		obs.raster_filename = raster_filenames[i];
+		tr.removeRasters();
+
+		Raster* raster = new Raster(raster_filenames[i]);
+		tr.addRaster(raster);
+
+		tr.traverse();
+
+		if ( globalOptions.report_summary ) {
+			tr.reportSummary();
+		}
+
+		tr.removeRasters();
+		delete raster;
+	}
+
+	bool ok = !obs.ioError && writer.close();
+	if ( 0 != fclose(file) ) {
+		ok = false;
+	}
+	if ( !ok ) {
+		fprintf(stderr, "Error writing %s\n", bin_filename);
+		return 1;
+	}
+	return 0;
+}
+
+
+int starspan_bin2csv(const char* bin_filename, const char* csv_filename) {
+	FILE* file = fopen(bin_filename, "rb");
+	if ( !file) {
+		fprintf(stderr, "Cannot open %s\n", bin_filename);
+		return 1;
+	}
+	BinTableReader reader(file);
+	if ( !reader.readHeader() ) {
+		fclose(file);
+		return 1;
+	}
+
+	OutputFile* csv_file = OutputFile::open(csv_filename);
+	if ( !csv_file) {
+		fprintf(stderr, "Cannot create %s\n", csv_filename);
+		fclose(file);
+		return 1;
+	}
+
+	CsvOutput csvOut;
+	csvOut.setFile(csv_file);
+	csvOut.setSeparator(globalOptions.delimiter);
+
+	const vector<BinColumn>& columns = reader.getColumns();
+	csvOut.startLine();
+	for ( unsigned i = 0; i < columns.size(); i++ ) {
+		csvOut.addString(columns[i].name);
+	}
+	csvOut.endLine();
+
+	int num_rows;
+	while ( (num_rows = reader.readChunk()) > 0 ) {
+		for ( int row = 0; row < num_rows; row++ ) {
+			csvOut.startLine();
+			for ( unsigned i = 0; i < columns.size(); i++ ) {
+				reader.addField(csvOut, i, row);
+			}
+			csvOut.endLine();
+		}
+	}
+	csvOut.flush();
+
+	fclose(file);
+	bool ok = csv_file->close();
+	delete csv_file;
+	return num_rows < 0 || !ok ? 1 : 0;
+}
+
+
+int starspan_bininfo(const char* bin_filename) {
+	FILE* file = fopen(bin_filename, "rb");
+	if ( !file) {
+		fprintf(stderr, "Cannot open %s\n", bin_filename);
+		return 1;
+	}
+	BinTableReader reader(file);
+	if ( !reader.readHeader() ) {
+		fclose(file);
+		return 1;
+	}
+
+	const vector<BinColumn>& columns = reader.getColumns();
+	fprintf(stdout, "%s: %u columns%s\n", bin_filename, (unsigned) columns.size(),
+		reader.isCompressed() ? " (compressed)" : "");
+	for ( unsigned i = 0; i < columns.size(); i++ ) {
+		fprintf(stdout, "  %3u: %-20s %s\n", i+1, columns[i].name.c_str(),
+			columns[i].type == GDT_Unknown ? "String" : GDALGetDataTypeName(columns[i].type));
+	}
+
+	long total_rows = 0;
+	int num_chunks = 0;
+	int num_rows;
+	while ( (num_rows = reader.readChunk()) > 0 ) {
+		total_rows += num_rows;
+		num_chunks++;
+	}
+	fprintf(stdout, "  rows: %ld in %d chunks\n", total_rows, num_chunks);
+	fprintf(stdout, "  column data: %.0f bytes stored, %.0f bytes raw\n",
+		reader.getStoredBytes(), reader.getRawBytes());
+
+	fclose(file);
+	return num_rows < 0 ? 1 : 0;
+}
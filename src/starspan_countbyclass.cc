@@ -7,19 +7,86 @@
 
 #include "starspan.h"           
 #include "traverser.h"       
-#include "Stats.h"       
 #include "Csv.h"       
 
 #include <iostream>
 #include <cstdlib>
 #include <math.h>
 #include <cassert>
+#include <algorithm>
 
 using namespace std;
 
 // my prefix for verbose output:
 static const char* vprefix = "  [count-by-class]";
 
+
+/**
+  * Counts for one band, or for a pair of bands in the case of a
+  * cross-tabulation.
+  * A dense array indexed by class value is used when the value range of
+  * the band data type(s) is small enough (8- and 16-bit bands, or a pair
+  * of 8-bit bands); otherwise a map is used. The dense array and the list
+  * of touched entries are allocated once and reused for every feature.
+  */
+struct ClassTally {
+	unsigned band_a, band_b;   // 0-based band indices
+	bool is_pair;
+	
+	bool dense;
+	int min_a, size_a;
+	int min_b, size_b;
+	vector<int> counts;
+	vector<unsigned> touched;
+	
+	map<pair<int,int>, int> sparse;
+	
+	ClassTally(unsigned band_a, GDALDataType type_a) 
+	: band_a(band_a), band_b(0), is_pair(false) {
+		min_b = 0;
+		size_b = 1;
+		dense = getRange(type_a, &min_a, &size_a);
+		if ( dense ) {
+			counts.resize(size_a, 0);
+			touched.reserve(size_a);
+		}
+	}
+	
+	ClassTally(unsigned band_a, GDALDataType type_a, unsigned band_b, GDALDataType type_b) 
+	: band_a(band_a), band_b(band_b), is_pair(true) {
+		dense = getRange(type_a, &min_a, &size_a) 
+		     && getRange(type_b, &min_b, &size_b)
+		     && (long) size_a * size_b <= 65536;
+		if ( dense ) {
+			counts.resize(size_a * size_b, 0);
+			touched.reserve(size_a * size_b);
+		}
+	}
+	
+	/** gets the value range of a type if suitable for a dense array */
+	static bool getRange(GDALDataType type, int* min, int* size) {
+		switch ( type ) {
+			case GDT_Byte:   *min = 0;      *size = 256;   return true;
+			case GDT_UInt16: *min = 0;      *size = 65536; return true;
+			case GDT_Int16:  *min = -32768; *size = 65536; return true;
+			default:         return false;
+		}
+	}
+	
+	void add(int a, int b) {
+		if ( dense ) {
+			unsigned idx = (a - min_a) * size_b + (b - min_b);
+			if ( counts[idx]++ == 0 ) {
+				touched.push_back(idx);
+			}
+		}
+		else {
+			sparse[make_pair(a, b)]++;
+		}
+	}
+};
+
+
 /**
   * Creates fields and populates the table.
   */
@@ -28,15 +95,24 @@ public:
 	Traverser& tr;
 	GlobalInfo* global_info;
 	Vector* vect;
-	FILE* outfile;
+	OutputFile* outfile;
+	vector<unsigned> bands;
+	bool crosstab;
 	bool OK;
+	
+	vector<ClassTally*> tallies;
+	
+	// data type and byte offset of each band in TraversalEvent.bandValues
+	vector<GDALDataType> bandTypes;
+	vector<int> bandOffsets;
 		
 	CsvOutput csvOut;
 
 	/**
 	  * Creates a counter by class.
 	  */
-	CountByClassObserver(Traverser& tr, FILE* f) : tr(tr), outfile(f) {
+	CountByClassObserver(Traverser& tr, OutputFile* f, vector<unsigned>& bands, bool crosstab) 
+	: tr(tr), outfile(f), bands(bands), crosstab(crosstab) {
 		vect = tr.getVector();
 		global_info = 0;
 		OK = false;
@@ -55,24 +131,35 @@ public:
 	  */
 	void end() {
 		if ( outfile ) {
-			fclose(outfile);
+			csvOut.flush();
+			outfile->close();
+			delete outfile;
 			cout<< "CountByClass: finished" << endl;
 			outfile = 0;
 		}
+		for ( unsigned i = 0; i < tallies.size(); i++ ) {
+			delete tallies[i];
+		}
+		tallies.clear();
 	}
 
 
 	/**
-	  * returns true. We ask traverser to get values for
-	  * visited pixels in each feature.
+	  * returns false. We get the band values as the pixels are visited.
 	  */
 	bool isSimple() { 
-		return true; 
+		return false; 
+	}
+	
+	static bool isIntegral(GDALDataType bandType) {
+		return bandType != GDT_Float64 && bandType != GDT_Float32;
 	}
 
 	/**
 	  * Creates first line with column headers:
-	  *    FID, class, count
+	  *    FID, class, count                       (a single band)
+	  *    FID, band, class, count                 (several bands)
+	  *    FID, class_Band<i>, class_Band<j>, count  (cross-tabulation)
 	  */
 	void init(GlobalInfo& info) {
 		global_info = &info;
@@ -92,20 +179,60 @@ public:
 		
 		const unsigned num_bands = global_info->bands.size();
 		
-		if ( num_bands > 1 ) {
-			cerr<< "CountByClass: warning: multiband raster data;" <<endl;
-			cerr<< "              Only the first band will be processed." <<endl;
-		}
-		else if ( num_bands == 0 ) {
+		if ( num_bands == 0 ) {
 			cerr<< "CountByClass: warning: no bands in raster data;" <<endl;
 			return;
 		}
 
-		// check first band is of integral type:
-		GDALDataType bandType = global_info->bands[0]->GetRasterDataType();
-		if ( bandType == GDT_Float64 || bandType == GDT_Float32 ) {
-			cerr<< "CountByClass: warning: first band in raster data is not of integral type" <<endl;
-			return;
+		int offset = 0;
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
+			bandTypes.push_back(bandType);
+			bandOffsets.push_back(offset);
+			offset += GDALGetDataTypeSize(bandType) >> 3;
+		}
+		
+		if ( bands.size() == 0 ) {
+			// all bands of integral type:
+			for ( unsigned i = 0; i < num_bands; i++ ) {
+				if ( isIntegral(bandTypes[i]) ) {
+					bands.push_back(i + 1);
+				}
+				else {
+					cerr<< "CountByClass: warning: band " <<(i+1)<< " is not of integral type; skipped" <<endl;
+				}
+			}
+			if ( bands.size() == 0 ) {
+				cerr<< "CountByClass: warning: no band of integral type in raster data" <<endl;
+				return;
+			}
+		}
+		
+		// check requested bands:
+		for ( unsigned i = 0; i < bands.size(); i++ ) {
+			if ( bands[i] < 1 || bands[i] > num_bands ) {
+				cerr<< "CountByClass: warning: band " <<bands[i]<< " out of range" <<endl;
+				return;
+			}
+			if ( !isIntegral(bandTypes[bands[i] - 1]) ) {
+				cerr<< "CountByClass: warning: band " <<bands[i]<< " in raster data is not of integral type" <<endl;
+				return;
+			}
+		}
+		
+		if ( crosstab ) {
+			if ( bands.size() != 2 ) {
+				cerr<< "CountByClass: warning: cross-tabulation requires two bands" <<endl;
+				return;
+			}
+			unsigned a = bands[0] - 1, b = bands[1] - 1;
+			tallies.push_back(new ClassTally(a, bandTypes[a], b, bandTypes[b]));
+		}
+		else {
+			for ( unsigned i = 0; i < bands.size(); i++ ) {
+				unsigned a = bands[i] - 1;
+				tallies.push_back(new ClassTally(a, bandTypes[a]));
+			}
 		}
 
 		csvOut.setFile(outfile);
@@ -115,16 +242,74 @@ public:
 		//		
 		// write column headers:
 		//
-		csvOut.addString("FID").addString("class").addString("count");
+		csvOut.addString("FID");
+		if ( crosstab ) {
+			csvOut.addField("class_Band%u", bands[0]).addField("class_Band%u", bands[1]);
+		}
+		else {
+			if ( bands.size() > 1 ) {
+				csvOut.addString("band");
+			}
+			csvOut.addString("class");
+		}
+		csvOut.addString("count");
 		csvOut.endLine();
-		//fprintf(outfile, "FID,class,count\n");
 		
 		// now, all seems OK to continue processing		
 		OK = true;
 	}
 	
 	/**
-	  * gets the counts and writes news records accordingly.
+	  * updates the counts with the pixel's values.
+	  */
+	void addPixel(TraversalEvent& ev) {
+		if ( !OK )
+			return;
+		
+		char* ptr = (char*) ev.bandValues;
+		for ( unsigned t = 0; t < tallies.size(); t++ ) {
+			ClassTally* tally = tallies[t];
+			int a = starspan_extract_int_value(bandTypes[tally->band_a], ptr + bandOffsets[tally->band_a]);
+			int b = 0;
+			if ( tally->is_pair ) {
+				b = starspan_extract_int_value(bandTypes[tally->band_b], ptr + bandOffsets[tally->band_b]);
+			}
+			tally->add(a, b);
+		}
+	}
+	
+	/**
+	  * adds a record to outfile.
+	  */
+	void writeRecord(long FID, ClassTally* tally, int a, int b, int count) {
+		csvOut.startLine();
+		csvOut.addInt(FID);
+		if ( tally->is_pair ) {
+			csvOut.addInt(a).addInt(b);
+		}
+		else {
+			if ( tallies.size() > 1 ) {
+				csvOut.addUInt(tally->band_a + 1);
+			}
+			csvOut.addInt(a);
+		}
+		csvOut.addInt(count);
+		csvOut.endLine();
+
+		if ( globalOptions.verbose ) {
+			cout<< vprefix<< "   band=" <<(tally->band_a + 1);
+			if ( tally->is_pair ) {
+				cout<< "," <<(tally->band_b + 1)<< " class=" <<a<< "," <<b;
+			}
+			else {
+				cout<< " class=" <<a;
+			}
+			cout<< " count=" <<count<< endl;
+		}
+	}
+	
+	/**
+	  * writes the counts and resets them for the next feature.
 	  */
 	void intersectionEnd(IntersectionInfo& intersInfo) {
 		if ( !OK )
@@ -132,33 +317,31 @@ public:
 
 		const long FID = intersInfo.feature->GetFID();
 		
-		// get values of pixels corresponding to first band:		
-		vector<int> values;
-		tr.getPixelIntegerValuesInBand(1, values);
-		
-		// get the counts:
-		map<int,int> counters;
-		Stats::computeCounts(values, counters);
-
 		// report the counts:
 		if ( globalOptions.verbose ) {
 			cout<< vprefix<< " FID=" <<FID<< " pixels=" <<tr.getPixelSetSize()<< ":\n";
 		}
-		for ( map<int, int>::iterator it = counters.begin(); it != counters.end(); it++ ) {
-			const int class_ = it->first;
-			const int count = it->second;
-			
-			// add record to outfile:
-			csvOut.startLine();
-			csvOut.addField("%ld", FID).addField("%d", class_).addField("%d", count);
-			csvOut.endLine();
-			//fprintf(outfile, "%ld,%d,%d\n", FID, class_, count);
-
-			if ( globalOptions.verbose ) {
-				cout<< vprefix<< "   class=" <<class_<< " count=" <<count<< endl;
+		for ( unsigned t = 0; t < tallies.size(); t++ ) {
+			ClassTally* tally = tallies[t];
+			if ( tally->dense ) {
+				// sorted indices give ascending class order:
+				sort(tally->touched.begin(), tally->touched.end());
+				for ( unsigned k = 0; k < tally->touched.size(); k++ ) {
+					const unsigned idx = tally->touched[k];
+					const int a = idx / tally->size_b + tally->min_a;
+					const int b = idx % tally->size_b + tally->min_b;
+					writeRecord(FID, tally, a, b, tally->counts[idx]);
+					tally->counts[idx] = 0;
+				}
+				tally->touched.clear();
+			}
+			else {
+				for ( map<pair<int,int>, int>::iterator it = tally->sparse.begin(); it != tally->sparse.end(); it++ ) {
+					writeRecord(FID, tally, it->first.first, it->first.second, it->second);
+				}
+				tally->sparse.clear();
 			}
 		}
-		fflush(outfile);
 	}
 };
 
@@ -169,17 +352,18 @@ public:
   */
 Observer* starspan_getCountByClassObserver(
 	Traverser& tr,
-	const char* filename
+	const char* filename,
+	vector<unsigned>& bands,
+	bool crosstab
 ) {
 	// create output file
-	FILE* outfile = fopen(filename, "w");
+	OutputFile* outfile = OutputFile::open(filename);
 	if ( !outfile ) {
 		cerr<< "Couldn't create "<< filename << endl;
 		return 0;
 	}
 
-	return new CountByClassObserver(tr, outfile);	
+	return new CountByClassObserver(tr, outfile, bands, crosstab);	
 }
 		
 
-
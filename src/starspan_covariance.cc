@@ -0,0 +1,318 @@
+//
+// STARSpan project
+// starspan_covariance - per-feature band covariance matrix
+//
+
+#include "starspan.h"
+#include "traverser.h"
+#include "Covariance.h"
+#include "NoData.h"
+#include "Csv.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cassert>
+
+using namespace std;
+
+// my prefix for verbose output:
+static const char* vprefix = "  [covariance]";
+
+/**
+  * Computes the mean vector and the band covariance matrix of the
+  * pixels intersecting each feature.
+  * Pixel values are accumulated as they are visited (see addPixel), so
+  * no second pass over the raster data is required.
+  */
+class CovarianceObserver : public Observer {
+public:
+	Traverser& tr;
+	GlobalInfo* global_info;
+	Vector* vect;
+	OutputFile* outfile;
+	vector<const char*>* select_fields;
+	bool OK;
+
+	// accumulator for current feature
+	Covariance* cov;
+
+	// values of current pixel converted to double
+	double* values;
+
+	// data type, byte offset in TraversalEvent.bandValues and nodata
+	// value for each band
+	vector<GDALDataType> bandTypes;
+	vector<int> bandOffsets;
+	vector<BandNoData> nodata;
+
+	// If some band has a mask or alpha band, the locations and values of
+	// the pixels of the current feature are kept until intersectionEnd,
+	// where the masks are read for all of them at once.
+	bool masked;
+	vector<EPixel> locs;
+	vector<double> pixelValues;
+	vector<unsigned char> mask, valid;
+
+	CsvOutput csvOut;
+
+	/**
+	  * Creates a covariance calculator
+	  */
+	CovarianceObserver(Traverser& tr, vector<const char*>* select_fields, OutputFile* f)
+	: tr(tr), outfile(f), select_fields(select_fields) {
+		vect = tr.getVector();
+		global_info = 0;
+		OK = false;
+		masked = false;
+		cov = 0;
+		values = 0;
+		assert(outfile);
+	}
+
+	/**
+	  * simply calls end()
+	  */
+	~CovarianceObserver() {
+		end();
+	}
+
+	/**
+	  * closes the file and releases the accumulator
+	  */
+	void end() {
+		if ( outfile ) {
+			csvOut.flush();
+			outfile->close();
+			delete outfile;
+			cout<< "Covariance: finished" << endl;
+			outfile = 0;
+		}
+		if ( cov ) {
+			delete cov;
+			cov = 0;
+		}
+		if ( values ) {
+			delete[] values;
+			values = 0;
+		}
+	}
+
+
+	/**
+	  * returns false. We need the band values of each visited pixel.
+	  */
+	bool isSimple() {
+		return false;
+	}
+
+	/**
+	  * Creates first line with column headers:
+	  *    FID, {vect-attrs}, numPixels, avg_Band1 ... avg_BandB, cov_Band1_Band1, cov_Band1_Band2 ... cov_BandB_BandB
+	  * Only the upper triangle of the covariance matrix is written.
+	  */
+	void init(GlobalInfo& info) {
+		global_info = &info;
+
+		if ( globalOptions.verbose ) {
+			cout<< vprefix<< " init\n";
+		}
+
+		OK = false;   // but let's see ...
+
+		int layernum = tr.getLayerNum();
+		OGRLayer* poLayer = vect->getLayer(layernum);
+		if ( !poLayer ) {
+			cerr<< "Couldn't fetch layer" << endl;
+			return;
+		}
+
+		const unsigned num_bands = global_info->bands.size();
+		if ( num_bands == 0 ) {
+			cerr<< "Covariance: warning: no bands in raster data;" <<endl;
+			return;
+		}
+
+		int offset = 0;
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
+			bandTypes.push_back(bandType);
+			bandOffsets.push_back(offset);
+			offset += GDALGetDataTypeSize(bandType) >> 3;
+			nodata.push_back(BandNoData(global_info->bands[i], globalOptions.nodata));
+			if ( nodata[i].getMaskBand() ) {
+				masked = true;
+			}
+		}
+
+		cov = new Covariance(num_bands);
+		values = new double[num_bands];
+
+		csvOut.setFile(outfile);
+		csvOut.setSeparator(globalOptions.delimiter);
+		csvOut.startLine();
+
+		//
+		// write column headers:
+		//
+		csvOut.addString("FID");
+		if ( select_fields ) {
+			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+				csvOut.addString(*fname);
+			}
+		}
+		else {
+			// all fields from layer definition
+			OGRFeatureDefn* poDefn = poLayer->GetLayerDefn();
+			int feature_field_count = poDefn->GetFieldCount();
+			for ( int i = 0; i < feature_field_count; i++ ) {
+				csvOut.addString(poDefn->GetFieldDefn(i)->GetNameRef());
+			}
+		}
+		csvOut.addString("numPixels");
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			csvOut.addField("avg_Band%d", i+1);
+		}
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			for ( unsigned j = i; j < num_bands; j++ ) {
+				csvOut.addField("cov_Band%d_Band%d", i+1, j+1);
+			}
+		}
+		csvOut.endLine();
+
+		// now, all seems OK to continue processing
+		OK = true;
+	}
+
+	/**
+	  * starts a new accumulation
+	  */
+	void intersectionFound(IntersectionInfo& intersInfo) {
+		if ( OK ) {
+			cov->reset();
+			locs.clear();
+			pixelValues.clear();
+		}
+	}
+
+	/**
+	  * adds the pixel to the accumulation unless some band has the
+	  * nodata value. If there are masks, the pixel is kept for
+	  * addMaskedPixels.
+	  */
+	void addPixel(TraversalEvent& ev) {
+		if ( !OK )
+			return;
+
+		char* ptr = (char*) ev.bandValues;
+		const unsigned num_bands = bandTypes.size();
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			values[i] = starspan_extract_double_value(bandTypes[i], ptr + bandOffsets[i]);
+			if ( !nodata[i].isValid(values[i]) ) {
+				return;
+			}
+		}
+		if ( masked ) {
+			locs.push_back(EPixel(ev.pixel.col, ev.pixel.row));
+			pixelValues.insert(pixelValues.end(), values, values + num_bands);
+		}
+		else {
+			cov->add(values);
+		}
+	}
+
+	/**
+	  * adds the kept pixels that are not masked out in any band.
+	  */
+	void addMaskedPixels() {
+		const unsigned num_bands = bandTypes.size();
+		valid.assign(locs.size(), 1);
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			if ( nodata[i].getMaskBand() ) {
+				mask.clear();
+				tr.getPixelMaskValuesInBand(i+1, locs, mask);
+				BandNoData::applyMask(mask, valid);
+			}
+		}
+		for ( unsigned k = 0; k < locs.size(); k++ ) {
+			if ( valid[k] ) {
+				cov->add(&pixelValues[k * num_bands]);
+			}
+		}
+	}
+
+	/**
+	  * writes the record for the feature
+	  */
+	void intersectionEnd(IntersectionInfo& intersInfo) {
+		if ( !OK )
+			return;
+
+		OGRFeature* feature = intersInfo.feature;
+		const long FID = feature->GetFID();
+
+		if ( masked ) {
+			addMaskedPixels();
+		}
+		if ( cov->getCount() == 0 ) {
+			if ( globalOptions.verbose ) {
+				cout<< vprefix<< " FID=" <<FID<< ": no valid pixels\n";
+			}
+			return;
+		}
+
+		csvOut.startLine();
+		csvOut.addInt(FID);
+		if ( select_fields ) {
+			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+				const int i = feature->GetFieldIndex(*fname);
+				if ( i < 0 ) {
+					cerr<< endl << "\tField `" <<*fname<< "' not found" << endl;
+					exit(1);
+				}
+				csvOut.addString(feature->GetFieldAsString(i));
+			}
+		}
+		else {
+			int feature_field_count = feature->GetFieldCount();
+			for ( int i = 0; i < feature_field_count; i++ ) {
+				csvOut.addString(feature->GetFieldAsString(i));
+			}
+		}
+		csvOut.addInt(cov->getCount());
+
+		const unsigned num_bands = cov->getNumBands();
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			csvOut.addDouble(cov->getMean(i));
+		}
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			for ( unsigned j = i; j < num_bands; j++ ) {
+				csvOut.addDouble(cov->getCovariance(i, j));
+			}
+		}
+		csvOut.endLine();
+
+		if ( globalOptions.verbose ) {
+			cout<< vprefix<< " FID=" <<FID<< " pixels=" <<cov->getCount()<< endl;
+		}
+	}
+};
+
+
+
+/**
+  * starspan_getCovarianceObserver: implementation
+  */
+Observer* starspan_getCovarianceObserver(
+	Traverser& tr,
+	vector<const char*>* select_fields,
+	const char* filename
+) {
+	// create output file
+	OutputFile* outfile = OutputFile::open(filename);
+	if ( !outfile ) {
+		cerr<< "Couldn't create "<< filename << endl;
+		return 0;
+	}
+
+	return new CovarianceObserver(tr, select_fields, outfile);
+}
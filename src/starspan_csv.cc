@@ -8,6 +8,7 @@
 #include "starspan.h"
 #include "traverser.h"
 #include "Csv.h"
+#include "RasterPool.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -19,24 +20,47 @@
 class CSVObserver : public Observer {
 public:
 	GlobalInfo* global_info;
+	GlobalOptions* options;   // of the traversal; set in init()
 	Vector* vect;
 	OGRLayer* poLayer;
 	OGRFeature* currentFeature;
 	vector<const char*>* select_fields;
 	const char* raster_filename;
-	string RID_value;  //  will be used only if globalOptions.RID != "none".
+	string RID_value;  //  will be used only if options->RID != "none".
 	bool write_header;
-	FILE* file;
+	OutputFile* file;
 	int layernum;
 	CsvOutput csvOut;
 	
+	// if true, the output is kept across traversals and only flushed
+	// when the buffer is full or by an explicit csvOut.flush()
+	bool keepOutput;
+	
+	// data type and byte offset in TraversalEvent.bandValues for each band;
+	// determined once per raster in init()
+	vector<GDALDataType> bandTypes;
+	vector<int> bandOffsets;
+	
+	// indices of the selected fields in the layer definition
+	vector<int> fieldIndices;
+	
+	// FID, attribute and RID values of the current feature, rendered once
+	// in intersectionFound() and copied to each pixel record
+	CsvOutput prefixOut;
+	string prefix;
+	int prefixFields;
+	
 	/**
 	  * Creates a csv creator
 	  */
-	CSVObserver(Vector* vect, vector<const char*>* select_fields, FILE* f, int layernum)
+	CSVObserver(Vector* vect, vector<const char*>* select_fields, OutputFile* f, int layernum)
 	: vect(vect), select_fields(select_fields), file(f), layernum(layernum)
 	{
 		global_info = 0;
+		options = &globalOptions;
+		keepOutput = false;
+		prefixOut.setFile((FILE*) 0);
+		prefixFields = 0;
 		poLayer = vect->getLayer(layernum);
 		if ( !poLayer ) {
 			fprintf(stderr, "Couldn't fetch layer %d\n", layernum);
@@ -51,9 +75,16 @@ public:
 	  */
 	void init(GlobalInfo& info) {
 		global_info = &info;
+		options = global_info->options;
 		
-		csvOut.setFile(file);
-		csvOut.setSeparator(globalOptions.delimiter);
+		// the fields are those of the layer being traversed, which under
+		// --sql is the result set and not poLayer:
+		OGRLayer* layer = global_info->layer ? global_info->layer : poLayer;
+		
+		if ( !keepOutput ) {
+			csvOut.setFile(file);
+		}
+		csvOut.setSeparator(options->delimiter);
 		csvOut.startLine();
 
 		if ( write_header ) {
@@ -72,7 +103,7 @@ public:
 			}
 			else {
 				// all fields from layer definition
-				OGRFeatureDefn* poDefn = poLayer->GetLayerDefn();
+				OGRFeatureDefn* poDefn = layer->GetLayerDefn();
 				int feature_field_count = poDefn->GetFieldCount();
 				
 				for ( int i = 0; i < feature_field_count; i++ ) {
@@ -83,17 +114,17 @@ public:
 			}
 			
 			// RID column, if to be included
-			if ( globalOptions.RID != "none" ) {
+			if ( options->RID != "none" ) {
 				csvOut.addString(RID_colName);
 			}
 			
 			// Create (col,row) fields, if so indicated
-			if ( !globalOptions.noColRow ) {
+			if ( !options->noColRow ) {
 				csvOut.addString("col").addString("row");
 			}
 			
 			// Create (x,y) fields, if so indicated
-			if ( !globalOptions.noXY ) {
+			if ( !options->noXY ) {
 				csvOut.addString("x").addString("y");
 			}
 			
@@ -105,10 +136,29 @@ public:
 			csvOut.endLine();
 		}
 		
+		bandTypes.clear();
+		bandOffsets.clear();
+		int offset = 0;
+		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
+			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
+			bandTypes.push_back(bandType);
+			bandOffsets.push_back(offset);
+			offset += GDALGetDataTypeSize(bandType) >> 3;
+		}
+		
+		fieldIndices.clear();
+		if ( select_fields ) {
+			OGRFeatureDefn* poDefn = layer->GetLayerDefn();
+			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+				fieldIndices.push_back(poDefn->GetFieldIndex(*fname));
+			}
+		}
+		prefixOut.setSeparator(options->delimiter);
+		
 		currentFeature = NULL;
-		if ( globalOptions.RID != "none" ) {
+		if ( options->RID != "none" ) {
 			RID_value = raster_filename;
-			if ( globalOptions.RID == "file" ) {
+			if ( options->RID == "file" ) {
 				starspan_simplify_filename(RID_value);
 			}
 		}
@@ -116,40 +166,27 @@ public:
 	
 
 	/**
-	  * Used here to update currentFeature
+	  * Updates currentFeature and renders the fields that are common
+	  * to all its pixel records: FID, attributes, and RID.
 	  */
 	void intersectionFound(IntersectionInfo& intersInfo) {
 		currentFeature = intersInfo.feature;
-	}
-	
-	
-	/**
-	  * Adds a record to the output file.
-	  */
-	void addPixel(TraversalEvent& ev) { 
-		int col = 1 + ev.pixel.col;
-		int row = 1 + ev.pixel.row;
-		void* band_values = ev.bandValues;
 		
-		//
-		// Add field values to new record:
-		//
+		prefixOut.startLine();
 		
-		csvOut.startLine();
-
-		// Add FID value:
-		csvOut.addField("%ld", currentFeature->GetFID());
+		// FID value:
+		prefixOut.addInt(currentFeature->GetFID());
 		
-		// add attribute fields from source currentFeature to record:
+		// attribute fields from source currentFeature:
 		if ( select_fields ) {
-			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
-				const int i = currentFeature->GetFieldIndex(*fname);
+			for ( unsigned k = 0; k < fieldIndices.size(); k++ ) {
+				const int i = fieldIndices[k];
 				if ( i < 0 ) {
-					fprintf(stderr, "\n\tField `%s' not found\n", *fname);
+					fprintf(stderr, "\n\tField `%s' not found\n", (*select_fields)[k]);
 					exit(1);
 				}
 				const char* str = currentFeature->GetFieldAsString(i);
-				csvOut.addString(str);
+				prefixOut.addString(str);
 			}
 		}
 		else {
@@ -157,50 +194,186 @@ public:
 			int feature_field_count = currentFeature->GetFieldCount();
 			for ( int i = 0; i < feature_field_count; i++ ) {
 				const char* str = currentFeature->GetFieldAsString(i);
-				csvOut.addString(str);
+				prefixOut.addString(str);
 			}
 		}
 
-		// add RID field
-		if ( globalOptions.RID != "none" ) {
-			csvOut.addString(RID_value);
+		// RID field
+		if ( options->RID != "none" ) {
+			prefixOut.addString(RID_value);
 		}
 		
+		prefixFields = prefixOut.takeLine(prefix);
+	}
+	
+	
+	/**
+	  * Adds a record to the output file.
+	  */
+	void addPixel(TraversalEvent& ev) { 
+		int col = 1 + ev.pixel.col;
+		int row = 1 + ev.pixel.row;
+		void* band_values = ev.bandValues;
+		
+		//
+		// Add field values to new record:
+		//
+		
+		csvOut.startLine();
+
+		// FID, attribute fields, and RID:
+		csvOut.addRendered(prefix, prefixFields);
 		
 		// add (col,row) fields
-		if ( !globalOptions.noColRow ) {
-			csvOut.addField("%d", col).addField("%d", row);
+		if ( !options->noColRow ) {
+			csvOut.addInt(col).addInt(row);
 		}
 		
 		// add (x,y) fields
-		if ( !globalOptions.noXY ) {
-			csvOut.addField("%.3f", ev.pixel.x).addField("%.3f", ev.pixel.y);
+		if ( !options->noXY ) {
+			csvOut.addDouble(ev.pixel.x, 3).addDouble(ev.pixel.y, 3);
 		}
 		
-		// add band values to record:
+		// add band values to record (same formats as starspan_extract_string_value):
 		char* ptr = (char*) band_values;
-		char value[1024];
-		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
-			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
-			int typeSize = GDALGetDataTypeSize(bandType) >> 3;
-			
-			starspan_extract_string_value(bandType, ptr, value);
-			csvOut.addString(value);
-			
-			// move to next piece of data in buffer:
-			ptr += typeSize;
+		for ( unsigned i = 0; i < bandTypes.size(); i++ ) {
+			char* p = ptr + bandOffsets[i];
+			switch ( bandTypes[i] ) {
+				case GDT_Byte:
+					csvOut.addUInt(*( (unsigned char*) p ));
+					break;
+				case GDT_UInt16:
+					csvOut.addUInt(*( (unsigned short*) p ));
+					break;
+				case GDT_Int16:
+					csvOut.addInt(*( (short*) p ));
+					break;
+				case GDT_UInt32:
+					csvOut.addUInt(*( (unsigned int*) p ));
+					break;
+				case GDT_Int32:
+					csvOut.addInt(*( (int*) p ));
+					break;
+				case GDT_Float32:
+					csvOut.addDouble(*( (float*) p ));
+					break;
+				case GDT_Float64:
+					csvOut.addDouble(*( (double*) p ));
+					break;
+				default: {
+					char value[1024];
+					starspan_extract_string_value(bandTypes[i], p, value);
+					csvOut.addString(value);
+				}
+			}
 		}
 		csvOut.endLine();
 	}
 
 	/**
-	  * does nothing
+	  * writes any pending output unless keepOutput is true
 	  */
-	void end() {}
+	void end() {
+		if ( !keepOutput ) {
+			csvOut.flush();
+		}
+	}
 };
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+  * State kept across the extractions of a session.
+  */
+struct CSVSession {
+	OutputFile* file;
+	CSVObserver* obs;
+	Traverser tr;
+	ExtractionContext context;
+	bool new_file;
+	long num_extractions;
+};
+
+
+CSVSession* starspan_csv_open_session(
+	Vector* vect,
+	vector<const char*>* select_fields,
+	const char* csv_filename,
+	int layernum,
+	const ExtractionContext* context
+) {
+	// if file exists, append new rows. Otherwise create file.
+	OutputFile* file = OutputFile::open(csv_filename, true);
+	if ( !file) {
+		fprintf(stderr, "Cannot create %s\n", csv_filename);
+		return 0;
+	}
+	
+	CSVSession* session = new CSVSession();
+	session->file = file;
+	session->new_file = file->isNew();
+	session->num_extractions = 0;
+	if ( context ) {
+		session->context = *context;
+	}
+	// the layer is being read by the caller:
+	session->context.resetReading = false;
+	if ( !session->new_file && session->context.options.verbose ) {
+		fprintf(stdout, "starspan_csv: Appending to existing file %s\n", csv_filename);
+	}
+	
+	session->obs = new CSVObserver(vect, select_fields, file, layernum);
+	session->obs->keepOutput = true;
+	session->obs->csvOut.setFile(file);
+	
+	session->tr.setContext(&session->context);
+	session->tr.addObserver(session->obs);
+	session->tr.setVector(vect);
+	session->tr.setLayerNum(layernum);
+	return session;
+}
+
+
+int starspan_csv_session_extract(
+	CSVSession* session,
+	long FID,
+	const char* raster_filename
+) {
+	Raster* raster = RasterPool::getPool().get(raster_filename);
+	if ( !raster ) {
+		return 1;
+	}
+	
+	CSVObserver* obs = session->obs;
+	obs->raster_filename = raster_filename;
+	obs->write_header = session->new_file && session->num_extractions == 0;
+	session->num_extractions++;
+	
+	Traverser& tr = session->tr;
+	tr.removeRasters();
+	tr.addRaster(raster);
+	tr.setDesiredFID(FID);
+	tr.traverse();
+	
+	tr.removeRasters();
+	RasterPool::getPool().release(raster);
+	return 0;
+}
+
+
+int starspan_csv_close_session(CSVSession* session) {
+	session->obs->csvOut.flush();
+	bool ok = session->file->close();
+	delete session->obs;
+	delete session->file;
+	delete session;
+	return ok ? 0 : 1;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 
 //
@@ -213,41 +386,15 @@ int starspan_csv(
 	const char* csv_filename,
 	int layernum
 ) {
-	FILE* file;
-	bool new_file = false;
-	
 	// if file exists, append new rows. Otherwise create file.
-	file = fopen(csv_filename, "r+");
-	if ( file ) {
-		if ( globalOptions.verbose ) {
-			fprintf(stdout, "starspan_csv: Appending to existing file %s\n", csv_filename);
-        }
-
-		fseek(file, 0, SEEK_END);
-
-		// check that new data will start in a new line:
-		// if last character is not '\n', then write a '\n':
-		// (This check will make the output more robust in case
-		// the previous information is not properly aligned, eg.
-		// when the previous generation was killed for some reason.)
-		long endpos = ftell(file);
-		if ( endpos > 0 ) {
-			fseek(file, endpos -1, SEEK_SET);
-			char c;
-			if ( 1 == fread(&c, sizeof(c), 1, file) ) {
-				if ( c != '\n' )
-					fputc('\n', file);    // add a new line
-			}
-		}
+	OutputFile* file = OutputFile::open(csv_filename, true);
+	if ( !file) {
+		fprintf(stderr, "Cannot create %s\n", csv_filename);
+		return 1;
 	}
-	else {
-		// create output file
-		file = fopen(csv_filename, "w");
-		if ( !file) {
-			fprintf(stderr, "Cannot create %s\n", csv_filename);
-			return 1;
-		}
-		new_file = true;
+	bool new_file = file->isNew();
+	if ( !new_file && globalOptions.verbose ) {
+		fprintf(stdout, "starspan_csv: Appending to existing file %s\n", csv_filename);
 	}
 
 	CSVObserver obs(vect, select_fields, file, layernum);
@@ -287,8 +434,9 @@ int starspan_csv(
 		delete raster;
 	}
 	
-	fclose(file);
+	bool ok = file->close();
+	delete file;
 	
-	return 0;
+	return ok ? 0 : 1;
 }
 
@@ -13,71 +13,55 @@
 #include <assert.h>
 
 
-static Vector* vect;
-static vector<const char*>* select_fields;
-static int layernum;
-
-static const char* csv_filename;
-
-
-
+//
+// item->data is the session
+//
 static void extractFunction(ExtractionItem* item) {
-    
-	// strategy:
-	// - Set globalOptions.FID = feature->GetFID();
-	// - Set list of rasters to only the one given
-	// - Call starspan_csv() 
-	
-	// - Set globalOptions.FID = feature->GetFID();
-	globalOptions.FID = item->feature->GetFID();
-	
-	// - Set list of rasters to only the one given
-	vector<const char*> raster_filenames;
-	raster_filenames.push_back(item->rasterFilename);
-	
-	// - Call starspan_csv()
-	bool prevResetReading = Traverser::_resetReading;
-	Traverser::_resetReading = false;
-	int ret = starspan_csv(
-		vect,
-		raster_filenames,
-		select_fields,
-		csv_filename,
-		layernum
+	int ret = starspan_csv_session_extract(
+		(CSVSession*) item->data,
+		item->feature->GetFID(),
+		item->rasterFilename
 	);
-	Traverser::_resetReading = prevResetReading;
 	
-	if ( globalOptions.verbose ) {
-		cout<< "--starspan_csv2: do_extraction: starspan_csv returned: " <<ret<< endl;
+	if ( item->context->options.verbose ) {
+		cout<< "--starspan_csv2: do_extraction: starspan_csv_session_extract returned: " <<ret<< endl;
 	}
 }
 
 //
 // FR 200337: Duplicate pixel handling.
-// It uses starspan_dup_pixel
+// It uses starspan_dup_pixel; the extraction of each feature goes to 
+// a session kept open for the whole run.
 //
 int starspan_csv2(
-	Vector* _vect,
+	Vector* vect,
 	vector<const char*> raster_filenames,
 	vector<const char*> *mask_filenames,
-	vector<const char*>* _select_fields,
-	int _layernum,
+	vector<const char*>* select_fields,
+	int layernum,
 	vector<DupPixelMode>& dupPixelModes,
-	const char* _csv_filename
+	const char* csv_filename
 ) {
-    vect = _vect;
-    select_fields = _select_fields;
-    layernum = _layernum;
-    csv_filename = _csv_filename;
+    ExtractionContext context;
+    CSVSession* session = starspan_csv_open_session(vect, select_fields, csv_filename, layernum, &context);
+    if ( !session ) {
+        return 1;
+    }
     
-    return starspan_dup_pixel(
+    int res = starspan_dup_pixel(
         vect,
         raster_filenames,
         mask_filenames,
         select_fields,
         layernum,
         dupPixelModes,
-        extractFunction
+        extractFunction,
+        session,
+        &context
     );
+    
+    if ( starspan_csv_close_session(session) ) {
+        res = 1;
+    }
+    return res;
 }
-
@@ -6,238 +6,281 @@
 // $Id: starspan_csv_raster_field.cc,v 1.3 2006-11-10 22:53:08 perrygeo Exp $
 //
 
-#include "starspan.h"           
-#include "traverser.h"       
+#include "starspan.h"
+#include "traverser.h"
+#include "RasterPool.h"
+#include "Csv.h"
 
 #include <stdlib.h>
 #include <assert.h>
+#include <map>
+#include <algorithm>
 
-static const char* raster_field_name;
-static const char* raster_directory;
-static string raster_filename;
-static vector<const char*>* select_fields;
-static const char* output_filename;
-static FILE* output_file;
-static bool new_file = false;
-static bool write_column_headers = false;
-static OGRFeature* currentFeature;
-static Raster* raster;
-static bool RID_already_included = false;
-static OGRLayer* layer;
-	
 
+// A feature to be processed on its raster: its FID and the key of the
+// block containing the upper left corner of its envelope.
+struct FeatureRef {
+	long FID;
+	double x, y;
+	long block;
 
-
-static void open_output_file() {
-	// if file exists, append new rows. Otherwise create file.
-	output_file = fopen(output_filename, "r+");
-	if ( output_file ) {
-		fseek(output_file, 0, SEEK_END);
-		if ( globalOptions.verbose )
-			fprintf(stdout, "Appending to existing file %s\n", output_filename);
-	}
-	else {
-		// create output file
-		output_file = fopen(output_filename, "w");
-		if ( !output_file) {
-			fprintf(stderr, "Cannot create %s\n", output_filename);
-			exit(1);
-		}
-		new_file = true;
+	bool operator<(const FeatureRef& other) const {
+		return block < other.block;
 	}
-}
+};
+
+
+/**
+  * Writes the pixels of the features on the raster named in their
+  * raster field. The traverser is given one raster at a time together
+  * with the features referring to it.
+  */
+class RasterFieldObserver : public Observer {
+public:
+	GlobalInfo* global_info;
+	OGRLayer* poLayer;
+	const char* raster_field_name;
+	vector<const char*>* select_fields;
+	string raster_filename;
+	bool write_header;
+	bool RID_already_included;
+	CsvOutput csvOut;
+
+	// data type and byte offset in TraversalEvent.bandValues for each band
+	vector<GDALDataType> bandTypes;
+	vector<int> bandOffsets;
+
+	// FID, attribute and RID values of the current feature
+	CsvOutput prefixOut;
+	string prefix;
+	int prefixFields;
+
+	// a point feature is reported with its own coordinates:
+	bool isPoint;
+	double pointX, pointY;
 
-static void write_column_headers_if_necessary() {
-	if ( write_column_headers ) {
-		write_column_headers = false;
+	RasterFieldObserver(OGRLayer* poLayer, const char* raster_field_name,
+		vector<const char*>* select_fields, OutputFile* file
+	) : poLayer(poLayer), raster_field_name(raster_field_name), select_fields(select_fields)
+	{
+		global_info = 0;
+		write_header = false;
+		prefixFields = 0;
+		isPoint = false;
+		pointX = pointY = 0;
+		prefixOut.setFile((FILE*) 0);
+		prefixOut.setSeparator(globalOptions.delimiter);
+		csvOut.setFile(file);
+		csvOut.setSeparator(globalOptions.delimiter);
 
-		// Create FID field
-		fprintf(output_file, "FID");
-		
-		// Create fields:
+		// the raster field is included as an attribute unless not selected:
+		RID_already_included = true;
 		if ( select_fields ) {
+			RID_already_included = false;
 			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
-				fprintf(output_file, ",%s", *fname);
 				if ( 0 == strcmp(raster_field_name, *fname) ) {
 					RID_already_included = true;
 				}
 			}
 		}
+	}
+
+	/**
+	  * Gets the band types of the raster.
+	  */
+	void init(GlobalInfo& info) {
+		global_info = &info;
+		bandTypes.clear();
+		bandOffsets.clear();
+		int offset = 0;
+		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
+			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
+			bandTypes.push_back(bandType);
+			bandOffsets.push_back(offset);
+			offset += GDALGetDataTypeSize(bandType) >> 3;
+		}
+	}
+
+	/**
+	  * Writes the column headers with the bands of the current raster:
+	  *    FID, fields-from-feature, [raster-field,] [col,row,] [x,y,] bands
+	  */
+	void writeHeader() {
+		csvOut.startLine();
+		csvOut.addString("FID");
+		if ( select_fields ) {
+			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+				csvOut.addString(*fname);
+			}
+		}
 		else {
-			// all fields from layer definition
-			OGRFeatureDefn* poDefn = layer->GetLayerDefn();
-			int feature_field_count = poDefn->GetFieldCount();
-			
-			for ( int i = 0; i < feature_field_count; i++ ) {
-				OGRFieldDefn* poField = poDefn->GetFieldDefn(i);
-				const char* pfield_name = poField->GetNameRef();
-				fprintf(output_file, ",%s", pfield_name);
+			OGRFeatureDefn* poDefn = poLayer->GetLayerDefn();
+			for ( int i = 0; i < poDefn->GetFieldCount(); i++ ) {
+				csvOut.addString(poDefn->GetFieldDefn(i)->GetNameRef());
 			}
-			RID_already_included = true;
 		}
-		
-		if ( ! RID_already_included ) {
-			// add RID field
-			fprintf(output_file, ",%s", raster_field_name);
+		if ( !RID_already_included ) {
+			csvOut.addString(raster_field_name);
 		}
-		
-		// Create (col,row) fields, if so indicated
 		if ( !globalOptions.noColRow ) {
-			fprintf(output_file, ",col");
-			fprintf(output_file, ",row");
+			csvOut.addString("col").addString("row");
 		}
-		
-		// Create (x,y) fields, if so indicated
 		if ( !globalOptions.noXY ) {
-			fprintf(output_file, ",x");
-			fprintf(output_file, ",y");
+			csvOut.addString("x").addString("y");
 		}
-		
-		// Create fields for bands
-		GDALDataset* dataset = raster->getDataset();
-		for ( int i = 0; i < dataset->GetRasterCount(); i++ ) {
-			fprintf(output_file, ",Band%d", i+1);
+		for ( unsigned i = 0; i < bandTypes.size(); i++ ) {
+			csvOut.addField("Band%d", i+1);
 		}
-		
-		fprintf(output_file, "\n");
-		
+		csvOut.endLine();
 	}
-}
 
-static void processPoint(OGRPoint* point) {
-	double x = point->getX();
-	double y = point->getY();
-	int col, row;
-	raster->toColRow(x, y, &col, &row);
-	
-	void* band_values = raster->getBandValuesForPixel(col, row);
-	if ( !band_values ) {
-		// means NO intersection.
-		return;
-	}
-	
-	
-	write_column_headers_if_necessary();
-	
-	//
-	// Add field values to new record:
-	//
+	/**
+	  * Renders the fields common to all pixel records of the feature.
+	  */
+	void intersectionFound(IntersectionInfo& intersInfo) {
+		OGRFeature* feature = intersInfo.feature;
 
-	// Add FID value:
-	fprintf(output_file, "%ld", currentFeature->GetFID());
-	
-	// add attribute fields from source currentFeature to record:
-	if ( select_fields ) {
-		for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
-			const int i = currentFeature->GetFieldIndex(*fname);
-			if ( i < 0 ) {
-				fprintf(stderr, "\n\tField `%s' not found\n", *fname);
-				exit(1);
+		prefixOut.startLine();
+		prefixOut.addInt(feature->GetFID());
+		if ( select_fields ) {
+			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+				const int i = feature->GetFieldIndex(*fname);
+				if ( i < 0 ) {
+					fprintf(stderr, "\n\tField `%s' not found\n", *fname);
+					exit(1);
+				}
+				prefixOut.addString(feature->GetFieldAsString(i));
 			}
-			
-			const char* str = currentFeature->GetFieldAsString(i);
-			if ( strchr(str, ',') )
-				fprintf(output_file, ",\"%s\"", str);   // quote string
-			else
-				fprintf(output_file, ",%s", str);
 		}
-	}
-	else {
-		// all fields
-		int feature_field_count = currentFeature->GetFieldCount();
-		for ( int i = 0; i < feature_field_count; i++ ) {
-			const char* str = currentFeature->GetFieldAsString(i);
-			if ( strchr(str, ',') )
-				fprintf(output_file, ",\"%s\"", str);   // quote string
-			else
-				fprintf(output_file, ",%s", str);
+		else {
+			for ( int i = 0; i < feature->GetFieldCount(); i++ ) {
+				prefixOut.addString(feature->GetFieldAsString(i));
+			}
 		}
-	}
+		if ( !RID_already_included ) {
+			prefixOut.addString(raster_filename);
+		}
+		prefixFields = prefixOut.takeLine(prefix);
 
-	if ( ! RID_already_included ) {
-		// add RID field
-		fprintf(output_file, ",%s", raster_filename.c_str());
-	}
-	
-	
-	// add (col,row) fields
-	if ( !globalOptions.noColRow ) {
-		fprintf(output_file, ",%d,%d", col, row);
+		OGRGeometry* geometry = feature->GetGeometryRef();
+		isPoint = geometry && (geometry->getGeometryType() == wkbPoint
+		                   ||  geometry->getGeometryType() == wkbPoint25D);
+		if ( isPoint ) {
+			pointX = ((OGRPoint*) geometry)->getX();
+			pointY = ((OGRPoint*) geometry)->getY();
+		}
 	}
-	
-	// add (x,y) fields
-	if ( !globalOptions.noXY ) {
-		fprintf(output_file, ",%.3f,%.3f", x, y);
+
+	/**
+	  * Adds a record to the output file.
+	  * (x,y) are those of the point for a point feature, and those of
+	  * the pixel otherwise.
+	  */
+	void addPixel(TraversalEvent& ev) {
+		if ( write_header ) {
+			// header is written upon the first record
+			write_header = false;
+			writeHeader();
+		}
+
+		csvOut.startLine();
+		csvOut.addRendered(prefix, prefixFields);
+		if ( !globalOptions.noColRow ) {
+			csvOut.addInt(ev.pixel.col).addInt(ev.pixel.row);
+		}
+		if ( !globalOptions.noXY ) {
+			if ( isPoint ) {
+				csvOut.addDouble(pointX, 3).addDouble(pointY, 3);
+			}
+			else {
+				csvOut.addDouble(ev.pixel.x, 3).addDouble(ev.pixel.y, 3);
+			}
+		}
+		char* ptr = (char*) ev.bandValues;
+		char value[1024];
+		for ( unsigned i = 0; i < bandTypes.size(); i++ ) {
+			starspan_extract_string_value(bandTypes[i], ptr + bandOffsets[i], value);
+			csvOut.addString(value);
+		}
+		csvOut.endLine();
 	}
-	
-	// add band values to record:
-	char* ptr = (char*) band_values;
-	char value[1024];
-	GDALDataset* dataset = raster->getDataset();
-	for ( int i = 0; i < dataset->GetRasterCount(); i++ ) {
-		GDALRasterBand* band = dataset->GetRasterBand(i+1);
-		GDALDataType bandType = band->GetRasterDataType();
-		int typeSize = GDALGetDataTypeSize(bandType) >> 3;
-		starspan_extract_string_value(bandType, ptr, value);
-		fprintf(output_file, ",%s", value);
-		
-		// move to next piece of data in buffer:
-		ptr += typeSize;
+
+	/**
+	  * writes any pending output
+	  */
+	void end() {
+		csvOut.flush();
 	}
-	fprintf(output_file, "\n");
-	
-}
+};
 
 
 //
-// only Point type is processed now
+// Gets the name of the raster for the feature
 //
-static void processGeometry(OGRGeometry* geometry) {
-	OGRwkbGeometryType type = geometry->getGeometryType();
-	switch ( type ) {
-		case wkbPoint:
-		case wkbPoint25D:
-			processPoint((OGRPoint*) geometry);
-			break;
-			
-		default:
-			cerr<< (string(OGRGeometryTypeToName(type))
-			    + ": intersection type not considered."
-			);
+static string get_raster_filename(OGRFeature* feature, const char* raster_field_name, const char* raster_directory) {
+	const int i = feature->GetFieldIndex(raster_field_name);
+	if ( i < 0 ) {
+		fprintf(stderr, "\n\tField `%s' not found\n", raster_field_name);
+		exit(1);
 	}
+	string filename = raster_directory;
+	filename += "/";
+	filename += feature->GetFieldAsString(i);
+	return filename;
 }
 
 
-
-static void extract_pixels() {
-	OGRGeometry* feature_geometry = currentFeature->GetGeometryRef();
-	processGeometry(feature_geometry);
+//
+// Adds the feature to the group of its raster
+//
+static void add_feature(OGRFeature* feature, const char* raster_field_name, const char* raster_directory,
+	map<string, vector<FeatureRef> >& groups, vector<string>& order
+) {
+	FeatureRef ref;
+	ref.FID = feature->GetFID();
+	ref.x = ref.y = 0;
+	ref.block = 0;
+	OGRGeometry* geometry = feature->GetGeometryRef();
+	if ( geometry ) {
+		OGREnvelope env;
+		geometry->getEnvelope(&env);
+		ref.x = env.MinX;
+		ref.y = env.MaxY;
+	}
+	string filename = get_raster_filename(feature, raster_field_name, raster_directory);
+	vector<FeatureRef>& group = groups[filename];
+	if ( group.size() == 0 ) {
+		order.push_back(filename);
+	}
+	group.push_back(ref);
 }
 
 
-
-static void process_feature() {
-	if ( globalOptions.verbose ) {
-		fprintf(stdout, "\nFID: %ld", currentFeature->GetFID());
+//
+// Gets the FIDs of the group in block order
+//
+static void sort_group(Raster* raster, vector<FeatureRef>& group, vector<long>& FIDs) {
+	int width, height, bands;
+	raster->getSize(&width, &height, &bands);
+	int blockXSize = width, blockYSize = 1;
+	if ( bands > 0 ) {
+		raster->getDataset()->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
 	}
-	
-	const int i = currentFeature->GetFieldIndex(raster_field_name);
-	if ( i < 0 ) {
-		fprintf(stderr, "\n\tField `%s' not found\n", raster_field_name);
-		exit(1);
+	const long blocksPerRow = (width + blockXSize - 1) / blockXSize;
+	for ( vector<FeatureRef>::iterator ref = group.begin(); ref != group.end(); ref++ ) {
+		int col, row;
+		raster->toColRow(ref->x, ref->y, &col, &row);
+		col = col < 0 ? 0 : col >= width  ? width - 1  : col;
+		row = row < 0 ? 0 : row >= height ? height - 1 : row;
+		ref->block = (long) (row / blockYSize) * blocksPerRow + col / blockXSize;
 	}
-	raster_filename = raster_directory;
-	raster_filename += "/";
-	raster_filename += currentFeature->GetFieldAsString(i);
-	
-	raster = new Raster(raster_filename.c_str());
-	
-	extract_pixels();
-	
-	delete raster;
-}
-
+	stable_sort(group.begin(), group.end());
 
+	FIDs.clear();
+	for ( vector<FeatureRef>::const_iterator ref = group.begin(); ref != group.end(); ref++ ) {
+		FIDs.push_back(ref->FID);
+	}
+}
 
 
 
@@ -245,79 +288,94 @@ static void process_feature() {
 
 int starspan_csv_raster_field(
 	Vector*              vect,
-	const char*          _raster_field_name,
-	const char*          _raster_directory,
-	vector<const char*>* _select_fields,
-	const char*          _output_filename,
+	const char*          raster_field_name,
+	const char*          raster_directory,
+	vector<const char*>* select_fields,
+	const char*          csv_filename,
 	int                  layernum
 ) {
-	raster_field_name = _raster_field_name;
-	raster_directory =  _raster_directory;
-	select_fields =     _select_fields;
-	output_filename =   _output_filename;
-
-
-	//if ( vect->getLayerCount() > 1 ) {
-	//	cerr<< "Vector datasource with more than one layer: "
-	//	    << vect->getName()
-	//		<< "\nOnly one layer expected.\n"
-	//	;
-	//	return 1;
-	//}
-	
-	layer = vect->getLayer(layernum);
+	OGRLayer* layer = vect->getLayer(layernum);
 	if ( !layer ) {
 		cerr<< "Couldn't get layer from " << vect->getName()<< endl;
 		return 1;
 	}
 	layer->ResetReading();
 
-	open_output_file();
-	
-	write_column_headers = new_file;
-	
+	// if file exists, append new rows. Otherwise create file.
+	OutputFile* file = OutputFile::open(csv_filename, true);
+	if ( !file) {
+		fprintf(stderr, "Cannot create %s\n", csv_filename);
+		return 1;
+	}
+	if ( !file->isNew() && globalOptions.verbose ) {
+		fprintf(stdout, "Appending to existing file %s\n", csv_filename);
+	}
+
 	//
-	// Was a specific FID given?
+	// group the features by raster so each raster is opened once and
+	// read in block order
 	//
+	map<string, vector<FeatureRef> > groups;
+	vector<string> order;   // rasters in order of first appearance
+
+	OGRFeature* feature;
 	if ( globalOptions.FID >= 0 ) {
-		currentFeature = layer->GetFeature(globalOptions.FID);
-		if ( !currentFeature ) {
+		feature = layer->GetFeature(globalOptions.FID);
+		if ( !feature ) {
 			cerr<< "FID " <<globalOptions.FID<< " not found in " <<vect->getName()<< endl;
 			exit(1);
 		}
-		process_feature();
-		delete currentFeature;
+		add_feature(feature, raster_field_name, raster_directory, groups, order);
+		delete feature;
 	}
-	//
-	// else: process each feature in vector datasource:
-	//
 	else {
-		Progress* progress = 0;
-		if ( globalOptions.progress ) {
-			long psize = layer->GetFeatureCount();
-			if ( psize >= 0 ) {
-				progress = new Progress(psize, globalOptions.progress_perc);
-			}
-			else {
-				progress = new Progress((long)globalOptions.progress_perc);
-			}
-			cout << "\t";
-			progress->start();
+		while( (feature = layer->GetNextFeature()) != NULL ) {
+			add_feature(feature, raster_field_name, raster_directory, groups, order);
+			delete feature;
 		}
-		while( (currentFeature = layer->GetNextFeature()) != NULL ) {
-			process_feature();
-			delete currentFeature;
-			if ( progress )
-				progress->update();
-		}
-		if ( progress ) {
-			progress->complete();
-			delete progress;
-			progress = 0;
-			cout << endl;
+	}
+
+	RasterFieldObserver obs(layer, raster_field_name, select_fields, file);
+	obs.write_header = file->isNew();
+
+	Traverser tr;
+	tr.addObserver(&obs);
+	tr.setVector(vect);
+	tr.setLayerNum(layernum);
+
+	Progress* progress = 0;
+	if ( globalOptions.progress ) {
+		progress = new Progress(order.size(), globalOptions.progress_perc);
+		cout << "\t";
+		progress->start();
+	}
+	vector<long> FIDs;
+	for ( vector<string>::const_iterator filename = order.begin(); filename != order.end(); filename++ ) {
+		Raster* raster = RasterPool::getPool().get(*filename);
+		if ( raster ) {
+			if ( globalOptions.verbose ) {
+				fprintf(stdout, "\n%s: %u features", filename->c_str(), (unsigned) groups[*filename].size());
+			}
+			sort_group(raster, groups[*filename], FIDs);
+			obs.raster_filename = *filename;
+			tr.removeRasters();
+			tr.addRaster(raster);
+			tr.setDesiredFIDs(FIDs);
+			tr.traverse();
+			tr.removeRasters();
+			RasterPool::getPool().release(raster);
 		}
-	}	
-	
-	return 0;
-}
+		if ( progress )
+			progress->update();
+	}
+	if ( progress ) {
+		progress->complete();
+		delete progress;
+		progress = 0;
+		cout << endl;
+	}
 
+	bool ok = file->close();
+	delete file;
+	return ok ? 0 : 1;
+}
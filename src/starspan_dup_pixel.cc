@@ -9,6 +9,8 @@
 #include "starspan.h"
 #include "traverser.h"
 #include "Csv.h"
+#include "RasterPool.h"
+#include "WorkerPool.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -36,16 +38,6 @@ static const double maxDistancePercentage = 5;
 
 
 
-
-// obtained in starspan_dup_pixel() and used in do_extraction():
-static Vector* vect;
-static vector<const char*>* select_fields;
-static int layernum;
-
-static void (*extrFunction)(ExtractionItem* item);
-static ExtractionItem extrItem;
-
-
 /**
  * Gets the center of the geometry. 
  */
@@ -76,6 +68,9 @@ struct RasterInfo {
 	// bounding box
 	OGRPolygon* ri_bb;
 	
+	// envelope of ri_bb
+	OGREnvelope ri_env;
+	
 	// center of ri_bb;
 	OGRPoint* ri_center;
 	
@@ -104,6 +99,7 @@ struct RasterInfo {
 		raster_ring->addPoint(x0, y0);
 		ri_bb = new OGRPolygon();
 		ri_bb->addRingDirectly(raster_ring);
+		ri_bb->getEnvelope(&ri_env);
 		
 		ri_center = getGeometryCenter(ri_bb);
 	}
@@ -120,249 +116,468 @@ struct RasterInfo {
 
 
 /////////////////////////////////////////////////////////////////////////////
-///////// ignore_nodata handling
-
-/**
- * Determines whether the feature should be considered according to the
- * ignore_nodata mode.
- */
-static bool ok_for_nodata(DupPixelMode* ignore_nodata, OGRFeature* feature, RasterInfo* rasterInfo) {
-    
-    static enum { ALL_BANDS, ANY_BAND, ONE_BAND } band_param;
-    static int band_number = 0;
-    
-    band_param = ignore_nodata->param1 == "all_bands" ? ALL_BANDS
-               : ignore_nodata->param1 == "any_band" ? ANY_BAND
-               : ONE_BAND
-   ;
-   if ( band_param == ONE_BAND ) {
-       band_number = (int) ignore_nodata->arg;
-   }
-   
-	// strategy:
-    // - Traverse feature with a NoDataObserver
-    
-    /**
-      * Checks bands for nodata values according to the band_param and band_number
-      * variables above. If some pixel fails to satisfy the ignore_nodata mode,
-      * its location [col0, row0] is recorded and the nodataFound flag is
-      * assigned true.
-      */
-    struct NoDataObserver : public Observer {
-        GlobalInfo* global_info;
-        bool OK;
-        bool nodataFound;
-        
-        int col0;
-        int row0;
-            
-        NoDataObserver() : global_info(0), nodataFound(false) {
-        }
-        
-        void init(GlobalInfo& info) {
-            global_info = &info;
-    
-            OK = false;   // but let's see ...
-            
-            const unsigned noBands = global_info->bands.size();
-            if ( noBands == 0 ) {
-                cerr<< "NoDataObserver: warning: no bands in raster" <<endl;
-                return;
-            }
-    
-            if ( band_param == ONE_BAND ) {
-                if ( band_number <= 0 || band_number > noBands ) {
-                    cerr<< "NoDataObserver: warning: band number " <<band_number
-                        << " is not between 1 and " <<noBands<< endl;
-                    return;
-                }
-            }
-            // now, all seems OK to continue processing		
-            OK = true;
-        }
-        
-        void addPixel(TraversalEvent& ev) { 
-            if ( !OK || nodataFound ) {
-                return;
-            }
-            void* band_values = ev.bandValues;
-            
-            // check bands for nodata values
-            char* ptr = (char*) band_values;
-            const unsigned noBands = global_info->bands.size();
-            
-            // check for nodata in a particular band?
-            if ( band_param == ONE_BAND ) {
-                GDALDataType bandType = global_info->bands[band_number]->GetRasterDataType();
-                int typeSize = GDALGetDataTypeSize(bandType) >> 3;
-                
-                ptr += (band_number - 1) * typeSize;
-                double value = starspan_extract_double_value(bandType, ptr);
-                if ( fabs(value - globalOptions.nodata) <= 10e-4 ) {
-                    nodataFound = true;
-                }
-            }
-            
-            // check for nodata in any or all the bands?
-            else {
-                assert( band_param == ANY_BAND || band_param == ALL_BANDS );
-                
-                int noNodatas = 0;
-                // check in sequence while necessary:
-                for ( unsigned i = 0; i < noBands; i++ ) {
-                    GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
-                    int typeSize = GDALGetDataTypeSize(bandType) >> 3;
-                    
-                    double value = starspan_extract_double_value(bandType, ptr);
-                    if ( fabs(value - globalOptions.nodata) <= 10e-4 ) {
-                        // one more nodata:
-                        noNodatas++;
-                        if ( band_param == ANY_BAND ) {
-                            break;
-                        }
-                    }
-                    
-                    // move to next piece of data in buffer:
-                    ptr += typeSize;
-                }
-                
-                if ( noNodatas > 0 ) {
-                    if ( band_param == ANY_BAND ) {
-                        nodataFound = true;
-                    }
-                    else {
-                        if ( noNodatas == noBands ) {
-                            nodataFound = true;
-                        }
-                    }
-                }
-            }
-            
-            if ( nodataFound ) {
-                col0 = 1 + ev.pixel.col;
-                row0 = 1 + ev.pixel.row;
-            }
-        }
-    };
-    
-    NoDataObserver obs;
-    
-	Traverser tr;
-	tr.addObserver(&obs);
-    
-	tr.setVector(vect);
-	tr.setLayerNum(layernum);
-	tr.setDesiredFID(feature->GetFID());
-               
-    Raster ri_raster(rasterInfo->ri_filename);
-    tr.addRaster(&ri_raster);
-    
-	bool prevResetReading = Traverser::_resetReading;
-	Traverser::_resetReading = false;
-    
-    tr.traverse();
-    
-    Traverser::_resetReading = prevResetReading;
-    
-    return obs.OK && !obs.nodataFound;
-}
+///////// raster footprint index
 
+// maximum number of children of a node in the footprint index
+#define FOOTPRINT_NODE_CAPACITY 16
 
-
-/////////////////////////////////////////////////////////////////////////////
-///////// mask handling
+static inline bool envelopeContains(const OGREnvelope& outer, const OGREnvelope& inner) {
+	return outer.MinX <= inner.MinX && inner.MaxX <= outer.MaxX
+	    && outer.MinY <= inner.MinY && inner.MaxY <= outer.MaxY;
+}
 
 /**
-  * Checks bands for zero values. If a zero is found, it records its
-  * location [col0, row0].
-  */
-struct MaskObserver : public Observer {
-	GlobalInfo* global_info;
-	bool OK;
-    bool zeroFound;
-    
-    int col0;
-    int row0;
-		
-	MaskObserver() : global_info(0), zeroFound(false) {
+ * Sort-Tile-Recursive (STR) packed tree over the envelopes of the rasters.
+ * Gives the rasters whose envelope contains a given envelope, so the
+ * exact containment test is only done on those.
+ */
+class FootprintIndex {
+public:
+	void build(vector<RasterInfo*>& rastInfos) {
+		levels.clear();
+		vector<Node> level;
+		for ( unsigned i = 0; i < rastInfos.size(); i++ ) {
+			Node node;
+			node.env = rastInfos[i]->ri_env;
+			node.first = i;
+			node.count = 0;
+			level.push_back(node);
+		}
+		if ( level.size() == 0 ) {
+			return;
+		}
+		for (;;) {
+			pack(level);
+			levels.push_back(level);
+			if ( level.size() <= 1 ) {
+				break;
+			}
+			
+			// parent level:
+			vector<Node> parents;
+			for ( unsigned i = 0; i < level.size(); i += FOOTPRINT_NODE_CAPACITY ) {
+				Node parent;
+				parent.first = i;
+				parent.count = min((unsigned) FOOTPRINT_NODE_CAPACITY, (unsigned) level.size() - i);
+				parent.env = level[i].env;
+				for ( unsigned k = 1; k < parent.count; k++ ) {
+					parent.env.Merge(level[i + k].env);
+				}
+				parents.push_back(parent);
+			}
+			level.swap(parents);
+		}
 	}
 	
-	void init(GlobalInfo& info) {
-		global_info = &info;
-
-		OK = false;   // but let's see ...
-		
-		if ( global_info->bands.size() == 0 ) {
-			cerr<< "MaskObserver: warning: no bands in raster mask" <<endl;
+	/**
+	 * Gets the rasters whose envelope contains env, in the original order.
+	 */
+	void query(const OGREnvelope& env, vector<RasterInfo*>& rastInfos, vector<RasterInfo*>& result) const {
+		result.clear();
+		if ( levels.size() == 0 ) {
 			return;
 		}
+		vector<unsigned> hits;
+		queryNode(levels.size() - 1, 0, env, hits);
+		sort(hits.begin(), hits.end());
+		for ( unsigned i = 0; i < hits.size(); i++ ) {
+			result.push_back(rastInfos[hits[i]]);
+		}
+	}
 
-		// now, all seems OK to continue processing		
-		OK = true;
+private:
+	struct Node {
+		OGREnvelope env;
+		// leaves: index of the raster; otherwise: children in the level below
+		unsigned first;
+		unsigned count;
+	};
+	
+	// levels[0] are the leaves; the last level has the root
+	vector<vector<Node> > levels;
+	
+	static bool byCenterX(const Node& a, const Node& b) {
+		return a.env.MinX + a.env.MaxX < b.env.MinX + b.env.MaxX;
+	}
+	static bool byCenterY(const Node& a, const Node& b) {
+		return a.env.MinY + a.env.MaxY < b.env.MinY + b.env.MaxY;
 	}
 	
-	void addPixel(TraversalEvent& ev) { 
-        if ( !OK || zeroFound ) {
-            return;
-        }
-		void* band_values = ev.bandValues;
-		
-		// check bands for any zero value
-		char* ptr = (char*) band_values;
-		char value[1024];
-		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
-			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
-			int typeSize = GDALGetDataTypeSize(bandType) >> 3;
-			
-			int value = starspan_extract_int_value(bandType, ptr);
-            if ( value == 0 ) {
-                zeroFound = true;
-                col0 = 1 + ev.pixel.col;
-                row0 = 1 + ev.pixel.row;
-                break;
-            }
-			
-			// move to next piece of data in buffer:
-			ptr += typeSize;
+	// STR ordering: vertical slices by x, each sorted by y
+	static void pack(vector<Node>& level) {
+		const unsigned n = level.size();
+		const unsigned numNodes = (n + FOOTPRINT_NODE_CAPACITY - 1) / FOOTPRINT_NODE_CAPACITY;
+		const unsigned numSlices = (unsigned) ceil(sqrt((double) numNodes));
+		const unsigned sliceSize = numSlices * FOOTPRINT_NODE_CAPACITY;
+		sort(level.begin(), level.end(), byCenterX);
+		for ( unsigned i = 0; i < n; i += sliceSize ) {
+			sort(level.begin() + i, level.begin() + min(n, i + sliceSize), byCenterY);
 		}
 	}
+	
+	void queryNode(unsigned l, unsigned i, const OGREnvelope& env, vector<unsigned>& hits) const {
+		const Node& node = levels[l][i];
+		if ( !envelopeContains(node.env, env) ) {
+			return;
+		}
+		if ( l == 0 ) {
+			hits.push_back(node.first);
+			return;
+		}
+		for ( unsigned k = 0; k < node.count; k++ ) {
+			queryNode(l - 1, node.first + k, env, hits);
+		}
+	}
+};
+
 
+/**
+ * State of a starspan_dup_pixel() run, passed down to the processing of
+ * each feature, so that independent runs do not share any state.
+ */
+struct DupPixelJob {
+	Vector* vect;
+	vector<const char*>* select_fields;
+	int layernum;
+	
+	void (*extrFunction)(ExtractionItem* item);
+	void* extrData;
+	
+	// options of the run; also given to the traversals
+	ExtractionContext context;
+	
+	FootprintIndex footprintIndex;
 };
 
 
+/////////////////////////////////////////////////////////////////////////////
+///////// footprint of the feature and probing of candidates
+///////// (ignore_nodata and mask handling)
+
+// number of rows read at a time when probing a raster
+#define PROBE_STRIP_ROWS 64
 
+// row order of pixel locations
+static bool byRow(const EPixel& a, const EPixel& b) {
+	return a.row < b.row || (a.row == b.row && a.col < b.col);
+}
 
 /**
- * Determines whether the feature is fully contained in the raster
- * according to the mask. 
+ * Pixel locations of a feature on the grid of a raster, obtained with
+ * a traversal of the feature on that raster. It is reused for all the 
+ * rasters sharing the grid.
  */
-static bool within_mask(OGRFeature* feature, RasterInfo* rasterInfo) {
-    assert( rasterInfo->ri_mask ) ;
+struct Footprint {
+	double x0, y0;
+	double pix_x_size, pix_y_size;
+	vector<EPixel> locs;
+	
+	/**
+	 * Determines whether the raster has the same grid as this footprint; 
+	 * if so, gets the offset of the footprint locations in the raster.
+	 */
+	bool alignedWith(Raster* raster, int* dcol, int* drow) const {
+		double rx0, ry0, rx1, ry1, rpx, rpy;
+		raster->getCoordinates(&rx0, &ry0, &rx1, &ry1);
+		raster->getPixelSize(&rpx, &rpy);
+		if ( fabs(rpx - pix_x_size) > 1e-9 * fabs(pix_x_size)
+		||   fabs(rpy - pix_y_size) > 1e-9 * fabs(pix_y_size) ) {
+			return false;
+		}
+		const double fcol = (x0 - rx0) / pix_x_size;
+		const double frow = (y0 - ry0) / pix_y_size;
+		*dcol = (int) floor(fcol + 0.5);
+		*drow = (int) floor(frow + 0.5);
+		return fabs(fcol - *dcol) <= 1e-6 && fabs(frow - *drow) <= 1e-6;
+	}
+};
 
-	// strategy:
-    // - Traverse feature with a MaskObserver to detect if a zero value appears
-    
-    MaskObserver obs;
-    
+/**
+ * Gets the pixel locations of the feature.
+ */
+struct FootprintObserver : public Observer {
+	Traverser& tr;
+	vector<EPixel>& locs;
+	
+	FootprintObserver(Traverser& tr, vector<EPixel>& locs) : tr(tr), locs(locs) {}
+	
+	bool isSimple() { 
+		return true; 
+	}
+	
+	void intersectionEnd(IntersectionInfo& intersInfo) {
+		tr.getPixelLocations(locs);
+	}
+};
+
+/**
+ * Gets the footprint of the feature for the grid of the given raster,
+ * computing it if not already in footprints.
+ */
+static const Footprint* get_footprint(DupPixelJob& job, OGRFeature* feature, Raster* raster, 
+	vector<Footprint*>& footprints, int* dcol, int* drow
+) {
+	for ( unsigned i = 0; i < footprints.size(); i++ ) {
+		if ( footprints[i]->alignedWith(raster, dcol, drow) ) {
+			return footprints[i];
+		}
+	}
+	
+	Footprint* fp = new Footprint();
+	double x1, y1;
+	raster->getCoordinates(&fp->x0, &fp->y0, &x1, &y1);
+	raster->getPixelSize(&fp->pix_x_size, &fp->pix_y_size);
+	
 	Traverser tr;
+	FootprintObserver obs(tr, fp->locs);
+	tr.setContext(&job.context);
 	tr.addObserver(&obs);
-
-	tr.setVector(vect);
-	tr.setLayerNum(layernum);
+	tr.setVector(job.vect);
+	tr.setLayerNum(job.layernum);
 	tr.setDesiredFID(feature->GetFID());
-    
-    tr.addRaster(rasterInfo->ri_mask);
-    
-	bool prevResetReading = Traverser::_resetReading;
-	Traverser::_resetReading = false;
+	tr.addRaster(raster);
+	tr.traverse();
+	
+	// probes read by rows:
+	sort(fp->locs.begin(), fp->locs.end(), byRow);
+	
+	footprints.push_back(fp);
+	*dcol = *drow = 0;
+	return fp;
+}
 
-    tr.traverse();
-    
-    Traverser::_resetReading = prevResetReading;
-    
-    return obs.OK && !obs.zeroFound;
+
+/**
+ * Check of the pixels of a feature on a raster (data or mask).
+ * A pixel fails if the number of checked bands with a "hit" value (nodata
+ * for ignore_nodata, zero for masks) is at least minHits.
+ */
+struct Probe {
+	Raster* raster;
+	const char* filename;
+	const Footprint* fp;
+	int dcol, drow;
+	
+	bool mask;          // hit: zero value; otherwise: nodata value
+	int band_number;    // 1-based band to check; 0: all bands
+	bool all_bands;     // for nodata, all checked bands must hit
+	
+	const GlobalOptions* options;
+	
+	bool ok;            // result
+};
+
+/**
+ * Reads the pixels of the footprint in strips of rows and stops at the
+ * first failing pixel.
+ */
+static void run_probe(int task, int worker, void* arg) {
+	Probe& probe = (*(vector<Probe>*) arg)[task];
+	probe.ok = false;
+	
+	GDALDataset* dataset = probe.raster->getDataset();
+	const int numBands = dataset->GetRasterCount();
+	if ( numBands == 0 ) {
+		cerr<< (probe.mask ? "MaskObserver" : "NoDataObserver")
+		    << ": warning: no bands in raster " <<probe.filename<< endl;
+		return;
+	}
+	if ( probe.band_number < 0 || probe.band_number > numBands ) {
+		cerr<< "NoDataObserver: warning: band number " <<probe.band_number
+		    << " is not between 1 and " <<numBands<< endl;
+		return;
+	}
+	
+	vector<int> bands;
+	if ( probe.band_number > 0 ) {
+		bands.push_back(probe.band_number);
+	}
+	else {
+		for ( int b = 1; b <= numBands; b++ ) {
+			bands.push_back(b);
+		}
+	}
+	const int minHits = probe.all_bands ? bands.size() : 1;
+	
+	const vector<EPixel>& locs = probe.fp->locs;
+	const int width = dataset->GetRasterXSize();
+	const int height = dataset->GetRasterYSize();
+	vector<double> buffer;
+	
+	for ( unsigned first = 0; first < locs.size(); ) {
+		// strip of rows starting at the row of locs[first]:
+		const int row0 = locs[first].row;
+		unsigned last = first;
+		int col0 = locs[first].col, col1 = col0;
+		while ( last < locs.size() && locs[last].row < row0 + PROBE_STRIP_ROWS ) {
+			col0 = min(col0, locs[last].col);
+			col1 = max(col1, locs[last].col);
+			last++;
+		}
+		const int row1 = locs[last - 1].row;
+		
+		// window in the raster:
+		const int wcol = col0 + probe.dcol;
+		const int wrow = row0 + probe.drow;
+		const int wwidth = col1 - col0 + 1;
+		const int wheight = row1 - row0 + 1;
+		if ( wcol < 0 || wrow < 0 || wcol + wwidth > width || wrow + wheight > height ) {
+			// (not expected as the feature is contained in the raster)
+			return;
+		}
+		const size_t bandSize = (size_t) wwidth * wheight;
+		buffer.resize(bandSize * bands.size());
+		for ( unsigned k = 0; k < bands.size(); k++ ) {
+			GDALRasterBand* band = dataset->GetRasterBand(bands[k]);
+			if ( CE_None != band->RasterIO(GF_Read, wcol, wrow, wwidth, wheight,
+					&buffer[k * bandSize], wwidth, wheight, GDT_Float64, 0, 0) ) {
+				return;
+			}
+		}
+		
+		for ( unsigned i = first; i < last; i++ ) {
+			const size_t offset = (size_t) (locs[i].row - row0) * wwidth + (locs[i].col - col0);
+			int hits = 0;
+			for ( unsigned k = 0; k < bands.size(); k++ ) {
+				const double value = buffer[k * bandSize + offset];
+				const bool hit = probe.mask
+					? (int) value == 0
+					: fabs(value - probe.options->nodata) <= 10e-4;
+				if ( hit && ++hits >= minHits ) {
+					if ( probe.options->verbose ) {
+						cout<< "\t" << "  " <<probe.filename<< ": " 
+						    <<(probe.mask ? "zero mask value" : "nodata")<< " at [" 
+						    <<(1 + locs[i].col + probe.dcol)<< "," <<(1 + locs[i].row + probe.drow)<< "]" <<endl;
+					}
+					return;
+				}
+			}
+		}
+		first = last;
+	}
+	probe.ok = true;
 }
 
+/**
+ * Runs the probes, in parallel if they are on different rasters.
+ */
+static void run_probes(const GlobalOptions& options, vector<Probe>& probes) {
+	int numWorkers = min(options.num_threads, (int) probes.size());
+	for ( unsigned i = 0; i < probes.size() && numWorkers > 1; i++ ) {
+		for ( unsigned j = i + 1; j < probes.size(); j++ ) {
+			if ( probes[i].raster == probes[j].raster ) {
+				numWorkers = 1;
+				break;
+			}
+		}
+	}
+	WorkerPool pool(numWorkers);
+	pool.run(probes.size(), run_probe, &probes);
+}
+
+/**
+ * Keeps the candidates satisfying the ignore_nodata mode (if given) and
+ * whose mask (if any) is nonzero at all pixels of the feature.
+ * The feature is rasterized once per distinct grid.
+ */
+static void select_candidates(DupPixelJob& job, DupPixelMode* ignore_nodata, OGRFeature* feature, 
+	vector<RasterInfo*>& candidates
+) {
+	const GlobalOptions& options = job.context.options;
+	vector<Footprint*> footprints;
+	vector<Raster*> rasters;
+	vector<Probe> probes;
+	
+	///////////////////////////////////////////////////////////////////
+	// ignore_nodata?
+	if ( ignore_nodata ) {
+		// select according to ignore_nodata mode:
+		if ( options.verbose ) {
+			cout<< "--duplicate_pixel: Selecting according to ignore_nodata mode: "
+			    << ignore_nodata->toString() <<endl
+			;
+		}
+		const bool one_band = ignore_nodata->param1 != "all_bands" && ignore_nodata->param1 != "any_band";
+		for ( unsigned i = 0; i < candidates.size(); i++ ) {
+			Raster* raster = RasterPool::getPool().get(candidates[i]->ri_filename);
+			if ( !raster ) {
+				continue;
+			}
+			rasters.push_back(raster);
+			
+			Probe probe;
+			probe.raster = raster;
+			probe.filename = candidates[i]->ri_filename;
+			probe.fp = get_footprint(job, feature, raster, footprints, &probe.dcol, &probe.drow);
+			probe.mask = false;
+			// (an invalid band number is reported by the probe)
+			probe.band_number = !one_band ? 0 : ignore_nodata->arg >= 1 ? (int) ignore_nodata->arg : -1;
+			probe.all_bands = ignore_nodata->param1 == "all_bands";
+			probe.options = &options;
+			probes.push_back(probe);
+		}
+		run_probes(options, probes);
+		
+		vector<RasterInfo*> newCandidates;
+		for ( unsigned i = 0, p = 0; i < candidates.size() && p < probes.size(); i++ ) {
+			if ( probes[p].filename != candidates[i]->ri_filename ) {
+				continue;   // raster couldn't be opened
+			}
+			if ( probes[p++].ok ) {
+				newCandidates.push_back(candidates[i]);
+				if ( options.verbose ) {
+					cout<< "\t" << "  " <<candidates[i]->ri_filename<< endl;
+				}
+			}
+		}
+		candidates.swap(newCandidates);
+	}
+	
+	/////////////////////////////////////////////////////////////////
+	// if masks are given, then check that all pixels in features contain actual
+	// data according to the masks:
+	if ( candidates.size() > 0 ) {
+		if ( options.verbose ) {
+			cout<< "--duplicate_pixel: Selecting according to masks, if given:" <<endl;
+		}
+		probes.clear();
+		for ( unsigned i = 0; i < candidates.size(); i++ ) {
+			RasterInfo* rasterInfo = candidates[i];
+			if ( !rasterInfo->ri_mask ) {
+				continue;
+			}
+			Probe probe;
+			probe.raster = rasterInfo->ri_mask;
+			probe.filename = rasterInfo->ri_mask_filename;
+			probe.fp = get_footprint(job, feature, rasterInfo->ri_mask, footprints, &probe.dcol, &probe.drow);
+			probe.mask = true;
+			probe.band_number = 0;
+			probe.all_bands = false;
+			probe.options = &options;
+			probes.push_back(probe);
+		}
+		run_probes(options, probes);
+		
+		vector<RasterInfo*> newCandidates;
+		for ( unsigned i = 0, p = 0; i < candidates.size(); i++ ) {
+			RasterInfo* rasterInfo = candidates[i];
+			if ( !rasterInfo->ri_mask || probes[p++].ok ) {
+				newCandidates.push_back(rasterInfo);
+				if ( options.verbose ) {
+					cout<< "\t" << "  " <<rasterInfo->ri_filename<< endl;
+				}
+			}
+		}
+		candidates.swap(newCandidates);
+	}
+	
+	for ( unsigned i = 0; i < rasters.size(); i++ ) {
+		RasterPool::getPool().release(rasters[i]);
+	}
+	for ( unsigned i = 0; i < footprints.size(); i++ ) {
+		delete footprints[i];
+	}
+}
 
 
 
@@ -370,11 +585,13 @@ static bool within_mask(OGRFeature* feature, RasterInfo* rasterInfo) {
 /**
  * Calls the given extraction function 
  */
-static void do_extraction(OGRFeature* feature, RasterInfo* rasterInfo) {
-
+static void do_extraction(DupPixelJob& job, OGRFeature* feature, RasterInfo* rasterInfo) {
+    ExtractionItem extrItem;
     extrItem.feature = feature;
     extrItem.rasterFilename = rasterInfo->ri_filename;
-    extrFunction(&extrItem);
+    extrItem.data = job.extrData;
+    extrItem.context = &job.context;
+    job.extrFunction(&extrItem);
 }
 		
 
@@ -405,10 +622,12 @@ static bool comparator(RasterInfo* ri1, RasterInfo* ri2) {
  * Applies the duplicate pixel modes to the given feature 
  */
 static void process_modes_feature(
+		DupPixelJob& job,
 		vector<DupPixelMode>& dupPixelModes,
 		OGRFeature* feature, 
 		vector<RasterInfo*>& rastInfos) {
 	
+	const GlobalOptions& options = job.context.options;
 
     // will point to the first "ignore_nodata" mode, if any:
 	DupPixelMode* ignore_nodata = 0;
@@ -423,7 +642,7 @@ static void process_modes_feature(
 		}
 	}
 	
-	if ( globalOptions.verbose ) {
+	if ( options.verbose ) {
         cout<< endl
 		    << "___________________________________________________" <<endl
             << "--duplicate_pixel: FID " <<feature->GetFID()<< endl;
@@ -440,7 +659,7 @@ static void process_modes_feature(
 	///////////////////////////////////////////////////////////////////
 	// --buffer option given?
 	// this operation is IGNORED here -- see traverser.cc
-	if ( globalOptions.bufferParams.given ) {
+	if ( options.bufferParams.given ) {
 		cout<< "--duplicate_pixel: Warning: buffer operation ignored for selection of raster."<<endl;
 		cout<< "     But it will be applied before extraction."<<endl;
 	}
@@ -449,22 +668,27 @@ static void process_modes_feature(
 	/////////////////////////////////////////////////////////////////
 	// initialize candidates with the rasters containing the feature:
 	vector<RasterInfo*> candidates;
-	if ( globalOptions.verbose ) {
+	if ( options.verbose ) {
         cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": Checking " <<rastInfos.size()<< " rasters for containment" <<endl;
 	}
-	for ( unsigned i = 0, numRasters = rastInfos.size(); i < numRasters; i++ ) {
-		RasterInfo* rasterInfo = rastInfos[i];
-		bool containsFeature = false;
+	// (only rasters whose envelope contains the feature's envelope are 
+	// tested for actual containment)
+	OGREnvelope feature_env;
+	feature_geometry->getEnvelope(&feature_env);
+	vector<RasterInfo*> envCandidates;
+	job.footprintIndex.query(feature_env, rastInfos, envCandidates);
+	for ( unsigned i = 0, numRasters = envCandidates.size(); i < numRasters; i++ ) {
+		RasterInfo* rasterInfo = envCandidates[i];
 		if ( rasterInfo->ri_bb->Contains(feature_geometry) ) {
 			candidates.push_back(rasterInfo);
-            if ( globalOptions.verbose ) {
+            if ( options.verbose ) {
                 cout<< "\t" << "  " <<rasterInfo->ri_filename<< endl;
             }
 		}
 	}
 	
 	if ( candidates.size() == 0 ) {
-		if ( globalOptions.verbose ) {
+		if ( options.verbose ) {
 			cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": No raster containing the feature" << endl;
 		}
 		delete feature_center;
@@ -473,64 +697,13 @@ static void process_modes_feature(
     
     
 	///////////////////////////////////////////////////////////////////
-	// ignore_nodata?
-	if ( ignore_nodata ) {
-        // select according to ignore_nodata mode:
-        if ( globalOptions.verbose ) {
-            cout<< "--duplicate_pixel: Selecting according to ignore_nodata mode: "
-                << ignore_nodata->toString() <<endl
-            ;
-        }
-        vector<RasterInfo*> newCandidates;
-        for ( unsigned i = 0, numRasters = candidates.size(); i < numRasters; i++ ) {
-            RasterInfo* rasterInfo = candidates[i];
-            if ( ok_for_nodata(ignore_nodata, feature, rasterInfo) ) {
-                newCandidates.push_back(rasterInfo);
-                if ( globalOptions.verbose ) {
-                    cout<< "\t" << "  " <<rasterInfo->ri_filename<< endl;
-                }
-            }
-        }
-        // update candidates list:
-        candidates.clear();
-        for (unsigned i = 0; i < newCandidates.size(); i++ ) {
-            candidates.push_back(newCandidates[i]);
-        }
-        
-        if ( candidates.size() == 0 ) {
-            if ( globalOptions.verbose ) {
-                cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": No raster containing the feature" << endl;
-            }
-            delete feature_center;
-            return;
-        }
-	}
-
-	/////////////////////////////////////////////////////////////////
-	// if masks are given, then check that all pixels in features contain actual
-    // data according to the masks:
-	if ( globalOptions.verbose ) {
-        cout<< "--duplicate_pixel: Selecting according to masks, if given:" <<endl;
-	}
-    vector<RasterInfo*> newCandidates;
-    for ( unsigned i = 0, numRasters = candidates.size(); i < numRasters; i++ ) {
-        RasterInfo* rasterInfo = candidates[i];
-        if ( !rasterInfo->ri_mask || within_mask(feature, rasterInfo) ) {
-            newCandidates.push_back(rasterInfo);
-            if ( globalOptions.verbose ) {
-                cout<< "\t" << "  " <<rasterInfo->ri_filename<< endl;
-            }
-        }
-    }
-    // update candidates list:
-    candidates.clear();
-    for (unsigned i = 0; i < newCandidates.size(); i++ ) {
-        candidates.push_back(newCandidates[i]);
-    }
+	// ignore_nodata and masks:
+	select_candidates(job, ignore_nodata, feature, candidates);
+	vector<RasterInfo*> newCandidates;
 	
     
 	if ( candidates.size() == 0 ) {
-		if ( globalOptions.verbose ) {
+		if ( options.verbose ) {
 			cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": No raster containing the feature" << endl;
 		}
 		delete feature_center;
@@ -543,7 +716,7 @@ static void process_modes_feature(
 	RasterInfo* selectedRasterInfo = 0;
 	
 	if ( candidates.size() == 1 ) {
-		if ( globalOptions.verbose ) {
+		if ( options.verbose ) {
 			cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": Only one raster contains the feature" << endl;
 			cout<< "   No need to apply duplicate pixel mode(s)" << endl;
 		}
@@ -554,7 +727,7 @@ static void process_modes_feature(
 		// Apply given modes until one candidate is obtained
         // Note that ignore_nodata is handled above, so it's skipped below
 		
-		if ( globalOptions.verbose ) {
+		if ( options.verbose ) {
 			cout<< "--duplicate_pixel: Applying duplicate pixel mode(s) to FID " <<feature->GetFID()<< ": " 
 			    <<candidates.size()<< " initial candidates..." <<endl;
 		}
@@ -574,7 +747,7 @@ static void process_modes_feature(
                 continue;
             }
             
-			if ( globalOptions.verbose ) {
+			if ( options.verbose ) {
 				cout<< "--duplicate_pixel: Applying duplicate pixel mode: " <<mode.code<< " " <<mode.arg<< endl;
 			}
 				
@@ -642,7 +815,7 @@ static void process_modes_feature(
 		selectedRasterInfo = candidates[0];
 		
 		if ( candidates.size() > 1 ) {
-			if ( globalOptions.verbose ) {
+			if ( options.verbose ) {
 				cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": More than one raster satisfy the conditions." << endl;
 				cout<< "   First best candidate will be chosen for extraction." << endl;
 			}
@@ -654,7 +827,7 @@ static void process_modes_feature(
 	delete feature_center;
 	
 	// we have our selected raster:
-	do_extraction(feature, selectedRasterInfo);
+	do_extraction(job, feature, selectedRasterInfo);
 }
 
 
@@ -665,23 +838,31 @@ static void process_modes_feature(
 // Only one raster is chosen (if possible) to get pixel data for the feature.
 //
 int starspan_dup_pixel(
-	Vector* _vect,
+	Vector* vect,
 	vector<const char*> raster_filenames,
 	vector<const char*> *mask_filenames,
-	vector<const char*>* _select_fields,
-	int _layernum,
+	vector<const char*>* select_fields,
+	int layernum,
 	vector<DupPixelMode>& dupPixelModes,
-	void (*_extrFunction)(ExtractionItem* item)
+	void (*extrFunction)(ExtractionItem* item),
+	void* extractionData,
+	const ExtractionContext* context
 ) {
     // Either no masks are given, or the number of rasters and masks are the same:
     assert( mask_filenames == 0 || mask_filenames->size() == raster_filenames.size() );
     
-	vect = _vect;
-	select_fields = _select_fields;
-	layernum = _layernum;
-
-    
-    extrFunction = _extrFunction;
+	DupPixelJob job;
+	job.vect = vect;
+	job.select_fields = select_fields;
+	job.layernum = layernum;
+	job.extrFunction = extrFunction;
+	job.extrData = extractionData;
+	if ( context ) {
+		job.context = *context;
+	}
+	// the layer is read here; the traversals must not reset it:
+	job.context.resetReading = false;
+	const GlobalOptions& options = job.context.options;
 	
 	
 	////////////
@@ -694,9 +875,9 @@ int starspan_dup_pixel(
 	layer->ResetReading();
 	
 	
-	// Open rasters, corresponding bounding boxes, and union of all boxes:
+	// Open rasters, corresponding bounding boxes, and envelope of all boxes:
 	vector<RasterInfo*> rastInfos;
-	OGRGeometry* allRasterArea = new OGRPolygon();
+	OGREnvelope allRasterEnv;
 	
 	int res = 0;
 	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
@@ -706,12 +887,14 @@ int starspan_dup_pixel(
         }
 		RasterInfo* rasterInfo = new RasterInfo(i, raster_filenames[i], mask_filename);
 
-		OGRGeometry* newAllRasterArea = allRasterArea->Union(rasterInfo->ri_bb);
-		delete allRasterArea;
-		allRasterArea = newAllRasterArea;
+		if ( i == 0 )
+			allRasterEnv = rasterInfo->ri_env;
+		else
+			allRasterEnv.Merge(rasterInfo->ri_env);
 		
 		rastInfos.push_back(rasterInfo);
 	}
+	job.footprintIndex.build(rastInfos);
 	
 	
 	// Now, traverse the features:
@@ -720,17 +903,17 @@ int starspan_dup_pixel(
 	//
 	// Was a specific FID given?
 	//
-	if ( globalOptions.FID >= 0 ) {
-		if ( globalOptions.verbose ) {
-			cout<< "--duplicate_pixel: Only to process FID: " <<globalOptions.FID <<endl;
+	if ( options.FID >= 0 ) {
+		if ( options.verbose ) {
+			cout<< "--duplicate_pixel: Only to process FID: " <<options.FID <<endl;
 		}
-		feature = layer->GetFeature(globalOptions.FID);
+		feature = layer->GetFeature(options.FID);
 		if ( !feature ) {
-			cerr<< "FID " <<globalOptions.FID<< " not found in " <<vect->getName()<< endl;
+			cerr<< "FID " <<options.FID<< " not found in " <<vect->getName()<< endl;
 			res = 2;
 			goto end;
 		}
-		process_modes_feature(dupPixelModes, feature, rastInfos);
+		process_modes_feature(job, dupPixelModes, feature, rastInfos);
 		delete feature;
 	}
 	
@@ -745,22 +928,20 @@ int starspan_dup_pixel(
 	// else: process each feature in vector datasource:
 	//
 	else {
-		if ( globalOptions.verbose ) {
+		if ( options.verbose ) {
 			cout<< "--duplicate_pixel: Setting spatial filter" << endl;
 		}
-		layer->SetSpatialFilter(allRasterArea);
+		if ( rastInfos.size() > 0 ) {
+			layer->SetSpatialFilterRect(allRasterEnv.MinX, allRasterEnv.MinY, allRasterEnv.MaxX, allRasterEnv.MaxY);
+		}
 		
 		while( (feature = layer->GetNextFeature()) != NULL ) {
-			process_modes_feature(dupPixelModes, feature, rastInfos);
+			process_modes_feature(job, dupPixelModes, feature, rastInfos);
 			delete feature;
 		}
 	}
 	
 end:
-	if ( allRasterArea ) {
-		delete allRasterArea;
-	}
-	
 	        
 	// release rasters
 	for ( unsigned i = 0; i < rastInfos.size(); i++ ) {
@@ -7,6 +7,7 @@
 
 #include "starspan.h"           
 #include "traverser.h"       
+#include "OutputFile.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +19,10 @@
 // is unknown, and a second one to update it.
 #define LINES_WIDTH 8
 
+// spectra are accumulated up to this size before handing them over 
+// to the data file writer
+#define DATA_BUFFER_SIZE   (1024*1024)
+
 
 // for selection
 struct Field {
@@ -44,8 +49,11 @@ public:
 	bool envi_image;
 	int typeSize;
 	int numBands;
-	FILE* data_file;
+	OutputFile* data_file;
 	FILE* header_file;
+	
+	// pending spectra for data_file
+	string data_buffer;
 	list<Field*>* fields;
 	
 	OGRFeature* currentFeature;
@@ -55,7 +63,7 @@ public:
 	/**
 	  * Initializes the header.
 	  */
-	EnviSlObserver(bool image, int bands, FILE* df, FILE* hf, list<Field*>* fields_)
+	EnviSlObserver(bool image, int bands, OutputFile* df, FILE* hf, list<Field*>* fields_)
 	: envi_image(image), numBands(bands), 
 	  data_file(df), header_file(hf), fields(fields_)
 	{
@@ -198,9 +206,12 @@ public:
 		//
 		// write bands to binary file:
 		//
-		if ( (size_t) numBands != fwrite(band_values, typeSize, numBands, data_file) ) {
-			fprintf(stderr, "Couldn't write pixel\n");
-			exit(1);
+		data_buffer.append((const char*) band_values, typeSize * numBands);
+		if ( data_buffer.size() >= DATA_BUFFER_SIZE ) {
+			if ( !data_file->write(data_buffer) ) {
+				fprintf(stderr, "Couldn't write pixel\n");
+				exit(1);
+			}
 		}
 		
 		
@@ -279,7 +290,11 @@ public:
 		_endHeader();
 		
 		fclose(header_file);
-		fclose(data_file);
+		data_file->write(data_buffer);
+		if ( !data_file->close() ) {
+			fprintf(stderr, "Couldn't write pixel\n");
+		}
+		delete data_file;
 		if ( fields ) {
 			list<Field*>::const_iterator it = fields->begin();
 			for ( ; it != fields->end(); it++ )
@@ -314,7 +329,7 @@ Observer* starspan_gen_envisl(
 	char header_filename[1024];
 	sprintf(header_filename, "%s.hdr", envisl_name);
 	
-	FILE* data_file = fopen(data_filename, "w");
+	OutputFile* data_file = OutputFile::open(data_filename);
 	if ( !data_file ) {
 		fprintf(stderr, "Couldn't create %s\n", data_filename);
 		return 0;
@@ -322,7 +337,7 @@ Observer* starspan_gen_envisl(
 
 	FILE* header_file = fopen(header_filename, "w");
 	if ( !header_file ) {
-		fclose(data_file);
+		delete data_file;
 		fprintf(stderr, "Couldn't create %s\n", header_filename);
 		return 0;
 	}
@@ -337,7 +352,7 @@ Observer* starspan_gen_envisl(
 			field->file = fopen(filename, "w");
 			if ( !field->file ) {
 				fclose(header_file);
-				fclose(data_file);
+				delete data_file;
 				fprintf(stderr, "Couldn't create %s\n", filename);
 				return 0;
 			}
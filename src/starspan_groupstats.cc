@@ -0,0 +1,352 @@
+//
+// STARSpan project
+// starspan_groupstats - stats aggregated by attribute value
+//
+
+#include "starspan.h"
+#include "traverser.h"
+#include "Stats.h"
+#include "NoData.h"
+#include "Csv.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cassert>
+#include <set>
+
+using namespace std;
+
+
+/**
+  * Accumulated state for one value of the group-by field.
+  */
+struct GroupState {
+	// features in the group; a feature may be found in several rasters
+	set<long> FIDs;
+	long numPixels;
+
+	// one accumulator per band
+	vector<StatsAccumulator> bandStats;
+
+	GroupState(unsigned num_bands, bool keep_histogram)
+	: numPixels(0), bandStats(num_bands, StatsAccumulator(keep_histogram)) {}
+};
+
+
+/**
+  * Accumulates the pixels of all features having the same value for a
+  * given field into a single streaming stats state, across all features
+  * and all traversed rasters. Results are written by writeResults(), one
+  * row per group.
+  */
+class GroupStatsObserver : public Observer {
+public:
+	Traverser& tr;
+	GlobalInfo* global_info;
+	Vector* vect;
+	vector<const char*> select_stats;
+	const char* group_field;
+	bool keep_histogram;
+
+	// number of bands, taken from the first traversed raster
+	unsigned num_bands;
+
+	// data type, byte offset in TraversalEvent.bandValues and nodata
+	// value for each band of the current raster
+	vector<GDALDataType> bandTypes;
+	vector<int> bandOffsets;
+	vector<BandNoData> nodata;
+
+	// If some band has a mask or alpha band, the locations and values of
+	// the pixels of the current feature are kept until intersectionEnd,
+	// where the masks are read for all of them at once.
+	bool masked;
+	vector<EPixel> locs;
+	vector<double> pixelValues;
+	vector<unsigned char> mask;
+
+	bool OK;
+
+	// groups in order of the field value
+	map<string, GroupState*> groups;
+
+	// group of current feature
+	GroupState* current;
+
+
+	GroupStatsObserver(Traverser& tr, vector<const char*> select_stats, const char* group_field)
+	: tr(tr), select_stats(select_stats), group_field(group_field)
+	{
+		vect = tr.getVector();
+		global_info = 0;
+		num_bands = 0;
+		current = 0;
+		masked = false;
+		OK = false;
+
+		keep_histogram = false;
+		for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
+			if ( 0 == strcmp(*stat, "mode") || 0 == strcmp(*stat, "median") )
+				keep_histogram = true;
+			else if ( 0 != strcmp(*stat, "avg")
+			&&        0 != strcmp(*stat, "stdev")
+			&&        0 != strcmp(*stat, "min")
+			&&        0 != strcmp(*stat, "max")
+			&&        0 != strcmp(*stat, "sum")
+			&&        0 != strcmp(*stat, "nulls") ) {
+				cerr<< "Unrecognized stats " << *stat<< endl;
+				exit(1);
+			}
+		}
+	}
+
+	~GroupStatsObserver() {
+		for ( map<string, GroupState*>::iterator it = groups.begin(); it != groups.end(); it++ ) {
+			delete it->second;
+		}
+	}
+
+	/**
+	  * returns false. We accumulate the band values as the pixels are visited.
+	  */
+	bool isSimple() {
+		return false;
+	}
+
+	/**
+	  * Called at the beginning of each raster traversal.
+	  */
+	void init(GlobalInfo& info) {
+		global_info = &info;
+		OK = false;
+
+		const unsigned rast_bands = global_info->bands.size();
+		if ( num_bands == 0 ) {
+			num_bands = rast_bands;
+		}
+		else if ( num_bands != rast_bands ) {
+			cerr<< "GroupStats: warning: raster has " <<rast_bands<< " bands but "
+			    <<num_bands<< " were expected; raster skipped" <<endl;
+			return;
+		}
+
+		bandTypes.clear();
+		bandOffsets.clear();
+		nodata.clear();
+		masked = false;
+		int offset = 0;
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			GDALRasterBand* band = global_info->bands[i];
+			GDALDataType bandType = band->GetRasterDataType();
+			bandTypes.push_back(bandType);
+			bandOffsets.push_back(offset);
+			offset += GDALGetDataTypeSize(bandType) >> 3;
+			nodata.push_back(BandNoData(band, globalOptions.nodata));
+			if ( nodata[i].getMaskBand() ) {
+				masked = true;
+			}
+		}
+		OK = true;
+	}
+
+	/**
+	  * selects the group of the feature.
+	  */
+	void intersectionFound(IntersectionInfo& intersInfo) {
+		current = 0;
+		if ( !OK )
+			return;
+
+		OGRFeature* feature = intersInfo.feature;
+		const int i = feature->GetFieldIndex(group_field);
+		if ( i < 0 ) {
+			cerr<< endl << "\tField `" <<group_field<< "' not found" << endl;
+			exit(1);
+		}
+		string key = feature->GetFieldAsString(i);
+
+		map<string, GroupState*>::iterator it = groups.find(key);
+		if ( it == groups.end() ) {
+			current = new GroupState(num_bands, keep_histogram);
+			groups.insert(map<string, GroupState*>::value_type(key, current));
+		}
+		else {
+			current = it->second;
+		}
+		current->FIDs.insert(feature->GetFID());
+		locs.clear();
+		pixelValues.clear();
+	}
+
+	/**
+	  * adds the pixel to the current group. If there are masks, the
+	  * pixel is kept for addMaskedPixels.
+	  */
+	void addPixel(TraversalEvent& ev) {
+		if ( !current )
+			return;
+
+		char* ptr = (char*) ev.bandValues;
+		current->numPixels++;
+		if ( masked ) {
+			locs.push_back(EPixel(ev.pixel.col, ev.pixel.row));
+		}
+		for ( unsigned j = 0; j < num_bands; j++ ) {
+			double value = starspan_extract_double_value(bandTypes[j], ptr + bandOffsets[j]);
+			if ( masked )
+				pixelValues.push_back(value);
+			else if ( !nodata[j].isValid(value) )
+				current->bandStats[j].addNull();
+			else
+				current->bandStats[j].add(value);
+		}
+	}
+
+	/**
+	  * adds the kept pixels to the current group; those masked out in
+	  * a band are nulls in that band.
+	  */
+	void addMaskedPixels() {
+		for ( unsigned j = 0; j < num_bands; j++ ) {
+			mask.clear();
+			if ( nodata[j].getMaskBand() ) {
+				tr.getPixelMaskValuesInBand(j+1, locs, mask);
+			}
+			for ( unsigned k = 0; k < locs.size(); k++ ) {
+				double value = pixelValues[k * num_bands + j];
+				if ( !nodata[j].isValid(value) || (mask.size() > 0 && !mask[k]) )
+					current->bandStats[j].addNull();
+				else
+					current->bandStats[j].add(value);
+			}
+		}
+	}
+
+	void intersectionEnd(IntersectionInfo& intersInfo) {
+		if ( current && masked ) {
+			addMaskedPixels();
+		}
+		current = 0;
+	}
+
+	/**
+	  * writes the results:
+	  *    <group_field>, numFeatures, numPixels, S1_Band1, S1_Band2 ..., S2_Band1, S2_Band2 ...
+	  * where S# is each desired statistics
+	  */
+	void writeResults(OutputFile* file) {
+		CsvOutput csvOut;
+		csvOut.setFile(file);
+		csvOut.setSeparator(globalOptions.delimiter);
+
+		csvOut.startLine();
+		csvOut.addString(group_field).addString("numFeatures").addString("numPixels");
+		for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
+			for ( unsigned j = 0; j < num_bands; j++ ) {
+				csvOut.addField("%s_Band%d", *stat, j+1);
+			}
+		}
+		csvOut.endLine();
+
+		double result[TOT_RESULTS];
+		vector<double> results(num_bands * TOT_RESULTS);
+		for ( map<string, GroupState*>::iterator it = groups.begin(); it != groups.end(); it++ ) {
+			GroupState* group = it->second;
+			if ( group->numPixels == 0 )
+				continue;
+
+			for ( unsigned j = 0; j < num_bands; j++ ) {
+				group->bandStats[j].compute(result);
+				for ( int i = 0; i < TOT_RESULTS; i++ ) {
+					results[i * num_bands + j] = result[i];
+				}
+			}
+
+			csvOut.startLine();
+			csvOut.addString(it->first);
+			csvOut.addInt(group->FIDs.size()).addInt(group->numPixels);
+			for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
+				int s = 0;
+				if ( 0 == strcmp(*stat, "avg") )         s = AVG;
+				else if ( 0 == strcmp(*stat, "mode") )   s = MODE;
+				else if ( 0 == strcmp(*stat, "stdev") )  s = STDEV;
+				else if ( 0 == strcmp(*stat, "min") )    s = MIN;
+				else if ( 0 == strcmp(*stat, "max") )    s = MAX;
+				else if ( 0 == strcmp(*stat, "sum") )    s = SUM;
+				else if ( 0 == strcmp(*stat, "median") ) s = MEDIAN;
+				else                                     s = NULLS;
+
+				for ( unsigned j = 0; j < num_bands; j++ ) {
+					if ( s == NULLS )
+						csvOut.addInt(int(results[s * num_bands + j]));
+					else
+						csvOut.addDouble(results[s * num_bands + j]);
+				}
+			}
+			csvOut.endLine();
+		}
+		csvOut.flush();
+	}
+};
+
+
+//
+// All rasters are traversed with the same observer so the groups
+// accumulate across rasters.
+//
+int starspan_group_stats(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*> select_stats,
+	const char* group_field,
+	const char* csv_filename,
+	int layernum
+) {
+	OutputFile* file = OutputFile::open(csv_filename);
+	if ( !file) {
+		fprintf(stderr, "Cannot create %s\n", csv_filename);
+		return 1;
+	}
+
+	Traverser tr;
+	tr.setVector(vect);
+	tr.setLayerNum(layernum);
+
+	if ( globalOptions.FID >= 0 )
+		tr.setDesiredFID(globalOptions.FID);
+	if ( globalOptions.progress ) {
+		tr.setProgress(globalOptions.progress_perc, cout);
+		cout << "Number of features: ";
+		long psize = vect->getLayer(layernum)->GetFeatureCount();
+		if ( psize >= 0 )
+			cout << psize;
+		else
+			cout << "(not known in advance)";
+		cout<< endl;
+	}
+
+	GroupStatsObserver obs(tr, select_stats, group_field);
+	tr.addObserver(&obs);
+
+	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
+		fprintf(stdout, "%3u: Extracting from %s\n", i+1, raster_filenames[i]);
+		Raster* rast = new Raster(raster_filenames[i]);
+		tr.removeRasters();
+		tr.addRaster(rast);
+
+		tr.traverse();
+
+		if ( globalOptions.report_summary ) {
+			tr.reportSummary();
+		}
+		tr.removeRasters();
+		delete rast;
+	}
+
+	obs.writeResults(file);
+	bool ok = file->close();
+	delete file;
+	cout<< "GroupStats: finished" << endl;
+
+	return ok ? 0 : 1;
+}
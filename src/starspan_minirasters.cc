@@ -7,6 +7,7 @@
 
 #include "starspan.h"           
 #include "traverser.h"       
+#include "WorkerPool.h"
 #include <iostream>
 #include <iomanip>
 #include <cstdlib>
@@ -18,6 +19,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -36,8 +38,13 @@ public:
 	bool first;
 	int mini_col0, mini_row0, mini_col1, mini_row1;
 	
-	// If not null, basic info is added for each created miniraster
+	// If not null, the minirasters are only registered in this list
+	// instead of being created during the traversal
 	vector<MRBasicInfo>* mrbi_list;
+	
+	// true if the minirasters registered in mrbi_list are to be
+	// created by this observer (see deferCreation())
+	bool createRegistered;
     
 	/**
 	  * Creates the observer for this operation. 
@@ -48,6 +55,7 @@ public:
 		global_info = 0;
 		hOutDS = 0;
 		mrbi_list = 0;
+		createRegistered = false;
 	}
 	
 	
@@ -57,13 +65,29 @@ public:
 	  */
 	~MiniRasterObserver() {
 		end();
+		if ( createRegistered ) {
+			delete mrbi_list;
+		}
+	}
+	
+	/**
+	  * Makes the minirasters be registered in an own list and created 
+	  * in batches by starspan_create_minirasters().
+	  */
+	void deferCreation() {
+		mrbi_list = new vector<MRBasicInfo>();
+		createRegistered = true;
 	}
     
     
 	/**
-	  * Nothing done in this class.
+	  * Creates the pending minirasters, if any.
 	  */
 	virtual void end() {
+		if ( createRegistered && mrbi_list->size() > 0 ) {
+			starspan_create_minirasters(prefix, pszOutputSRS, mrbi_list);
+			mrbi_list->clear();
+		}
 	}
 	
 	/**
@@ -114,7 +138,8 @@ public:
 	/** aux to create image filename */
 	static string create_filename(string prefix, long FID) {
 		ostringstream ostr;
-		ostr << prefix << setfill('0') << setw(4) << FID << ".img";
+		ostr << prefix << setfill('0') << setw(4) << FID 
+		     << (globalOptions.mini_raster_vrt ? ".vrt" : ".img");
 		return ostr.str();
 	}
 	static string create_filename_hdr(string prefix, long FID) {
@@ -125,7 +150,8 @@ public:
 
 	/**
 	  * Proper creation of mini-raster with info gathered during traversal
-	  * of the given feature.
+	  * of the given feature. If mrbi_list is given, the miniraster is only
+	  * registered there for the strip generation.
 	  */
 	virtual void intersectionEnd(IntersectionInfo& intersInfo) {
         OGRFeature* feature = intersInfo.feature;
@@ -139,9 +165,7 @@ public:
 		int mini_width = mini_col1 - mini_col0 + 1;  
 		int mini_height = mini_row1 - mini_row0 + 1;
 		
-		// create mini raster
 		long FID = feature->GetFID();
-		string mini_filename = create_filename(prefix, FID);
 		
 		// for parity; by default no parity adjustments:
 		int xsize_incr = 0; 
@@ -190,44 +214,24 @@ public:
         
         Raster* rastr = intersInfo.trv->getRaster(0);
         
-		GDALDatasetH hOutDS = starspan_subset_raster(
-			rastr->getDataset(),
-			mini_col0, mini_row0, mini_width, mini_height,
-			mini_filename.c_str(),
-			pszOutputSRS,
-			xsize_incr, ysize_incr,
-			NULL // nodata -- PENDING
-		);
-		
+		// if only_in_feature, pixels not visited are nullified in the window
+		// as it is written:
+		string mask;
 		if ( globalOptions.only_in_feature ) {
-			double nodata = globalOptions.nodata;
-			
 			if ( globalOptions.verbose )
 				cout<< "nullifying pixels...\n";
 
-			const int nBandCount = GDALGetRasterCount(hOutDS);
-			
-			int num_points = 0;			
+			mask.resize((size_t) mini_width * mini_height);
+			int num_points = 0;
+			size_t k = 0;
 			for ( int row = mini_row0; row <= mini_row1; row++ ) {
-				for ( int col = mini_col0; col <= mini_col1 ; col++ ) {
+				for ( int col = mini_col0; col <= mini_col1 ; col++, k++ ) {
 					if ( intersInfo.trv->pixelVisited(col, row) ) {
+						mask[k] = 1;
 						num_points++;
 					}
-					else {   // nullify:
-						for(int i = 0; i < nBandCount; i++ ) {
-							GDALRasterBand* band = ((GDALDataset *) hOutDS)->GetRasterBand(i+1);
-							band->RasterIO(
-								GF_Write,
-								col - mini_col0, 
-								row - mini_row0,
-								1, 1,              // nXSize, nYSize
-								&nodata,           // pData
-								1, 1,              // nBufXSize, nBufYSize
-								GDT_Float64,       // eBufType
-								0, 0               // nPixelSpace, nLineSpace
-							);
-							
-						}
+					else {
+						mask[k] = 0;
 					}
 				}
 			}
@@ -236,17 +240,41 @@ public:
 		}
 
 		if ( mrbi_list ) {
+			// just register the window; the data is transferred later by
+			// starspan_create_strip or starspan_create_minirasters
             int next_row = 0;   // will remain zero if mrbi_list is empty
             if ( mrbi_list->size() > 0 ) {
                 // get last inserted mrbi:
-                MRBasicInfo mrbi = mrbi_list->back();
+                MRBasicInfo& mrbi = mrbi_list->back();
                 next_row = mrbi.getNextRow() + globalOptions.mini_raster_separation;
             }
             
-			mrbi_list->push_back(MRBasicInfo(FID, mini_filename, mini_width, mini_height, next_row));
+			mrbi_list->push_back(MRBasicInfo(FID, rastr->getDataset()->GetDescription(), 
+				mini_col0, mini_row0, mini_width, mini_height, 
+				xsize_incr, ysize_incr, next_row
+			));
+			mrbi_list->back().mask.swap(mask);
+			
+			if ( createRegistered && mrbi_list->size() >= MINIRASTER_BATCH_SIZE ) {
+				end();
+			}
+		}
+		else {
+			// create mini raster
+			string mini_filename = create_filename(prefix, FID);
+			GDALDatasetH hOutDS = starspan_subset_raster(
+				rastr->getDataset(),
+				mini_col0, mini_row0, mini_width, mini_height,
+				mini_filename.c_str(),
+				pszOutputSRS,
+				xsize_incr, ysize_incr,
+				NULL, // nodata -- PENDING
+				globalOptions.only_in_feature ? mask.data() : NULL,
+				globalOptions.nodata,
+				globalOptions.mini_raster_vrt
+			);
+			GDALClose(hOutDS);
 		}
-		
-		GDALClose(hOutDS);
 		cout<< endl;
 	}
 };
@@ -256,7 +284,114 @@ Observer* starspan_getMiniRasterObserver(
 	const char* prefix,
 	const char* pszOutputSRS 
 ) {	
-	return new MiniRasterObserver(prefix, pszOutputSRS);
+	MiniRasterObserver* obs = new MiniRasterObserver(prefix, pszOutputSRS);
+	if ( globalOptions.num_threads > 1 ) {
+		obs->deferCreation();
+	}
+	return obs;
+}
+
+
+/**
+ * Creates a MiniRasterObserver that only registers the minirasters
+ * in the given list, whose ownership remains the caller's.
+ */
+Observer* starspan_getMiniRasterObserver2(
+	const char* prefix,
+	const char* pszOutputSRS,
+    vector<MRBasicInfo>* mrbi_list
+) {	
+    assert( mrbi_list );
+	MiniRasterObserver* obs = new MiniRasterObserver(prefix, pszOutputSRS);
+	obs->mrbi_list = mrbi_list;
+	return obs;
+}
+
+
+
+/**
+  * Info shared by the workers creating minirasters.
+  */
+struct MiniRasterCreation {
+	string prefix;
+	const char* pszOutputSRS;
+	vector<MRBasicInfo>* mrbi_list;
+	
+	// current source raster of each worker:
+	vector<GDALDatasetH> src_ds;
+	vector<string> src_filenames;
+	
+	// to serialize the opening of source rasters
+	CPLMutex* open_mutex;
+};
+
+/**
+  * Creates the m-th registered miniraster.
+  */
+static void create_miniraster(int m, int w, void* arg) {
+	MiniRasterCreation* mc = (MiniRasterCreation*) arg;
+	const MRBasicInfo& mrbi = (*mc->mrbi_list)[m];
+	
+	// open source raster if different from the current one of this worker:
+	if ( mc->src_filenames[w] != mrbi.raster_filename ) {
+		CPLAcquireMutex(mc->open_mutex, 1000.0);
+		if ( mc->src_ds[w] ) {
+			GDALClose(mc->src_ds[w]);
+		}
+		mc->src_filenames[w] = mrbi.raster_filename;
+		mc->src_ds[w] = GDALOpen(mrbi.raster_filename.c_str(), GA_ReadOnly);
+		if ( !mc->src_ds[w] ) {
+			cerr<< " Unexpected: couldn't read " <<mrbi.raster_filename<< endl;
+		}
+		CPLReleaseMutex(mc->open_mutex);
+	}
+	if ( !mc->src_ds[w] ) {
+		return;
+	}
+	
+	string mini_filename = MiniRasterObserver::create_filename(mc->prefix, mrbi.FID);
+	GDALDatasetH hOutDS = starspan_subset_raster(
+		mc->src_ds[w],
+		mrbi.col0, mrbi.row0, mrbi.width, mrbi.height,
+		mini_filename.c_str(),
+		mc->pszOutputSRS,
+		mrbi.xsize_incr, mrbi.ysize_incr,
+		NULL, // nodata -- PENDING
+		mrbi.mask.size() > 0 ? mrbi.mask.data() : NULL,
+		globalOptions.nodata,
+		globalOptions.mini_raster_vrt
+	);
+	GDALClose(hOutDS);
+}
+
+void starspan_create_minirasters(
+	string prefix,
+	const char* pszOutputSRS,
+    vector<MRBasicInfo>* mrbi_list
+) {
+	WorkerPool pool(min(globalOptions.num_threads, (int) mrbi_list->size()));
+	if ( globalOptions.verbose ) {
+		cout<< "starspan_create_minirasters: creating " <<mrbi_list->size()
+		    << " minirasters with " <<pool.getNumWorkers()<< " workers\n";
+	}
+	
+	MiniRasterCreation mc;
+	mc.prefix = prefix;
+	mc.pszOutputSRS = pszOutputSRS;
+	mc.mrbi_list = mrbi_list;
+	mc.src_ds.resize(pool.getNumWorkers(), NULL);
+	mc.src_filenames.resize(pool.getNumWorkers());
+	mc.open_mutex = CPLCreateMutex();
+	CPLReleaseMutex(mc.open_mutex);    // created acquired
+	
+	pool.run(mrbi_list->size(), create_miniraster, &mc);
+	
+	CPLDestroyMutex(mc.open_mutex);
+	for ( unsigned w = 0; w < mc.src_ds.size(); w++ ) {
+		if ( mc.src_ds[w] ) {
+			GDALClose(mc.src_ds[w]);
+		}
+	}
 }
 
 
@@ -291,8 +426,8 @@ class MiniRasterStripObserver : public MiniRasterObserver {
     bool ownMrbiList;
 	
 public:
-	MiniRasterStripObserver(string bfilename, string prefix)
-	: MiniRasterObserver(prefix, 0),
+	MiniRasterStripObserver(string bfilename)
+	: MiniRasterObserver("", 0),
       basefilename(bfilename), inLayer(0), 
       outVector(0), outLayer(0), 
       ownOutVector(true), // although there is no outVector, actually
@@ -502,7 +637,6 @@ public:
             starspan_create_strip(
                 strip_band_type,
                 strip_bands,
-                prefix,
                 mrbi_list,
                 strip_filename,
                 fid_filename,
@@ -579,10 +713,7 @@ Observer* starspan_getMiniRasterStripObserver(
     
     
     
-    string prefix = basefilename;
-    prefix += "_TMP_PRFX_";
-    
-	MiniRasterStripObserver* obs = new MiniRasterStripObserver(basefilename, prefix.c_str());
+	MiniRasterStripObserver* obs = new MiniRasterStripObserver(basefilename);
     obs->setOutVectorDirectly(outVector, outLayer);
     
 	return obs;
@@ -600,14 +731,13 @@ Observer* starspan_getMiniRasterStripObserver(
  */
 Observer* starspan_getMiniRasterStripObserver2(
 	string basefilename,
-	string prefix,
     Vector* outVector,
     OGRLayer* outLayer,
     vector<MRBasicInfo>* mrbi_list
 ) {	
     assert( mrbi_list );
     
-	MiniRasterStripObserver* obs = new MiniRasterStripObserver(basefilename, prefix);
+	MiniRasterStripObserver* obs = new MiniRasterStripObserver(basefilename);
     
     // observer won't own output vector
     obs->setOutVector(outVector, outLayer); 
@@ -13,47 +13,46 @@
 #include <assert.h>
 
 
-static Vector* vect;
-static vector<const char*>* select_fields;
-static int layernum;
-
-static const char*  mini_prefix;
-static const char*  mini_srs;
-
+// state of a minirasters2 run
+struct MiniRasters2Job {
+	Vector* vect;
+	int layernum;
+	const char* mini_prefix;
+	const char* mini_srs;
+	
+	// if num_threads > 1, the minirasters are registered here 
+	// and created in parallel in batches:
+	vector<MRBasicInfo>* mrbi_list;
+};
 
 
+//
+// item->data is the job
+//
 static void extractFunction(ExtractionItem* item) {
+	MiniRasters2Job* job = (MiniRasters2Job*) item->data;
     
 	// strategy:
-	// - Set globalOptions.FID = feature->GetFID();
-	// - Set list of rasters to only the one given
-	// - Create and initialize a traverser
+	// - Create and initialize a traverser for the feature on the
+	//   given raster only
 	// - Create and register MiniRasterObserver
     // - traverse
 	
-	// - Set globalOptions.FID = feature->GetFID();
-	globalOptions.FID = item->feature->GetFID();
-	
-	// - Set list of rasters to only the one given
-	vector<const char*> raster_filenames;
-	raster_filenames.push_back(item->rasterFilename);
-	
-	// - Create and initialize a traverser
-	bool prevResetReading = Traverser::_resetReading;
-	Traverser::_resetReading = false;
-    
 	Traverser tr;
+	tr.setContext(item->context);
     
-	tr.setVector(vect);
-	tr.setLayerNum(layernum);
+	tr.setVector(job->vect);
+	tr.setLayerNum(job->layernum);
 
     Raster* raster = new Raster(item->rasterFilename);  
     tr.addRaster(raster);
 
-    tr.setDesiredFID(globalOptions.FID);
+    tr.setDesiredFID(item->feature->GetFID());
     
     // - Create and register MiniRasterObserver
-    Observer* obs = starspan_getMiniRasterObserver(mini_prefix, mini_srs);
+    Observer* obs = job->mrbi_list
+        ? starspan_getMiniRasterObserver2(job->mini_prefix, job->mini_srs, job->mrbi_list)
+        : starspan_getMiniRasterObserver(job->mini_prefix, job->mini_srs);
 	tr.addObserver(obs);
 
     // - traverse
@@ -61,11 +60,14 @@ static void extractFunction(ExtractionItem* item) {
     
     tr.releaseObservers();
     
-	Traverser::_resetReading = prevResetReading;
-    
     delete raster;
+    
+    if ( job->mrbi_list && job->mrbi_list->size() >= MINIRASTER_BATCH_SIZE ) {
+        starspan_create_minirasters(job->mini_prefix, job->mini_srs, job->mrbi_list);
+        job->mrbi_list->clear();
+    }
 	
-	if ( globalOptions.verbose ) {
+	if ( item->context->options.verbose ) {
 		cout<< "--starspan_miniraster2: completed." << endl;
 	}
 }
@@ -73,30 +75,45 @@ static void extractFunction(ExtractionItem* item) {
 //
 //
 int starspan_miniraster2(
-	Vector* _vect,
+	Vector* vect,
 	vector<const char*> raster_filenames,
 	vector<const char*> *mask_filenames,
-	vector<const char*>* _select_fields,
-	int _layernum,
+	vector<const char*>* select_fields,
+	int layernum,
 	vector<DupPixelMode>& dupPixelModes,
-    const char*  _mini_prefix,
-    const char*  _mini_srs
+    const char*  mini_prefix,
+    const char*  mini_srs
 ) {
-    vect = _vect;
-    select_fields = _select_fields;
-    layernum = _layernum;
+    MiniRasters2Job job;
+    job.vect = vect;
+    job.layernum = layernum;
+    job.mini_prefix = mini_prefix;
+    job.mini_srs    = mini_srs;
     
-    mini_prefix = _mini_prefix;
-    mini_srs    = _mini_srs;
+    job.mrbi_list = 0;
+    if ( globalOptions.num_threads > 1 ) {
+        job.mrbi_list = new vector<MRBasicInfo>();
+    }
     
-    return starspan_dup_pixel(
+    int res = starspan_dup_pixel(
         vect,
         raster_filenames,
         mask_filenames,
         select_fields,
         layernum,
         dupPixelModes,
-        extractFunction
+        extractFunction,
+        &job
     );
+    
+    if ( job.mrbi_list ) {
+        // create remaining minirasters:
+        if ( job.mrbi_list->size() > 0 ) {
+            starspan_create_minirasters(mini_prefix, mini_srs, job.mrbi_list);
+        }
+        delete job.mrbi_list;
+    }
+    
+    return res;
 }
 
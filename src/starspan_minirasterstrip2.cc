@@ -13,44 +13,41 @@
 #include <assert.h>
 
 
-static Vector* vect;
-static vector<const char*>* select_fields;
-static int layernum;
-                    
-// the common observer while all features are traversed:
-static Observer* obs;
-
+// state of a minirasterstrip2 run
+struct MiniRasterStrip2Job {
+	Vector* vect;
+	int layernum;
+	
+	// the common observer while all features are traversed:
+	Observer* obs;
+};
 
 
+//
+// item->data is the job
+//
 static void mrs_extractFunction(ExtractionItem* item) {
+	MiniRasterStrip2Job* job = (MiniRasterStrip2Job*) item->data;
     
 	// strategy:
-	// - Set globalOptions.FID = feature->GetFID();
-	// - Set list of rasters to only the one given
-	// - Create and initialize a traverser
+	// - Create and initialize a traverser for the feature on the
+	//   given raster only
 	// - Register the common observer
     // - traverse
 	
-	// - Set globalOptions.FID = feature->GetFID();
-	globalOptions.FID = item->feature->GetFID();
-	
-	// - Set list of rasters to only the one given
-	vector<const char*> raster_filenames;
-	raster_filenames.push_back(item->rasterFilename);
-	
-	// - Create and initialize a traverser
 	Traverser tr;
+	tr.setContext(item->context);
     
-	tr.setVector(vect);
-	tr.setLayerNum(layernum);
+	tr.setVector(job->vect);
+	tr.setLayerNum(job->layernum);
 
     Raster raster(item->rasterFilename);  
     tr.addRaster(&raster);
 
-    tr.setDesiredFID(globalOptions.FID);
+    tr.setDesiredFID(item->feature->GetFID());
     
     // - Register the common observer
-	tr.addObserver(obs);
+	tr.addObserver(job->obs);
 
     // - traverse
     tr.traverse();
@@ -59,21 +56,20 @@ static void mrs_extractFunction(ExtractionItem* item) {
 //
 //
 int starspan_minirasterstrip2(
-	Vector* _vect,
+	Vector* vect,
 	vector<const char*> raster_filenames,
 	vector<const char*> *mask_filenames,
-	vector<const char*>* _select_fields,
-	int _layernum,
+	vector<const char*>* select_fields,
+	int layernum,
 	vector<DupPixelMode>& dupPixelModes,
     string mrst_img_filename,
     string mrst_shp_filename,
     string mrst_fid_filename,
     string mrst_glt_filename
 ) {
-    vect = _vect;
-    select_fields = _select_fields;
-    layernum = _layernum;
-
+    MiniRasterStrip2Job job;
+    job.vect = vect;
+    job.layernum = layernum;
     
     Vector* outVector = 0;
     OGRLayer* outLayer = 0;
@@ -119,27 +115,20 @@ int starspan_minirasterstrip2(
     // </shp>
     
     
-    string prefix = mrst_img_filename;
-    prefix += "_TMP_PRFX_";
-    
     // our own list to be updated and used later to create final strip:
     vector<MRBasicInfo> mrbi_list;
 
     // this observer will update outVector/outLayer if any, but won't
     // create any strip -- we will do it after the scan of features below
     // and with the help ow our own list of MRBasicInfo elements:
-    obs = starspan_getMiniRasterStripObserver2(
+    job.obs = starspan_getMiniRasterStripObserver2(
         mrst_img_filename,
-        prefix.c_str(),
         outVector,
         outLayer,
         &mrbi_list
     );
     
     
-	bool prevResetReading = Traverser::_resetReading;
-	Traverser::_resetReading = false;
-
     int res = starspan_dup_pixel(
         vect,
         raster_filenames,
@@ -147,11 +136,10 @@ int starspan_minirasterstrip2(
         select_fields,
         layernum,
         dupPixelModes,
-        mrs_extractFunction
+        mrs_extractFunction,
+        &job
     );
     
-	Traverser::_resetReading = prevResetReading;
-    
     if ( res ) {
         // problems: messages should have been generated.
     }
@@ -170,7 +158,6 @@ int starspan_minirasterstrip2(
             starspan_create_strip(
                 strip_band_type,
                 strip_bands,
-                prefix,
                 &mrbi_list,
                 mrst_img_filename,
                 mrst_fid_filename,
@@ -183,7 +170,7 @@ int starspan_minirasterstrip2(
     if ( outVector ) {
         delete outVector;
     }
-    delete obs;
+    delete job.obs;
     
     
     // Done:
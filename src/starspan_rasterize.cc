@@ -9,42 +9,94 @@
 #include "traverser.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <list>
+
+
+// maximum memory for the tile cache
+#define TILE_CACHE_SIZE  (128*1024*1024)
+
+// desired memory for a tile
+#define TILE_SIZE  (4*1024*1024)
 
 
 /**
-  * This observer extracts from ONE raster
+  * A rectangular piece of the output raster kept in memory.
+  * Pixels are stored band-interleaved-by-pixel.
+  */
+struct RasterizeTile {
+	int index;
+	bool dirty;
+	vector<char> data;
+
+	// position in the LRU list
+	list<RasterizeTile*>::iterator lru_pos;
+};
+
+
+/**
+  * Rasterizes the features.
+  * Burned values go to an in-memory tile cache; tiles are written to
+  * the output raster when evicted (least recently used first) and
+  * at the end.
   */
 class RasterizeObserver : public Observer {
 public:
     RasterizeParams* rasterizeParams;
-    
+
     GlobalInfo* global_info;
-    OGRPolygon* inRasterPoly;
-    
-    // the buffer type and the output band type: 
+
+    // the output band type:
     GDALDataType data_type;
-    short* buffer;
-    
+    int typeSize;
+
+    // what to burn in each band
+    vector<RasterizeBurn> burns;
+    vector<int> burnFieldIndices;
+
+    // values to burn for current feature, in data_type, one per band
+    vector<char> pixelValue;
+
     // output dataset:
     GDALDataset* ds;
-    
-	
+    int width, height;
+    int numBands;
+
+    // tiling
+    int tileWidth, tileHeight;
+    int tilesPerRow, tilesPerColumn;
+    unsigned maxTiles;
+    vector<RasterizeTile*> tiles;       // by tile index; NULL if not in memory
+    vector<bool> written;               // tile already written to ds
+    list<RasterizeTile*> lru;           // most recently used first
+    RasterizeTile* lastTile;
+
+    // value for pixels not burned
+    double fillValue;
+
+
 	/**
 	  * Creates a rasterizer
 	  */
 	RasterizeObserver(RasterizeParams* rasterizeParams)
     : rasterizeParams(rasterizeParams)
 	{
+        ds = 0;
+        lastTile = 0;
+        burns = rasterizeParams->burns;
+        if ( burns.size() == 0 ) {
+            burns.push_back(RasterizeBurn(RasterizeBurn::VALUE, rasterizeParams->rastValue));
+        }
 	}
-	
+
 	/**
+	  * Determines the output type, creates the output raster and
+	  * sets up the tile cache.
 	  */
 	void init(GlobalInfo& info) {
 		global_info = &info;
-		
-        inRasterPoly = &info.rasterPoly;
-        
+
         // start output raster:
 		GDALDriver* hDriver = GetGDALDriverManager()->GetDriverByName(rasterizeParams->rastFormat);
 		if( hDriver == NULL ) {
@@ -52,102 +104,299 @@ public:
 			return;
 		}
 		// the dimensions for output raster:
-		int width =  info.width ;		
-		int height = info.height;
-        
-        /////////////////////////////////////////////////////////////////////
-		// allocate transfer buffer with enough space for the longest row and type:	
-		const long ints = (long) width ;
-		if ( globalOptions.verbose ) {
-			cout<< "Allocating " <<ints<< " short integers for buffer\n";
-		}
-		buffer = new short[ints];
-		if ( !buffer ) {
-			cerr<< " Cannot allocate " <<ints<< " elements for buffer\n";
-			return;
-		}
-		
+		width =  info.width ;
+		height = info.height;
+		numBands = burns.size();
+
         //////////////////////////////////////////////
-        // data_type: the buffer type and the output band type: 
-        if ( rasterizeParams->rastValue <= 255 ) {
-            data_type = GDT_Byte;
-            unsigned char* bytes = (unsigned char*) buffer; 
-            for ( int i = 0; i < ints; i++ ) {
-                bytes[i] = (unsigned char) rasterizeParams->rastValue;
+        // data_type: the output band type, enough for all burned values:
+        data_type = GDT_Byte;
+        // (fields of the layer being traversed, eg., the result of --sql)
+        OGRFeatureDefn* poDefn = info.layer->GetLayerDefn();
+        burnFieldIndices.clear();
+        for ( unsigned b = 0; b < burns.size(); b++ ) {
+            GDALDataType type = GDT_Byte;
+            int fieldIndex = -1;
+            switch ( burns[b].kind ) {
+                case RasterizeBurn::VALUE:
+                    if ( burns[b].value != (int) burns[b].value )
+                        type = GDT_Float64;
+                    else if ( burns[b].value < -32768 || burns[b].value > 32767 )
+                        type = GDT_Int32;
+                    else if ( burns[b].value < 0 || burns[b].value > 255 )
+                        type = GDT_Int16;
+                    break;
+                case RasterizeBurn::FID:
+                    type = GDT_Int32;
+                    break;
+                case RasterizeBurn::FIELD:
+                    fieldIndex = poDefn->GetFieldIndex(burns[b].field);
+                    if ( fieldIndex < 0 ) {
+                        cerr<< "Field `" <<burns[b].field<< "' not found" << endl;
+                        return;
+                    }
+                    if ( poDefn->GetFieldDefn(fieldIndex)->GetType() == OFTInteger )
+                        type = GDT_Int32;
+                    else if ( poDefn->GetFieldDefn(fieldIndex)->GetType() == OFTReal )
+                        type = GDT_Float64;
+                    else {
+                        cerr<< "Field `" <<burns[b].field<< "' is not numeric" << endl;
+                        return;
+                    }
+                    break;
             }
+            burnFieldIndices.push_back(fieldIndex);
+            data_type = widerType(data_type, type);
         }
-        else {
-            data_type = GDT_Int16;
-            short* shorts = (short*) buffer; 
-            for ( int i = 0; i < ints; i++ ) {
-                shorts[i] = (short) rasterizeParams->rastValue;
-            }
-        }        
-        
+        typeSize = GDALGetDataTypeSize(data_type) >> 3;
+        pixelValue.resize(numBands * typeSize);
+
         /////////////////////////////////////////////////////////////////////
 		// create raster:
 		ds = hDriver->Create(
-			rasterizeParams->outRaster_filename, width, height, 1 /*bands*/, 
-			data_type, 
-			NULL   /*papszOptions*/ 
+			rasterizeParams->outRaster_filename.c_str(), width, height, numBands,
+			data_type,
+			NULL   /*papszOptions*/
 		);
 		if ( !ds ) {
-			delete buffer;
 			cerr<< "Couldn't create " <<rasterizeParams->outRaster_filename<< endl;
 			return;
 		}
-        
+
         if ( rasterizeParams->projection ) {
             ds->SetProjection(rasterizeParams->projection);
         }
         ds->SetGeoTransform(rasterizeParams->geoTransform);
-        
+
+        fillValue = 0;
         if ( rasterizeParams->fillNoData ) {
-            // fill with globalOptions.nodata
-            ds->GetRasterBand(1)->Fill(globalOptions.nodata);
+            // fill with globalOptions.nodata. Tiles are initialized with
+            // this value, and the tiles not burned are written in end(),
+            // so each pixel is written only once.
+            fillValue = globalOptions.nodata;
+        }
+
+        /////////////////////////////////////////////////////////////////////
+        // tiles: multiples of the native block size; whole rows
+        // for scanline oriented formats
+        int blockXSize, blockYSize;
+        ds->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+        const long pixelBytes = (long) numBands * typeSize;
+        if ( blockXSize >= width ) {
+            tileWidth = width;
+            tileHeight = (int) max(1L, TILE_SIZE / (pixelBytes * width));
+        }
+        else {
+            tileWidth = max(blockXSize, 256 / blockXSize * blockXSize);
+            tileHeight = max(blockYSize, 256 / blockYSize * blockYSize);
+        }
+        tileHeight = min(tileHeight, height);
+        tilesPerRow = (width + tileWidth - 1) / tileWidth;
+        tilesPerColumn = (height + tileHeight - 1) / tileHeight;
+        maxTiles = (unsigned) max(2L, TILE_CACHE_SIZE / (pixelBytes * tileWidth * tileHeight));
+
+        tiles.assign((size_t) tilesPerRow * tilesPerColumn, (RasterizeTile*) 0);
+        written.assign(tiles.size(), false);
+        lru.clear();
+        lastTile = 0;
+
+        if ( globalOptions.verbose ) {
+            cout<< "Rasterize: " <<numBands<< " band(s) of type " <<GDALGetDataTypeName(data_type)
+                << "; tiles of " <<tileWidth<< " x " <<tileHeight
+                << "; up to " <<maxTiles<< " tiles in memory\n";
         }
-        
 	}
-	
-    
+
+
     /** don't need pixel values */
     bool isSimple(void) { return true; }
 
+    /**
+      * Gets the values to burn for the feature.
+      */
+    void intersectionFound(IntersectionInfo& intersInfo) {
+        if ( !ds )
+            return;
+        OGRFeature* feature = intersInfo.feature;
+        for ( int b = 0; b < numBands; b++ ) {
+            double value;
+            switch ( burns[b].kind ) {
+                case RasterizeBurn::FID:
+                    value = feature->GetFID();
+                    break;
+                case RasterizeBurn::FIELD:
+                    value = feature->GetFieldAsDouble(burnFieldIndices[b]);
+                    break;
+                default:
+                    value = burns[b].value;
+            }
+            GDALCopyWords(&value, GDT_Float64, 0, &pixelValue[b * typeSize], data_type, 0, 1);
+        }
+    }
+
 	/**
-	  * Puts a rastValue to the given pixel.
+	  * Puts the values of the feature to the given pixel.
 	  */
-	void addPixel(TraversalEvent& ev) { 
+	void addPixel(TraversalEvent& ev) {
+		if ( !ds )
+			return;
+
 		int col = ev.pixel.col;
 		int row = ev.pixel.row;
-		
-        ds->RasterIO(GF_Write,
-            col,               //nXOff,
-            row,               //nYOff,
-            1,                 //nXSize,
-            1,                 //nYSize,
-            buffer,            //pData,
-            1,                 //nBufXSize,
-            1,                 //nBufYSize,
-            data_type,         //eBufType,
-            1,                 //nBandCount,
-            NULL,              //panBandMap,
-            0,                 //nPixelSpace,
-            0,                 //nLineSpace,
-            0                  //nBandSpace
-        );  	
+		if ( col < 0 || col >= width || row < 0 || row >= height ) {
+			return;
+		}
+
+		const int tileCol = col / tileWidth;
+		const int tileRow = row / tileHeight;
+		const int index = tileRow * tilesPerRow + tileCol;
+
+		RasterizeTile* tile = lastTile;
+		if ( !tile || tile->index != index ) {
+			tile = getTile(index);
+			lastTile = tile;
+		}
+
+		const long offset = ((long) (row - tileRow * tileHeight) * tileWidth + (col - tileCol * tileWidth)) * pixelValue.size();
+		memcpy(&tile->data[offset], &pixelValue[0], pixelValue.size());
+		tile->dirty = true;
 	}
 
 	/**
-	  * Closes generated raster.
+	  * Writes pending tiles and closes generated raster.
 	  */
 	void end() {
+		if ( !ds )
+			return;
+
+		for ( list<RasterizeTile*>::iterator it = lru.begin(); it != lru.end(); it++ ) {
+			writeTile(*it);
+			delete *it;
+		}
+		lru.clear();
+
+		if ( rasterizeParams->fillNoData ) {
+			// write the fill value to the tiles not burned:
+			RasterizeTile fill;
+			fill.data.resize(pixelValue.size() * tileWidth * tileHeight);
+			initTile(&fill);
+			for ( unsigned index = 0; index < written.size(); index++ ) {
+				if ( !written[index] ) {
+					fill.index = index;
+					fill.dirty = true;
+					writeTile(&fill);
+				}
+			}
+		}
+		tiles.clear();
+		lastTile = 0;
+
 		if ( globalOptions.verbose ) {
 			cout<< "Closing generated raster\n";
 		}
         delete ds;
+        ds = 0;
         cout<< "Done.\n";
     }
 
+private:
+
+    // a type that can hold values of the two given types
+    static GDALDataType widerType(GDALDataType a, GDALDataType b) {
+        // GDT_Byte < GDT_Int16 < GDT_Int32 < GDT_Float64
+        static const GDALDataType order[] = { GDT_Byte, GDT_Int16, GDT_Int32, GDT_Float64 };
+        int ia = 0, ib = 0;
+        for ( int i = 0; i < 4; i++ ) {
+            if ( order[i] == a ) ia = i;
+            if ( order[i] == b ) ib = i;
+        }
+        return order[max(ia, ib)];
+    }
+
+    // gets the window of a tile
+    void getTileWindow(int index, int* xoff, int* yoff, int* xsize, int* ysize) {
+        *xoff = (index % tilesPerRow) * tileWidth;
+        *yoff = (index / tilesPerRow) * tileHeight;
+        *xsize = min(tileWidth, width - *xoff);
+        *ysize = min(tileHeight, height - *yoff);
+    }
+
+    // transfers the tile data from/to the output raster
+    void tileIO(GDALRWFlag rwFlag, RasterizeTile* tile) {
+        int xoff, yoff, xsize, ysize;
+        getTileWindow(tile->index, &xoff, &yoff, &xsize, &ysize);
+        const int pixelSpace = pixelValue.size();
+        CPLErr err = ds->RasterIO(rwFlag,
+            xoff, yoff, xsize, ysize,
+            &tile->data[0],
+            xsize, ysize,
+            data_type,
+            numBands, NULL,
+            pixelSpace,                  // nPixelSpace
+            pixelSpace * tileWidth,      // nLineSpace
+            typeSize                     // nBandSpace
+        );
+        if ( err != CE_None ) {
+            cerr<< "Rasterize: error " <<(rwFlag == GF_Write ? "writing" : "reading")
+                << " tile at (" <<xoff<< "," <<yoff<< ")" << endl;
+        }
+    }
+
+    void writeTile(RasterizeTile* tile) {
+        if ( tile->dirty ) {
+            tileIO(GF_Write, tile);
+            written[tile->index] = true;
+            tile->dirty = false;
+        }
+    }
+
+    // sets all pixels of the tile to the fill value
+    void initTile(RasterizeTile* tile) {
+        vector<char> fill(pixelValue.size());
+        for ( int b = 0; b < numBands; b++ ) {
+            GDALCopyWords(&fillValue, GDT_Float64, 0, &fill[b * typeSize], data_type, 0, 1);
+        }
+        const long pixels = (long) tileWidth * tileHeight;
+        for ( long p = 0; p < pixels; p++ ) {
+            memcpy(&tile->data[p * fill.size()], &fill[0], fill.size());
+        }
+    }
+
+    // gets a tile, loading it if necessary
+    RasterizeTile* getTile(int index) {
+        RasterizeTile* tile = tiles[index];
+        if ( tile ) {
+            // move to front of LRU list
+            lru.splice(lru.begin(), lru, tile->lru_pos);
+            return tile;
+        }
+
+        if ( lru.size() >= maxTiles ) {
+            // reuse least recently used tile
+            tile = lru.back();
+            lru.pop_back();
+            writeTile(tile);
+            tiles[tile->index] = 0;
+        }
+        else {
+            tile = new RasterizeTile();
+            tile->data.resize(pixelValue.size() * tileWidth * tileHeight);
+        }
+        tile->index = index;
+        tile->dirty = false;
+
+        if ( written[index] ) {
+            tileIO(GF_Read, tile);
+        }
+        else {
+            initTile(tile);
+        }
+
+        lru.push_front(tile);
+        tile->lru_pos = lru.begin();
+        tiles[index] = tile;
+        return tile;
+    }
 };
 
 
@@ -8,6 +8,8 @@
 #include "starspan.h"           
 #include "traverser.h"       
 #include "Stats.h"       
+#include "NoData.h"
+#include "Sampling.h"
 #include "Csv.h"
 
 #include <iostream>
@@ -26,11 +28,11 @@ public:
 	Traverser& tr;
 	GlobalInfo* global_info;
 	Vector* vect;
-	FILE* file;
+	OutputFile* file;
 	vector<const char*> select_stats;
 	vector<const char*>* select_fields;
 	const char* raster_filename;
-	string RID;  //  will be used only if globalOptions.RID != "none".
+	string RID;  //  will be used only if tr.getOptions().RID != "none".
 	
 	// if all bands are of integral type, then tr.getPixelIntegerValuesInBand
 	// is used; else tr.getPixelDoubleValuesInBand is used.
@@ -39,6 +41,18 @@ public:
 	Stats stats;
 	double* result_stats[TOT_RESULTS];
 	
+	// nodata handling for each band
+	vector<BandNoData> nodata;
+	
+	// validity of the pixel values (see computeResults)
+	vector<unsigned char> valid;
+	vector<unsigned char> mask;
+	
+	// for --approx: number of pixels actually read and half-width
+	// of the confidence interval of the average for each band
+	unsigned num_sampled;
+	vector<double> ci_avg;
+	
 	bool write_header;
 	bool closeFile;
 	bool releaseStats;
@@ -49,13 +63,16 @@ public:
 	// last processed FID (this value "survives" last_feature)
 	long last_FID;
 	
+	// if not null, a copy of the results for each feature is kept here
+	map<long, double**>* collected;
+	
 	CsvOutput csvOut;
 
 
 	/**
 	  * Creates a stats calculator
 	  */
-	StatsObserver(Traverser& tr, FILE* f, vector<const char*> select_stats,
+	StatsObserver(Traverser& tr, OutputFile* f, vector<const char*> select_stats,
 		vector<const char*>* select_fields
 	) : tr(tr), file(f), select_stats(select_stats), select_fields(select_fields)
 	{
@@ -78,6 +95,7 @@ public:
 
 		last_FID = -1;
 		last_feature = 0;
+		collected = 0;
 		
 		for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
 			if ( 0 == strcmp(*stat, "avg") )
@@ -112,13 +130,16 @@ public:
 	
 	/**
 	  * finalizes current feature if any; 
+	  * writes any pending output;
 	  * closes the file if closeFile is true;
 	  * releases the result_stats arrays if releaseStats is true
 	  */
 	void end() {
 		finalizePreviousFeatureIfAny();
+		csvOut.flush();
 		if ( closeFile && file ) {
-			fclose(file);
+			file->close();
+			delete file;
 			cout<< "Stats: finished" << endl;
 			file = 0;
 		}
@@ -146,7 +167,9 @@ public:
 	  * If write_header is true, it creates first line with 
 	  * column headers:
 	  *    FID, {vect-attrs}, RID, numPixels, S1_Band1, S1_Band2 ..., S2_Band1, S2_Band2 ...
-	  * where S# is each desired statistics
+	  * where S# is each desired statistics.
+	  * With --approx, a numSampled column is added after numPixels, and
+	  * ci_avg_Band1, ci_avg_Band2 ... columns at the end.
 	  */
 	void init(GlobalInfo& info) {
 		global_info = &info;
@@ -159,7 +182,7 @@ public:
 		}
 
 		csvOut.setFile(file);
-		csvOut.setSeparator(globalOptions.delimiter);
+		csvOut.setSeparator(tr.getOptions().delimiter);
 		csvOut.startLine();
 		
 		//		
@@ -192,7 +215,7 @@ public:
 			
 			
 			// RID column, if to be included
-			if ( globalOptions.RID != "none" ) {
+			if ( tr.getOptions().RID != "none" ) {
 				csvOut.addString(RID_colName);
 				//fprintf(file, ",RID");
 			}
@@ -200,6 +223,9 @@ public:
 			// Create numPixels field
 			csvOut.addString("numPixels");
 			//fprintf(file, ",numPixels");
+			if ( tr.getOptions().approxParams.given ) {
+				csvOut.addString("numSampled");
+			}
 			
 			// Create fields for bands
 			for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
@@ -208,15 +234,28 @@ public:
 					//fprintf(file, ",%s_Band%d", *stat, i+1);
 				}
 			}	
+			if ( tr.getOptions().approxParams.given ) {
+				for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
+					csvOut.addField("ci_avg_Band%d", i+1);
+				}
+			}
 			csvOut.endLine();
 			//fprintf(file, "\n");
 		}
 		
 		// allocate space for all possible results
 		for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
+			if ( result_stats[i] )
+				delete[] result_stats[i];
 			result_stats[i] = new double[global_info->bands.size()];
 		}
 		
+		// nodata for each band of this raster
+		nodata.clear();
+		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
+			nodata.push_back(BandNoData(global_info->bands[i], tr.getOptions().nodata));
+		}
+		
 		// assume integer bands:
 		get_integer = true;
 		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
@@ -228,30 +267,149 @@ public:
 		}		
 		
 		// prepare RID
-		if ( globalOptions.RID != "none" ) {
+		if ( tr.getOptions().RID != "none" ) {
 			RID = raster_filename;
-			if ( globalOptions.RID == "file" ) {
+			if ( tr.getOptions().RID == "file" ) {
 				starspan_simplify_filename(RID);
 			}
 		}
 	}
 	
 
+	/**
+	  * Gets the validity of the values of band j (0-based) according
+	  * to its nodata value and, if any, its mask band.
+	  */
+	template <class T>
+	void computeValidity(unsigned j, vector<T>& values, const vector<EPixel>* locs = 0) {
+		nodata[j].markValid(values, valid);
+		if ( nodata[j].getMaskBand() ) {
+			mask.clear();
+			if ( locs )
+				tr.getPixelMaskValuesInBand(j+1, *locs, mask);
+			else
+				tr.getPixelMaskValuesInBand(j+1, mask);
+			BandNoData::applyMask(mask, valid);
+		}
+	}
+
+	/**
+	  * reads the values of band j (0-based) at the sampled pixels, from
+	  * the one in position from on, and their validity into valid.
+	  */
+	void readSample(unsigned j, StratifiedSample& sample, vector<EPixel>& all_locs,
+		unsigned from, vector<EPixel>& locs, vector<double>& values
+	) {
+		const vector<unsigned>& indices = sample.getIndices();
+		locs.clear();
+		for ( unsigned k = from; k < indices.size(); k++ ) {
+			locs.push_back(all_locs[indices[k]]);
+		}
+		values.clear();
+		tr.getPixelDoubleValuesInBand(j+1, locs, values);
+		computeValidity(j, values, &locs);
+	}
+
+	/**
+	  * --approx: estimates the results from a stratified random sample
+	  * of the pixels. A pilot sample gives the coefficient of variation
+	  * of each band, from which the sample size is determined according
+	  * to the target relative error of the average. The average (with
+	  * its confidence interval), sum and nulls are estimates for the 
+	  * whole feature; min, max, stdev, median and mode are those of the
+	  * sample.
+	  */
+	void computeResultsApprox(void) {
+		const unsigned pilot_size = 64;
+		const unsigned num_strata = 16;
+		const double rel_error = tr.getOptions().approxParams.rel_error;
+		const double z = StratifiedSample::normalQuantile(tr.getOptions().approxParams.confidence);
+		const unsigned num_bands = global_info->bands.size();
+		
+		vector<EPixel> all_locs;
+		tr.getPixelLocations(all_locs);
+		const unsigned N = all_locs.size();
+		
+		// the FID as seed makes the selection reproducible:
+		StratifiedSample sample(N, num_strata, (unsigned long) last_feature->GetFID());
+		sample.extend(pilot_size);
+
+		vector<EPixel> locs;
+		vector<double> values;
+		
+		// pilot values and validity of the bands, kept for the final pass:
+		const unsigned pilot_n = sample.getIndices().size();
+		vector<vector<double> > pilot_values(num_bands);
+		vector<vector<unsigned char> > pilot_valid(num_bands);
+		
+		// required sample size:
+		Stats pilot;
+		pilot.include[MODE] = pilot.include[MEDIAN] = false;
+		unsigned n = pilot_n;
+		for ( unsigned j = 0; j < num_bands && n < N; j++ ) {
+			readSample(j, sample, all_locs, 0, locs, values);
+			pilot_values[j] = values;
+			pilot_valid[j] = valid;
+			// a band with no valid pilot values, or with a zero mean (for
+			// which the relative error is undefined), does not determine
+			// the sample size; otherwise it would force a full read:
+			if ( pilot.compute(values, valid) == 0 || pilot.result[AVG] == 0 )
+				continue;
+			double cv = pilot.result[STDEV] / fabs(pilot.result[AVG]);
+			unsigned n_j = StratifiedSample::requiredSize(cv, rel_error, z, N);
+			if ( n < n_j )
+				n = n_j;
+		}
+		sample.extend(n);
+		num_sampled = sample.getIndices().size();
+		
+		for ( unsigned j = 0; j < num_bands; j++ ) {
+			// the pilot pixels of the band, if read above, are not read again:
+			if ( pilot_values[j].size() > 0 ) {
+				readSample(j, sample, all_locs, pilot_n, locs, values);
+				values.insert(values.begin(), pilot_values[j].begin(), pilot_values[j].end());
+				valid.insert(valid.begin(), pilot_valid[j].begin(), pilot_valid[j].end());
+			}
+			else {
+				readSample(j, sample, all_locs, 0, locs, values);
+			}
+			stats.compute(values, valid);
+			for ( int i = 0; i < TOT_RESULTS; i++ ) {
+				result_stats[i][j] = stats.result[i]; 
+			}
+			
+			// the sample is self-weighting, but use the stratified estimator 
+			// for the average and its confidence interval:
+			double mean, half_width;
+			sample.estimateMean(values, valid, z, &mean, &half_width);
+			result_stats[AVG][j] = mean;
+			ci_avg[j] = half_width;
+			
+			// scale counts to the whole feature:
+			double nulls = floor(stats.result[NULLS] * N / num_sampled + 0.5);
+			result_stats[NULLS][j] = nulls;
+			result_stats[SUM][j] = mean * (N - nulls);
+		}
+	}
+
 	/**
 	  * compute all results from current list of pixels.
 	  * Desired results are reported by finalizePreviousFeatureIfAny.
 	  */
 	void computeResults(void) {
-		if ( get_integer ) {
+		num_sampled = tr.getPixelSetSize();
+		ci_avg.assign(global_info->bands.size(), 0.0);
+		
+		if ( tr.getOptions().approxParams.given && num_sampled > 2 * 64 ) {
+			computeResultsApprox();
+		}
+		else if ( get_integer ) {
 			vector<int> values;
 			for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
 				values.clear();
 				tr.getPixelIntegerValuesInBand(j+1, values);
-				if (!globalOptions.nodata) {
-					double nodata = global_info->bands[j]->GetNoDataValue();
-					globalOptions.nodata = nodata;
-				} 
-				stats.compute(values, int(globalOptions.nodata));
+				computeValidity(j, values);
+				stats.compute(values, valid);
 				for ( int i = 0; i < TOT_RESULTS; i++ ) {
 					result_stats[i][j] = stats.result[i]; 
 				}
@@ -262,11 +420,8 @@ public:
 			for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
 				values.clear();
 				tr.getPixelDoubleValuesInBand(j+1, values);
-				if (!globalOptions.nodata) {
-					double nodata = global_info->bands[j]->GetNoDataValue();
-					globalOptions.nodata = nodata;
-				} 
-				stats.compute(values, globalOptions.nodata);
+				computeValidity(j, values);
+				stats.compute(values, valid);
 				for ( int i = 0; i < TOT_RESULTS; i++ ) {
 					result_stats[i][j] = stats.result[i]; 
 				}
@@ -283,7 +438,7 @@ public:
 		
 		
 		if ( 0 == tr.getPixelSetSize() ) {
-			if ( globalOptions.verbose ) {
+			if ( tr.getOptions().verbose ) {
 				cout<< "No intersecting pixels actually found for previous FID: " <<last_feature->GetFID()<< endl;
 			}
 			delete last_feature;
@@ -293,11 +448,24 @@ public:
 		
 		computeResults();
  
+		if ( collected ) {
+			const unsigned num_bands = global_info->bands.size();
+			double** results = new double*[TOT_RESULTS];
+			for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
+				results[i] = new double[num_bands];
+				memcpy(results[i], result_stats[i], num_bands * sizeof(double));
+			}
+			double**& prev = (*collected)[last_feature->GetFID()];
+			if ( prev ) {
+				starspan_releaseFeatureStats(prev);
+			}
+			prev = results;
+		}
 
 
 		if ( file ) {
 			// Add FID value:
-			csvOut.addField("%ld", last_feature->GetFID());
+			csvOut.addInt(last_feature->GetFID());
 			//fprintf(file, "%ld", last_feature->GetFID());
 	
 			// add attribute fields from source feature to record:
@@ -324,64 +492,67 @@ public:
 			}
 			
 			// add RID field
-			if ( globalOptions.RID != "none" ) {
+			if ( tr.getOptions().RID != "none" ) {
 				csvOut.addString(RID);
 				//fprintf(file, ",%s", RID.c_str());
 			}
 			
 			
 			// Add numPixels value:
-			csvOut.addField("%d", tr.getPixelSetSize());
+			csvOut.addInt(tr.getPixelSetSize());
 			//fprintf(file, ",%d", tr.getPixelSetSize());
+			if ( tr.getOptions().approxParams.given ) {
+				csvOut.addUInt(num_sampled);
+			}
 			
 			// report desired results:
 			// (desired list is traversed to keep order according to column headers)
 			for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
 				if ( 0 == strcmp(*stat, "avg") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[AVG][j]);
+						csvOut.addDouble(result_stats[AVG][j]);
 						//fprintf(file, ",%f", result_stats[AVG][j]);
 					}
 				}
 				else if ( 0 == strcmp(*stat, "mode") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MODE][j]);
+						csvOut.addDouble(result_stats[MODE][j]);
 						//fprintf(file, ",%f", result_stats[MODE][j]);
 					}
 				}
 				else if ( 0 == strcmp(*stat, "stdev") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[STDEV][j]);
+						csvOut.addDouble(result_stats[STDEV][j]);
 						//fprintf(file, ",%f", result_stats[STDEV][j]);
 					}
 				}
 				else if ( 0 == strcmp(*stat, "min") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MIN][j]);
+						csvOut.addDouble(result_stats[MIN][j]);
 						//fprintf(file, ",%f", result_stats[MIN][j]);
 					}
 				}
 				else if ( 0 == strcmp(*stat, "max") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MAX][j]);
+						csvOut.addDouble(result_stats[MAX][j]);
 						//fprintf(file, ",%f", result_stats[MAX][j]);
 					}
 				}
 				else if ( 0 == strcmp(*stat, "sum") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[SUM][j]);
+						csvOut.addDouble(result_stats[SUM][j]);
 						//fprintf(file, ",%f", result_stats[SUM][j]);
 					}
 				}
 				else if ( 0 == strcmp(*stat, "median") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MEDIAN][j]);
+						csvOut.addDouble(result_stats[MEDIAN][j]);
 						//fprintf(file, ",%f", result_stats[MEDIAN][j]);
 					}
 				}
 				else if ( 0 == strcmp(*stat, "nulls") ) {
 					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%d", int(result_stats[NULLS][j]) );
+						csvOut.addInt(int(result_stats[NULLS][j]) );
 						//fprintf(file, ",%d", int(result_stats[NULLS][j]) );
 					}
 				}
@@ -390,6 +561,11 @@ public:
 					exit(1);
 				}
 			}
+			if ( tr.getOptions().approxParams.given ) {
+				for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
+					csvOut.addDouble(ci_avg[j]);
+				}
+			}
 			csvOut.endLine();
 			//fprintf(file, "\n");
 		}
@@ -431,7 +607,7 @@ Observer* starspan_getStatsObserver(
 	const char* filename
 ) {
 	// create output file
-	FILE* file = fopen(filename, "w");
+	OutputFile* file = OutputFile::open(filename);
 	if ( !file ) {
 		cerr<< "Couldn't create "<< filename << endl;
 		return 0;
@@ -455,7 +631,7 @@ double** starspan_getFeatureStats(
 
     double** result_stats = 0;
     
-	FILE* file = 0;
+	OutputFile* file = 0;
 	vector<const char*> select_fields;
 	StatsObserver* statsObs = new StatsObserver(tr, file, select_stats, &select_fields);
 	if ( statsObs ) {
@@ -488,7 +664,7 @@ double** starspan_getFeatureStatsByField(
 	tr.addRaster(rast);
 	tr.setDesiredFeatureByField(field_name, field_value);
 
-	FILE* file = 0;
+	OutputFile* file = 0;
 	vector<const char*> select_fields; // empty means don't select any fields.
 	StatsObserver* statsObs = new StatsObserver(tr, file, select_stats, &select_fields);
 	if ( !statsObs )
@@ -511,6 +687,44 @@ double** starspan_getFeatureStatsByField(
 }
 
 
+/**
+  * starspan_getFeaturesStats: implementation
+  */
+int starspan_getFeaturesStats(
+	const vector<long>& FIDs, Vector* vect, Raster* rast,
+	vector<const char*> select_stats,
+	map<long, double**>& results
+) {
+	if ( FIDs.size() == 0 )
+		return 0;
+	
+	Traverser tr;
+	tr.setVector(vect);
+	tr.addRaster(rast);
+	tr.setDesiredFIDs(FIDs);
+
+	OutputFile* file = 0;
+	vector<const char*> select_fields;
+	StatsObserver statsObs(tr, file, select_stats, &select_fields);
+	statsObs.collected = &results;
+	
+	tr.addObserver(&statsObs);
+	tr.traverse();
+	
+	return results.size();
+}
+
+
+/**
+  * starspan_releaseFeatureStats: implementation
+  */
+void starspan_releaseFeatureStats(double** stats) {
+	for ( unsigned i = 0; i < TOT_RESULTS; i++ )
+		delete[] stats[i];
+	delete[] stats;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 
 //
@@ -524,41 +738,15 @@ int starspan_stats(
 	const char* csv_filename,
 	int layernum
 ) {
-	FILE* file;
-	bool new_file = false;
-	
 	// if file exists, append new rows. Otherwise create file.
-	file = fopen(csv_filename, "r+");
-	if ( file ) {
-		if ( globalOptions.verbose )
-			fprintf(stdout, "Appending to existing file %s\n", csv_filename);
-
-		fseek(file, 0, SEEK_END);
-
-		// check that new data will start in a new line:
-		// if last character is not '\n', then write a '\n':
-		// (This check will make the output more robust in case
-		// the previous information is not properly aligned, eg.
-		// when the previous generation was killed for some reason.)
-		long endpos = ftell(file);
-		if ( endpos > 0 ) {
-			fseek(file, endpos -1, SEEK_SET);
-			char c;
-			if ( 1 == fread(&c, sizeof(c), 1, file) ) {
-				if ( c != '\n' )
-					fputc('\n', file);    // add a new line
-			}
-		}
-	}
-	else {
-		// create output file
-		file = fopen(csv_filename, "w");
-		if ( !file) {
-			fprintf(stderr, "Cannot create %s\n", csv_filename);
-			return 1;
-		}
-		new_file = true;
+	OutputFile* file = OutputFile::open(csv_filename, true);
+	if ( !file) {
+		fprintf(stderr, "Cannot create %s\n", csv_filename);
+		return 1;
 	}
+	bool new_file = file->isNew();
+	if ( !new_file && globalOptions.verbose )
+		fprintf(stdout, "Appending to existing file %s\n", csv_filename);
 
 	Traverser tr;
 	tr.setVector(vect);
@@ -601,12 +789,13 @@ int starspan_stats(
 		}
 	}
 	
-	fclose(file);
+	bool ok = file->close();
+	delete file;
 	
 	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
 		delete rasters[i];
 	}
 	
-	return 0;
+	return ok ? 0 : 1;
 }
 
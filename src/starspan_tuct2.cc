@@ -10,6 +10,7 @@
 
 #include "Csv.h"       
 #include <fstream>       
+#include <set>
 #include <cstdlib>
 #include <cassert>
 
@@ -25,8 +26,8 @@ int starspan_tuct_2(
 	const char* calbase_filename
 ) {
 	// open input file
-	ifstream speclib_file(speclib_filename);
-	if ( !speclib_file ) {
+	CsvReader speclib;
+	if ( !speclib.open(speclib_filename) ) {
 		cerr<< "Couldn't open " << speclib_filename << endl;
 		return 1;
 	}
@@ -34,7 +35,7 @@ int starspan_tuct_2(
 	// create output file
 	ofstream calbase_file(calbase_filename, ios::out);
 	if ( !calbase_file ) {
-		speclib_file.close();
+		speclib.close();
 		cerr<< "Couldn't create " << calbase_filename << endl;
 		return 1;
 	}
@@ -79,19 +80,17 @@ int starspan_tuct_2(
 		// reset speclib input
 		// (repeated for each image, but doesn't matter)
 		//
-		speclib_file.seekg(0);
-		Csv csv(speclib_file);
-		string line;
-		if ( !csv.getline(line) ) {
-			speclib_file.close();
+		speclib.rewind();
+		if ( !speclib.nextLine() ) {
+			speclib.close();
 			cerr<< "Couldn't get header line from " << speclib_filename << endl;
 			ret = 1;
 			break;
 		}
-		const unsigned num_speclib_fields = csv.getnfield();
+		const unsigned num_speclib_fields = speclib.getNumFields();
 		if ( num_speclib_fields < 2 
-		||   csv.getfield(0) != link_name ) {
-			speclib_file.close();
+		||   speclib.getField(0) != link_name ) {
+			speclib.close();
 			cerr<< "Unexpected format: " << speclib_filename << endl;
 			cerr<< "There bust be more than one field and the "
 			    << "first one is expected to be named " << link_name << endl;
@@ -100,7 +99,7 @@ int starspan_tuct_2(
 		}
 		
 		if ( num_speclib_fields-1 != (unsigned) bands ) {
-			speclib_file.close();
+			speclib.close();
 			cerr<< "Different number of bands:" << endl
 			    << "  " << speclib_filename << ": " << (num_speclib_fields-1) << endl
 			    << "  " << raster_filename << ": " << bands << endl
@@ -110,65 +109,82 @@ int starspan_tuct_2(
 		}
 				
 		//
-		// for each feature
+		// locate the linked features with the field index (built on the
+		// first lookup and reused for all rasters)
+		//
+		vector<long> FIDs;
+		set<long> seen;
+		while ( speclib.nextLine() ) {
+			string link_val = speclib.getString(0);
+			long FID = vect->getFIDByField(0, link_name, link_val.c_str());
+			if ( FID >= 0 && seen.insert(FID).second ) {
+				FIDs.push_back(FID);
+			}
+		}
+		
+		//
+		// stats for all linked features in a single traversal
 		//
 		cout << "processing features..." << endl;
-		for ( int record = 0; csv.getline(line); record++ ) {
-			string link_val = csv.getfield(0);
+		map<long, double**> all_stats;
+		starspan_getFeaturesStats(FIDs, vect, rast, select_stats, all_stats);
+		
+		//
+		// for each record
+		//
+		speclib.rewind();
+		speclib.nextLine();    // header
+		for ( int record = 0; speclib.nextLine(); record++ ) {
+			string link_val = speclib.getString(0);
 
 			// progress message
 			cout << "\n\t processing " <<link_name<< ": " << link_val << endl;
 			
 			// get stats for link_val
-			long FID;
-			double** stats = starspan_getFeatureStatsByField(
-				link_name, link_val.c_str(), 
-				vect, rast,
-				select_stats,
-				&FID
-			); 
-			if ( stats ) {
-				if ( FID >= 0 ) {
-					for ( int bandNumber = 1; bandNumber <= bands; bandNumber++ ) {
-						double fieldBandValue = atof(csv.getfield(bandNumber).c_str());
+			long FID = vect->getFIDByField(0, link_name, link_val.c_str());
+			map<long, double**>::const_iterator found = all_stats.find(FID);
+			if ( found != all_stats.end() ) {
+				double** stats = found->second;
+				for ( int bandNumber = 1; bandNumber <= bands; bandNumber++ ) {
+					double fieldBandValue = speclib.getDouble(bandNumber);
 
-						// write record
-						calbase_file <<FID<< "," <<link_val<< "," ;
-						
-						if ( globalOptions.RID != "none" )
-							calbase_file <<RID<< ",";
-						
-						calbase_file <<bandNumber<< "," <<fieldBandValue ;
+					// write record
+					calbase_file <<FID<< "," <<link_val<< "," ;
+					
+					if ( globalOptions.RID != "none" )
+						calbase_file <<RID<< ",";
+					
+					calbase_file <<bandNumber<< "," <<fieldBandValue ;
+					
+					for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
+						double imageBandValue = 0.0;
+						if ( 0 == strcmp(*stat, "avg") )
+							imageBandValue = stats[AVG][bandNumber-1];
+						else if ( 0 == strcmp(*stat, "mode") )
+							imageBandValue = stats[MODE][bandNumber-1];
+						else if ( 0 == strcmp(*stat, "stdev") )
+							imageBandValue = stats[STDEV][bandNumber-1];
+						else if ( 0 == strcmp(*stat, "min") )
+							imageBandValue = stats[MIN][bandNumber-1];
+						else if ( 0 == strcmp(*stat, "max") )
+							imageBandValue = stats[MAX][bandNumber-1];
 						
-						for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
-							double imageBandValue = 0.0;
-							if ( 0 == strcmp(*stat, "avg") )
-								imageBandValue = stats[AVG][bandNumber-1];
-							else if ( 0 == strcmp(*stat, "mode") )
-								imageBandValue = stats[MODE][bandNumber-1];
-							else if ( 0 == strcmp(*stat, "stdev") )
-								imageBandValue = stats[STDEV][bandNumber-1];
-							else if ( 0 == strcmp(*stat, "min") )
-								imageBandValue = stats[MIN][bandNumber-1];
-							else if ( 0 == strcmp(*stat, "max") )
-								imageBandValue = stats[MAX][bandNumber-1];
-							
-							calbase_file<< "," << imageBandValue;
-						}
-						calbase_file<< endl;
+						calbase_file<< "," << imageBandValue;
 					}
-	
+					calbase_file<< endl;
 				}
-				// release stats:
-				for ( unsigned i = 0; i < TOT_RESULTS; i++ )
-					delete[] stats[i];
 			}
 		}
+		
+		// release stats:
+		for ( map<long, double**>::iterator it = all_stats.begin(); it != all_stats.end(); it++ ) {
+			starspan_releaseFeatureStats(it->second);
+		}
 		delete rast;
 	}
 
 	calbase_file.close();    
-	speclib_file.close();
+	speclib.close();
 	cout << "finished." << endl;
 	return ret;	
 }
@@ -7,10 +7,109 @@
 
 #include "starspan.h"           
 #include "Csv.h"       
+#include "WorkerPool.h"
 #include <fstream>       
 
 #include <cstdlib>
 #include <cassert>
+#include <algorithm>
+
+
+// number of records read and processed at a time
+#define UPDATE_CSV_CHUNK_RECORDS (1024*1024)
+
+
+/**
+  * A chunk of records being updated with the band values of a raster.
+  * The records are sorted by the raster block containing their pixel so
+  * each block is read only once; the sorted list is divided in segments
+  * (not splitting blocks) that are processed by the workers.
+  */
+struct UpdateChunk {
+	int num_records;
+	
+	// pixel location of each record in the current raster
+	vector<int> cols;
+	vector<int> rows;
+	
+	// current raster:
+	int raster_index;
+	int width, height, bands;
+	int block_xsize, block_ysize;
+	
+	// indices of the records in the raster sorted by block, 
+	// the block of each of them, and the segments for the workers
+	vector<int> order;
+	vector<long> blocks;
+	vector<int> segments;
+	
+	// extracted values: num_records x total_bands; and flags 
+	// indicating the pixel was in the raster: num_records x num_rasters
+	int total_bands;
+	int band_offset;     // of current raster
+	vector<double> values;
+	vector<char> found;
+	int num_rasters;
+	
+	// per worker: dataset handles (one per raster), block buffer, and
+	// whether a read error occurred
+	vector<vector<GDALDataset*> > datasets;
+	vector<vector<double> > buffers;
+	vector<char> errors;
+};
+
+// to sort record indices by block
+struct BlockComparator {
+	const vector<long>& blocks;
+	BlockComparator(const vector<long>& blocks) : blocks(blocks) {}
+	bool operator()(int a, int b) const {
+		return blocks[a] < blocks[b];
+	}
+};
+
+
+/**
+  * Gets the band values for the records in a segment of the sorted list.
+  */
+static void extract_segment(int segment, int worker, void* arg) {
+	UpdateChunk* uc = (UpdateChunk*) arg;
+	GDALDataset* dataset = uc->datasets[worker][uc->raster_index];
+	vector<double>& buffer = uc->buffers[worker];
+	
+	const int end = uc->segments[segment + 1];
+	for ( int i = uc->segments[segment]; i < end; ) {
+		// read the block of the record at i:
+		const int record = uc->order[i];
+		const long block = uc->blocks[record];
+		const int x0 = (uc->cols[record] / uc->block_xsize) * uc->block_xsize;
+		const int y0 = (uc->rows[record] / uc->block_ysize) * uc->block_ysize;
+		const int w = min(uc->block_xsize, uc->width - x0);
+		const int h = min(uc->block_ysize, uc->height - y0);
+		buffer.resize((size_t) w * h * uc->bands);
+		CPLErr status = dataset->RasterIO(GF_Read,
+			x0, y0, w, h,
+			&buffer[0], w, h, GDT_Float64,
+			uc->bands, NULL,
+			0, 0, 0
+		);
+		if ( status != CE_None ) {
+			fprintf(stderr, "Error reading band values, status= %d\n", status);
+			uc->errors[worker] = 1;
+			return;
+		}
+		
+		// get the values for all the records in this block:
+		for ( ; i < end && uc->blocks[uc->order[i]] == block; i++ ) {
+			const int rec = uc->order[i];
+			const long offset = (long) (uc->rows[rec] - y0) * w + (uc->cols[rec] - x0);
+			double* values = &uc->values[(long) rec * uc->total_bands + uc->band_offset];
+			for ( int b = 0; b < uc->bands; b++ ) {
+				values[b] = buffer[(long) b * w * h + offset];
+			}
+			uc->found[(long) rec * uc->num_rasters + uc->raster_index] = 1;
+		}
+	}
+}
 
 
 /**
@@ -25,15 +124,12 @@ int starspan_update_csv(
 	const string delimiter = globalOptions.delimiter;
 	
 	// open input file
-	ifstream in_file(in_csv_filename);
-	if ( !in_file ) {
+	CsvReader reader(delimiter);
+	if ( !reader.open(in_csv_filename) ) {
 		cerr<< "Couldn't open " <<in_csv_filename<< endl;
 		return 1;
 	}
-	Csv csv(in_file, delimiter);
-	string line;
-	if ( !csv.getline(line) ) {
-		in_file.close();
+	if ( !reader.nextLine() ) {
 		cerr<< "Couldn't get header line from " <<in_csv_filename<< endl;
 		return 1;
 	}
@@ -46,9 +142,9 @@ int starspan_update_csv(
 	int y_field_index = -1;
 	int col_field_index = -1;
 	int row_field_index = -1;
-	const unsigned num_existing_fields = csv.getnfield();
+	const unsigned num_existing_fields = reader.getNumFields();
 	for ( unsigned i = 0; i < num_existing_fields; i++ ) {
-		string field = csv.getfield(i);
+		const CsvField& field = reader.getField(i);
 		if ( field == "x" )
 			x_field_index = i;
 		else if ( field == "y" )
@@ -64,30 +160,29 @@ int starspan_update_csv(
 		cout<< "         Will try with col,row fields ...\n";
 		use_xy = false;
 		if ( col_field_index < 0 || row_field_index < 0 ) {
-			in_file.close();
 			cout<< "No fields 'col' and/or 'row' are present in " <<in_csv_filename<<endl;
 			return 1;
 		}
 	}
 
 	// create output file
-	ofstream out_file(out_csv_filename, ios::out);
+	OutputFile* out_file = OutputFile::open(out_csv_filename);
 	if ( !out_file ) {
-		in_file.close();
 		cerr<< "Couldn't create " <<out_csv_filename<< endl;
 		return 1;
 	}
+	CsvOutput csvOut;
+	csvOut.setFile(out_file);
+	csvOut.setSeparator(delimiter);
 
 	//
 	// copy existing field definitions
 	//
+	csvOut.startLine();
 	for ( unsigned i = 0; i < num_existing_fields; i++ ) {
-		string field = csv.getfield(i);
+		string field = reader.getString(i);
 		cout << "Creating field: " << field << endl;
-		if ( i > 0 ) {
-			out_file << delimiter;
-		}
-		out_file << field;
+		csvOut.addString(field);
 	}
 
 
@@ -97,113 +192,209 @@ int starspan_update_csv(
 	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
 		rasts.push_back(new Raster(raster_filenames[i]));
 	}
-	int next_field_index = num_existing_fields;
+	vector<int> band_offsets;
+	int total_bands = 0;
 	for ( unsigned r = 0; r < raster_filenames.size(); r++ ) {
 		const char* rast_name = raster_filenames[r];
 		Raster* rast = rasts[r];
 		int bands;
 		rast->getSize(NULL, NULL, &bands);
+		band_offsets.push_back(total_bands);
+		total_bands += bands;
 		for ( int b = 0; b < bands; b++ ) {
 			char field_name[1024];
 			sprintf(field_name, "Band_%d_%s", b+1, rast_name);
 			cout<< "Creating field: " <<field_name<<endl;
-			out_file << delimiter << field_name;
-			next_field_index++;
+			csvOut.addString(field_name);
 		}
 	}
 	// end column headers
-	out_file << endl;
+	csvOut.endLine();
 	
 	
 	//
 	// main body of processing
 	//
 	
-	// for each point point in input csv...
+	WorkerPool pool(globalOptions.num_threads);
+	
+	UpdateChunk uc;
+	uc.total_bands = total_bands;
+	uc.num_rasters = rasts.size();
+	
+	// each worker gets its own handles on the rasters:
+	uc.datasets.resize(pool.getNumWorkers());
+	uc.buffers.resize(pool.getNumWorkers());
+	uc.errors.assign(pool.getNumWorkers(), 0);
+	bool failed = false;
+	for ( int w = 0; w < pool.getNumWorkers() && !failed; w++ ) {
+		for ( unsigned r = 0; r < rasts.size(); r++ ) {
+			GDALDataset* dataset = w == 0 
+				? rasts[r]->getDataset()
+				: (GDALDataset*) GDALOpen(raster_filenames[r], GA_ReadOnly);
+			if ( !dataset ) {
+				cerr<< "Couldn't open " <<raster_filenames[r]<< endl;
+				failed = true;
+				break;
+			}
+			uc.datasets[w].push_back(dataset);
+		}
+	}
+	
+	// rendered existing fields and coordinates of the records in a chunk:
+	vector<string> prefixes;
+	vector<double> xs, ys;
+	CsvOutput prefixOut;
+	prefixOut.setFile((FILE*) 0);
+	prefixOut.setSeparator(delimiter);
+	
 	cout<< "processing records...\n";
-	for ( int record = 0; csv.getline(line); record++ ) {
-		cout<< "record " <<record<< "  ";
+	long total_records = 0;
+	bool more = !failed;
+	while ( more ) {
 		//
-		// copy existing field values
+		// read a chunk of records
 		//
-		for ( unsigned i = 0; i < num_existing_fields; i++ ) {
-			string field = csv.getfield(i);
-			if ( i > 0 ) {
-				out_file << delimiter;
+		prefixes.clear();
+		xs.clear();
+		ys.clear();
+		while ( prefixes.size() < UPDATE_CSV_CHUNK_RECORDS && (more = reader.nextLine()) ) {
+			// existing field values
+			prefixOut.startLine();
+			for ( unsigned i = 0; i < num_existing_fields; i++ ) {
+				prefixOut.addString(reader.getField(i));
+			}
+			prefixes.push_back(string());
+			prefixOut.takeLine(prefixes.back());
+			
+			if ( use_xy ) {
+				xs.push_back(reader.getDouble(x_field_index));
+				ys.push_back(reader.getDouble(y_field_index));
+			}
+			else {
+				// make col and row 0-based:
+				xs.push_back(reader.getLong(col_field_index) - 1);
+				ys.push_back(reader.getLong(row_field_index) - 1);
 			}
-			out_file << field;
 		}
 		
+		const int num_records = prefixes.size();
+		if ( num_records == 0 ) {
+			break;
+		}
+		uc.num_records = num_records;
+		uc.cols.resize(num_records);
+		uc.rows.resize(num_records);
+		uc.blocks.resize(num_records);
+		uc.values.assign((size_t) num_records * total_bands, 0.0);
+		uc.found.assign((size_t) num_records * uc.num_rasters, 0);
 		
 		//
-		// now extract desired pixel from given rasters
+		// extract pixels from given rasters, one raster at a time
 		//
-		
-		double x = 0, y = 0;
-		int col = 0, row = 0;
-		
-		if ( use_xy ) {
-			x = atof(csv.getfield(x_field_index).c_str());
-			y = atof(csv.getfield(y_field_index).c_str());
-			cout<< "x , y = " <<x<< " , " <<y<< endl;
-		}
-		else {
-			col = atoi(csv.getfield(col_field_index).c_str());
-			row = atoi(csv.getfield(row_field_index).c_str());
-			cout<< "col , row = " <<col<< " , " <<row<< endl;
-			// make col and row 0-based:
-			--col;
-			--row;
-		}
-		
-		
-		// for each raster...
-		next_field_index = num_existing_fields;
 		for ( unsigned r = 0; r < rasts.size(); r++ ) {
 			Raster* rast = rasts[r];
-			int bands;
-			rast->getSize(NULL, NULL, &bands);
-			GDALDataset* dataset = rast->getDataset();
-
-			if ( use_xy ) {
-				// convert from (x,y) to (col,row) in this rast
-				rast->toColRow(x, y, &col, &row);
-				//cout<< "x,y = " <<x<< " , " <<y<< endl;
+			rast->getSize(&uc.width, &uc.height, &uc.bands);
+			rast->getDataset()->GetRasterBand(1)->GetBlockSize(&uc.block_xsize, &uc.block_ysize);
+			const long blocks_per_row = (uc.width + uc.block_xsize - 1) / uc.block_xsize;
+			uc.raster_index = r;
+			uc.band_offset = band_offsets[r];
+			
+			// locate the records in this raster:
+			uc.order.clear();
+			for ( int rec = 0; rec < num_records; rec++ ) {
+				int col, row;
+				if ( use_xy ) {
+					// convert from (x,y) to (col,row) in this rast
+					rast->toColRow(xs[rec], ys[rec], &col, &row);
+				}
+				else {
+					col = (int) xs[rec];
+					row = (int) ys[rec];
+				}
+				if ( col < 0 || col >= uc.width || row < 0 || row >= uc.height ) {
+					continue;
+				}
+				uc.cols[rec] = col;
+				uc.rows[rec] = row;
+				uc.blocks[rec] = (row / uc.block_ysize) * blocks_per_row + col / uc.block_xsize;
+				uc.order.push_back(rec);
 			}
-			// else: (col,row) already given above.
+			if ( uc.order.size() == 0 ) {
+				continue;
+			}
+			stable_sort(uc.order.begin(), uc.order.end(), BlockComparator(uc.blocks));
 			
+			// divide in segments for the workers, not splitting blocks:
+			const int num_segments = pool.getNumWorkers() * 8;
+			const int segment_size = (uc.order.size() + num_segments - 1) / num_segments;
+			uc.segments.clear();
+			uc.segments.push_back(0);
+			int i = 0;
+			while ( i < (int) uc.order.size() ) {
+				i = min(i + segment_size, (int) uc.order.size());
+				while ( i < (int) uc.order.size() && uc.blocks[uc.order[i]] == uc.blocks[uc.order[i - 1]] ) {
+					i++;
+				}
+				uc.segments.push_back(i);
+			}
 			
-			//
-			// extract pixel at (col,row) from rast
-			char* ptr = (char*) rast->getBandValuesForPixel(col, row);
-			if ( ptr ) {
-				// add these bands to csv
+			pool.run(uc.segments.size() - 1, extract_segment, &uc);
+			for ( int w = 0; w < pool.getNumWorkers(); w++ ) {
+				if ( uc.errors[w] ) {
+					failed = true;
+				}
+			}
+			if ( failed ) {
+				break;
+			}
+		}
+		if ( failed ) {
+			break;
+		}
+		
+		//
+		// write the records in their original order
+		//
+		for ( int rec = 0; rec < num_records; rec++ ) {
+			csvOut.startLine();
+			csvOut.addRendered(prefixes[rec], num_existing_fields);
+			for ( unsigned r = 0; r < rasts.size(); r++ ) {
+				if ( !uc.found[(long) rec * uc.num_rasters + r] ) {
+					continue;
+				}
+				int bands;
+				rasts[r]->getSize(NULL, NULL, &bands);
+				const double* values = &uc.values[(long) rec * total_bands + band_offsets[r]];
 				for ( int b = 0; b < bands; b++ ) {
-					GDALRasterBand* band = dataset->GetRasterBand(b+1);
-					GDALDataType bandType = band->GetRasterDataType();
-
-					double val = starspan_extract_double_value(bandType, ptr);
-					out_file << delimiter << val;
-
-					int bandTypeSize = GDALGetDataTypeSize(bandType) >> 3;
-					ptr += bandTypeSize;
+					csvOut.addField("%g", values[b]);
 				}
 			}
+			csvOut.endLine();
 		}
-		// end record
-		out_file << endl;
+		
+		total_records += num_records;
+		cout<< "  " <<total_records<< " records processed\n";
 	}
+	csvOut.flush();
 
 	// close files:
+	for ( int w = 1; w < pool.getNumWorkers(); w++ ) {
+		for ( unsigned r = 0; r < uc.datasets[w].size(); r++ ) {
+			delete uc.datasets[w][r];
+		}
+	}
 	for ( unsigned r = 0; r < rasts.size(); r++ ) {
 		delete rasts[r];
 	}
-	in_file.close();
-	out_file.close();
+	reader.close();
+	bool ok = out_file->close();
+	delete out_file;
 
+	if ( failed ) {
+		cerr<< "update_csv: " <<out_csv_filename<< " is incomplete" << endl;
+		return 1;
+	}
 	cout<< "finished.\n";
-	return 0;
+	return ok ? 0 : 1;
 }
-		
-
-
@@ -8,9 +8,11 @@
 #include "starspan.h"           
 #include "vrtdataset.h"
 #include "jts.h"       
+#include "WorkerPool.h"
 
 #include <stdlib.h>
 #include <iomanip>
+#include <algorithm>
 
 // aux routine for reporting 
 void starspan_report(Traverser& tr) {
@@ -70,7 +72,15 @@ GDALDatasetH starspan_subset_raster(
 
 	int          xsize_incr,      // used to create the raster 
 	int          ysize_incr,      // used to create the raster
-	double		 *nodata          // used if not null
+	double		 *nodata,         // used if not null
+
+	const char*  mask,            // if not null, xsize*ysize flags, row by row;
+	                              // pixels with a zero flag are set to mask_value,
+	                              // or masked out in a virtual output
+	double       mask_value,
+
+	bool         virtual_output   // if true, a VRT file referencing the window
+	                              // of the input dataset is written
 ) {
 	// input vars:
     int*              panBandList = NULL;
@@ -80,7 +90,7 @@ GDALDatasetH starspan_subset_raster(
     int               bStrict = TRUE;
 
 	// output vars:
-    const char*     pszFormat = "ENVI";
+    const char*     pszFormat = virtual_output ? "VRT" : "ENVI";
     GDALDriverH		hDriver;
 	GDALDatasetH	hOutDS;
 	int             anSrcWin[4] = { xoff, yoff, xsize, ysize };
@@ -121,6 +131,70 @@ GDALDatasetH starspan_subset_raster(
 /* -------------------------------------------------------------------- */
     poVDS = new VRTDataset( nOXSize + xsize_incr, nOYSize + ysize_incr );
 
+/* -------------------------------------------------------------------- */
+/*      If a mask is given, read the window with a single call, apply   */
+/*      the mask in memory, and use the result as the source of the     */
+/*      virtual bands, so the output is written only once.              */
+/* -------------------------------------------------------------------- */
+	GDALDatasetH hMaskedDS = NULL;
+	if ( mask && !virtual_output ) {
+		GDALDriverH hMemDriver = GDALGetDriverByName("MEM");
+		if ( hMemDriver == NULL ) {
+			fprintf(stderr, "MEM driver not available.\n");
+			delete poVDS;
+			CPLFree( panBandList );
+			return NULL;
+		}
+		hMaskedDS = GDALCreate(hMemDriver, "", xsize, ysize, 0, GDT_Byte, NULL);
+		if ( hMaskedDS == NULL ) {
+			fprintf(stderr, "Cannot create in-memory dataset for mask.\n");
+			delete poVDS;
+			CPLFree( panBandList );
+			return NULL;
+		}
+		
+		bool complex = false;
+		for(int i = 0; i < nBandCount; i++ ) {
+			GDALDataType eType = GDALGetRasterDataType(GDALGetRasterBand(hDataset, i+1));
+			GDALAddBand(hMaskedDS, eType, NULL);
+			if ( GDALDataTypeIsComplex(eType) )
+				complex = true;
+		}
+		
+		// values per pixel in the buffer (real, imaginary if complex)
+		const int nWords = complex ? 2 : 1;
+		const GDALDataType eBufType = complex ? GDT_CFloat64 : GDT_Float64;
+		const long nPixels = (long) xsize * ysize;
+		double* buffer = (double*) CPLMalloc(sizeof(double) * nWords * nPixels * nBandCount);
+		
+		CPLErr err = GDALDatasetRasterIO(hDataset, GF_Read, xoff, yoff, xsize, ysize,
+			buffer, xsize, ysize, eBufType, nBandCount, panBandList, 0, 0, 0
+		);
+		if ( err == CE_None ) {
+			for(int i = 0; i < nBandCount; i++ ) {
+				double* ptr = buffer + i * nWords * nPixels;
+				for ( long k = 0; k < nPixels; k++, ptr += nWords ) {
+					if ( !mask[k] ) {
+						ptr[0] = mask_value;
+						if ( complex )
+							ptr[1] = 0;
+					}
+				}
+			}
+			err = GDALDatasetRasterIO(hMaskedDS, GF_Write, 0, 0, xsize, ysize,
+				buffer, xsize, ysize, eBufType, nBandCount, panBandList, 0, 0, 0
+			);
+		}
+		CPLFree(buffer);
+		if ( err != CE_None ) {
+			fprintf(stderr, "Error applying mask: %s\n", CPLGetLastErrorMsg());
+			GDALClose(hMaskedDS);
+			delete poVDS;
+			CPLFree( panBandList );
+			return NULL;
+		}
+	}
+
 	// set projection:
 	if ( pszOutputSRS ) {
 		OGRSpatialReference oOutputSRS;
@@ -192,10 +266,18 @@ GDALDatasetH starspan_subset_raster(
 /*      Create a simple data source depending on the         */
 /*      translation type required.                                      */
 /* -------------------------------------------------------------------- */
-		poVRTBand->AddSimpleSource( poSrcBand,
-									anSrcWin[0], anSrcWin[1], 
-									anSrcWin[2], anSrcWin[3], 
-									0, 0, nOXSize, nOYSize );
+		if ( hMaskedDS ) {
+			poVRTBand->AddSimpleSource( ((GDALDataset *) hMaskedDS)->GetRasterBand(i+1),
+										0, 0, 
+										anSrcWin[2], anSrcWin[3], 
+										0, 0, nOXSize, nOYSize );
+		}
+		else {
+			poVRTBand->AddSimpleSource( poSrcBand,
+										anSrcWin[0], anSrcWin[1], 
+										anSrcWin[2], anSrcWin[3], 
+										0, 0, nOXSize, nOYSize );
+		}
 		
 /* -------------------------------------------------------------------- */
 /*      copy over some other information of interest.                   */
@@ -217,6 +299,62 @@ GDALDatasetH starspan_subset_raster(
 		}
     }
 
+/* -------------------------------------------------------------------- */
+/*      A virtual output with a mask gets a mask band whose source is   */
+/*      a byte file written next to it: 255 for the flagged pixels,     */
+/*      0 otherwise.                                                    */
+/* -------------------------------------------------------------------- */
+	if ( mask && virtual_output && nBandCount > 0 ) {
+		string mask_filename = CPLResetExtension(pszDest, "mask.img");
+		GDALDriverH hMaskDriver = GDALGetDriverByName("ENVI");
+		GDALDatasetH hMaskDS = NULL;
+		if ( hMaskDriver ) {
+			hMaskDS = GDALCreate(hMaskDriver, mask_filename.c_str(), xsize, ysize, 1, GDT_Byte, NULL);
+		}
+		CPLErr err = CE_Failure;
+		if ( hMaskDS ) {
+			const long nPixels = (long) xsize * ysize;
+			unsigned char* bytes = (unsigned char*) CPLMalloc(nPixels);
+			for ( long k = 0; k < nPixels; k++ )
+				bytes[k] = mask[k] ? 255 : 0;
+			err = GDALDatasetRasterIO(hMaskDS, GF_Write, 0, 0, xsize, ysize,
+				bytes, xsize, ysize, GDT_Byte, 1, NULL, 0, 0, 0
+			);
+			CPLFree(bytes);
+			GDALClose(hMaskDS);
+			hMaskDS = NULL;
+		}
+		// reopened shared, so the source keeps it open until the VRT is closed:
+		if ( err == CE_None ) {
+			hMaskDS = GDALOpenShared(mask_filename.c_str(), GA_ReadOnly);
+		}
+		if ( hMaskDS && poVDS->CreateMaskBand(GMF_PER_DATASET) == CE_None ) {
+			VRTSourcedRasterBand* poMaskBand = (VRTSourcedRasterBand*) poVDS->GetRasterBand(1)->GetMaskBand();
+			poMaskBand->AddSimpleSource( ((GDALDataset *) hMaskDS)->GetRasterBand(1),
+										0, 0, xsize, ysize,
+										0, 0, xsize, ysize );
+			GDALClose(hMaskDS);
+		}
+		else {
+			fprintf(stderr, "Error creating mask %s: %s\n", mask_filename.c_str(), CPLGetLastErrorMsg());
+			if ( hMaskDS )
+				GDALClose(hMaskDS);
+			delete poVDS;
+			CPLFree( panBandList );
+			return NULL;
+		}
+	}
+
+/* -------------------------------------------------------------------- */
+/*      A virtual output is the virtual dataset itself: it is written   */
+/*      to pszDest when closed.                                         */
+/* -------------------------------------------------------------------- */
+	if ( virtual_output ) {
+		poVDS->SetDescription(pszDest);
+		CPLFree( panBandList );
+		return (GDALDatasetH) poVDS;
+	}
+
 /* -------------------------------------------------------------------- */
 /*      Write to the output file using CopyCreate().                    */
 /* -------------------------------------------------------------------- */
@@ -225,6 +363,8 @@ GDALDatasetH starspan_subset_raster(
                              pfnProgress, NULL );
 
     GDALClose((GDALDatasetH) poVDS);
+	if ( hMaskedDS )
+		GDALClose(hMaskedDS);
 	CPLFree( panBandList );
   	
 	
@@ -483,19 +623,235 @@ int starspan_validate_input_elements(
 ///////////////////////////////////////////////////
 // mini raster strip creation
 
-static string create_filename_hdr(string prefix, long FID) {
-    ostringstream ostr;
-    ostr << prefix << setfill('0') << setw(4) << FID << ".hdr";
-    return ostr.str();
+// approximate size of the buffers used to transfer blocks of rows
+#define STRIP_BLOCK_SIZE (16*1024*1024)
+
+/**
+  * State of a worker transferring minirasters to the strips:
+  * own handles on the outputs and the current source raster, and 
+  * transfer buffers for blocks of complete rows.
+  */
+struct StripWorker {
+    GDALDataset* strip_ds;
+    GDALDataset* fid_ds;
+    GDALDataset* loc_ds;
+    
+    // current source raster:
+    GDALDataset* src_ds;
+    string src_filename;
+    
+    // data (as doubles), FIDs, and loc (2 bands)
+    double* buffer;
+    int* fids;
+    float* locs;
+};
+
+/**
+  * Info shared by the workers creating a strip.
+  */
+struct StripCreation {
+    vector<MRBasicInfo>* mrbi_list;
+    int strip_width;
+    int strip_height;
+    int strip_bands;
+    int block_rows;
+    long block_pixels;
+    
+    vector<StripWorker> workers;
+    
+    // to serialize the opening of source rasters
+    CPLMutex* open_mutex;
+};
+
+
+/**
+  * Transfers data, fid, and loc for a miniraster to the output strips.
+  * Only the rows of the strip assigned to the miniraster are written, 
+  * so minirasters can be transferred concurrently by different workers.
+  */
+static void transfer_miniraster(int m, int w, void* arg) {
+    StripCreation* sc = (StripCreation*) arg;
+    StripWorker* worker = &sc->workers[w];
+    const MRBasicInfo* mrbi = &(*sc->mrbi_list)[m];
+    
+    const int strip_width = sc->strip_width;
+    const int strip_bands = sc->strip_bands;
+    const long block_pixels = sc->block_pixels;
+    double* buffer = worker->buffer;
+    int* fids = worker->fids;
+    float* locs = worker->locs;
+
+    if ( globalOptions.verbose ) {
+        cout<< "  adding miniraster FID=" <<mrbi->FID<< " to strip...\n";
+    }
+
+    ///////////////////////
+    // open source raster if different from the current one
+    if ( worker->src_filename != mrbi->raster_filename ) {
+        CPLAcquireMutex(sc->open_mutex, 1000.0);
+        if ( worker->src_ds ) {
+            delete worker->src_ds;
+        }
+        worker->src_filename = mrbi->raster_filename;
+        worker->src_ds = (GDALDataset*) GDALOpen(worker->src_filename.c_str(), GA_ReadOnly);
+        if ( !worker->src_ds ) {
+            cerr<< " Unexpected: couldn't read " <<worker->src_filename<< endl;
+        }
+        CPLReleaseMutex(sc->open_mutex);
+    }
+    GDALDataset* src_ds = worker->src_ds;
+    
+    // geotransform of the miniraster:
+    double adfGeoTransform[6] = { 0, 1, 0, 0, 0, 1 };
+    if ( src_ds ) {
+        src_ds->GetGeoTransform(adfGeoTransform);
+        adfGeoTransform[0] += mrbi->col0 * adfGeoTransform[1] + mrbi->row0 * adfGeoTransform[2];
+        adfGeoTransform[3] += mrbi->col0 * adfGeoTransform[4] + mrbi->row0 * adfGeoTransform[5];
+    }
+    
+    // value for the parity adjustment pixels in each band: the nodata
+    // value of the source band, if any, or zero:
+    vector<double> incr_values(strip_bands, 0.0);
+    for ( int k = 0; src_ds && k < strip_bands && k < src_ds->GetRasterCount(); k++ ) {
+        int bSuccess;
+        double dfNoData = src_ds->GetRasterBand(k+1)->GetNoDataValue(&bSuccess);
+        if ( bSuccess )
+            incr_values[k] = dfNoData;
+    }
+    
+    // extent of the miniraster in the strip including parity adjustments:
+    const int mini_width = min(mrbi->width + mrbi->xsize_incr, strip_width);
+    const int mini_height = mrbi->height + mrbi->ysize_incr;
+    
+    // loc values: x is the same for every row; y is accumulated row by row
+    const float pix_x_size = (float) adfGeoTransform[1];
+    const float pix_y_size = (float) adfGeoTransform[5];
+    vector<float> loc_x(mini_width);
+    float loc_y = (float) adfGeoTransform[3];
+    if ( src_ds ) {
+        float x = (float) adfGeoTransform[0];
+        for ( int j = 0; j < mini_width; j++, x += pix_x_size ) {
+            loc_x[j] = x;
+        }
+    }
+    
+    // rows of the strip assigned to this miniraster: up to the next one
+    // (rows left by the separation, if any, get the background values)
+    const int first_row = m == 0 ? 0 : mrbi->mrs_row;
+    const int end_row = m + 1 < (int) sc->mrbi_list->size() ? (*sc->mrbi_list)[m+1].mrs_row : sc->strip_height;
+    
+    for ( int row = first_row; row < end_row; row += sc->block_rows ) {
+        const int nrows = min(sc->block_rows, end_row - row);
+        const long npixels = (long) strip_width * nrows;
+        
+        // fill with background values: globalOptions.nodata for data,
+        // -1 for FID (as normally FIDs starts from zero), and 
+        // 0 (arbitrarely chosen) for loc:
+        for ( int k = 0; k < strip_bands; k++ ) {
+            fill(buffer + k * block_pixels, buffer + k * block_pixels + npixels, globalOptions.nodata);
+        }
+        fill(fids, fids + npixels, -1);
+        fill(locs, locs + npixels, 0.0f);
+        fill(locs + block_pixels, locs + block_pixels + npixels, 0.0f);
+        
+        // miniraster rows [i0, i1) are in this block:
+        const int i0 = max(0, row - mrbi->mrs_row);
+        const int i1 = src_ds ? min(mini_height, row + nrows - mrbi->mrs_row) : 0;
+        
+        for ( int i = i0; i < i1; i++ ) {
+            const long offset = (long) (mrbi->mrs_row + i - row) * strip_width;
+            
+            if ( i < mrbi->height ) {
+                // parity column(s):
+                for ( int k = 0; k < strip_bands; k++ ) {
+                    fill(buffer + k * block_pixels + offset + mrbi->width, 
+                         buffer + k * block_pixels + offset + mini_width, incr_values[k]);
+                }
+            }
+            else {
+                // parity row:
+                for ( int k = 0; k < strip_bands; k++ ) {
+                    fill(buffer + k * block_pixels + offset, 
+                         buffer + k * block_pixels + offset + mini_width, incr_values[k]);
+                }
+            }
+            
+            // FID and loc:
+            fill(fids + offset, fids + offset + mini_width, (int) mrbi->FID);
+            copy(loc_x.begin(), loc_x.end(), locs + offset);
+            fill(locs + block_pixels + offset, locs + block_pixels + offset + mini_width, loc_y);
+            loc_y += pix_y_size;
+        }
+        
+        // data rows in this block:
+        const int data_rows = min(i1, mrbi->height) - i0;
+        if ( data_rows > 0 ) {
+            const long offset = (long) (mrbi->mrs_row + i0 - row) * strip_width;
+            
+            // read the window rows directly into the block:
+            CPLErr err = src_ds->RasterIO(GF_Read,
+                mrbi->col0,                  //nXOff,
+                mrbi->row0 + i0,             //nYOff,
+                mrbi->width,                 //nXSize,
+                data_rows,                   //nYSize,
+                buffer + offset,             //pData,
+                mrbi->width,                 //nBufXSize,
+                data_rows,                   //nBufYSize,
+                GDT_Float64,                 //eBufType,
+                strip_bands,                 //nBandCount,
+                NULL,                        //panBandMap,
+                sizeof(double),              //nPixelSpace,
+                strip_width * sizeof(double),   //nLineSpace,
+                block_pixels * sizeof(double)   //nBandSpace
+            );
+            if ( err != CE_None ) {
+                cerr<< " Unexpected: couldn't read window for FID=" <<mrbi->FID<< " from " <<worker->src_filename<< endl;
+            }
+            
+            // nullify pixels not in the mask, if any:
+            if ( mrbi->mask.size() > 0 ) {
+                for ( int i = i0; i < i0 + data_rows; i++ ) {
+                    const char* flags = mrbi->mask.data() + (long) i * mrbi->width;
+                    const long row_offset = (long) (mrbi->mrs_row + i - row) * strip_width;
+                    for ( int j = 0; j < mrbi->width; j++ ) {
+                        if ( !flags[j] ) {
+                            for ( int k = 0; k < strip_bands; k++ ) {
+                                buffer[k * block_pixels + row_offset + j] = globalOptions.nodata;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        
+        // write the block of rows in the strips:
+        worker->strip_ds->RasterIO(GF_Write, 0, row, strip_width, nrows,
+            buffer, strip_width, nrows, GDT_Float64, strip_bands, NULL,
+            0, 0, block_pixels * sizeof(double)
+        );
+        worker->fid_ds->RasterIO(GF_Write, 0, row, strip_width, nrows,
+            fids, strip_width, nrows, GDT_Int32, 1, NULL,
+            0, 0, 0
+        );
+        worker->loc_ds->RasterIO(GF_Write, 0, row, strip_width, nrows,
+            locs, strip_width, nrows, GDT_Float32, 2, NULL,
+            0, 0, block_pixels * sizeof(float)
+        );
+    }
 }
 
+
 /**
   * Creates output strips according to the minirasters registered in mrbi_list.
+  * The strip is written in blocks of complete rows; each block is filled with
+  * the background values and the window data read directly from the source
+  * raster of the corresponding miniraster.
+  * The minirasters are transferred by globalOptions.num_threads workers,
+  * each one with its own handles on the source and output rasters.
   */
 void starspan_create_strip(
     GDALDataType strip_band_type,
     int strip_bands,
-    string prefix,
     vector<MRBasicInfo>* mrbi_list,
     string strip_filename,
     string fid_filename,
@@ -537,18 +893,6 @@ void starspan_create_strip(
             <<strip_width<< " x " <<strip_height<< " x " <<strip_bands<< endl;
     }
 
-    /////////////////////////////////////////////////////////////////////
-    // allocate transfer buffer with enough space for the longest row	
-    const long doubles = (long)strip_width * strip_bands;
-    if ( globalOptions.verbose ) {
-        cout<< "Allocating " <<doubles<< " doubles for buffer\n";
-    }
-    double* buffer = new double[doubles];
-    if ( !buffer ) {
-        cerr<< " Cannot allocate " <<doubles<< " doubles for buffer\n";
-        return;
-    }
-    
     //////////////////////////////////////////////
     // the band types for the strips: 
     const GDALDataType fid_band_type = GDT_Int32; 
@@ -557,6 +901,7 @@ void starspan_create_strip(
     
     ////////////////////////////////////////////////////////////////
     // create output rasters
+    // (no initial fill needed: every row is written by the workers)
     ///////////////////////////////////////////////////////////////
 
     char **papszOptions = NULL;
@@ -569,14 +914,9 @@ void starspan_create_strip(
         papszOptions 
     );
     if ( !strip_ds ) {
-        delete buffer;
         cerr<< "Couldn't create " <<strip_filename<< endl;
         return;
     }
-    // fill with globalOptions.nodata
-    for ( int k = 0; k < strip_bands; k++ ) {
-        strip_ds->GetRasterBand(k+1)->Fill(globalOptions.nodata);
-    }
     
     /////////////////////////////////////////////////////////////////////
     // create FID 1-band image:
@@ -588,13 +928,9 @@ void starspan_create_strip(
     if ( !fid_ds ) {
         delete strip_ds;
         hDriver->Delete(strip_filename.c_str());
-        delete buffer;
         cerr<< "Couldn't create " <<fid_filename<< endl;
         return;
     }
-    // fill with -1 as "background" value. 
-    // -1 is chosen as normally FIDs starts from zero.
-    fid_ds->GetRasterBand(1)->Fill(-1);
     
     /////////////////////////////////////////////////////////////////////
     // create 2-band loc image:
@@ -608,225 +944,117 @@ void starspan_create_strip(
         hDriver->Delete(fid_filename.c_str());
         delete strip_ds;
         hDriver->Delete(strip_filename.c_str());
-        delete buffer;
         cerr<< "Couldn't create " <<loc_filename<< endl;
         return;
     }
-    // fill with 0 as "background" value.
-    // 0 is arbitrarely chosen.
-    loc_ds->GetRasterBand(1)->Fill(0);
-    loc_ds->GetRasterBand(2)->Fill(0);
+    
+    ///////////////////////////////////////////////////////////////
+    //
+    // set projection for generated strips using the info from
+    // the raster of the (arbitrarely chosen) first miniraster:
+    //
+    GDALDataset* src_ds = (GDALDataset*) GDALOpen(mrbi_list->front().raster_filename.c_str(), GA_ReadOnly);
+    if ( src_ds ) {
+        const char* projection = src_ds->GetProjectionRef();
+        if ( projection && strlen(projection) > 0 ) {
+            strip_ds->SetProjection(projection);
+            fid_ds->  SetProjection(projection);                   
+            loc_ds->  SetProjection(projection);
+        }
+        
+        //
+        // also, set the geotransform accordingly, that is, keep them from
+        // the first miniraster but adjust origin point to be (0,0):
+        //
+        double adfGeoTransform[6];
+        src_ds->GetGeoTransform(adfGeoTransform);
+        adfGeoTransform[0] = 0;   // top left x
+        adfGeoTransform[3] = 0;   // top left y
+        strip_ds->SetGeoTransform(adfGeoTransform);
+        fid_ds->  SetGeoTransform(adfGeoTransform);                   
+        loc_ds->  SetGeoTransform(adfGeoTransform);
+        
+        delete src_ds;
+    }
+    
+    // close the outputs (so the headers get written); each worker opens 
+    // its own handles below:
+    delete strip_ds;
+    delete fid_ds;
+    delete loc_ds;
     
     
     /////////////////////////////////////////////////////////////////////
-    // transfer data, fid, and loc from minirasters to output strips
+    // transfer data, fid, and loc from source rasters to output strips
     /////////////////////////////////////////////////////////////////////
     
-    int processed_minirasters = 0;
+    WorkerPool pool(min(globalOptions.num_threads, (int) mrbi_list->size()));
     
-    /////////////////////////////////////////////////////////////////////
-    // for each miniraster (according to mrbi_list):
-    for ( vector<MRBasicInfo>::const_iterator mrbi = mrbi_list->begin(); 
-    mrbi != mrbi_list->end(); mrbi++, processed_minirasters++ ) {
+    StripCreation sc;
+    sc.mrbi_list = mrbi_list;
+    sc.strip_width = strip_width;
+    sc.strip_height = strip_height;
+    sc.strip_bands = strip_bands;
     
-        if ( globalOptions.verbose ) {
-            cout<< "  adding miniraster FID=" <<mrbi->FID<< " to strip...\n";
-        }
-
-        // get miniraster filename:
-        string mini_filename = mrbi->mini_filename; //create_filename(prefix, mrbi->FID);
-        
-        ///////////////////////
-        // open miniraster
-        GDALDataset* mini_ds = (GDALDataset*) GDALOpen(mini_filename.c_str(), GA_ReadOnly);
-        if ( !mini_ds ) {
-            cerr<< " Unexpected: couldn't read " <<mini_filename<< endl;
-            hDriver->Delete(mini_filename.c_str());
-            unlink(create_filename_hdr(prefix, mrbi->FID).c_str()); // hack
-            continue;
-        }
-        
-        // row to position miniraster in strip:
-        int next_row = mrbi->mrs_row;
-
-        // column to position miniraster in strip:
-        int next_col = 0;
-        
-
-        ///////////////////////////////////////////////////////////////
-        // transfer data to image strip (row by row):			
-        for ( int i = 0; i < mini_ds->GetRasterYSize(); i++ ) {
-            
-            // read data from raster into buffer
-            // (note: reading is always (0,0)-relative in source miniraster)
-            mini_ds->RasterIO(GF_Read,
-                0,   	                     //nXOff,
-                0 + i,  	                 //nYOff,
-                mini_ds->GetRasterXSize(),   //nXSize,
-                1,                           //nYSize,
-                buffer,                      //pData,
-                mini_ds->GetRasterXSize(),   //nBufXSize,
-                1,                           //nBufYSize,
-                strip_band_type,             //eBufType,
-                strip_bands,                 //nBandCount,
-                NULL,                        //panBandMap,
-                0,                           //nPixelSpace,
-                0,                           //nLineSpace,
-                0                            //nBandSpace
-            );  	
-            
-            // write buffer in strip image
-            // (note: wiritn is (next_col,next_row)-based in destination strip)
-            strip_ds->RasterIO(GF_Write,
-                next_col,                    //nXOff,
-                next_row + i,                //nYOff,
-                mini_ds->GetRasterXSize(),   //nXSize,
-                1,                           //nYSize,
-                buffer,                      //pData,
-                mini_ds->GetRasterXSize(),   //nBufXSize,
-                1,                           //nBufYSize,
-                strip_band_type,             //eBufType,
-                strip_bands,                 //nBandCount,
-                NULL,                        //panBandMap,
-                0,                           //nPixelSpace,
-                0,                           //nLineSpace,
-                0                            //nBandSpace
-            );  	
+    // rows per transfer block:
+    const long row_bytes = (long) strip_width * (strip_bands * sizeof(double) + sizeof(int) + 2 * sizeof(float));
+    sc.block_rows = (int) max(1L, min((long) strip_height, STRIP_BLOCK_SIZE / row_bytes));
+    sc.block_pixels = (long) strip_width * sc.block_rows;
+    if ( globalOptions.verbose ) {
+        cout<< "Allocating buffers for " <<sc.block_rows<< " rows in each of " 
+            <<pool.getNumWorkers()<< " workers\n";
+    }
+    
+    bool ok = true;
+    sc.workers.resize(pool.getNumWorkers());
+    for ( unsigned w = 0; w < sc.workers.size(); w++ ) {
+        StripWorker& worker = sc.workers[w];
+        worker.strip_ds = (GDALDataset*) GDALOpen(strip_filename.c_str(), GA_Update);
+        worker.fid_ds = (GDALDataset*) GDALOpen(fid_filename.c_str(), GA_Update);
+        worker.loc_ds = (GDALDataset*) GDALOpen(loc_filename.c_str(), GA_Update);
+        worker.src_ds = 0;
+        worker.buffer = new double[sc.block_pixels * strip_bands];
+        worker.fids = new int[sc.block_pixels];
+        worker.locs = new float[sc.block_pixels * 2];
+        if ( !worker.strip_ds || !worker.fid_ds || !worker.loc_ds ) {
+            ok = false;
         }
+    }
+    
+    if ( ok ) {
+        sc.open_mutex = CPLCreateMutex();
+        CPLReleaseMutex(sc.open_mutex);    // created acquired
         
-        ///////////////////////////////////////////////////////////////
-        // write FID chunck by replication
-        long fid_datum = mrbi->FID;
-        
-        if ( false ) {  
-            // ----- should work but seems to be a RasterIO bug  -----
-            // NOTE: The arguments in the following call need to be reviewed
-            // since I haven't paid much attention to keep it up to date.
-            fid_ds->RasterIO(GF_Write,
-                next_col,                  //nXOff,
-                next_row,                  //nYOff,
-                mini_ds->GetRasterXSize(), //nXSize,
-                mini_ds->GetRasterYSize(), //nYSize,
-                &fid_datum,                //pData,
-                1,                         //nBufXSize,
-                1,                         //nBufYSize,
-                fid_band_type,             //eBufType,
-                1,                         //nBandCount,
-                NULL,                      //panBandMap,
-                0,                         //nPixelSpace,
-                0,                         //nLineSpace,
-                0                          //nBandSpace
-            );
-        }
-        else { 
-           // ------- workaround  -------------
-            // replicate FID in buffer
-            int* fids = (int*) buffer;
-            for ( int j = 0; j < mini_ds->GetRasterXSize(); j++ ) {
-                fids[j] = (int) mrbi->FID;
-            }
-            for ( int i = 0; i < mini_ds->GetRasterYSize(); i++ ) {
-                fid_ds->RasterIO(GF_Write,
-                    next_col,                   //nXOff,
-                    next_row + i,               //nYOff,
-                    mini_ds->GetRasterXSize(),  //nXSize,
-                    1,                          //nYSize,
-                    fids,                       //pData,
-                    mini_ds->GetRasterXSize(),  //nBufXSize,
-                    1,                          //nBufYSize,
-                    fid_band_type,              //eBufType,
-                    1,                          //nBandCount,
-                    NULL,                       //panBandMap,
-                    0,                          //nPixelSpace,
-                    0,                          //nLineSpace,
-                    0                           //nBandSpace
-                );
-            }
-        }
+        pool.run(mrbi_list->size(), transfer_miniraster, &sc);
         
-        ///////////////////////////////////////////////////////////////
-        // write loc data
-        double adfGeoTransform[6];
-        mini_ds->GetGeoTransform(adfGeoTransform);
-        float pix_x_size = (float) adfGeoTransform[1];
-        float pix_y_size = (float) adfGeoTransform[5];
-        float x0 = (float) adfGeoTransform[0];
-        float y0 = (float) adfGeoTransform[3];
-        float xy[2] = { x0, y0 };
-        for ( int i = 0; i < mini_ds->GetRasterYSize(); i++, xy[1] += pix_y_size ) {
-            xy[0] = x0;
-            for ( int j = 0; j < mini_ds->GetRasterXSize(); j++, xy[0] += pix_x_size ) {
-                loc_ds->RasterIO(GF_Write,
-                    next_col + j,               //nXOff,
-                    next_row + i,               //nYOff,
-                    1,                          //nXSize,
-                    1,                          //nYSize,
-                    xy,                         //pData,
-                    1,                          //nBufXSize,
-                    1,                          //nBufYSize,
-                    loc_band_type,              //eBufType,
-                    2,                          //nBandCount,
-                    NULL,                       //panBandMap,
-                    0,                          //nPixelSpace,
-                    0,                          //nLineSpace,
-                    0                           //nBandSpace
-                );
-            }
+        CPLDestroyMutex(sc.open_mutex);
+    }
+    else {
+        cerr<< "Couldn't open the strips for update\n";
+    }
+    
+    for ( unsigned w = 0; w < sc.workers.size(); w++ ) {
+        StripWorker& worker = sc.workers[w];
+        if ( worker.src_ds ) {
+            delete worker.src_ds;
         }
         
-        ///////////////////////////////////////////////////////////////
-        //
-        // is this the first miniraster?
-        //
-        if ( processed_minirasters == 0 ) {
-            //
-            // then, set projection for generated strips using the info from
-            // this (arbitrarely chosen) first miniraster:
-            //
-            const char* projection = mini_ds->GetProjectionRef();
-            if ( projection && strlen(projection) > 0 ) {
-                strip_ds->SetProjection(projection);
-                fid_ds->  SetProjection(projection);                   
-                loc_ds->  SetProjection(projection);
-            }
-            
-            //
-            // also, set the geotransform accordingly, that is, keep them from
-            // the first miniraster but adjust origin point to be (0,0):
-            //
-            adfGeoTransform[0] = 0;   // top left x
-            adfGeoTransform[3] = 0;   // top left y
-            strip_ds->SetGeoTransform(adfGeoTransform);
-            fid_ds->  SetGeoTransform(adfGeoTransform);                   
-            loc_ds->  SetGeoTransform(adfGeoTransform);
+        // close outputs
+        if ( worker.strip_ds ) {
+            delete worker.strip_ds;
         }
-        
-        ///////////////////////////////////////////////////////////////
-        if ( false ) {  
-            // GDAL bug: ENVIDataset::FlushCache is not idempotent
-            // for header file (repeated items would be generated)
-            strip_ds->FlushCache();
-            fid_ds->FlushCache();
-            loc_ds->FlushCache();
+        if ( worker.fid_ds ) {
+            delete worker.fid_ds;
         }
-        else {
-            // workaround: don't call FlushCache; it seems
-            // we don't need these calls anyway.
+        if ( worker.loc_ds ) {
+            delete worker.loc_ds;
         }
         
-        // close and delete miniraster
-        delete mini_ds;
-        hDriver->Delete(mini_filename.c_str());
-        unlink(create_filename_hdr(prefix, mrbi->FID).c_str()); // hack
+        // release buffers
+        delete[] worker.buffer;
+        delete[] worker.fids;
+        delete[] worker.locs;
     }
-    
-    // close outputs
-    delete strip_ds;
-    delete fid_ds;
-    delete loc_ds;
-    
-    // release buffer
-    delete buffer;
 }
 
 
@@ -0,0 +1,56 @@
+//
+//	Covariance - streaming band covariance calculator
+//	See Covariance.h for public doc.
+//
+
+#include "Covariance.h"
+
+
+Covariance::Covariance(unsigned num_bands)
+: num_bands(num_bands), mean(num_bands), delta(num_bands), 
+  comoment(num_bands * (num_bands + 1) / 2) {
+	reset();
+}
+
+void Covariance::reset() {
+	count = 0;
+	for ( unsigned i = 0; i < num_bands; i++ ) {
+		mean[i] = 0.0;
+	}
+	for ( unsigned k = 0; k < comoment.size(); k++ ) {
+		comoment[k] = 0.0;
+	}
+}
+
+void Covariance::add(const double* values) {
+	count++;
+	const double inv_count = 1.0 / count;
+	double* m = &mean[0];
+	double* d = &delta[0];
+	
+	// delta with respect to the previous mean, then update the mean:
+	for ( unsigned i = 0; i < num_bands; i++ ) {
+		d[i] = values[i] - m[i];
+		m[i] += d[i] * inv_count;
+	}
+	
+	// C[i][j] += (x_i - old_mean_i) * (x_j - new_mean_j), for j >= i:
+	double* c = &comoment[0];
+	for ( unsigned i = 0; i < num_bands; i++ ) {
+		const double di = d[i];
+		for ( unsigned j = i; j < num_bands; j++ ) {
+			*c++ += di * (values[j] - m[j]);
+		}
+	}
+}
+
+double Covariance::getCovariance(unsigned i, unsigned j) {
+	if ( count < 2 )
+		return 0.0;
+	if ( i > j ) {
+		unsigned t = i; i = j; j = t;
+	}
+	// offset of row i in the packed upper triangle:
+	unsigned k = i * num_bands - i * (i - 1) / 2 + (j - i);
+	return comoment[k] / (count - 1);
+}
@@ -0,0 +1,62 @@
+//
+// Covariance - streaming band covariance calculator
+//
+
+#ifndef Covariance_h
+#define Covariance_h
+
+#include <vector>
+
+using namespace std;
+
+
+/**
+  * Streaming calculator of the mean vector and the BxB covariance
+  * matrix of B-band observations.
+  *
+  * Values are accumulated one observation at a time (Welford's method,
+  * updated across all bands at once), so no per-pixel values need to be
+  * kept in memory. Only the upper triangle of the co-moment matrix is
+  * maintained; the matrix is symmetric.
+  */
+class Covariance {
+public:
+	/** creates a calculator for the given number of bands. */
+	Covariance(unsigned num_bands);
+	
+	/** discards any accumulated observation. */
+	void reset();
+	
+	/** number of bands */
+	unsigned getNumBands() { return num_bands; }
+	
+	/** number of observations added since last reset */
+	long getCount() { return count; }
+	
+	/**
+	  * adds an observation.
+	  * @param values num_bands values.
+	  */
+	void add(const double* values);
+	
+	/** mean of band i (0-based) */
+	double getMean(unsigned i) { return mean[i]; }
+	
+	/**
+	  * sample covariance between bands i and j (0-based).
+	  * Returns 0 if less than two observations have been added.
+	  */
+	double getCovariance(unsigned i, unsigned j);
+	
+private:
+	unsigned num_bands;
+	long count;
+	vector<double> mean;
+	vector<double> delta;
+	
+	// co-moments, upper triangle in row-major order
+	vector<double> comoment;
+};
+
+
+#endif
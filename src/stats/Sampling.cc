@@ -0,0 +1,129 @@
+//
+//	Sampling - stratified random sampling of a population
+//	See Sampling.h for public doc.
+//
+
+#include "Sampling.h"
+
+#include <cmath>
+
+
+StratifiedSample::StratifiedSample(unsigned population, unsigned num_strata_, unsigned long seed)
+: population(population), num_strata(num_strata_) {
+	if ( num_strata > population )
+		num_strata = population;
+	if ( num_strata == 0 )
+		num_strata = 1;
+	
+	for ( unsigned h = 0; h <= num_strata; h++ ) {
+		starts.push_back((unsigned) ((double) population * h / num_strata));
+	}
+	perm.resize(population);
+	for ( unsigned i = 0; i < population; i++ ) {
+		perm[i] = i;
+	}
+	taken.resize(num_strata, 0);
+	rnd_state = seed * 2654435761UL + 1;
+}
+
+// a simple linear congruential generator: enough for selection and
+// reproducible across platforms
+unsigned StratifiedSample::random(unsigned n) {
+	rnd_state = (rnd_state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+	return (unsigned) ((double) rnd_state / 2147483648.0 * n);
+}
+
+void StratifiedSample::extend(unsigned n) {
+	if ( n > population )
+		n = population;
+	for ( unsigned h = 0; h < num_strata; h++ ) {
+		const unsigned size = getStratumSize(h);
+		
+		// proportional allocation, at least one per stratum:
+		unsigned n_h = (unsigned) ceil((double) n * size / population);
+		if ( n_h < 1 )
+			n_h = 1;
+		if ( n_h > size )
+			n_h = size;
+		
+		// select elements taken[h] .. n_h-1 of the stratum:
+		unsigned* p = &perm[starts[h]];
+		for ( unsigned k = taken[h]; k < n_h; k++ ) {
+			unsigned j = k + random(size - k);
+			unsigned t = p[k]; p[k] = p[j]; p[j] = t;
+			indices.push_back(p[k]);
+			strata.push_back(h);
+		}
+		if ( taken[h] < n_h )
+			taken[h] = n_h;
+	}
+}
+
+unsigned StratifiedSample::estimateMean(const vector<double>& values, const vector<unsigned char>& valid, 
+	double z, double* mean, double* half_width
+) {
+	// per-stratum counts, sums and sums of squares of valid values:
+	vector<double> count(num_strata, 0.0), sum(num_strata, 0.0), sum2(num_strata, 0.0);
+	for ( unsigned k = 0; k < values.size(); k++ ) {
+		if ( !valid[k] )
+			continue;
+		const unsigned h = strata[k];
+		count[h] += 1;
+		sum[h] += values[k];
+		sum2[h] += values[k] * values[k];
+	}
+	
+	// since the allocation is proportional, weights are taken from the
+	// strata sizes restricted to those with valid values:
+	double total_weight = 0.0;
+	unsigned num_valid = 0;
+	for ( unsigned h = 0; h < num_strata; h++ ) {
+		if ( count[h] > 0 ) {
+			total_weight += getStratumSize(h);
+			num_valid += (unsigned) count[h];
+		}
+	}
+	*mean = *half_width = 0.0;
+	if ( num_valid == 0 )
+		return 0;
+	
+	double var_mean = 0.0;
+	for ( unsigned h = 0; h < num_strata; h++ ) {
+		if ( count[h] == 0 )
+			continue;
+		const double W_h = getStratumSize(h) / total_weight;
+		const double mean_h = sum[h] / count[h];
+		*mean += W_h * mean_h;
+		if ( count[h] > 1 ) {
+			double s2_h = (sum2[h] - count[h] * mean_h * mean_h) / (count[h] - 1);
+			if ( s2_h < 0 )
+				s2_h = 0;
+			const double fpc = 1.0 - (double) taken[h] / getStratumSize(h);
+			var_mean += W_h * W_h * s2_h / count[h] * fpc;
+		}
+	}
+	*half_width = z * sqrt(var_mean);
+	return num_valid;
+}
+
+unsigned StratifiedSample::requiredSize(double cv, double rel_error, double z, unsigned population) {
+	double n0 = z * cv / rel_error;
+	n0 *= n0;
+	double n = n0 / (1.0 + n0 / population);
+	if ( !(n < population) )   // also if cv is not finite
+		return population;
+	return (unsigned) ceil(n);
+}
+
+double StratifiedSample::normalQuantile(double confidence) {
+	// solve erf(z/sqrt(2)) = confidence by bisection
+	double lo = 0.0, hi = 10.0;
+	for ( int i = 0; i < 60; i++ ) {
+		double mid = (lo + hi) / 2;
+		if ( erf(mid / sqrt(2.0)) < confidence )
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo + hi) / 2;
+}
@@ -0,0 +1,95 @@
+//
+// Sampling - stratified random sampling of a population
+//
+
+#ifndef Sampling_h
+#define Sampling_h
+
+#include <vector>
+
+using namespace std;
+
+
+/**
+  * Stratified random sample (without replacement) of the elements
+  * 0..N-1 of a population. The population is split into contiguous
+  * strata of (almost) equal size, and the sample is allocated
+  * proportionally to the stratum sizes, so it is self-weighting.
+  *
+  * The sample can be extended (e.g., after a pilot sample) keeping the
+  * elements already selected. Selection is reproducible for a given seed.
+  */
+class StratifiedSample {
+public:
+	/**
+	  * @param population N
+	  * @param num_strata desired number of strata (reduced if N is small)
+	  * @param seed for the random selection
+	  */
+	StratifiedSample(unsigned population, unsigned num_strata, unsigned long seed);
+	
+	/**
+	  * Extends the sample to approximately n elements (at least one per stratum).
+	  * The new elements are appended to the list given by getIndices().
+	  */
+	void extend(unsigned n);
+	
+	/** the selected elements (with getStrata() giving their strata) */
+	const vector<unsigned>& getIndices() { return indices; }
+	const vector<unsigned>& getStrata() { return strata; }
+	
+	unsigned getNumStrata() { return num_strata; }
+	unsigned getPopulation() { return population; }
+	
+	/** size of stratum h in the population */
+	unsigned getStratumSize(unsigned h) { return starts[h+1] - starts[h]; }
+	
+	/**
+	  * Estimates the population mean of some variable from its values in the
+	  * sample, along with the half-width of the confidence interval.
+	  * @param values values of the variable for the elements in getIndices()
+	  * @param valid  only values[k] with valid[k] != 0 are considered
+	  * @param z      standard normal quantile for the desired confidence
+	  * @param mean   the estimate
+	  * @param half_width  half-width of the confidence interval for the mean
+	  * @return number of valid values used
+	  */
+	unsigned estimateMean(const vector<double>& values, const vector<unsigned char>& valid, 
+		double z, double* mean, double* half_width);
+	
+	/**
+	  * Sample size needed to estimate a mean with a given relative error,
+	  * according to the coefficient of variation observed in a sample.
+	  * @param cv coefficient of variation (stdev/mean)
+	  * @param rel_error target relative error (e.g., 0.01)
+	  * @param z standard normal quantile for the desired confidence
+	  * @param population population size (for finite population correction)
+	  */
+	static unsigned requiredSize(double cv, double rel_error, double z, unsigned population);
+	
+	/** standard normal quantile z such that P(|Z| <= z) = confidence */
+	static double normalQuantile(double confidence);
+	
+private:
+	unsigned population;
+	unsigned num_strata;
+	
+	// stratum h is [starts[h], starts[h+1])
+	vector<unsigned> starts;
+	
+	// permutation of the population, shuffled within each stratum as 
+	// the sample grows (partial Fisher-Yates)
+	vector<unsigned> perm;
+	
+	// number of elements selected from each stratum
+	vector<unsigned> taken;
+	
+	vector<unsigned> indices;
+	vector<unsigned> strata;
+	
+	unsigned long rnd_state;
+	unsigned random(unsigned n);
+};
+
+
+#endif
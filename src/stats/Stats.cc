@@ -15,33 +15,51 @@
 
 
 void Stats::compute(vector<int>& values, int nodata) {
+	vector<unsigned char> valid(values.size());
+	for ( unsigned i = 0; i < values.size(); i++ ) {
+		valid[i] = values[i] != nodata;
+	}
+	compute(values, valid);
+}
+
+// median of the sample (which gets reordered)
+template <class T>
+static double median_of(vector<T>& sample) {
+	const unsigned sample_size = sample.size();
+	// 0-based middle position(s):
+	const unsigned pos_two = sample_size / 2;
+	nth_element(sample.begin(), sample.begin() + pos_two, sample.end());
+	double median = sample[pos_two];
+	if ( (sample_size % 2) == 0 ) { //even
+		// the other middle value is the maximum of the lower part:
+		median = (*max_element(sample.begin(), sample.begin() + pos_two) + median) / 2.0;
+	}
+	return median;
+}
+
+unsigned Stats::compute(vector<int>& values, const vector<unsigned char>& valid) {
 	//
 	// Note that stats that require only a first pass are always computed.
 	//
 	
-	unsigned total_pixels = values.size();
-	
-	// Remove nodata values from the vector
-	values.erase(remove(values.begin(), values.end(), nodata), values.end());
+	const unsigned total_pixels = values.size();
 	
 	// initialize result:
 	for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
 		result[i] = 0.0;
 	}
 	
-	const unsigned num_values = values.size();
-	if ( num_values == 0 )
-		return;
-
-	result[NULLS] = total_pixels - num_values;
-	
-	result[MIN] = result[MAX] = values[0];
-
-	for ( unsigned i = 0; i < num_values; i++ ) {
+	unsigned num_values = 0;
+	for ( unsigned i = 0; i < total_pixels; i++ ) {
+		if ( !valid[i] )
+			continue;
 		const int value = values[i];
+		
+		if ( num_values++ == 0 ) 
+			result[MIN] = result[MAX] = value;
 
-        	// cumulate
-        	result[SUM] += value;
+		// cumulate
+		result[SUM] += value;
 	
 		// min and max:
 		// min
@@ -53,10 +71,13 @@ void Stats::compute(vector<int>& values, int nodata) {
 			result[MAX] = value; 
 	}
 	
+	if ( num_values == 0 )
+		return 0;
+
+	result[NULLS] = total_pixels - num_values;
+	
 	// average
-	if ( num_values > 0 ) {
-		result[AVG] = result[SUM] / num_values;
-	}
+	result[AVG] = result[SUM] / num_values;
 
 	if ( include[VAR] || include[STDEV] ) {
 		
@@ -68,11 +89,11 @@ void Stats::compute(vector<int>& values, int nodata) {
 			double aux_CUM = 0.0;
 			
 			// take values again
-			for ( unsigned i = 0; i < num_values; i++ ) {
-				const int value = values[i];
-	
+			for ( unsigned i = 0; i < total_pixels; i++ ) {
+				if ( !valid[i] )
+					continue;
 				// cumulate square variance:
-				double h = value - result[AVG];
+				double h = values[i] - result[AVG];
 				aux_CUM += h * h; 
 			}
 			
@@ -85,8 +106,11 @@ void Stats::compute(vector<int>& values, int nodata) {
 
 	if ( include[MODE] ) {
 		map<int,int> count;
-		computeCounts(values, count);		
-		int best_value;
+		for ( unsigned i = 0; i < total_pixels; i++ ) {
+			if ( valid[i] )
+				count[values[i]]++;
+		}
+		int best_value = 0;
 		int best_count = 0;
 		for ( map<int, int>::iterator it = count.begin(); it != count.end(); it++ ) {
 			pair<int,int> p = *it;
@@ -100,24 +124,16 @@ void Stats::compute(vector<int>& values, int nodata) {
 	}
 
 	if ( include[MEDIAN] ) {
-		sort(values.begin(), values.end()); 
-		int sample_size = values.size();
-		double median;
-		double middle_position_one;
-		double middle_position_two;
-
-  		if ((sample_size % 2) == 0){ //even
-			middle_position_one = (sample_size /2);
-			middle_position_two = (sample_size /2)+1;
-			median = (values[int(middle_position_one-1)] + values[int(middle_position_two-1)])/2.0;
-
-		} else if ((sample_size % 2) != 0) { //odd
-				middle_position_one = (sample_size /2)+1;
-				median = values[int(middle_position_one-1)];
+		// only the median needs the valid values apart:
+		vector<int> sample;
+		sample.reserve(num_values);
+		for ( unsigned i = 0; i < total_pixels; i++ ) {
+			if ( valid[i] )
+				sample.push_back(values[i]);
 		}
-	        result[MEDIAN] = median;
+		result[MEDIAN] = median_of(sample);
 	}
-
+	return num_values;
 }
 
 void Stats::computeCounts(vector<int>& values, map<int,int>& count) {
@@ -134,30 +150,34 @@ void Stats::computeCounts(vector<int>& values, map<int,int>& count) {
 
 
 void Stats::compute(vector<double>& values, double nodata) {
+	vector<unsigned char> valid(values.size());
+	for ( unsigned i = 0; i < values.size(); i++ ) {
+		valid[i] = values[i] != nodata;
+	}
+	compute(values, valid);
+}
+
+unsigned Stats::compute(vector<double>& values, const vector<unsigned char>& valid) {
 	//
 	// Note that stats that require only a first pass are always computed.
 	//
 
-	unsigned total_pixels = values.size();
-
-	// Remove nodata values from the vector
-	values.erase(remove(values.begin(), values.end(), nodata), values.end());
+	const unsigned total_pixels = values.size();
 
 	// initialize result:
 	for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
 		result[i] = 0.0;
 	}
 	
-	const unsigned num_values = values.size();
-	if ( num_values == 0 )
-		return;
-	
-	result[NULLS] = total_pixels - num_values;
-	result[MIN] = result[MAX] = values[0];
-	
-	for ( unsigned i = 0; i < num_values; i++ ) {
+	unsigned num_values = 0;
+	for ( unsigned i = 0; i < total_pixels; i++ ) {
+		if ( !valid[i] )
+			continue;
 		const double value = values[i];
 
+		if ( num_values++ == 0 ) 
+			result[MIN] = result[MAX] = value;
+
 		// cumulate
 		result[SUM] += value;
 	
@@ -171,10 +191,13 @@ void Stats::compute(vector<double>& values, double nodata) {
 			result[MAX] = value; 
 	}
 	
+	if ( num_values == 0 )
+		return 0;
+	
+	result[NULLS] = total_pixels - num_values;
+
 	// average
-	if ( num_values > 0 ) {
-		result[AVG] = result[SUM] / num_values;
-	}
+	result[AVG] = result[SUM] / num_values;
 
 	if ( include[VAR] || include[STDEV] ) {
 		
@@ -186,11 +209,11 @@ void Stats::compute(vector<double>& values, double nodata) {
 			double aux_CUM = 0.0;
 			
 			// take values again
-			for ( unsigned i = 0; i < num_values; i++ ) {
-				const double value = values[i];
-	
+			for ( unsigned i = 0; i < total_pixels; i++ ) {
+				if ( !valid[i] )
+					continue;
 				// cumulate square variance:
-				double h = value - result[AVG];
+				double h = values[i] - result[AVG];
 				aux_CUM += h * h; 
 			}
 			
@@ -205,16 +228,12 @@ void Stats::compute(vector<double>& values, double nodata) {
 		map<string,int> count;
 		
 		// take values again
-		for ( unsigned i = 0; i < num_values; i++ ) {
-			const double value = values[i];
+		for ( unsigned i = 0; i < total_pixels; i++ ) {
+			if ( !valid[i] )
+				continue;
 			char str[1024];
-			sprintf(str, "%.3f", value);
-			string key = str;
-			map<string, int>::iterator it = count.find(str); 
-			if ( it == count.end() )
-				count.insert(map<string,int>::value_type(str, 1));
-			else
-				count[str]++;
+			sprintf(str, "%.3f", values[i]);
+			count[str]++;
 		}
 		string best_str;
 		int best_count = 0;
@@ -230,22 +249,99 @@ void Stats::compute(vector<double>& values, double nodata) {
 	}
 
 	if ( include[MEDIAN] ) {
-		sort(values.begin(), values.end()); 
-		int sample_size = values.size();
-		double median;
-		double middle_position_one;
-		double middle_position_two;
-
-  		if ((sample_size % 2) == 0){  //even
-			middle_position_one = (sample_size /2);
-			middle_position_two = (sample_size /2)+1;
-			median = (values[int(middle_position_one-1)] + values[int(middle_position_two-1)])/2.0;
-		} else if ((sample_size % 2) != 0) {  //odd
-				middle_position_one = (sample_size /2)+1;
-				median = values[int(middle_position_one-1)];
+		// only the median needs the valid values apart:
+		vector<double> sample;
+		sample.reserve(num_values);
+		for ( unsigned i = 0; i < total_pixels; i++ ) {
+			if ( valid[i] )
+				sample.push_back(values[i]);
 		}
-	        result[MEDIAN] = median;
+		result[MEDIAN] = median_of(sample);
 	}
+	return num_values;
 }
 
 
+StatsAccumulator::StatsAccumulator(bool keep_histogram) 
+: keep_histogram(keep_histogram) {
+	count = nulls = 0;
+	sum = min = max = mean = m2 = 0.0;
+}
+
+void StatsAccumulator::add(double value) {
+	if ( count == 0 ) {
+		min = max = value;
+	}
+	else {
+		if ( min > value ) 
+			min = value; 
+		if ( max < value ) 
+			max = value; 
+	}
+	count++;
+	sum += value;
+	
+	double delta = value - mean;
+	mean += delta / count;
+	m2 += delta * (value - mean);
+	
+	if ( keep_histogram ) {
+		histogram[value]++;
+	}
+}
+
+void StatsAccumulator::compute(double result[TOT_RESULTS]) {
+	for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
+		result[i] = 0.0;
+	}
+	if ( count == 0 )
+		return;
+	
+	result[NULLS] = nulls;
+	result[SUM] = sum;
+	result[MIN] = min;
+	result[MAX] = max;
+	result[AVG] = sum / count;
+	
+	if ( count > 1 ) {
+		result[VAR] = m2 / (count - 1);
+		result[STDEV] = sqrt(result[VAR]);
+	}
+	
+	if ( keep_histogram ) {
+		// mode: as in Stats::compute, values are binned by their "%.3f"
+		// rendering, and the first bin (in string order) with the highest
+		// count is taken:
+		map<string,long> bins;
+		for ( map<double,long>::iterator it = histogram.begin(); it != histogram.end(); it++ ) {
+			char str[1024];
+			sprintf(str, "%.3f", it->first);
+			bins[str] += it->second;
+		}
+		long best_count = 0;
+		for ( map<string,long>::iterator it = bins.begin(); it != bins.end(); it++ ) {
+			if ( best_count < it->second ) {
+				result[MODE] = atof(it->first.c_str());
+				best_count = it->second;
+			}
+		}
+		
+		// median: value at 1-based position (count+1)/2, or the
+		// average of the values at count/2 and count/2+1 if count is even
+		long pos_one = (count % 2) == 0 ? count / 2 : count / 2 + 1;
+		long pos_two = (count % 2) == 0 ? count / 2 + 1 : pos_one;
+		double value_one = 0.0, value_two = 0.0;
+		long cum = 0;
+		for ( map<double,long>::iterator it = histogram.begin(); it != histogram.end(); it++ ) {
+			long prev_cum = cum;
+			cum += it->second;
+			if ( prev_cum < pos_one && pos_one <= cum )
+				value_one = it->first;
+			if ( prev_cum < pos_two && pos_two <= cum ) {
+				value_two = it->first;
+				break;
+			}
+		}
+		result[MEDIAN] = (value_one + value_two) / 2.0;
+	}
+}
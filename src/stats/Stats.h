@@ -62,6 +62,24 @@ public:
 	  */
 	void compute(vector<double>& values, double nodata); 
 	
+	/**
+	  * compute those stats s where include[s] == true, only
+	  * considering values[i] such that valid[i] != 0.
+	  * Invalid entries are counted as NULLS.
+	  * The values are not modified.
+	  * @return the number of valid values. If zero, all results are 0.
+	  */
+	unsigned compute(vector<int>& values, const vector<unsigned char>& valid); 
+	
+	/**
+	  * compute those stats s where include[s] == true, only
+	  * considering values[i] such that valid[i] != 0.
+	  * Invalid entries are counted as NULLS.
+	  * The values are not modified.
+	  * @return the number of valid values. If zero, all results are 0.
+	  */
+	unsigned compute(vector<double>& values, const vector<unsigned char>& valid); 
+	
 	/**
 	  * Utility method to count the number of occurrences of each value.
 	  * Results are updated in the given map.
@@ -71,5 +89,46 @@ public:
 };
 
 
+/**
+  * Streaming statistics calculator.
+  * Values are added one at a time, so a single state can be fed from
+  * many features and rasters. A histogram of the values (and not the
+  * values themselves) is kept when MODE or MEDIAN is requested, so
+  * these results are exact.
+  * The results are defined as in Stats::compute.
+  */
+class StatsAccumulator {
+public:
+	/**
+	  * creates an empty accumulator.
+	  * @param keep_histogram true if MODE or MEDIAN will be needed.
+	  */
+	StatsAccumulator(bool keep_histogram = true);
+	
+	/** adds a valid value */
+	void add(double value);
+	
+	/** adds a nodata value */
+	void addNull() { nulls++; }
+	
+	/** number of valid values added */
+	long getCount() { return count; }
+	
+	/**
+	  * computes all results from the values added so far.
+	  * MODE and MEDIAN are 0 if no histogram is being kept.
+	  */
+	void compute(double result[TOT_RESULTS]);
+	
+private:
+	bool keep_histogram;
+	long count;
+	long nulls;
+	double sum, min, max;
+	double mean, m2;      // Welford's running mean and sum of squares
+	map<double,long> histogram;
+};
+
+
 #endif
 
@@ -7,10 +7,12 @@
 //
 
 #include "traverser.h"           
+#include "WorkerPool.h"
 
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <cmath>
 
 // for polygon processing:
 #include "geos/opPolygonize.h"
@@ -25,6 +27,12 @@ inline void swap_if_greater(int& a, int&b) {
 }
 
 
+// Number of tiles per thread. Tiles are handed out to the threads as
+// they become available, so tiles that are quickly resolved (eg., fully
+// inside the polygon) do not leave threads idle.
+#define QT_TILES_PER_THREAD 4
+
+
 
 // processValidPolygon_QT: Quadtree algorithm
 void Traverser::processValidPolygon_QT(Polygon* geos_poly) {
@@ -43,14 +51,110 @@ void Traverser::processValidPolygon_QT(Polygon* geos_poly) {
 	toGridXY(minCol, minRow, &x, &y);
 	_Rect env(this, x, y, maxCol - minCol + 1, maxRow - minRow +1);
 	
-	rasterize_poly_QT(env, geos_poly);
+	if ( !processSplitPolygon_QT(env, geos_poly) ) {
+		rasterize_poly_QT(env, geos_poly);
+	}
+}
+
+
+//
+// Rasterization of a large polygon on several threads. 
+// The envelope is split in tiles on the pixel grid, and the quadtree scan
+// of each tile is a task run by a WorkerPool. The tasks only collect the
+// rectangles to be dispatched and the messages to be logged; these are
+// then dispatched and logged in tile order by the calling thread. As the
+// inclusion of a pixel does not depend on the decomposition, the resulting
+// pixels are the same as with rasterize_poly_QT on the whole envelope.
+//
+struct Traverser::_QTSplit {
+	Traverser* tr;
+	
+	vector<_Rect> tiles;
+	
+	// a factory and a copy of the polygon in it for each worker: GEOS 
+	// geometries cache some derived data upon first use, and a factory
+	// keeps an unsynchronized count of the geometries referring to it, 
+	// so neither is shared
+	vector<GeometryFactory*> factories;
+	vector<Polygon*> polys;
+	
+	// rectangles to be dispatched and messages, for each tile
+	vector<_QTTile> results;
+};
+
+void Traverser::rasterizeTile_QT(int task, int worker, void* arg) {
+	_QTSplit* split = (_QTSplit*) arg;
+	_Rect& tile = split->tiles[task];
+	Geometry* inters = tile.intersect(split->polys[worker], &split->results[task].errors);
+	if ( inters ) {
+		split->tr->rasterize_geometry_QT(tile, inters, &split->results[task]);
+		delete inters;
+	}
+}
+
+//
+// Returns false if the polygon is not to be split.
+//
+bool Traverser::processSplitPolygon_QT(_Rect& env, Polygon* geos_poly) {
+	const int num_threads = getOptions().num_threads;
+	if ( num_threads <= 1 || (double) env.cols * env.rows < qt_split_min_pixels ) {
+		return false;
+	}
+	
+	// square tiles so there are about QT_TILES_PER_THREAD per thread:
+	const int num_tiles = num_threads * QT_TILES_PER_THREAD;
+	int side = (int) ceil(sqrt((double) env.cols * env.rows / num_tiles));
+	if ( side < 1 ) {
+		side = 1;
+	}
+	
+	_QTSplit split;
+	split.tr = this;
+	for ( int row = 0; row < env.rows; row += side ) {
+		const int rows = min(side, env.rows - row);
+		for ( int col = 0; col < env.cols; col += side ) {
+			const int cols = min(side, env.cols - col);
+			split.tiles.push_back(_Rect(this, 
+				env.x + col * pix_x_size, env.y + row * pix_y_size, cols, rows
+			));
+		}
+	}
+	split.results.resize(split.tiles.size());
+	
+	WorkerPool pool(min(num_threads, (int) split.tiles.size()));
+	for ( int w = 0; w < pool.getNumWorkers(); w++ ) {
+		GeometryFactory* factory = new GeometryFactory();
+		split.factories.push_back(factory);
+		split.polys.push_back(dynamic_cast<Polygon*>(factory->createGeometry(geos_poly)));
+	}
+	
+	pool.run(split.tiles.size(), rasterizeTile_QT, &split);
+	
+	// the geometries before their factories:
+	for ( unsigned w = 0; w < split.polys.size(); w++ ) {
+		delete split.polys[w];
+		delete split.factories[w];
+	}
+	
+	// merge: dispatch the pixels and log the messages of the tiles in order:
+	for ( unsigned t = 0; t < split.results.size(); t++ ) {
+		vector<_Rect>& found = split.results[t].found;
+		for ( unsigned k = 0; k < found.size(); k++ ) {
+			dispatchRect_QT(found[k]);
+		}
+		cerr<< split.results[t].errors;
+		if ( logstream ) {
+			(*logstream) << split.results[t].warnings;
+		}
+	}
+	return true;
 }
 
 // 
 // rasterize_geometry_QT and rasterize_poly_QT are mutually recursive
 // functions that implicitily do a quadtree-like scan:
 //
-void Traverser::rasterize_poly_QT(_Rect& e, Polygon* i) {
+void Traverser::rasterize_poly_QT(_Rect& e, Polygon* i, _QTTile* tile) {
 	if ( i == NULL || e.empty() )
 		return;
 
@@ -70,25 +174,31 @@ void Traverser::rasterize_poly_QT(_Rect& e, Polygon* i) {
 	//
 	if ( area_i >= area_e - (pix_abs_area - pixelProportion_times_pix_abs_area) ) {
 		// all pixels in e are to be reported:
-		dispatchRect_QT(e);
+		if ( tile )
+			tile->found.push_back(e);
+		else
+			dispatchRect_QT(e);
 		return;
 	}
 	
 	//	
-	// if globalOptions.pix_prop > 0.0 we can check if the area of intersection
+	// if getOptions().pix_prop > 0.0 we can check if the area of intersection
 	// is too small compared to the minimum required by that pixel proportion:
-	if ( globalOptions.pix_prop > 0.0 ) {
+	if ( getOptions().pix_prop > 0.0 ) {
 		if ( area_i < pixelProportion_times_pix_abs_area ) { 
 			// do nothing (we can safely discard the whole envelope).
 			return;
 		}
 	}
 	else {  
-		// globalOptions.pix_prop == 0.0: means that just the intersection 
+		// getOptions().pix_prop == 0.0: means that just the intersection 
 		// (i != null) will be enough condition to include the envelope 
 		// when this is just a pixel:
 		if ( e.cols == e.rows && e.rows == 1 ) {
-			dispatchRect_QT(e);
+			if ( tile )
+				tile->found.push_back(e);
+			else
+				dispatchRect_QT(e);
 			return;
 		}
 	}
@@ -99,43 +209,43 @@ void Traverser::rasterize_poly_QT(_Rect& e, Polygon* i) {
 	//
 	
 	_Rect e_ul = e.upperLeft();
-	Geometry* i_ul = e_ul.intersect(i);
+	Geometry* i_ul = e_ul.intersect(i, tile ? &tile->errors : 0);
 	if ( i_ul ) {		
-		rasterize_geometry_QT(e_ul, i_ul);
+		rasterize_geometry_QT(e_ul, i_ul, tile);
 		delete i_ul;
 	}
 	
 	_Rect e_ur = e.upperRight();
-	Geometry* i_ur = e_ur.intersect(i);
+	Geometry* i_ur = e_ur.intersect(i, tile ? &tile->errors : 0);
 	if ( i_ur ) {		
-		rasterize_geometry_QT(e_ur, i_ur);
+		rasterize_geometry_QT(e_ur, i_ur, tile);
 		delete i_ur;
 	}
 
 	_Rect e_ll = e.lowerLeft();
-	Geometry* i_ll = e_ll.intersect(i);
+	Geometry* i_ll = e_ll.intersect(i, tile ? &tile->errors : 0);
 	if ( i_ll ) {		
-		rasterize_geometry_QT(e_ll, i_ll);
+		rasterize_geometry_QT(e_ll, i_ll, tile);
 		delete i_ll;
 	}
 
 	_Rect e_lr = e.lowerRight();
-	Geometry* i_lr = e_lr.intersect(i);
+	Geometry* i_lr = e_lr.intersect(i, tile ? &tile->errors : 0);
 	if ( i_lr ) {		
-		rasterize_geometry_QT(e_lr, i_lr);
+		rasterize_geometry_QT(e_lr, i_lr, tile);
 		delete i_lr;
 	}
 }
 
 // implicitily does a quadtree-like scan:
 // MP 20110817 : remove C-style casts and use dynamic_cast instead
-void Traverser::rasterize_geometry_QT(_Rect& e, Geometry* i) {
+void Traverser::rasterize_geometry_QT(_Rect& e, Geometry* i, _QTTile* tile) {
 	if ( i == NULL || e.empty() )
 		return;
 	GeometryTypeId type = i->getGeometryTypeId();
 	switch ( type ) {
 		case GEOS_POLYGON:
-			rasterize_poly_QT(e, dynamic_cast<Polygon*>(i)); // (Polygon*) i);
+			rasterize_poly_QT(e, dynamic_cast<Polygon*>(i), tile); // (Polygon*) i);
 			break;
 			
 		case GEOS_MULTIPOLYGON:
@@ -143,19 +253,24 @@ void Traverser::rasterize_geometry_QT(_Rect& e, Geometry* i) {
 			GeometryCollection* gc = dynamic_cast<GeometryCollection*>(i); // (GeometryCollection*) i; 
 			for ( int j = 0; j < gc->getNumGeometries(); j++ ) {
 				Geometry* g = (Geometry*) gc->getGeometryN(j);
-				rasterize_geometry_QT(e, dynamic_cast<Polygon*>(g)); // (Polygon*) g);
+				rasterize_geometry_QT(e, dynamic_cast<Polygon*>(g), tile); // (Polygon*) g);
 			}
 			break;
 		}
 	
 		default:
 			if ( logstream ) {
-				(*logstream)
-					<< "Warning: rasterize_geometry_QT: "
+				// on a worker thread, the warning is logged at merge:
+				ostringstream msg;
+				msg << "Warning: rasterize_geometry_QT: "
 					<< "intersection ignored: "
 					<< i->getGeometryType() <<endl
 					//<< wktWriter.write(i) <<endl
 				;
+				if ( tile )
+					tile->warnings += msg.str();
+				else
+					(*logstream) << msg.str();
 			}
 	}
 	
@@ -11,6 +11,8 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <set>
 
 // for polygon processing:
 #include "geos/opPolygonize.h"
@@ -24,6 +26,7 @@ bool Traverser::_resetReading = true;
 
 Traverser::Traverser() {
 	vect = 0;
+	context = 0;
 	desired_FID = -1;
 	desired_fieldName = "";
 	desired_fieldValue = "";
@@ -44,6 +47,11 @@ Traverser::Traverser() {
     
 	debug_dump_polys = getenv("STARSPAN_DUMP_POLYS_ON_EXCEPTION") != 0;
 	debug_no_spatial_filter = getenv("STARSPAN_NO_SPATIAL_FILTER") != 0;
+	
+	// the default is 2^20 pixels; a smaller value allows to exercise the
+	// split rasterization on small inputs (see test_threads_qt):
+	const char* qt_split = getenv("STARSPAN_QT_SPLIT_MIN_PIXELS");
+	qt_split_min_pixels = qt_split ? atof(qt_split) : (1 << 20);
 }
 
 
@@ -69,6 +77,10 @@ void Traverser::setDesiredFID(long FID) {
 }
 
 
+void Traverser::setDesiredFIDs(const vector<long>& FIDs) {
+	desired_FIDs = FIDs; 
+}
+
 void Traverser::setDesiredFeatureByField(const char* field_name, const char* field_value) {
 	desired_fieldName = field_name;
 	desired_fieldValue = field_value;
@@ -205,6 +217,144 @@ void Traverser::getBandValuesForPixel(int col, int row) {
 }
 
 
+void Traverser::getPixelLocations(vector<EPixel>& locs) {
+	locs.reserve(locs.size() + pixset.size());
+	PixSet::Iterator* iter = pixset.iterator();
+	while ( iter->hasNext() ) {
+		int col, row;
+		iter->next(&col, &row);
+		locs.push_back(EPixel(col, row));
+	}
+	delete iter;
+}
+
+// orders indices of locations by row, then column
+struct LocOrder {
+	const vector<EPixel>& locs;
+	LocOrder(const vector<EPixel>& locs) : locs(locs) {}
+	bool operator()(unsigned a, unsigned b) const {
+		return locs[a].row < locs[b].row 
+		    || (locs[a].row == locs[b].row && locs[a].col < locs[b].col);
+	}
+};
+
+//
+// Values are read with a single RasterIO over the bounding window of the
+// given locations when this window is not much bigger than the number of
+// locations (the common case for polygons); otherwise, with one RasterIO
+// per strip of block rows containing some of the locations.
+//
+void Traverser::readPixelsInBand(GDALRasterBand* band, GDALDataType bufType, 
+	const vector<EPixel>& locs, void* out
+) {
+	const int typeSize = GDALGetDataTypeSize(bufType) >> 3;
+	const unsigned num_pixels = locs.size();
+	char* dst = (char*) out;
+	memset(dst, 0, num_pixels * typeSize);
+	if ( num_pixels == 0 )
+		return;
+	
+	// bounding window of valid locations:
+	int min_col = width, min_row = height, max_col = -1, max_row = -1;
+	for ( unsigned k = 0; k < num_pixels; k++ ) {
+		const int col = locs[k].col, row = locs[k].row;
+		if ( col < 0 || col >= width || row < 0 || row >= height )
+			continue;
+		if ( min_col > col ) min_col = col;
+		if ( max_col < col ) max_col = col;
+		if ( min_row > row ) min_row = row;
+		if ( max_row < row ) max_row = row;
+	}
+	if ( max_col < 0 )
+		return;   // no valid locations
+	
+	const int win_width = max_col - min_col + 1;
+	const int win_height = max_row - min_row + 1;
+	const double win_size = (double) win_width * win_height;
+	
+	if ( win_size <= 4.0 * num_pixels + 4096  &&  win_size * typeSize <= 64.0*1024*1024 ) {
+		// compact locations: a single read of the bounding window
+		char* window = new char[win_width * win_height * typeSize];
+		int status = band->RasterIO(
+			GF_Read,
+			min_col, min_row,
+			win_width, win_height,  // nXSize, nYSize
+			window,                 // pData
+			win_width, win_height,  // nBufXSize, nBufYSize
+			bufType,                // eBufType
+			0, 0                    // nPixelSpace, nLineSpace
+		);
+		if ( status != CE_None ) {
+			cerr<< "Error reading band values, status=" <<status<< "\n";
+			exit(1);
+		}
+		for ( unsigned k = 0; k < num_pixels; k++, dst += typeSize ) {
+			const int col = locs[k].col, row = locs[k].row;
+			if ( col >= 0 && col < width && row >= 0 && row < height ) {
+				memcpy(dst, window + ((row - min_row) * win_width + (col - min_col)) * typeSize, typeSize);
+			}
+			// else: keep the 0 value
+		}
+		delete[] window;
+		return;
+	}
+	
+	//
+	// scattered locations (eg., a sample of the pixels): in row order, the
+	// locations within a strip of the band's block rows are read with a 
+	// single window spanning their columns.
+	//
+	vector<unsigned> order;
+	for ( unsigned k = 0; k < num_pixels; k++ ) {
+		const int col = locs[k].col, row = locs[k].row;
+		if ( col >= 0 && col < width && row >= 0 && row < height )
+			order.push_back(k);
+	}
+	sort(order.begin(), order.end(), LocOrder(locs));
+	
+	int blockXSize, blockYSize;
+	band->GetBlockSize(&blockXSize, &blockYSize);
+	if ( blockYSize < 1 )
+		blockYSize = 1;
+	
+	vector<char> strip;
+	for ( unsigned first = 0; first < order.size(); ) {
+		const int row0 = locs[order[first]].row;
+		const int strip_end = (row0 / blockYSize + 1) * blockYSize;
+		unsigned last = first;
+		int col0 = locs[order[first]].col, col1 = col0;
+		while ( last < order.size() && locs[order[last]].row < strip_end ) {
+			col0 = min(col0, locs[order[last]].col);
+			col1 = max(col1, locs[order[last]].col);
+			last++;
+		}
+		const int row1 = locs[order[last - 1]].row;
+		const int strip_width = col1 - col0 + 1;
+		const int strip_height = row1 - row0 + 1;
+		strip.resize((size_t) strip_width * strip_height * typeSize);
+		int status = band->RasterIO(
+			GF_Read,
+			col0, row0,
+			strip_width, strip_height,  // nXSize, nYSize
+			&strip[0],                  // pData
+			strip_width, strip_height,  // nBufXSize, nBufYSize
+			bufType,                    // eBufType
+			0, 0                        // nPixelSpace, nLineSpace
+		);
+		if ( status != CE_None ) {
+			cerr<< "Error reading band values, status=" <<status<< "\n";
+			exit(1);
+		}
+		for ( unsigned i = first; i < last; i++ ) {
+			const EPixel& loc = locs[order[i]];
+			memcpy(dst + order[i] * typeSize, 
+				&strip[((size_t) (loc.row - row0) * strip_width + (loc.col - col0)) * typeSize], typeSize
+			);
+		}
+		first = last;
+	}
+}
+
 int Traverser::getPixelIntegerValuesInBand(
 	unsigned band_index, 
 	vector<int>& list
@@ -214,74 +364,67 @@ int Traverser::getPixelIntegerValuesInBand(
 		return 1;
 	}
 	
-	GDALRasterBand* band = globalInfo.bands[band_index-1];
-	PixSet::Iterator* iter = pixset.iterator();
-	while ( iter->hasNext() ) {
-		int col, row;
-		iter->next(&col, &row);
-		int value = 0;
-		if ( col < 0 || col >= width || row < 0 || row >= height ) {
-			// nothing:  keep the 0 value
-		}
-		else {
-			int status = band->RasterIO(
-				GF_Read,
-				col, row,
-				1, 1,             // nXSize, nYSize
-				&value,           // pData
-				1, 1,             // nBufXSize, nBufYSize
-				GDT_Int32,        // eBufType
-				0, 0              // nPixelSpace, nLineSpace
-			);
-			
-			if ( status != CE_None ) {
-				cerr<< "Error reading band value, status=" <<status<< "\n";
-				exit(1);
-			}
-		}
-		list.push_back(value);
+	vector<EPixel> locs;
+	getPixelLocations(locs);
+	const unsigned start = list.size();
+	list.resize(start + locs.size());
+	if ( locs.size() > 0 ) {
+		readPixelsInBand(globalInfo.bands[band_index-1], GDT_Int32, locs, &list[start]);
 	}
-	delete iter;
 	return 0;
 }
 
 int Traverser::getPixelDoubleValuesInBand(
 	unsigned band_index, 
 	vector<double>& list
+) {
+	vector<EPixel> locs;
+	getPixelLocations(locs);
+	return getPixelDoubleValuesInBand(band_index, locs, list);
+}
+
+int Traverser::getPixelDoubleValuesInBand(
+	unsigned band_index, 
+	const vector<EPixel>& locs,
+	vector<double>& list
 ) {
 	if ( band_index <= 0 || band_index > globalInfo.bands.size() ) {
 		cerr<< "Traverser::getPixelDoubleValuesInBand: band_index " <<band_index<< " out of range\n";
 		return 1;
 	}
 	
-	GDALRasterBand* band = globalInfo.bands[band_index-1];
-	PixSet::Iterator* iter = pixset.iterator();
-	while ( iter->hasNext() ) {
-		int col, row;
-		iter->next(&col, &row);
-		double value = 0.0;
-		if ( col < 0 || col >= width || row < 0 || row >= height ) {
-			// nothing:  keep the 0.0 value
-		}
-		else {
-			int status = band->RasterIO(
-				GF_Read,
-				col, row,
-				1, 1,             // nXSize, nYSize
-				&value,           // pData
-				1, 1,             // nBufXSize, nBufYSize
-				GDT_Float64,      // eBufType
-				0, 0              // nPixelSpace, nLineSpace
-			);
-			
-			if ( status != CE_None ) {
-				cerr<< "Error reading band value, status=" <<status<< "\n";
-				exit(1);
-			}
-		}
-		list.push_back(value);
+	const unsigned start = list.size();
+	list.resize(start + locs.size());
+	if ( locs.size() > 0 ) {
+		readPixelsInBand(globalInfo.bands[band_index-1], GDT_Float64, locs, &list[start]);
+	}
+	return 0;
+}
+
+int Traverser::getPixelMaskValuesInBand(
+	unsigned band_index, 
+	vector<unsigned char>& list
+) {
+	vector<EPixel> locs;
+	getPixelLocations(locs);
+	return getPixelMaskValuesInBand(band_index, locs, list);
+}
+
+int Traverser::getPixelMaskValuesInBand(
+	unsigned band_index, 
+	const vector<EPixel>& locs,
+	vector<unsigned char>& list
+) {
+	if ( band_index <= 0 || band_index > globalInfo.bands.size() ) {
+		cerr<< "Traverser::getPixelMaskValuesInBand: band_index " <<band_index<< " out of range\n";
+		return 1;
+	}
+	
+	const unsigned start = list.size();
+	list.resize(start + locs.size());
+	if ( locs.size() > 0 ) {
+		readPixelsInBand(globalInfo.bands[band_index-1]->GetMaskBand(), GDT_Byte, locs, &list[start]);
 	}
-	delete iter;
 	return 0;
 }
 
@@ -419,7 +562,7 @@ void Traverser::processPolygon(OGRPolygon* poly) {
 	else {
 		summary.num_invalid_polys++;
 		
-		if ( globalOptions.skip_invalid_polys ) {
+		if ( getOptions().skip_invalid_polys ) {
 			//cerr<< "--skipping invalid polygon--"<< endl;
 			if ( debug_dump_polys ) {
 				cerr<< "geos_poly = " << wktWriter.write(geos_poly) << endl;
@@ -437,12 +580,12 @@ void Traverser::processPolygon(OGRPolygon* poly) {
 				// get noded linestring:
 				Geometry* noded = 0;
 				const int num_points = lines->getNumPoints();
-                if ( globalOptions.verbose ) {
+                if ( getOptions().verbose ) {
                     cout << "Exploding external ring with " <<num_points<< " points...\n";
                 }
 				const CoordinateSequence* coordinates = lines->getCoordinatesRO();
 				for ( int i = 1; i < num_points; i++ ) {
-                    if ( globalOptions.verbose && i % 1000 == 0 ) {
+                    if ( getOptions().verbose && i % 1000 == 0 ) {
                         cout << "\tpoint " <<i<< "\n";
                     }
 					vector<Coordinate>* subcoordinates = new vector<Coordinate>();
@@ -469,7 +612,7 @@ void Traverser::processPolygon(OGRPolygon* poly) {
 					if ( polys ) {
 						summary.num_polys_exploded++;
 						summary.num_sub_polys += polys->size();
-						if ( globalOptions.verbose ) {
+						if ( getOptions().verbose ) {
 							cout << polys->size() << " sub-polys obtained\n";
                         }
 						for ( unsigned i = 0; i < polys->size(); i++ ) {
@@ -576,7 +719,7 @@ void Traverser::processGeometry(OGRGeometry* intersection_geometry, bool count)
 // processes a given feature
 //
 void Traverser::process_feature(OGRFeature* feature) {
-	if ( globalOptions.verbose ) {
+	if ( getOptions().verbose ) {
 		fprintf(stdout, "\n\nFID: %ld", feature->GetFID());
 	}
 	
@@ -595,7 +738,7 @@ void Traverser::process_feature(OGRFeature* feature) {
 	//
 	// apply box operation if so indicated:
 	//
-	if ( globalOptions.boxParams.given ) {
+	if ( getOptions().boxParams.given ) {
         //
         // Create a rectangle with the given box sizes and centered w.r.t.
         // the bounding box of the feature geometry.
@@ -603,7 +746,7 @@ void Traverser::process_feature(OGRFeature* feature) {
         
         // requested box dimensions:
         double rbw, rbh;
-        globalOptions.boxParams.getParsedDims(&rbw, &rbh);
+        getOptions().boxParams.getParsedDims(&rbw, &rbh);
         
         // bounding box
         OGREnvelope bbox;
@@ -639,13 +782,13 @@ void Traverser::process_feature(OGRFeature* feature) {
 	//
 	// else: apply buffer operation if so indicated:
 	//
-	else if ( globalOptions.bufferParams.given ) {
+	else if ( getOptions().bufferParams.given ) {
 		OGRGeometry* buffered_geometry = 0;
 		
 		// get distance:
 		double distance; 
-		if ( globalOptions.bufferParams.distance[0] == '@' ) {
-			const char* attr = globalOptions.bufferParams.distance.c_str() + 1;
+		if ( getOptions().bufferParams.distance[0] == '@' ) {
+			const char* attr = getOptions().bufferParams.distance.c_str() + 1;
 			int index = feature->GetFieldIndex(attr);
 			if ( index < 0 ) {
 				cerr<< "\n\tField `" <<attr<< "' not found\n";
@@ -654,13 +797,13 @@ void Traverser::process_feature(OGRFeature* feature) {
 			distance = feature->GetFieldAsInteger(index);
 		}
 		else {
-			distance = atoi(globalOptions.bufferParams.distance.c_str());
+			distance = atoi(getOptions().bufferParams.distance.c_str());
 		}
 		
 		// get quadrantSegments:
 		int quadrantSegments;
-		if ( globalOptions.bufferParams.quadrantSegments[0] == '@' ) {
-			const char* attr = globalOptions.bufferParams.quadrantSegments.c_str() + 1;
+		if ( getOptions().bufferParams.quadrantSegments[0] == '@' ) {
+			const char* attr = getOptions().bufferParams.quadrantSegments.c_str() + 1;
 			int index = feature->GetFieldIndex(attr);
 			if ( index < 0 ) {
 				cerr<< "\n\tField `" <<attr<< "' not found\n";
@@ -669,7 +812,7 @@ void Traverser::process_feature(OGRFeature* feature) {
 			quadrantSegments = feature->GetFieldAsInteger(index);
 		}
 		else {
-			quadrantSegments = atoi(globalOptions.bufferParams.quadrantSegments.c_str());
+			quadrantSegments = atoi(getOptions().bufferParams.quadrantSegments.c_str());
 		}
 		
 		
@@ -708,7 +851,7 @@ void Traverser::process_feature(OGRFeature* feature) {
 	}
 
 	if ( !intersection_geometry ) {
-		if ( globalOptions.verbose ) {
+		if ( getOptions().verbose ) {
 			cout<< " NO INTERSECTION:\n";
 		}
 		goto done;
@@ -716,7 +859,7 @@ void Traverser::process_feature(OGRFeature* feature) {
 
 	summary.num_intersecting_features++;
 
-	if ( globalOptions.verbose ) {
+	if ( getOptions().verbose ) {
 		cout<< " Type of intersection: "
 		    << intersection_geometry->getGeometryName()<< endl
 		;
@@ -795,27 +938,27 @@ void Traverser::traverse() {
     bool releaseLayer = false;
     
     // SQL statement?
-    if ( globalOptions.vSelParams.sql.length() > 0 ) {
+    if ( getOptions().vSelParams.sql.length() > 0 ) {
         OGRDataSource *poDS = vect->getDataSource();
         
 		const char *dialect = 0;
-        if ( globalOptions.vSelParams.dialect.length() > 0 ) {
-            dialect = globalOptions.vSelParams.dialect.c_str();
+        if ( getOptions().vSelParams.dialect.length() > 0 ) {
+            dialect = getOptions().vSelParams.dialect.c_str();
         }
 
         OGRGeometry *poSpatialFilter = 0;  // We do not use this here; TODO perhaps enable it later on.
         
-        layer = poDS->ExecuteSQL(globalOptions.vSelParams.sql.c_str(), poSpatialFilter, dialect);
+        layer = poDS->ExecuteSQL(getOptions().vSelParams.sql.c_str(), poSpatialFilter, dialect);
         if ( layer != 0 ) {
-            if ( globalOptions.vSelParams.where.length() > 0 ) {
-                layer->SetAttributeFilter(globalOptions.vSelParams.where.c_str());
+            if ( getOptions().vSelParams.where.length() > 0 ) {
+                layer->SetAttributeFilter(getOptions().vSelParams.where.c_str());
             }
             // the OGR API requires this layer to be explicitly released:
             releaseLayer = true;
         }
         else {
             cerr<< "traverser: No result or an error occured while issueing query: "
-                << globalOptions.vSelParams.sql << endl;
+                << getOptions().vSelParams.sql << endl;
             return;
         }
     }
@@ -825,27 +968,27 @@ void Traverser::traverse() {
             cerr<< "Couldn't get layer " <<layernum<< " from " << vect->getName()<< endl;
             return;
         }
-        if ( globalOptions.vSelParams.where.length() > 0 ) {
-            layer->SetAttributeFilter(globalOptions.vSelParams.where.c_str());
+        if ( getOptions().vSelParams.where.length() > 0 ) {
+            layer->SetAttributeFilter(getOptions().vSelParams.where.c_str());
         }
     }
     
-	if ( _resetReading ) {
+	if ( _resetReading && (!context || context->resetReading) ) {
 		layer->ResetReading();
 	}
 
     
-	if ( globalOptions.boxParams.given ) {
+	if ( getOptions().boxParams.given ) {
         // parse them:
-        if ( globalOptions.boxParams.parse(pix_x_size, pix_y_size) ) {
+        if ( getOptions().boxParams.parse(pix_x_size, pix_y_size) ) {
             cerr<< "\nInvalid box dimension specification:\n"
-                << "    width : [" <<globalOptions.boxParams.width<<  "]\n"
-                << "    height: [" <<globalOptions.boxParams.height<< "]\n";
+                << "    width : [" <<getOptions().boxParams.width<<  "]\n"
+                << "    height: [" <<getOptions().boxParams.height<< "]\n";
             return;
         }
-        if ( globalOptions.verbose ) {
+        if ( getOptions().verbose ) {
             double rbw, rbh;
-            globalOptions.boxParams.getParsedDims(&rbw, &rbh);
+            getOptions().boxParams.getParsedDims(&rbw, &rbh);
             cout << "Parsed box dimensions: width=" <<rbw<< " height=" <<rbh<< "\n";
         }
     }    
@@ -860,9 +1003,10 @@ void Traverser::traverse() {
 	bandValues_buffer = new double[globalInfo.bands.size()];
 
 	// for polygon rasterization:
-	pixelProportion_times_pix_abs_area = globalOptions.pix_prop * pix_abs_area;
+	pixelProportion_times_pix_abs_area = getOptions().pix_prop * pix_abs_area;
 
     globalInfo.layer = layer;
+    globalInfo.options = &getOptions();
     
 	//
 	// notify observers about initialization of process
@@ -886,8 +1030,47 @@ void Traverser::traverse() {
 		delete feature;
 	}
 	//
-	// Was a specific field name/value given?
+	// Was a list of FIDs given? Get them directly unless the layer is an
+	// SQL result set or has an attribute filter (GetFeature ignores the
+	// filter, and the FIDs may not refer to the result set).
 	//
+	else if ( desired_FIDs.size() > 0 && !releaseLayer 
+	&&        getOptions().vSelParams.where.length() == 0 ) {
+		for ( vector<long>::const_iterator fid = desired_FIDs.begin(); fid != desired_FIDs.end(); fid++ ) {
+			feature = layer->GetFeature(*fid);
+			if ( !feature ) {
+				cerr<< "FID " <<*fid<< " not found in " <<vect->getName()<< endl;
+				continue;
+			}
+			process_feature(feature);
+			delete feature;
+		}
+	}
+	else if ( desired_FIDs.size() > 0 ) {
+		//
+		// scan the selected features for the given FIDs:
+		//
+		set<long> FIDs(desired_FIDs.begin(), desired_FIDs.end());
+		while( FIDs.size() > 0 && (feature = layer->GetNextFeature()) != NULL ) {
+			if ( FIDs.erase(feature->GetFID()) > 0 ) {
+				process_feature(feature);
+			}
+			delete feature;
+		}
+	}
+	//
+	// Was a specific field name/value given? Use the vector's index unless
+	// the layer is an SQL result set or has an attribute filter (the index
+	// is kept across traversals and does not follow filter changes).
+	//
+	else if ( desired_fieldName.size() > 0 && !releaseLayer 
+	&&        getOptions().vSelParams.where.length() == 0 ) {
+		long FID = vect->getFIDByField(layernum, desired_fieldName.c_str(), desired_fieldValue.c_str());
+		if ( FID >= 0 && (feature = layer->GetFeature(FID)) != NULL ) {
+			process_feature(feature);
+			delete feature;
+		}
+	}
 	else if ( desired_fieldName.size() > 0 ) {
 		//
 		// search for corresponding feature in vector datasource:
@@ -47,6 +47,7 @@
 #include <vector>
 #include <queue>
 #include <string>
+#include <sstream>
 #include <iostream>
 #include <cstdio>
 
@@ -133,6 +134,9 @@ struct GlobalInfo {
     
     /** The layer being traversed */
     OGRLayer* layer;
+    
+    /** Options of the traversal (see Traverser::getOptions) */
+    GlobalOptions* options;
 };
 
 
@@ -249,17 +253,19 @@ public:
 extern GeometryFactory* global_factory;
 extern const CoordinateSequenceFactory* global_cs_factory;
 
-// create pixel polygon
-inline Polygon* create_pix_poly(double x0, double y0, double x1, double y1) {
+// create pixel polygon (with the given factory, by default global_factory)
+inline Polygon* create_pix_poly(double x0, double y0, double x1, double y1,
+	const GeometryFactory* factory = global_factory
+) {
 	CoordinateSequence *cl = new DefaultCoordinateSequence();
 	cl->add(Coordinate(x0, y0));
 	cl->add(Coordinate(x1, y0));
 	cl->add(Coordinate(x1, y1));
 	cl->add(Coordinate(x0, y1));
 	cl->add(Coordinate(x0, y0));
-	LinearRing* pixLR = global_factory->createLinearRing(cl);
+	LinearRing* pixLR = factory->createLinearRing(cl);
 	vector<Geometry *>* holes = NULL;
-	Polygon *poly = global_factory->createPolygon(pixLR, holes);
+	Polygon *poly = factory->createPolygon(pixLR, holes);
 	return poly;
 }
 
@@ -356,11 +362,26 @@ public:
 	  */
 	void setDesiredFID(long FID);
 
+	/**
+	  * Only the given FIDs will be processed, in the given order.
+	  * This method will have no effect if setDesiredFID(FID) is called with
+	  * a valid FID.
+	  * If an SQL selection or a where condition is in effect, the selected
+	  * features are scanned instead, and those with the given FIDs are
+	  * processed in the order they are read.
+	  *
+	  * @param FIDs  list of FIDs. An empty list means no restriction.
+	  */
+	void setDesiredFIDs(const vector<long>& FIDs);
+
 	/**
 	  * Only the feature whose given field is equal to the given value
 	  * FID will be processed.
 	  * This method will have no effect if setDesiredFID(FID) is called with
-	  * a valid FID.
+	  * a valid FID, or setDesiredFIDs with a non-empty list.
+	  * The feature is located with the field index kept by the vector
+	  * (see Vector::getFIDByField) unless an SQL selection or a where
+	  * condition is in effect.
 	  *
 	  * @param field_name Name of field
 	  * @param field_value Value of the field
@@ -368,6 +389,18 @@ public:
 	void setDesiredFeatureByField(const char* field_name, const char* field_value);
 	
 	
+	/**
+	  * Sets the context whose options are used by this traverser and
+	  * given to the observers in GlobalInfo::options. The context is not
+	  * owned. By default, or if context is NULL, globalOptions are used.
+	  */
+	void setContext(ExtractionContext* context) { this->context = context; }
+	
+	ExtractionContext* getContext() { return context; }
+	
+	/** The options in effect for this traverser. */
+	GlobalOptions& getOptions() { return context ? context->options : globalOptions; }
+	
 	/**
 	  * Adds an observer to this traverser.
 	  */
@@ -417,6 +450,37 @@ public:
 	  */
 	int getPixelDoubleValuesInBand(unsigned band_index, vector<double>& list);
 	
+	/**
+	  * Gets the values of the mask band (GDALRasterBand::GetMaskBand) of the
+	  * given band corresponding to the set of visited pixels in current
+	  * traversed feature, in the same order as getPixel*ValuesInBand.
+	  * @param band_index Desired band. Note that 1 corresponds to the first band
+	  *              (to keep consistency with GDAL).
+	  * @param list Where values are to be added.
+	  *             Note that a 0 will be added where (col,row) is not valid.
+	  * @return 0 iff OK.
+	  */
+	int getPixelMaskValuesInBand(unsigned band_index, vector<unsigned char>& list);
+	
+	/**
+	  * Gets the locations of the set of visited pixels in current traversed 
+	  * feature, in the same order as the values given by getPixel*ValuesInBand.
+	  * @param locs Where locations are to be added.
+	  */
+	void getPixelLocations(vector<EPixel>& locs);
+	
+	/**
+	  * Like getPixelDoubleValuesInBand(band_index, list) but for the given
+	  * locations only (e.g., a sample of the visited pixels).
+	  */
+	int getPixelDoubleValuesInBand(unsigned band_index, const vector<EPixel>& locs, vector<double>& list);
+	
+	/**
+	  * Like getPixelMaskValuesInBand(band_index, list) but for the given
+	  * locations only.
+	  */
+	int getPixelMaskValuesInBand(unsigned band_index, const vector<EPixel>& locs, vector<unsigned char>& list);
+	
 	/**
 	  * Reads in values from all bands (all given rasters) at pixel in (col,row).
 	  * Values are stored in bandValues_buffer.
@@ -499,6 +563,8 @@ public:
 	 * As a quick fix to allow for this beahaviuor at least for specific commands,
 	 * this global (static) flag can be used to instruct the traversal not
 	 * to call ResetReading on the layer. 
+	 * Traversals with a context also honor ExtractionContext::resetReading,
+	 * which only affects the traversers of that context.
 	 */
 	static bool _resetReading;
 	
@@ -562,42 +628,63 @@ private:
 			return _Rect(tr, x2, y2, cols - cols2, rows - rows2);
 		}
 		
-		inline Geometry* intersect(Polygon* p) {
+		// The pixel polygon is created with the factory of p, so the
+		// geometries of a worker thread only refer to that worker's factory.
+		// If errors is given, error messages are added to it instead of
+		// being written to cerr.
+		inline Geometry* intersect(Polygon* p, string* errors = 0) {
 			if ( empty() )
 				return 0;
 			
-			Polygon* poly = create_pix_poly(x, y, x2(), y2());
+			Polygon* poly = create_pix_poly(x, y, x2(), y2(), p->getFactory());
 			Geometry* inters = 0;
+			string error;
 			try {
 				inters = p->intersection(poly);
 			}
 			catch(TopologyException* ex) {
-				cerr<< "TopologyException: " << EXC_STRING(ex) << endl;
-				if ( tr->debug_dump_polys ) {
-					cerr<< "pix_poly = " << tr->wktWriter.write(poly) << endl;
-					cerr<< "geos_poly = " << tr->wktWriter.write(p) << endl;
-				}
+				error = string("TopologyException: ") + EXC_STRING(ex);
 			}
 			catch(GEOSException* ex) {
-				cerr<< "GEOSException: " << EXC_STRING(ex) << endl;
+				error = string("GEOSException: ") + EXC_STRING(ex);
+			}
+			if ( error.size() > 0 ) {
+				ostringstream msg;
+				msg<< error << endl;
 				if ( tr->debug_dump_polys ) {
+					// not tr->wktWriter, as this may run on several threads
 					WKTWriter wktWriter;
-					cerr<< "pix_poly = " << tr->wktWriter.write(poly) << endl;
-					cerr<< "geos_poly = " << tr->wktWriter.write(p) << endl;
+					msg<< "pix_poly = " << wktWriter.write(poly) << endl;
+					msg<< "geos_poly = " << wktWriter.write(p) << endl;
 				}
+				if ( errors )
+					*errors += msg.str();
+				else
+					cerr<< msg.str();
 			}
 			delete poly;
 			return inters;
 		}
 	};
 	
+	// output of the quadtree scan of a tile on a worker thread, handed
+	// over to the calling thread when the tiles are merged
+	struct _QTTile {
+		vector<_Rect> found;   // rectangles to be dispatched
+		string errors;         // for cerr
+		string warnings;       // for the log stream
+	};
+	
 	Vector* vect;
 	int layernum;
 	vector<Raster*> rasts;
 	vector<Observer*> observers;
 	bool notSimpleObserver;
 
+	ExtractionContext* context;
+	
 	long desired_FID;
+	vector<long> desired_FIDs;
 	string desired_fieldName;
 	string desired_fieldValue;
 	
@@ -662,15 +749,26 @@ private:
 		return 0;
 	}
 	
+	// reads the values at the given locations from a band into out
+	// converted to bufType.
+	void readPixelsInBand(GDALRasterBand* band, GDALDataType bufType, const vector<EPixel>& locs, void* out);
+	
 	void processPoint(OGRPoint*);
 	void processMultiPoint(OGRMultiPoint*);
 	void processLineString(OGRLineString* linstr);
 	void processMultiLineString(OGRMultiLineString* coll);
 	void processValidPolygon(Polygon* geos_poly);
 	void processValidPolygon_QT(Polygon* geos_poly);
-	void rasterize_poly_QT(_Rect& env, Polygon* poly);
-	void rasterize_geometry_QT(_Rect& env, Geometry* geom);
+	// if tile is given, the rectangles to be dispatched and the messages
+	// are added to it
+	void rasterize_poly_QT(_Rect& env, Polygon* poly, _QTTile* tile = 0);
+	void rasterize_geometry_QT(_Rect& env, Geometry* geom, _QTTile* tile = 0);
 	void dispatchRect_QT(_Rect& r);
+	
+	// rasterization of a large polygon split in tiles (see polyqt.cc)
+	struct _QTSplit;
+	bool processSplitPolygon_QT(_Rect& env, Polygon* geos_poly);
+	static void rasterizeTile_QT(int task, int worker, void* arg);
 	void processPolygon(OGRPolygon* poly);
 	void processMultiPolygon(OGRMultiPolygon* mpoly);
 	void processGeometryCollection(OGRGeometryCollection* coll);
@@ -690,6 +788,10 @@ private:
 	bool debug_dump_polys;
 	bool debug_no_spatial_filter;
 	
+	// minimum number of pixels in the envelope of a polygon for its 
+	// rasterization to be split in tiles processed by several threads
+	double qt_split_min_pixels;
+	
 	WKTWriter wktWriter;
 };
 
@@ -0,0 +1,261 @@
+//
+//	OutputFile - asynchronous output file, possibly gzip compressed
+//	See OutputFile.h for public doc.
+//
+
+#include "OutputFile.h"
+
+#include <cstring>
+#include <sys/time.h>
+
+
+double OutputFile::totalBlockedTime = 0;
+double OutputFile::totalWriteTime = 0;
+double OutputFile::totalBytes = 0;
+
+
+// current time in seconds
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+OutputFile::OutputFile(const char* filename, unsigned maxQueued)
+: filename(filename), maxQueued(maxQueued > 0 ? maxQueued : 1) {
+	created = true;
+	error = false;
+	file = 0;
+	vsifile = 0;
+	mutex = 0;
+	cond = 0;
+	thread = 0;
+	closing = false;
+	blockedTime = writeTime = bytes = 0;
+}
+
+bool OutputFile::isCompressedName(const char* filename) {
+	size_t len = strlen(filename);
+	return len > 3 && 0 == strcmp(filename + len - 3, ".gz");
+}
+
+OutputFile* OutputFile::open(const char* filename, bool append, unsigned maxQueued) {
+	OutputFile* of = new OutputFile(filename, maxQueued);
+
+	if ( isCompressedName(filename) ) {
+		// if file exists, new rows go to a new gzip member, written
+		// to a temporary file that is appended on close:
+		VSIStatBufL statbuf;
+		if ( append && 0 == VSIStatL(filename, &statbuf) ) {
+			of->created = false;
+			of->partname = string(filename) + ".part";
+		}
+		string vsiname = string("/vsigzip/") + (of->created ? string(filename) : of->partname);
+		of->vsifile = VSIFOpenL(vsiname.c_str(), "wb");
+		if ( !of->vsifile ) {
+			delete of;
+			return 0;
+		}
+		of->start();
+		return of;
+	}
+
+	// if file exists, append new rows. Otherwise create file.
+	if ( append ) {
+		of->file = fopen(filename, "r+");
+	}
+	if ( of->file ) {
+		of->created = false;
+		fseek(of->file, 0, SEEK_END);
+
+		// check that new data will start in a new line:
+		// if last character is not '\n', then write a '\n':
+		// (This check will make the output more robust in case
+		// the previous information is not properly aligned, eg.
+		// when the previous generation was killed for some reason.)
+		long endpos = ftell(of->file);
+		if ( endpos > 0 ) {
+			fseek(of->file, endpos -1, SEEK_SET);
+			char c;
+			if ( 1 == fread(&c, sizeof(c), 1, of->file) ) {
+				// (a positioning call is required between reading and writing)
+				fseek(of->file, 0, SEEK_END);
+				if ( c != '\n' )
+					fputc('\n', of->file);    // add a new line
+			}
+		}
+	}
+	else {
+		of->file = fopen(filename, "w");
+		if ( !of->file ) {
+			delete of;
+			return 0;
+		}
+	}
+	of->start();
+	return of;
+}
+
+void OutputFile::start() {
+	mutex = CPLCreateMutex();
+	CPLReleaseMutex(mutex);    // created acquired
+	cond = CPLCreateCond();
+	thread = CPLCreateJoinableThread(writerThread, this);
+}
+
+OutputFile::~OutputFile() {
+	close();
+}
+
+bool OutputFile::write(const void* data, size_t size) {
+	string buffer((const char*) data, size);
+	return write(buffer);
+}
+
+bool OutputFile::write(string& buffer) {
+	if ( buffer.size() == 0 ) {
+		return !error;
+	}
+	if ( !thread ) {
+		// already closed
+		buffer.clear();
+		return false;
+	}
+
+	CPLAcquireMutex(mutex, 1000.0);
+	if ( queue.size() >= maxQueued ) {
+		double start = now();
+		while ( queue.size() >= maxQueued ) {
+			CPLCondWait(cond, mutex);
+		}
+		blockedTime += now() - start;
+	}
+	queue.push_back(string());
+	queue.back().swap(buffer);
+	CPLCondBroadcast(cond);
+	bool ok = !error;
+	CPLReleaseMutex(mutex);
+
+	buffer.clear();
+	return ok;
+}
+
+bool OutputFile::writeToFile(const string& data) {
+	if ( vsifile ) {
+		return data.size() == VSIFWriteL(data.data(), 1, data.size(), vsifile);
+	}
+	return data.size() == fwrite(data.data(), 1, data.size(), file);
+}
+
+void OutputFile::writerThread(void* arg) {
+	OutputFile* of = (OutputFile*) arg;
+	string data;
+
+	CPLAcquireMutex(of->mutex, 1000.0);
+	for (;;) {
+		while ( of->queue.size() == 0 && !of->closing ) {
+			CPLCondWait(of->cond, of->mutex);
+		}
+		if ( of->queue.size() == 0 ) {
+			break;   // closing and nothing else to write
+		}
+		data.swap(of->queue.front());
+		of->queue.pop_front();
+		CPLCondBroadcast(of->cond);
+		CPLReleaseMutex(of->mutex);
+
+		double start = now();
+		bool ok = of->writeToFile(data);
+		double elapsed = now() - start;
+
+		CPLAcquireMutex(of->mutex, 1000.0);
+		of->writeTime += elapsed;
+		of->bytes += data.size();
+		if ( !ok ) {
+			of->error = true;
+		}
+		data.clear();
+	}
+	CPLReleaseMutex(of->mutex);
+}
+
+bool OutputFile::close() {
+	if ( !file && !vsifile ) {
+		// already closed
+		return !error;
+	}
+
+	if ( thread ) {
+		CPLAcquireMutex(mutex, 1000.0);
+		closing = true;
+		CPLCondBroadcast(cond);
+		CPLReleaseMutex(mutex);
+		CPLJoinThread(thread);
+		thread = 0;
+		CPLDestroyCond(cond);
+		cond = 0;
+		CPLDestroyMutex(mutex);
+		mutex = 0;
+	}
+
+	if ( file ) {
+		if ( 0 != fclose(file) ) {
+			error = true;
+		}
+		file = 0;
+	}
+	if ( vsifile ) {
+		if ( 0 != VSIFCloseL(vsifile) ) {
+			error = true;
+		}
+		vsifile = 0;
+		if ( partname.size() > 0 ) {
+			if ( !error && !appendPart() ) {
+				error = true;
+			}
+			VSIUnlink(partname.c_str());
+		}
+	}
+
+	totalBlockedTime += blockedTime;
+	totalWriteTime += writeTime;
+	totalBytes += bytes;
+
+	if ( error ) {
+		cerr<< "Error writing " <<filename<< endl;
+	}
+	return !error;
+}
+
+// appends the contents of the temporary file to the output file
+bool OutputFile::appendPart() {
+	FILE* part = fopen(partname.c_str(), "rb");
+	if ( !part ) {
+		return false;
+	}
+	FILE* out = fopen(filename.c_str(), "ab");
+	if ( !out ) {
+		fclose(part);
+		return false;
+	}
+	bool ok = true;
+	char buffer[64*1024];
+	size_t size;
+	while ( ok && (size = fread(buffer, 1, sizeof(buffer), part)) > 0 ) {
+		ok = size == fwrite(buffer, 1, size, out);
+	}
+	ok = !ferror(part) && ok;
+	fclose(part);
+	if ( 0 != fclose(out) ) {
+		ok = false;
+	}
+	return ok;
+}
+
+void OutputFile::reportTotals(ostream& out) {
+	if ( totalBytes > 0 ) {
+		out<< "Output: " <<(long) totalBytes<< " bytes written in " <<totalWriteTime<< " seconds"
+		   << "; blocked on I/O: " <<totalBlockedTime<< " seconds" << endl;
+	}
+}
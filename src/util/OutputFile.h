@@ -0,0 +1,123 @@
+//
+// OutputFile - asynchronous output file, possibly gzip compressed
+//
+
+#ifndef OutputFile_h
+#define OutputFile_h
+
+#include "cpl_vsi.h"
+#include "cpl_multiproc.h"
+
+#include <iostream>
+#include <string>
+#include <list>
+#include <cstdio>
+
+using namespace std;
+
+
+/**
+  * An output file written by a dedicated writer thread.
+  * The caller fills buffers and hands them over with write(); the
+  * writer thread drains them with large sequential writes. At most
+  * maxQueued buffers can be pending; write() blocks while the queue
+  * is full, and that time is accounted as time blocked on I/O.
+  *
+  * If the file name ends with ".gz", the data is gzip compressed
+  * (through GDAL's /vsigzip/ handler), also on the writer thread.
+  */
+class OutputFile {
+public:
+	/**
+	  * Opens a file for writing.
+	  * @param filename name of the file
+	  * @param append if true and the file already exists, new data is
+	  *        appended after making sure it will start in a new line.
+	  *        For a compressed file, the new data is appended as a new
+	  *        gzip member, which gzip readers concatenate with the
+	  *        previous ones; it is written to a temporary file named
+	  *        filename + ".part" and appended to filename on close().
+	  * @param maxQueued maximum number of buffers pending to be written.
+	  * @return the output file, or NULL if it could not be opened.
+	  */
+	static OutputFile* open(const char* filename, bool append = false, unsigned maxQueued = 4);
+
+	/** true if the name ends with ".gz" */
+	static bool isCompressedName(const char* filename);
+
+	/**
+	  * Writes a summary of the time spent blocked on I/O and writing
+	  * by all the output files closed so far.
+	  */
+	static void reportTotals(ostream& out);
+
+	/** closes the file if not already closed */
+	~OutputFile();
+
+	/** true if the file did not exist or was truncated when opened */
+	bool isNew() { return created; }
+
+	/** true if the data is compressed */
+	bool isCompressed() { return vsifile != 0; }
+
+	/**
+	  * Queues the contents of the given buffer for writing. The buffer
+	  * is cleared.
+	  * @return false if an I/O error has occurred.
+	  */
+	bool write(string& buffer);
+
+	/**
+	  * Same as write(string&) for a block of bytes.
+	  */
+	bool write(const void* data, size_t size);
+
+	/**
+	  * Waits for the pending buffers to be written and closes the file.
+	  * @return false if an I/O error has occurred.
+	  */
+	bool close();
+
+private:
+	OutputFile(const char* filename, unsigned maxQueued);
+
+	string filename;
+	bool created;
+	bool error;
+
+	// plain file
+	FILE* file;
+
+	// compressed file
+	VSILFILE* vsifile;
+	
+	// if not empty, the compressed data goes to this temporary file,
+	// to be appended to filename on close
+	string partname;
+
+	// writer thread and its queue
+	CPLMutex* mutex;
+	CPLCond* cond;
+	CPLJoinableThread* thread;
+	list<string> queue;
+	unsigned maxQueued;
+	bool closing;
+
+	// time blocked in write() and time spent by the writer thread
+	// writing, in seconds; bytes written
+	double blockedTime;
+	double writeTime;
+	double bytes;
+
+	static double totalBlockedTime;
+	static double totalWriteTime;
+	static double totalBytes;
+
+	void start();
+	bool writeToFile(const string& data);
+	bool appendPart();
+	static void writerThread(void* arg);
+};
+
+
+#endif
@@ -0,0 +1,64 @@
+//
+//	WorkerPool - runs a set of independent tasks on a number of threads
+//	See WorkerPool.h for public doc.
+//
+
+#include "WorkerPool.h"
+
+#include <vector>
+
+using namespace std;
+
+
+WorkerPool::WorkerPool(int numWorkers)
+: numWorkers(numWorkers > 0 ? numWorkers : 1) {
+	mutex = 0;
+	nextTask = numTasks = 0;
+	func = 0;
+	arg = 0;
+}
+
+void WorkerPool::run(int numTasks, TaskFunction func, void* arg) {
+	if ( numWorkers == 1 || numTasks <= 1 ) {
+		for ( int task = 0; task < numTasks; task++ ) {
+			func(task, 0, arg);
+		}
+		return;
+	}
+
+	this->numTasks = numTasks;
+	this->func = func;
+	this->arg = arg;
+	nextTask = 0;
+	mutex = CPLCreateMutex();
+	CPLReleaseMutex(mutex);    // created acquired
+
+	const int num_threads = numWorkers < numTasks ? numWorkers : numTasks;
+	vector<Worker> workers(num_threads);
+	vector<CPLJoinableThread*> threads(num_threads);
+	for ( int i = 0; i < num_threads; i++ ) {
+		workers[i].pool = this;
+		workers[i].index = i;
+		threads[i] = CPLCreateJoinableThread(workerThread, &workers[i]);
+	}
+	for ( int i = 0; i < num_threads; i++ ) {
+		CPLJoinThread(threads[i]);
+	}
+
+	CPLDestroyMutex(mutex);
+	mutex = 0;
+}
+
+void WorkerPool::workerThread(void* arg) {
+	Worker* worker = (Worker*) arg;
+	WorkerPool* pool = worker->pool;
+	for (;;) {
+		CPLAcquireMutex(pool->mutex, 1000.0);
+		int task = pool->nextTask < pool->numTasks ? pool->nextTask++ : -1;
+		CPLReleaseMutex(pool->mutex);
+		if ( task < 0 ) {
+			break;
+		}
+		pool->func(task, worker->index, pool->arg);
+	}
+}
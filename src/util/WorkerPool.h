@@ -0,0 +1,60 @@
+//
+// WorkerPool - runs a set of independent tasks on a number of threads
+//
+
+#ifndef WorkerPool_h
+#define WorkerPool_h
+
+#include "cpl_multiproc.h"
+
+
+/**
+  * A set of worker threads executing numbered tasks.
+  * Tasks are handed out in increasing order to the next available
+  * worker. Each worker is also identified by a number so the task
+  * function can keep per-worker state (dataset handles, buffers).
+  * With one worker, the tasks are run in order in the calling thread.
+  */
+class WorkerPool {
+public:
+	/**
+	  * Task function.
+	  * @param task number of the task, in [0, numTasks)
+	  * @param worker number of the worker running the task, in [0, numWorkers)
+	  * @param arg the argument given to run()
+	  */
+	typedef void (*TaskFunction)(int task, int worker, void* arg);
+
+	/**
+	  * Creates a pool.
+	  * @param numWorkers number of worker threads; values less than 1 mean 1.
+	  */
+	WorkerPool(int numWorkers);
+
+	int getNumWorkers() { return numWorkers; }
+
+	/**
+	  * Runs the given number of tasks and waits for all of them to complete.
+	  */
+	void run(int numTasks, TaskFunction func, void* arg);
+
+private:
+	int numWorkers;
+
+	// state while running:
+	CPLMutex* mutex;
+	int nextTask;
+	int numTasks;
+	TaskFunction func;
+	void* arg;
+
+	struct Worker {
+		WorkerPool* pool;
+		int index;
+	};
+
+	static void workerThread(void* arg);
+};
+
+
+#endif
@@ -10,6 +10,8 @@
 #include "cpl_string.h"
 
 #include <stdio.h>  // FILE
+#include <string>
+#include <map>
 
 /**
  * Represents a vector dataset.
@@ -47,6 +49,19 @@ public:
 	/** report */
 	void showFields(FILE* file);
 	
+	/**
+	 * Gets the FID of the first feature in a layer whose given field
+	 * has the given value (as returned by GetFieldAsString).
+	 * An index from values to FIDs is built with a scan of the layer 
+	 * on the first call for that layer and field, and then reused.
+	 * The scan ignores the layer's spatial filter, which is restored
+	 * afterwards, and resets the reading of the layer. The attribute
+	 * filter in effect at that first call, if any, determines the
+	 * features in the index; later changes to it are not reflected.
+	 * @return the FID; -1 if not found or the field does not exist.
+	 */
+	long getFIDByField(int layer_num, const char* field_name, const char* field_value);
+	
 	/** gets the OGRDataSource */
 	OGRDataSource* getDataSource(void) { return poDS; } 
 	
@@ -60,6 +75,12 @@ public:
 private:
 	Vector(OGRDataSource* ds);
 	OGRDataSource* poDS;
+	
+	// field value -> FID
+	typedef std::map<std::string, long> FieldIndex;
+	
+	// indices built so far, by "layer_num:field_name"
+	std::map<std::string, FieldIndex*> fieldIndices;
 };
 
 #endif
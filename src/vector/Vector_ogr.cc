@@ -94,6 +94,9 @@ Vector::Vector(OGRDataSource* ds) {
 }
 
 Vector::~Vector() {
+	for ( std::map<std::string, FieldIndex*>::iterator it = fieldIndices.begin(); it != fieldIndices.end(); it++ ) {
+		delete it->second;
+	}
     delete poDS;
 }
 
@@ -110,6 +113,51 @@ OGRLayer* Vector::getLayer(int layer_num) {
 	return layer;
 }
 
+long Vector::getFIDByField(int layer_num, const char* field_name, const char* field_value) {
+	char key[32];
+	sprintf(key, "%d:", layer_num);
+	std::string index_key = std::string(key) + field_name;
+	
+	FieldIndex* index;
+	std::map<std::string, FieldIndex*>::iterator it = fieldIndices.find(index_key);
+	if ( it != fieldIndices.end() ) {
+		index = it->second;
+	}
+	else {
+		index = new FieldIndex();
+		fieldIndices[index_key] = index;
+		
+		OGRLayer* layer = getLayer(layer_num);
+		if ( !layer ) {
+			return -1;
+		}
+		const int i = layer->GetLayerDefn()->GetFieldIndex(field_name);
+		if ( i >= 0 ) {
+			// the scan ignores the spatial filter; restore it afterwards:
+			OGRGeometry* spatialFilter = layer->GetSpatialFilter();
+			if ( spatialFilter ) {
+				spatialFilter = spatialFilter->clone();
+				layer->SetSpatialFilter(NULL);
+			}
+			layer->ResetReading();
+			OGRFeature* feature;
+			while( (feature = layer->GetNextFeature()) != NULL ) {
+				// keep the first feature with each value:
+				index->insert(FieldIndex::value_type(feature->GetFieldAsString(i), feature->GetFID()));
+				delete feature;
+			}
+			if ( spatialFilter ) {
+				layer->SetSpatialFilter(spatialFilter);
+				delete spatialFilter;
+			}
+			layer->ResetReading();
+		}
+	}
+	
+	FieldIndex::const_iterator fid = index->find(field_value);
+	return fid != index->end() ? fid->second : -1;
+}
+
 void Vector::report(FILE* file) {
 	fprintf(file, "%s\n", poDS->GetName());
 	fprintf(file, "Layers = %d\n", poDS->GetLayerCount());